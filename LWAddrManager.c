@@ -0,0 +1,500 @@
+//
+//  LWAddrManager.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWAddrManager.h"
+#include "LWSet.h"
+#include "LWCrypto.h"
+#include "LWTransaction.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ADDR_SOURCE_BUCKETS     8         // number of buckets addresses from any one source group can be placed in
+#define ADDR_DEFAULT_THROUGHPUT 5.0       // blocks per second assumed for peers that haven't been downloaded from
+#define ADDR_DEFAULT_PING       0.5       // ping time in seconds assumed for peers that haven't been connected to
+#define ADDR_MAX_PING           60.0      // ignore ping times longer than this
+#define ADDR_STATS_VERSION      1
+#define ADDR_STATS_RECORD_SIZE  66        // 16 byte address, 2 byte port, 4x 4 byte counters, 3x 8 byte times,
+                                          // 4 byte ping time in ms, 4 byte throughput in thousandths of a block/s
+
+typedef struct {
+    LWPeer peer; // must be first so entries can be looked up with LWPeerHash() and LWPeerEq()
+    uint32_t attempts, successes, failures;
+    time_t lastAttempt, lastSuccess;
+    double pingTime, throughput; // smoothed ping time in seconds, blocks per second, 0 if unknown
+    uint16_t bucket, slot;
+} LWAddrEntry;
+
+typedef struct {
+    LWPeer peer; // must be first so bans can be looked up with LWPeerHash() and LWPeerEq()
+    uint32_t banScore;
+    time_t bannedUntil; // 0 if the peer isn't banned
+} LWAddrBan;
+
+struct LWAddrManagerStruct {
+    uint8_t key[16]; // random key for bucket selection, so bucket placement can't be predicted by other peers
+    LWSet *entries;
+    LWSet *bans; // misbehavior scores and bans, kept apart from the buckets so they can't be evicted or crowded out
+    LWAddrEntry *buckets[ADDR_BUCKET_COUNT][ADDR_BUCKET_SIZE];
+};
+
+// returns the misbehavior record of peer, or NULL if it has none or its ban has expired
+static LWAddrBan *_LWAddrManagerBan(LWAddrManager *manager, const LWPeer *peer, time_t now)
+{
+    LWAddrBan *ban = LWSetGet(manager->bans, peer);
+
+    return (ban && (ban->bannedUntil == 0 || ban->bannedUntil > now)) ? ban : NULL;
+}
+
+inline static int _LWAddrManagerIsBanned(LWAddrManager *manager, const LWPeer *peer, time_t now)
+{
+    const LWAddrBan *ban = _LWAddrManagerBan(manager, peer, now);
+
+    return (ban && ban->bannedUntil > now);
+}
+
+// expected sync throughput from connecting to entry's peer, the smoothed connect success rate times the measured (or
+// default) download rate, reduced by ping time, timestamp age and misbehavior
+static double _LWAddrEntryScore(LWAddrManager *manager, const LWAddrEntry *entry, time_t now)
+{
+    const LWAddrBan *ban = _LWAddrManagerBan(manager, &entry->peer, now);
+    uint32_t banScore = (ban) ? ban->banScore : 0;
+    double success = (entry->successes + 1.0)/(entry->attempts + 2.0),
+           rate = (entry->throughput > 0) ? entry->throughput : ADDR_DEFAULT_THROUGHPUT,
+           ping = (entry->pingTime > 0) ? entry->pingTime : ADDR_DEFAULT_PING,
+           age = (now > (time_t)entry->peer.timestamp) ? (double)(now - (time_t)entry->peer.timestamp) : 0,
+           penalty = (banScore < ADDR_BAN_SCORE) ? 1.0 - (double)banScore/ADDR_BAN_SCORE : 1.0;
+
+    return success*rate*penalty/((1.0 + ping)*(1.0 + age/(24*60*60)));
+}
+
+// writes the network group of address to group, the /16 for IPv4 and the /32 for IPv6
+static void _LWAddrGroup(uint8_t group[5], UInt128 address)
+{
+    if (address.u64[0] == 0 && address.u16[4] == 0 && address.u16[5] == 0xffff) { // ipv4 mapped ipv6
+        group[0] = 4, group[1] = address.u8[12], group[2] = address.u8[13], group[3] = group[4] = 0;
+    }
+    else group[0] = 6, memcpy(&group[1], address.u8, 4);
+}
+
+// bucket for peer learned from a peer in sourceGroup, each source group maps to at most ADDR_SOURCE_BUCKETS buckets
+static size_t _LWAddrManagerBucket(LWAddrManager *manager, const LWPeer *peer, const uint8_t sourceGroup[5])
+{
+    uint8_t buf[10];
+
+    memcpy(buf, sourceGroup, 5);
+    _LWAddrGroup(&buf[5], peer->address);
+    buf[5] = (uint8_t)(LWSipHash24(manager->key, buf, sizeof(buf)) % ADDR_SOURCE_BUCKETS); // replace address group
+    return (size_t)(LWSipHash24(manager->key, buf, 6) % ADDR_BUCKET_COUNT);
+}
+
+static void _LWAddrManagerRemoveEntry(LWAddrManager *manager, LWAddrEntry *entry)
+{
+    manager->buckets[entry->bucket][entry->slot] = NULL;
+    LWSetRemove(manager->entries, entry);
+    free(entry);
+}
+
+// places entry in its bucket, evicting the lowest scoring address if the bucket is full
+static void _LWAddrManagerInsert(LWAddrManager *manager, LWAddrEntry *entry, const LWPeer *source, time_t now)
+{
+    uint8_t sourceGroup[5];
+    LWAddrEntry **bucket, *worst = NULL;
+    double score, worstScore = 0;
+    size_t i;
+
+    _LWAddrGroup(sourceGroup, (source) ? source->address : entry->peer.address);
+    entry->bucket = (uint16_t)_LWAddrManagerBucket(manager, &entry->peer, sourceGroup);
+    bucket = manager->buckets[entry->bucket];
+
+    for (i = 0; i < ADDR_BUCKET_SIZE && bucket[i]; i++) {
+        score = _LWAddrEntryScore(manager, bucket[i], now);
+        if (! worst || score < worstScore) worst = bucket[i], worstScore = score;
+    }
+
+    if (i == ADDR_BUCKET_SIZE) i = worst->slot, _LWAddrManagerRemoveEntry(manager, worst);
+    entry->slot = (uint16_t)i;
+    bucket[i] = entry;
+    LWSetAdd(manager->entries, entry);
+}
+
+static LWAddrEntry *_LWAddrManagerEntry(LWAddrManager *manager, const LWPeer *peer)
+{
+    return LWSetGet(manager->entries, peer);
+}
+
+// returns a newly allocated LWAddrManager struct that must be freed by calling LWAddrManagerFree()
+// not thread-safe, callers must serialize access
+LWAddrManager *LWAddrManagerNew(void)
+{
+    LWAddrManager *manager = calloc(1, sizeof(*manager));
+
+    assert(manager != NULL);
+    for (size_t i = 0; i < sizeof(manager->key); i++) manager->key[i] = (uint8_t)LWRand(256);
+    manager->entries = LWSetNew(LWPeerHash, LWPeerEq, 1000);
+    manager->bans = LWSetNew(LWPeerHash, LWPeerEq, 10);
+    return manager;
+}
+
+// adds peers learned from source (NULL for DNS seeds or saved peers), a known address is updated with the more recent
+// timestamp and services, addresses of banned peers are ignored, returns number of new addresses added
+size_t LWAddrManagerAdd(LWAddrManager *manager, const LWPeer peers[], size_t peersCount, const LWPeer *source,
+                        time_t now)
+{
+    LWAddrEntry *entry;
+    size_t count = 0;
+
+    assert(manager != NULL);
+    assert(peers != NULL || peersCount == 0);
+
+    for (size_t i = 0; i < peersCount; i++) {
+        if (UInt128IsZero(peers[i].address) || peers[i].port == 0) continue;
+        if (_LWAddrManagerIsBanned(manager, &peers[i], now)) continue;
+        entry = _LWAddrManagerEntry(manager, &peers[i]);
+
+        if (entry) {
+            if (peers[i].timestamp > entry->peer.timestamp) {
+                entry->peer.timestamp = peers[i].timestamp;
+                entry->peer.services = peers[i].services;
+            }
+        }
+        else {
+            entry = calloc(1, sizeof(*entry));
+            assert(entry != NULL);
+            entry->peer = peers[i];
+            entry->peer.flags = 0;
+            _LWAddrManagerInsert(manager, entry, source, now);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// removes peer's address along with any misbehavior score or ban
+void LWAddrManagerRemove(LWAddrManager *manager, const LWPeer *peer)
+{
+    LWAddrEntry *entry;
+    LWAddrBan *ban;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    entry = _LWAddrManagerEntry(manager, peer);
+    if (entry) _LWAddrManagerRemoveEntry(manager, entry);
+    ban = LWSetGet(manager->bans, peer);
+    if (ban) LWSetRemove(manager->bans, ban), free(ban);
+}
+
+// removes all addresses, bans are kept
+void LWAddrManagerClear(LWAddrManager *manager)
+{
+    assert(manager != NULL);
+
+    for (size_t i = 0; i < ADDR_BUCKET_COUNT; i++) {
+        for (size_t j = 0; j < ADDR_BUCKET_SIZE; j++) {
+            if (manager->buckets[i][j]) _LWAddrManagerRemoveEntry(manager, manager->buckets[i][j]);
+        }
+    }
+}
+
+// number of addresses that aren't banned with a timestamp of at least since
+size_t LWAddrManagerCount(LWAddrManager *manager, time_t since, time_t now)
+{
+    const LWAddrEntry *entry = NULL;
+    size_t count = 0;
+
+    assert(manager != NULL);
+
+    while ((entry = LWSetIterate(manager->entries, entry))) {
+        if (! _LWAddrManagerIsBanned(manager, &entry->peer, now) && (time_t)entry->peer.timestamp >= since) count++;
+    }
+
+    return count;
+}
+
+// records a connect attempt to peer
+void LWAddrManagerAttempt(LWAddrManager *manager, const LWPeer *peer, time_t now)
+{
+    LWAddrEntry *entry;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    entry = _LWAddrManagerEntry(manager, peer);
+    if (entry) entry->attempts++, entry->lastAttempt = now;
+}
+
+// records a successful connect to peer with the given ping time in seconds
+void LWAddrManagerConnected(LWAddrManager *manager, const LWPeer *peer, double pingTime, time_t now)
+{
+    LWAddrEntry *entry;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    entry = _LWAddrManagerEntry(manager, peer);
+
+    if (entry) {
+        entry->successes++;
+        entry->failures = 0;
+        entry->lastSuccess = now;
+        if ((time_t)entry->peer.timestamp < now) entry->peer.timestamp = now;
+
+        if (pingTime >= 0 && pingTime < ADDR_MAX_PING) {
+            entry->pingTime = (entry->pingTime > 0) ? entry->pingTime*0.5 + pingTime*0.5 : pingTime;
+        }
+    }
+}
+
+// records a failed connect or a network error, the address is removed after ADDR_MAX_FAILURES failures in a row
+void LWAddrManagerFailed(LWAddrManager *manager, const LWPeer *peer)
+{
+    LWAddrEntry *entry;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    entry = _LWAddrManagerEntry(manager, peer);
+
+    if (entry && ++entry->failures >= ADDR_MAX_FAILURES) _LWAddrManagerRemoveEntry(manager, entry);
+}
+
+// records the measured block download rate of peer in blocks per second
+void LWAddrManagerSetThroughput(LWAddrManager *manager, const LWPeer *peer, double blocksPerSecond)
+{
+    LWAddrEntry *entry;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    entry = _LWAddrManagerEntry(manager, peer);
+    if (entry && blocksPerSecond > 0) entry->throughput = blocksPerSecond;
+}
+
+// returns the misbehavior record of peer, creating it if needed and resetting it if its ban has expired
+static LWAddrBan *_LWAddrManagerBanRecord(LWAddrManager *manager, const LWPeer *peer, time_t now)
+{
+    LWAddrBan *ban = LWSetGet(manager->bans, peer);
+
+    if (! ban) {
+        ban = calloc(1, sizeof(*ban));
+        assert(ban != NULL);
+        ban->peer = *peer;
+        ban->peer.flags = 0;
+        LWSetAdd(manager->bans, ban);
+    }
+    else if (ban->bannedUntil != 0 && ban->bannedUntil <= now) ban->banScore = 0, ban->bannedUntil = 0; // expired
+
+    return ban;
+}
+
+// adds score to peer's misbehavior score, returns true if the peer is now banned
+int LWAddrManagerMisbehaving(LWAddrManager *manager, const LWPeer *peer, uint32_t score, time_t now)
+{
+    LWAddrEntry *entry;
+    LWAddrBan *ban;
+
+    assert(manager != NULL);
+    assert(peer != NULL);
+    ban = _LWAddrManagerBanRecord(manager, peer, now); // peers are banned even if their address isn't known
+    ban->banScore = (score < ADDR_BAN_SCORE - ban->banScore) ? ban->banScore + score : ADDR_BAN_SCORE;
+
+    if (ban->banScore == ADDR_BAN_SCORE && ban->bannedUntil == 0) {
+        ban->bannedUntil = now + ADDR_BAN_TIME;
+        entry = _LWAddrManagerEntry(manager, peer);
+        if (entry) _LWAddrManagerRemoveEntry(manager, entry); // free the slot, the ban keeps the address out
+    }
+
+    return (ban->bannedUntil > now);
+}
+
+// true if peer is currently banned
+int LWAddrManagerIsBanned(LWAddrManager *manager, const LWPeer *peer, time_t now)
+{
+    assert(manager != NULL);
+    assert(peer != NULL);
+    return _LWAddrManagerIsBanned(manager, peer, now);
+}
+
+// writes up to peersCount peers that aren't banned, chosen at random weighted by expected sync throughput and
+// excluding any in exclude, to peers, returns number of peers written
+size_t LWAddrManagerSelect(LWAddrManager *manager, LWPeer peers[], size_t peersCount, LWPeer *const exclude[],
+                           size_t excludeCount, time_t now)
+{
+    const LWAddrEntry *entry = NULL;
+    size_t i, j, n = 0, count = 0, setCount;
+    double total = 0, r;
+
+    assert(manager != NULL);
+    assert(peers != NULL || peersCount == 0);
+    assert(exclude != NULL || excludeCount == 0);
+    setCount = LWSetCount(manager->entries);
+    if (peersCount == 0 || setCount == 0) return 0;
+
+    const LWAddrEntry **candidates = malloc(setCount*sizeof(*candidates));
+    double *weights = malloc(setCount*sizeof(*weights));
+
+    assert(candidates != NULL);
+    assert(weights != NULL);
+
+    while ((entry = LWSetIterate(manager->entries, entry))) {
+        if (_LWAddrManagerIsBanned(manager, &entry->peer, now)) continue;
+        for (j = 0; j < excludeCount && ! LWPeerEq(&entry->peer, exclude[j]); j++);
+        if (j < excludeCount) continue;
+        candidates[n] = entry;
+        weights[n] = _LWAddrEntryScore(manager, entry, now);
+        total += weights[n++];
+    }
+
+    while (count < peersCount && count < n && total > 0) {
+        r = total*LWRand(0)/LW_RAND_MAX;
+        for (i = 0; i + 1 < n && (weights[i] == 0 || r >= weights[i]); i++) r -= weights[i];
+        if (weights[i] == 0) break; // only rounding error left
+        peers[count++] = candidates[i]->peer;
+        total -= weights[i];
+        weights[i] = 0;
+    }
+
+    free(weights);
+    free(candidates);
+    return count;
+}
+
+// comparator for sorting peers by timestamp, most recent first
+static int _LWAddrEntryTimestampCompare(const void *entry, const void *otherEntry)
+{
+    uint64_t t1 = (*(const LWAddrEntry *const *)entry)->peer.timestamp,
+             t2 = (*(const LWAddrEntry *const *)otherEntry)->peer.timestamp;
+
+    return (t1 < t2) ? 1 : (t1 > t2) ? -1 : 0;
+}
+
+// writes up to peersCount of the most recent peers that aren't banned to peers, sorted by timestamp, returns number of
+// peers written, or total number of peers that aren't banned if peers is NULL
+size_t LWAddrManagerPeers(LWAddrManager *manager, LWPeer peers[], size_t peersCount, time_t now)
+{
+    const LWAddrEntry *entry = NULL;
+    size_t n = 0;
+
+    assert(manager != NULL);
+    if (! peers) return LWAddrManagerCount(manager, 0, now);
+
+    const LWAddrEntry **entries = malloc((LWSetCount(manager->entries) + 1)*sizeof(*entries));
+
+    assert(entries != NULL);
+
+    while ((entry = LWSetIterate(manager->entries, entry))) {
+        if (! _LWAddrManagerIsBanned(manager, &entry->peer, now)) entries[n++] = entry;
+    }
+
+    qsort(entries, n, sizeof(*entries), _LWAddrEntryTimestampCompare);
+    if (n > peersCount) n = peersCount;
+    for (size_t i = 0; i < n; i++) peers[i] = entries[i]->peer;
+    free(entries);
+    return n;
+}
+
+// writes a stats record for peer to buf, entry and ban may be NULL
+static void _LWAddrStatsSet(uint8_t *buf, const LWPeer *peer, const LWAddrEntry *entry, const LWAddrBan *ban)
+{
+    static const LWAddrEntry none;
+
+    if (! entry) entry = &none;
+    UInt128Set(buf, peer->address);
+    UInt16SetLE(&buf[16], peer->port);
+    UInt32SetLE(&buf[18], entry->attempts);
+    UInt32SetLE(&buf[22], entry->successes);
+    UInt32SetLE(&buf[26], entry->failures);
+    UInt32SetLE(&buf[30], (ban) ? ban->banScore : 0);
+    UInt64SetLE(&buf[34], (uint64_t)entry->lastAttempt);
+    UInt64SetLE(&buf[42], (uint64_t)entry->lastSuccess);
+    UInt64SetLE(&buf[50], (ban) ? (uint64_t)ban->bannedUntil : 0);
+    UInt32SetLE(&buf[58], (uint32_t)(entry->pingTime*1000 + 0.5));
+    UInt32SetLE(&buf[62], (uint32_t)(entry->throughput*1000 + 0.5));
+}
+
+// writes the connection statistics of all known addresses, and the misbehavior scores and bans of all peers, to buf,
+// returns number of bytes written, or buf length needed if buf is NULL
+size_t LWAddrManagerSerialize(LWAddrManager *manager, uint8_t *buf, size_t bufLen, time_t now)
+{
+    const LWAddrEntry *entry = NULL;
+    const LWAddrBan *ban = NULL;
+    size_t off = sizeof(uint32_t);
+
+    assert(manager != NULL);
+
+    while ((entry = LWSetIterate(manager->entries, entry))) { // addresses that were never tried have no stats
+        ban = _LWAddrManagerBan(manager, &entry->peer, now);
+        if (entry->attempts == 0 && (! ban || ban->banScore == 0)) continue;
+        if (buf && off + ADDR_STATS_RECORD_SIZE <= bufLen) _LWAddrStatsSet(&buf[off], &entry->peer, entry, ban);
+        off += ADDR_STATS_RECORD_SIZE;
+    }
+
+    while ((ban = LWSetIterate(manager->bans, ban))) { // peers whose address isn't known
+        if (ban->banScore == 0 || (ban->bannedUntil != 0 && ban->bannedUntil <= now)) continue;
+        if (_LWAddrManagerEntry(manager, &ban->peer)) continue;
+        if (buf && off + ADDR_STATS_RECORD_SIZE <= bufLen) _LWAddrStatsSet(&buf[off], &ban->peer, NULL, ban);
+        off += ADDR_STATS_RECORD_SIZE;
+    }
+
+    if (buf && off <= bufLen) UInt32SetLE(buf, ADDR_STATS_VERSION);
+    return (! buf || off <= bufLen) ? off : 0;
+}
+
+// loads connection statistics written by LWAddrManagerSerialize() for known addresses, along with the misbehavior
+// scores and any unexpired bans of all peers, returns true if buf was valid
+int LWAddrManagerLoad(LWAddrManager *manager, const uint8_t *buf, size_t bufLen, time_t now)
+{
+    LWAddrEntry *entry;
+    LWAddrBan *ban;
+    LWPeer peer = { UINT128_ZERO, 0, 0, 0, 0 };
+    uint32_t banScore;
+    time_t bannedUntil;
+
+    assert(manager != NULL);
+    assert(buf != NULL || bufLen == 0);
+    if (bufLen < sizeof(uint32_t) || (bufLen - sizeof(uint32_t)) % ADDR_STATS_RECORD_SIZE != 0) return 0;
+    if (UInt32GetLE(buf) != ADDR_STATS_VERSION) return 0;
+
+    for (size_t off = sizeof(uint32_t); off < bufLen; off += ADDR_STATS_RECORD_SIZE) {
+        peer.address = UInt128Get(&buf[off]);
+        peer.port = UInt16GetLE(&buf[off + 16]);
+        banScore = UInt32GetLE(&buf[off + 30]);
+        bannedUntil = (time_t)UInt64GetLE(&buf[off + 50]);
+        if (bannedUntil <= now || bannedUntil > now + ADDR_BAN_TIME) bannedUntil = 0;
+        if (banScore >= ADDR_BAN_SCORE) banScore = (bannedUntil) ? ADDR_BAN_SCORE : 0;
+
+        if (banScore > 0) {
+            ban = _LWAddrManagerBanRecord(manager, &peer, now);
+            ban->banScore = banScore;
+            ban->bannedUntil = bannedUntil;
+        }
+
+        entry = _LWAddrManagerEntry(manager, &peer);
+        if (entry && bannedUntil) _LWAddrManagerRemoveEntry(manager, entry), entry = NULL;
+        if (! entry) continue;
+        entry->attempts = UInt32GetLE(&buf[off + 18]);
+        entry->successes = UInt32GetLE(&buf[off + 22]);
+        entry->failures = UInt32GetLE(&buf[off + 26]);
+        entry->lastAttempt = (time_t)UInt64GetLE(&buf[off + 34]);
+        entry->lastSuccess = (time_t)UInt64GetLE(&buf[off + 42]);
+        entry->pingTime = UInt32GetLE(&buf[off + 58])/1000.0;
+        entry->throughput = UInt32GetLE(&buf[off + 62])/1000.0;
+        if (entry->successes > entry->attempts) entry->successes = entry->attempts;
+    }
+
+    return 1;
+}
+
+static void _LWAddrEntryFree(void *info, void *entry)
+{
+    free(entry);
+}
+
+// frees memory allocated for manager
+void LWAddrManagerFree(LWAddrManager *manager)
+{
+    assert(manager != NULL);
+    LWSetApply(manager->entries, NULL, _LWAddrEntryFree);
+    LWSetFree(manager->entries);
+    LWSetApply(manager->bans, NULL, _LWAddrEntryFree);
+    LWSetFree(manager->bans);
+    free(manager);
+}
@@ -0,0 +1,91 @@
+//
+//  LWAddrManager.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWAddrManager_h
+#define LWAddrManager_h
+
+#include "LWPeer.h"
+#include <stddef.h>
+#include <inttypes.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// tracks known peer addresses along with their connect success, ping time, download throughput and ban score, and
+// selects peers to connect to by expected sync throughput
+// addresses are kept in hashed buckets chosen from the address group of the peer and the peer it was learned from, so
+// a single source can only fill a few buckets, and a full bucket evicts its worst address
+// misbehavior scores and bans are kept apart from the buckets, so a ban can't be evicted and doesn't need a free slot
+
+#define ADDR_BUCKET_COUNT 128        // number of buckets
+#define ADDR_BUCKET_SIZE  32         // addresses per bucket
+#define ADDR_MAX_FAILURES 3          // forget an address after this many failed connects in a row
+#define ADDR_BAN_SCORE    100        // ban a peer once its misbehavior score reaches this
+#define ADDR_BAN_TIME     (24*60*60) // seconds a banned peer is ignored for
+
+typedef struct LWAddrManagerStruct LWAddrManager;
+
+// returns a newly allocated LWAddrManager struct that must be freed by calling LWAddrManagerFree()
+// not thread-safe, callers must serialize access
+LWAddrManager *LWAddrManagerNew(void);
+
+// adds peers learned from source (NULL for DNS seeds or saved peers), a known address is updated with the more recent
+// timestamp and services, addresses of banned peers are ignored, returns number of new addresses added
+size_t LWAddrManagerAdd(LWAddrManager *manager, const LWPeer peers[], size_t peersCount, const LWPeer *source,
+                        time_t now);
+
+// removes peer's address along with any misbehavior score or ban
+void LWAddrManagerRemove(LWAddrManager *manager, const LWPeer *peer);
+
+// removes all addresses, bans are kept
+void LWAddrManagerClear(LWAddrManager *manager);
+
+// number of addresses that aren't banned with a timestamp of at least since
+size_t LWAddrManagerCount(LWAddrManager *manager, time_t since, time_t now);
+
+// records a connect attempt to peer
+void LWAddrManagerAttempt(LWAddrManager *manager, const LWPeer *peer, time_t now);
+
+// records a successful connect to peer with the given ping time in seconds
+void LWAddrManagerConnected(LWAddrManager *manager, const LWPeer *peer, double pingTime, time_t now);
+
+// records a failed connect or a network error, the address is removed after ADDR_MAX_FAILURES failures in a row
+void LWAddrManagerFailed(LWAddrManager *manager, const LWPeer *peer);
+
+// records the measured block download rate of peer in blocks per second
+void LWAddrManagerSetThroughput(LWAddrManager *manager, const LWPeer *peer, double blocksPerSecond);
+
+// adds score to peer's misbehavior score, returns true if the peer is now banned
+int LWAddrManagerMisbehaving(LWAddrManager *manager, const LWPeer *peer, uint32_t score, time_t now);
+
+// true if peer is currently banned
+int LWAddrManagerIsBanned(LWAddrManager *manager, const LWPeer *peer, time_t now);
+
+// writes up to peersCount peers that aren't banned, chosen at random weighted by expected sync throughput and
+// excluding any in exclude, to peers, returns number of peers written
+size_t LWAddrManagerSelect(LWAddrManager *manager, LWPeer peers[], size_t peersCount, LWPeer *const exclude[],
+                           size_t excludeCount, time_t now);
+
+// writes up to peersCount of the most recent peers that aren't banned to peers, sorted by timestamp, returns number of
+// peers written, or total number of peers that aren't banned if peers is NULL
+size_t LWAddrManagerPeers(LWAddrManager *manager, LWPeer peers[], size_t peersCount, time_t now);
+
+// writes the connection statistics of all known addresses, and the misbehavior scores and bans of all peers, to buf,
+// returns number of bytes written, or buf length needed if buf is NULL
+size_t LWAddrManagerSerialize(LWAddrManager *manager, uint8_t *buf, size_t bufLen, time_t now);
+
+// loads connection statistics written by LWAddrManagerSerialize() for known addresses, along with the misbehavior
+// scores and any unexpired bans of all peers, returns true if buf was valid
+int LWAddrManagerLoad(LWAddrManager *manager, const uint8_t *buf, size_t bufLen, time_t now);
+
+// frees memory allocated for manager
+void LWAddrManagerFree(LWAddrManager *manager);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWAddrManager_h
@@ -367,6 +367,46 @@ size_t LWAddressScriptPubKey(uint8_t *script, size_t scriptLen, const char *addr
     return r;
 }
 
+#define ADDRESS_BATCH_SIZE 64 // pubKeys hashed and encoded per pass, keeps intermediate buffers on the stack
+
+// writes the pay-to-pubkey-hash address of each of count 33 byte compressed pubKeys, stored back to back, to
+// legacyAddrs, and the pay-to-witness-pubkey-hash address to witnessAddrs, either of which may be NULL
+void LWAddressesFromPubKeys(LWAddress legacyAddrs[], LWAddress witnessAddrs[], const uint8_t *pubKeys, size_t count)
+{
+    uint8_t md[ADDRESS_BATCH_SIZE*20], data[ADDRESS_BATCH_SIZE*21], script[22] = { OP_0, 20 },
+            pubkeyAddress = LITECOIN_PUBKEY_ADDRESS;
+    const char *bech32Prefix = "ltc";
+    size_t i, j, n;
+
+#if LITECOIN_TESTNET
+    pubkeyAddress = LITECOIN_PUBKEY_ADDRESS_TEST;
+    bech32Prefix = "tltc";
+#endif
+
+    assert(pubKeys != NULL || count == 0);
+
+    for (i = 0; i < count; i += n) {
+        n = (count - i < ADDRESS_BATCH_SIZE) ? count - i : ADDRESS_BATCH_SIZE;
+        LWHash160Array(md, &pubKeys[i*33], 33, n);
+
+        if (legacyAddrs) {
+            for (j = 0; j < n; j++) {
+                legacyAddrs[i + j] = LW_ADDRESS_NONE;
+                data[j*21] = pubkeyAddress;
+                memcpy(&data[j*21 + 1], &md[j*20], 20);
+            }
+
+            LWBase58CheckEncodeArray(legacyAddrs[i].s, sizeof(LWAddress), data, 21, n);
+        }
+
+        for (j = 0; witnessAddrs && j < n; j++) {
+            witnessAddrs[i + j] = LW_ADDRESS_NONE;
+            memcpy(&script[2], &md[j*20], 20);
+            LWBech32Encode(witnessAddrs[i + j].s, bech32Prefix, script);
+        }
+    }
+}
+
 // returns true if addr is a valid bitcoin address
 int LWAddressIsValid(const char *addr)
 {
@@ -82,6 +82,10 @@ size_t LWAddressFromWitness(char *addr, size_t addrLen, const uint8_t *witness,
 // returns the number of bytes written, or scriptLen needed if script is NULL
 size_t LWAddressScriptPubKey(uint8_t *script, size_t scriptLen, const char *addr);
 
+// writes the pay-to-pubkey-hash address of each of count 33 byte compressed pubKeys, stored back to back, to
+// legacyAddrs, and the pay-to-witness-pubkey-hash address to witnessAddrs, either of which may be NULL
+void LWAddressesFromPubKeys(LWAddress legacyAddrs[], LWAddress witnessAddrs[], const uint8_t *pubKeys, size_t count);
+
 // returns true if addr is a valid bitcoin address
 int LWAddressIsValid(const char *addr);
 
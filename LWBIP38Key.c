@@ -8,8 +8,10 @@
 #include "LWCrypto.h"
 #include "LWBase58.h"
 #include "LWInt.h"
+#include "LWArray.h"
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <assert.h>
 
 #define BIP38_NOEC_PREFIX      0x0142
@@ -153,40 +155,136 @@ static void _LWAES256ECBDecrypt(const void *key32, void *buf16)
     mem_clean(buf, sizeof(buf));
 }
 
-static UInt256 _LWBIP38DerivePassfactor(uint8_t flag, const uint8_t *entropy, const char *passphrase)
+typedef struct _LWBIP38JobStruct _LWBIP38Job;
+
+struct LWBIP38PoolStruct {
+    _LWBIP38Job **queue; // jobs waiting for a worker
+    _LWBIP38Job **running; // jobs being run by a worker, whose scrypt blocks may be mixed by any worker
+    pthread_t *threads;
+    unsigned threadCount;
+    uint64_t lastJobId;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when there's work for idle workers
+    pthread_cond_t blocksCond; // signalled when all the scrypt blocks of a running job are mixed
+};
+
+struct _LWBIP38JobStruct {
+    uint64_t id;
+    LWBIP38Pool *pool;
+    int cancelled, done;
+    LWKey key;
+    char *bip38Key, *passphrase;
+    void *info;
+    void (*decrypted)(void *info, uint64_t jobId, const LWKey *key);
+    void (*encrypted)(void *info, uint64_t jobId, const char *bip38Key);
+    uint8_t *b; // scrypt blocks being mixed, or NULL if the job isn't in a scrypt call
+    unsigned n, r, p, nextBlock, blocksDone;
+    void **scratch; // scratch buffer of the worker running the job
+    size_t *scratchLen;
+};
+
+// mixes block i of job's current scrypt call with the worker's scratch buffer, growing it if needed
+// called with the pool unlocked
+static void _LWBIP38JobMix(_LWBIP38Job *job, uint8_t *b, unsigned i, void **scratch, size_t *scratchLen)
+{
+    size_t len = 128*(size_t)job->r*job->n;
+    
+    if (*scratchLen < len) {
+        free(*scratch);
+        *scratch = malloc(len);
+        assert(*scratch != NULL);
+        *scratchLen = len;
+    }
+    
+    LWScryptROMix(&b[i*128*job->r], job->n, job->r, *scratch);
+}
+
+// scrypt that, when job isn't NULL, offers the p parallel blocks to idle pool workers, and returns false without
+// writing dk if job is cancelled
+static int _LWBIP38Scrypt(_LWBIP38Job *job, void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt,
+                          size_t saltLen, unsigned n, unsigned r, unsigned p)
+{
+    size_t len = 128*r*p;
+    uint8_t *b;
+    unsigned i;
+    int cancelled;
+    
+    if (! job) {
+        LWScrypt(dk, dkLen, pw, pwLen, salt, saltLen, n, r, p);
+        return 1;
+    }
+
+    b = malloc(len);
+    assert(b != NULL);
+    LWPBKDF2(b, len, LWSHA256, 256/8, pw, pwLen, salt, saltLen, 1);
+    pthread_mutex_lock(&job->pool->lock);
+    job->b = b, job->n = n, job->r = r, job->p = p, job->nextBlock = job->blocksDone = 0;
+    pthread_cond_broadcast(&job->pool->cond);
+    
+    while (job->nextBlock < job->p) {
+        i = job->nextBlock++;
+        
+        if (! job->cancelled) {
+            pthread_mutex_unlock(&job->pool->lock);
+            _LWBIP38JobMix(job, b, i, job->scratch, job->scratchLen);
+            pthread_mutex_lock(&job->pool->lock);
+        }
+        
+        job->blocksDone++;
+    }
+    
+    while (job->blocksDone < job->p) pthread_cond_wait(&job->pool->blocksCond, &job->pool->lock); // blocks others took
+    job->b = NULL;
+    cancelled = job->cancelled;
+    pthread_mutex_unlock(&job->pool->lock);
+    if (! cancelled) LWPBKDF2(dk, dkLen, LWSHA256, 256/8, pw, pwLen, b, len, 1);
+    mem_clean(b, len);
+    free(b);
+    return ! cancelled;
+}
+
+// writes the passfactor to passfactor, returns false if job is cancelled
+static int _LWBIP38DerivePassfactor(_LWBIP38Job *job, UInt256 *passfactor, uint8_t flag, const uint8_t *entropy,
+                                    const char *passphrase)
 {
     size_t len = strlen(passphrase);
-    UInt256 prefactor, passfactor;
+    UInt256 prefactor = UINT256_ZERO;
     
-    LWScrypt(&prefactor, sizeof(prefactor), passphrase, len, entropy, (flag & BIP38_LOTSEQUENCE_FLAG) ? 4 : 8,
-             BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P);
+    if (! _LWBIP38Scrypt(job, &prefactor, sizeof(prefactor), passphrase, len, entropy,
+                         (flag & BIP38_LOTSEQUENCE_FLAG) ? 4 : 8, BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P)) {
+        var_clean(&len);
+        return 0;
+    }
     
     if (flag & BIP38_LOTSEQUENCE_FLAG) { // passfactor = SHA256(SHA256(prefactor + entropy))
         uint8_t d[sizeof(prefactor) + sizeof(uint64_t)];
 
         memcpy(d, &prefactor, sizeof(prefactor));
         memcpy(&d[sizeof(prefactor)], entropy, sizeof(uint64_t));
-        LWSHA256_2(&passfactor, d, sizeof(d));
+        LWSHA256_2(passfactor, d, sizeof(d));
         mem_clean(d, sizeof(d));
     }
-    else passfactor = prefactor;
+    else *passfactor = prefactor;
     
     var_clean(&len);
     var_clean(&prefactor);
-    return passfactor;
+    return 1;
 }
 
-static UInt512 _LWBIP38DeriveKey(LWECPoint passpoint, const uint8_t *addresshash, const uint8_t *entropy)
+// writes the derived key to dk, returns false if job is cancelled
+static int _LWBIP38DeriveKey(_LWBIP38Job *job, UInt512 *dk, LWECPoint passpoint, const uint8_t *addresshash,
+                             const uint8_t *entropy)
 {
-    UInt512 dk;
     uint8_t salt[sizeof(uint32_t) + sizeof(uint64_t)];
+    int r;
     
     memcpy(salt, addresshash, sizeof(uint32_t));
     memcpy(&salt[sizeof(uint32_t)], entropy, sizeof(uint64_t)); // salt = addresshash + entropy
-    LWScrypt(&dk, sizeof(dk), &passpoint, sizeof(passpoint), salt, sizeof(salt), BIP38_SCRYPT_EC_N, BIP38_SCRYPT_EC_R,
-             BIP38_SCRYPT_EC_P);
+    r = _LWBIP38Scrypt(job, dk, sizeof(*dk), &passpoint, sizeof(passpoint), salt, sizeof(salt), BIP38_SCRYPT_EC_N,
+                       BIP38_SCRYPT_EC_R, BIP38_SCRYPT_EC_P);
     mem_clean(salt, sizeof(salt));
-    return dk;
+    return r;
 }
 
 int LWBIP38KeyIsValid(const char *bip38Key)
@@ -210,9 +308,7 @@ int LWBIP38KeyIsValid(const char *bip38Key)
     else return 0; // invalid prefix
 }
 
-// decrypts a BIP38 key using the given passphrase and returns false if passphrase is incorrect
-// passphrase must be unicode NFC normalized: http://www.unicode.org/reports/tr15/#Norm_Forms
-int LWKeySetBIP38Key(LWKey *key, const char *bip38Key, const char *passphrase)
+static int _LWKeySetBIP38Key(_LWBIP38Job *job, LWKey *key, const char *bip38Key, const char *passphrase)
 {
     int r = 1;
     uint8_t data[39];
@@ -235,8 +331,8 @@ int LWKeySetBIP38Key(LWKey *key, const char *bip38Key, const char *passphrase)
         // data = prefix + flag + addresshash + encrypted1 + encrypted2
         UInt128 encrypted1 = UInt128Get(&data[7]), encrypted2 = UInt128Get(&data[23]);
 
-        LWScrypt(&derived, sizeof(derived), passphrase, pwLen, addresshash, sizeof(uint32_t),
-                 BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P);
+        if (! _LWBIP38Scrypt(job, &derived, sizeof(derived), passphrase, pwLen, addresshash, sizeof(uint32_t),
+                             BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P)) return 0;
         derived1 = *(UInt256 *)&derived, derived2 = *(UInt256 *)&derived.u8[sizeof(UInt256)];
         var_clean(&derived);
         
@@ -254,12 +350,19 @@ int LWKeySetBIP38Key(LWKey *key, const char *bip38Key, const char *passphrase)
         // data = prefix + flag + addresshash + entropy + encrypted1[0...7] + encrypted2
         const uint8_t *entropy = &data[7];
         UInt128 encrypted1 = UINT128_ZERO, encrypted2 = UInt128Get(&data[23]);
-        UInt256 passfactor = _LWBIP38DerivePassfactor(flag, entropy, passphrase), factorb;
+        UInt256 passfactor, factorb;
         LWECPoint passpoint;
         uint64_t seedb[3];
         
+        if (! _LWBIP38DerivePassfactor(job, &passfactor, flag, entropy, passphrase)) return 0;
         LWSecp256k1PointGen(&passpoint, &passfactor); // passpoint = G*passfactor
-        derived = _LWBIP38DeriveKey(passpoint, addresshash, entropy);
+
+        if (! _LWBIP38DeriveKey(job, &derived, passpoint, addresshash, entropy)) {
+            var_clean(&passpoint);
+            var_clean(&passfactor);
+            return 0;
+        }
+
         var_clean(&passpoint);
         derived1 = *(UInt256 *)&derived, derived2 = *(UInt256 *)&derived.u8[sizeof(UInt256)];
         var_clean(&derived);
@@ -292,6 +395,16 @@ int LWKeySetBIP38Key(LWKey *key, const char *bip38Key, const char *passphrase)
     return r;
 }
 
+// decrypts a BIP38 key using the given passphrase and returns false if passphrase is incorrect
+// passphrase must be unicode NFC normalized: http://www.unicode.org/reports/tr15/#Norm_Forms
+int LWKeySetBIP38Key(LWKey *key, const char *bip38Key, const char *passphrase)
+{
+    assert(key != NULL);
+    assert(bip38Key != NULL);
+    assert(passphrase != NULL);
+    return _LWKeySetBIP38Key(NULL, key, bip38Key, passphrase);
+}
+
 // generates an "intermediate code" for an EC multiply mode key
 // salt should be 64bits of random data
 // passphrase must be unicode NFC normalized
@@ -320,10 +433,8 @@ void LWKeySetBIP38ItermediateCode(LWKey *key, const char *code, const uint8_t *s
     // TODO: XXX implement
 }
 
-// encrypts key with passphrase
-// passphrase must be unicode NFC normalized
-// returns number of bytes written to bip38Key including NULL terminator or total bip38KeyLen needed if bip38Key is NULL
-size_t LWKeyBIP38Key(LWKey *key, char *bip38Key, size_t bip38KeyLen, const char *passphrase)
+static size_t _LWKeyBIP38Key(_LWBIP38Job *job, LWKey *key, char *bip38Key, size_t bip38KeyLen,
+                             const char *passphrase)
 {
     uint16_t prefix = BIP38_NOEC_PREFIX;
     uint8_t buf[39], flag = BIP38_NOEC_FLAG;
@@ -344,8 +455,8 @@ size_t LWKeyBIP38Key(LWKey *key, char *bip38Key, size_t bip38KeyLen, const char
     LWSHA256_2(&hash, address.s, strlen(address.s));
     salt = hash.u32[0];
 
-    LWScrypt(&derived, sizeof(derived), passphrase, strlen(passphrase), &salt, sizeof(salt),
-             BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P);
+    if (! _LWBIP38Scrypt(job, &derived, sizeof(derived), passphrase, strlen(passphrase), &salt, sizeof(salt),
+                         BIP38_SCRYPT_N, BIP38_SCRYPT_R, BIP38_SCRYPT_P)) return 0;
     derived1 = *(UInt256 *)&derived, derived2 = *(UInt256 *)&derived.u8[sizeof(UInt256)];
     var_clean(&derived);
     
@@ -371,3 +482,231 @@ size_t LWKeyBIP38Key(LWKey *key, char *bip38Key, size_t bip38KeyLen, const char
     off += sizeof(encrypted2);
     return LWBase58CheckEncode(bip38Key, bip38KeyLen, buf, off);
 }
+
+// encrypts key with passphrase
+// passphrase must be unicode NFC normalized
+// returns number of bytes written to bip38Key including NULL terminator or total bip38KeyLen needed if bip38Key is NULL
+size_t LWKeyBIP38Key(LWKey *key, char *bip38Key, size_t bip38KeyLen, const char *passphrase)
+{
+    return _LWKeyBIP38Key(NULL, key, bip38Key, bip38KeyLen, passphrase);
+}
+
+// returns a new job with copies of bip38Key and passphrase, or NULL if they're too long
+static _LWBIP38Job *_LWBIP38JobNew(LWBIP38Pool *pool, const char *bip38Key, const char *passphrase, void *info)
+{
+    size_t keyLen = (bip38Key) ? strlen(bip38Key) + 1 : 0, pwLen = strlen(passphrase) + 1;
+    _LWBIP38Job *job = calloc(1, sizeof(*job) + keyLen + pwLen);
+    
+    assert(job != NULL);
+    job->pool = pool;
+    job->info = info;
+    job->passphrase = (char *)(job + 1);
+    memcpy(job->passphrase, passphrase, pwLen);
+    
+    if (bip38Key) {
+        job->bip38Key = job->passphrase + pwLen;
+        memcpy(job->bip38Key, bip38Key, keyLen);
+    }
+    
+    return job;
+}
+
+static void _LWBIP38JobFree(_LWBIP38Job *job)
+{
+    size_t len = sizeof(*job) + strlen(job->passphrase) + 1 + ((job->bip38Key) ? strlen(job->bip38Key) + 1 : 0);
+    
+    mem_clean(job, len);
+    free(job);
+}
+
+// adds job to the end of the queue and returns its id
+static uint64_t _LWBIP38PoolAdd(LWBIP38Pool *pool, _LWBIP38Job *job)
+{
+    uint64_t jobId;
+    
+    pthread_mutex_lock(&pool->lock);
+    jobId = job->id = ++pool->lastJobId;
+    array_add(pool->queue, job);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return jobId;
+}
+
+static void *_LWBIP38PoolThreadRoutine(void *arg)
+{
+    LWBIP38Pool *pool = arg;
+    _LWBIP38Job *job;
+    void *scratch = NULL;
+    size_t i, scratchLen = 0, bip38KeyLen = 0;
+    char bip38Key[61];
+    uint8_t *b;
+    unsigned block;
+    LWKey key;
+    int ok = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    while (! pool->stop) {
+        for (i = 0, job = NULL; ! job && i < array_count(pool->running); i++) {
+            if (pool->running[i]->b && pool->running[i]->nextBlock < pool->running[i]->p) job = pool->running[i];
+        }
+        
+        if (job) { // mix one of the scrypt blocks of a running job
+            block = job->nextBlock++, b = job->b;
+            
+            if (! job->cancelled) {
+                pthread_mutex_unlock(&pool->lock);
+                _LWBIP38JobMix(job, b, block, &scratch, &scratchLen);
+                pthread_mutex_lock(&pool->lock);
+            }
+            
+            if (++job->blocksDone == job->p) pthread_cond_broadcast(&pool->blocksCond);
+        }
+        else if (array_count(pool->queue) > 0) { // start the next queued job
+            job = pool->queue[0];
+            array_rm(pool->queue, 0);
+            array_add(pool->running, job);
+            job->scratch = &scratch, job->scratchLen = &scratchLen;
+            pthread_mutex_unlock(&pool->lock);
+            
+            if (job->decrypted) ok = _LWKeySetBIP38Key(job, &key, job->bip38Key, job->passphrase);
+            else bip38KeyLen = _LWKeyBIP38Key(job, &job->key, bip38Key, sizeof(bip38Key), job->passphrase);
+            
+            pthread_mutex_lock(&pool->lock);
+            
+            for (i = array_count(pool->running); i > 0; i--) {
+                if (pool->running[i - 1] == job) array_rm(pool->running, i - 1);
+            }
+            
+            if (! job->cancelled) { // a job can't be cancelled once it's no longer running
+                pthread_mutex_unlock(&pool->lock);
+                if (job->decrypted) job->decrypted(job->info, job->id, (ok) ? &key : NULL);
+                if (job->encrypted) job->encrypted(job->info, job->id, (bip38KeyLen > 0) ? bip38Key : NULL);
+                pthread_mutex_lock(&pool->lock);
+            }
+            
+            _LWBIP38JobFree(job);
+            var_clean(&key);
+            mem_clean(bip38Key, sizeof(bip38Key));
+        }
+        else pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    if (scratch) mem_clean(scratch, scratchLen);
+    free(scratch);
+    return NULL;
+}
+
+// returns a new pool of threadCount worker threads for running BIP38 key decryption and encryption in the background
+// each worker keeps a single scrypt scratch buffer (16MB with BIP38 parameters) for reuse across jobs, so memory use is
+// bounded by threadCount, and workers without a job of their own mix the parallel scrypt blocks of running jobs
+// returned pool must be freed by calling LWBIP38PoolFree()
+LWBIP38Pool *LWBIP38PoolNew(unsigned threadCount)
+{
+    LWBIP38Pool *pool = calloc(1, sizeof(*pool));
+    
+    assert(pool != NULL);
+    assert(threadCount > 0);
+    array_new(pool->queue, 10);
+    array_new(pool->running, threadCount);
+    pool->threads = calloc(threadCount, sizeof(*pool->threads));
+    assert(pool->threads != NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->blocksCond, NULL);
+    
+    while (pool->threadCount < threadCount &&
+           pthread_create(&pool->threads[pool->threadCount], NULL, _LWBIP38PoolThreadRoutine, pool) == 0) {
+        pool->threadCount++;
+    }
+    
+    assert(pool->threadCount > 0);
+    return pool;
+}
+
+// queues decryption of bip38Key with passphrase, and returns the job id
+// callback is called from a worker thread with the decrypted key, or NULL if the passphrase is incorrect
+// passphrase must be unicode NFC normalized
+uint64_t LWBIP38PoolDecrypt(LWBIP38Pool *pool, const char *bip38Key, const char *passphrase, void *info,
+                            void (*callback)(void *info, uint64_t jobId, const LWKey *key))
+{
+    _LWBIP38Job *job;
+    
+    assert(pool != NULL);
+    assert(bip38Key != NULL);
+    assert(passphrase != NULL);
+    assert(callback != NULL);
+    job = _LWBIP38JobNew(pool, bip38Key, passphrase, info);
+    job->decrypted = callback;
+    return _LWBIP38PoolAdd(pool, job);
+}
+
+// queues encryption of key with passphrase, and returns the job id
+// callback is called from a worker thread with the BIP38 key
+// passphrase must be unicode NFC normalized
+uint64_t LWBIP38PoolEncrypt(LWBIP38Pool *pool, const LWKey *key, const char *passphrase, void *info,
+                            void (*callback)(void *info, uint64_t jobId, const char *bip38Key))
+{
+    _LWBIP38Job *job;
+    
+    assert(pool != NULL);
+    assert(key != NULL);
+    assert(passphrase != NULL);
+    assert(callback != NULL);
+    job = _LWBIP38JobNew(pool, NULL, passphrase, info);
+    job->key = *key;
+    job->encrypted = callback;
+    return _LWBIP38PoolAdd(pool, job);
+}
+
+// cancels the job with jobId, a queued job is removed, and a running job stops before its next scrypt block
+// returns true if the job was cancelled before its callback was called, in which case the callback won't be called
+int LWBIP38PoolCancel(LWBIP38Pool *pool, uint64_t jobId)
+{
+    size_t i;
+    int r = 0;
+    
+    assert(pool != NULL);
+    pthread_mutex_lock(&pool->lock);
+    
+    for (i = array_count(pool->queue); ! r && i > 0; i--) {
+        if (pool->queue[i - 1]->id != jobId) continue;
+        _LWBIP38JobFree(pool->queue[i - 1]);
+        array_rm(pool->queue, i - 1);
+        r = 1;
+    }
+    
+    for (i = array_count(pool->running); ! r && i > 0; i--) {
+        if (pool->running[i - 1]->id != jobId || pool->running[i - 1]->cancelled) continue;
+        pool->running[i - 1]->cancelled = 1;
+        r = 1;
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    return r;
+}
+
+// cancels all jobs, waits for the worker threads to exit, and frees memory allocated for pool
+// must not be called from a job callback
+void LWBIP38PoolFree(LWBIP38Pool *pool)
+{
+    size_t i;
+    
+    assert(pool != NULL);
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    for (i = 0; i < array_count(pool->queue); i++) _LWBIP38JobFree(pool->queue[i]);
+    array_clear(pool->queue);
+    for (i = 0; i < array_count(pool->running); i++) pool->running[i]->cancelled = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->threadCount; i++) pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->cond);
+    pthread_cond_destroy(&pool->blocksCond);
+    pthread_mutex_destroy(&pool->lock);
+    array_free(pool->queue);
+    array_free(pool->running);
+    free(pool->threads);
+    free(pool);
+}
@@ -42,6 +42,34 @@ void LWKeySetBIP38ItermediateCode(LWKey *key, const char *code, const uint8_t *s
 // returns number of bytes written to bip38Key including NULL terminator or total bip38KeyLen needed if bip38Key is NULL
 size_t LWKeyBIP38Key(LWKey *key, char *bip38Key, size_t bip38KeyLen, const char *passphrase);
 
+typedef struct LWBIP38PoolStruct LWBIP38Pool;
+
+// returns a new pool of threadCount worker threads for running BIP38 key decryption and encryption in the background
+// each worker keeps a single scrypt scratch buffer (16MB with BIP38 parameters) for reuse across jobs, so memory use is
+// bounded by threadCount, and workers without a job of their own mix the parallel scrypt blocks of running jobs
+// returned pool must be freed by calling LWBIP38PoolFree()
+LWBIP38Pool *LWBIP38PoolNew(unsigned threadCount);
+
+// queues decryption of bip38Key with passphrase, and returns the job id
+// callback is called from a worker thread with the decrypted key, or NULL if the passphrase is incorrect
+// passphrase must be unicode NFC normalized
+uint64_t LWBIP38PoolDecrypt(LWBIP38Pool *pool, const char *bip38Key, const char *passphrase, void *info,
+                            void (*callback)(void *info, uint64_t jobId, const LWKey *key));
+
+// queues encryption of key with passphrase, and returns the job id
+// callback is called from a worker thread with the BIP38 key
+// passphrase must be unicode NFC normalized
+uint64_t LWBIP38PoolEncrypt(LWBIP38Pool *pool, const LWKey *key, const char *passphrase, void *info,
+                            void (*callback)(void *info, uint64_t jobId, const char *bip38Key));
+
+// cancels the job with jobId, a queued job is removed, and a running job stops before its next scrypt block
+// returns true if the job was cancelled before its callback was called, in which case the callback won't be called
+int LWBIP38PoolCancel(LWBIP38Pool *pool, uint64_t jobId);
+
+// cancels all jobs, waits for the worker threads to exit, and frees memory allocated for pool
+// must not be called from a job callback
+void LWBIP38PoolFree(LWBIP38Pool *pool);
+
 #ifdef __cplusplus
 }
 #endif
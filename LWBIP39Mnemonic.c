@@ -9,6 +9,38 @@
 #include <string.h>
 #include <assert.h>
 
+#define BIP39_INDEX_SIZE (BIP39_WORDLIST_COUNT*2) // hash table slots, must be a power of 2
+
+// builds an open addressing hash table of wordList, each slot holds a word index plus one, or zero if it's empty
+static void _LWBIP39IndexInit(uint16_t index[BIP39_INDEX_SIZE], const char *wordList[])
+{
+    uint32_t i, h;
+    
+    memset(index, 0, BIP39_INDEX_SIZE*sizeof(*index));
+    
+    for (i = 0; i < BIP39_WORDLIST_COUNT; i++) {
+        h = LWMurmur3_32(wordList[i], strlen(wordList[i]), 0) & (BIP39_INDEX_SIZE - 1);
+        while (index[h] != 0) h = (h + 1) & (BIP39_INDEX_SIZE - 1);
+        index[h] = i + 1;
+    }
+}
+
+// returns the wordList index of the first wordLen chars of word, or INT32_MAX if it isn't in wordList
+static uint32_t _LWBIP39IndexLookup(const uint16_t index[BIP39_INDEX_SIZE], const char *wordList[], const char *word,
+                                    size_t wordLen)
+{
+    uint32_t h = LWMurmur3_32(word, wordLen, 0) & (BIP39_INDEX_SIZE - 1);
+    const char *w;
+    
+    while (index[h] != 0) {
+        w = wordList[index[h] - 1];
+        if (strncmp(word, w, wordLen) == 0 && w[wordLen] == '\0') return index[h] - 1;
+        h = (h + 1) & (BIP39_INDEX_SIZE - 1);
+    }
+    
+    return INT32_MAX;
+}
+
 // returns number of bytes written to phrase including NULL terminator, or phraseLen needed if phrase is NULL
 size_t LWBIP39Encode(char *phrase, size_t phraseLen, const char *wordList[], const uint8_t *data, size_t dataLen)
 {
@@ -40,25 +72,16 @@ size_t LWBIP39Encode(char *phrase, size_t phraseLen, const char *wordList[], con
     return (! phrase || len + 1 <= phraseLen) ? len + 1 : 0;
 }
 
-// returns number of bytes written to data, or dataLen needed if data is NULL
-size_t LWBIP39Decode(uint8_t *data, size_t dataLen, const char *wordList[], const char *phrase)
+static size_t _LWBIP39Decode(uint8_t *data, size_t dataLen, const uint16_t index[BIP39_INDEX_SIZE],
+                             const char *wordList[], const char *phrase)
 {
     uint32_t x, y, count = 0, idx[24], i;
     uint8_t b = 0, hash[32];
     const char *word = phrase;
     size_t r = 0;
 
-    assert(wordList != NULL);
-    assert(phrase != NULL);
-    
     while (word && *word && count < 24) {
-        for (i = 0, idx[count] = INT32_MAX; i < BIP39_WORDLIST_COUNT; i++) { // not fast, but simple and correct
-            if (strncmp(word, wordList[i], strlen(wordList[i])) != 0 ||
-                (word[strlen(wordList[i])] != ' ' && word[strlen(wordList[i])] != '\0')) continue;
-            idx[count] = i;
-            break;
-        }
-        
+        idx[count] = _LWBIP39IndexLookup(index, wordList, word, strcspn(word, " "));
         if (idx[count] == INT32_MAX) break; // phrase contains unknown word
         count++;
         word = strchr(word, ' ');
@@ -91,6 +114,17 @@ size_t LWBIP39Decode(uint8_t *data, size_t dataLen, const char *wordList[], cons
     return (! data || r <= dataLen) ? r : 0;
 }
 
+// returns number of bytes written to data, or dataLen needed if data is NULL
+size_t LWBIP39Decode(uint8_t *data, size_t dataLen, const char *wordList[], const char *phrase)
+{
+    uint16_t index[BIP39_INDEX_SIZE];
+    
+    assert(wordList != NULL);
+    assert(phrase != NULL);
+    _LWBIP39IndexInit(index, wordList);
+    return _LWBIP39Decode(data, dataLen, index, wordList, phrase);
+}
+
 // verifies that all phrase words are contained in wordlist and checksum is valid
 int LWBIP39PhraseIsValid(const char *wordList[], const char *phrase)
 {
@@ -99,6 +133,28 @@ int LWBIP39PhraseIsValid(const char *wordList[], const char *phrase)
     return (LWBIP39Decode(NULL, 0, wordList, phrase) > 0);
 }
 
+// verifies each of phrases as in LWBIP39PhraseIsValid(), indexing wordList only once for all of them
+// if valid isn't NULL, valid[i] is set to true if phrases[i] is valid, returns number of valid phrases
+size_t LWBIP39PhrasesAreValid(const char *wordList[], const char *phrases[], size_t phrasesCount, int valid[])
+{
+    uint16_t index[BIP39_INDEX_SIZE];
+    size_t i, count = 0;
+    int r;
+    
+    assert(wordList != NULL);
+    assert(phrases != NULL || phrasesCount == 0);
+    _LWBIP39IndexInit(index, wordList);
+    
+    for (i = 0; i < phrasesCount; i++) {
+        assert(phrases[i] != NULL);
+        r = (_LWBIP39Decode(NULL, 0, index, wordList, phrases[i]) > 0);
+        if (valid) valid[i] = r;
+        if (r) count++;
+    }
+    
+    return count;
+}
+
 // key64 must hold 64 bytes (512 bits), phrase and passphrase must be unicode NFKD normalized
 // http://www.unicode.org/reports/tr15/#Norm_Forms
 // BUG: does not currently support passphrases containing NULL characters
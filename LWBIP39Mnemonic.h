@@ -27,6 +27,10 @@ size_t LWBIP39Decode(uint8_t *data, size_t dataLen, const char *wordList[], cons
 // verifies that all phrase words are contained in wordlist and checksum is valid
 int LWBIP39PhraseIsValid(const char *wordList[], const char *phrase);
 
+// verifies each of phrases as in LWBIP39PhraseIsValid(), indexing wordList only once for all of them
+// if valid isn't NULL, valid[i] is set to true if phrases[i] is valid, returns number of valid phrases
+size_t LWBIP39PhrasesAreValid(const char *wordList[], const char *phrases[], size_t phrasesCount, int valid[]);
+
 // key64 must hold 64 bytes (512 bits), phrase and passphrase must be unicode NFKD normalized
 // http://www.unicode.org/reports/tr15/#Norm_Forms
 // BUG: does not currently support passphrases containing NULL characters
@@ -11,41 +11,53 @@
 
 // base58 and base58check encoding: https://en.bitcoin.it/wiki/Base58Check_encoding
 
+#define BASE58_LIMB       656356768 // 58^5, five base58 digits per 32bit limb
+#define BASE58_LIMB_CHARS 5
+
 // returns the number of characters written to str including NULL terminator, or total strLen needed if str is NULL
 size_t LWBase58Encode(char *str, size_t strLen, const uint8_t *data, size_t dataLen)
 {
     static const char chars[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
-    size_t i, j, len, zcount = 0;
+    size_t i, j, n, len, count = 0, zcount = 0;
+    uint64_t carry;
     
     assert(data != NULL);
     while (zcount < dataLen && data && data[zcount] == 0) zcount++; // count leading zeroes
 
-    uint8_t buf[(dataLen - zcount)*138/100 + 1]; // log(256)/log(58), rounded up
-    
-    memset(buf, 0, sizeof(buf));
+    // the number is built up in little endian base 58^5 limbs, 4 bytes of data at a time, so each multiply and carry
+    // step handles 32 bits of input and 5 base58 digits of output
+    uint32_t limbs[(dataLen - zcount)*138/100/BASE58_LIMB_CHARS + 2]; // log(256)/log(58), rounded up
+    char buf[sizeof(limbs)/sizeof(*limbs)*BASE58_LIMB_CHARS];
     
-    for (i = zcount; data && i < dataLen; i++) {
-        uint32_t carry = data[i];
+    for (i = zcount; data && i < dataLen; i += n) {
+        n = (i == zcount && (dataLen - zcount) % 4 != 0) ? (dataLen - zcount) % 4 : 4; // leading partial word first
         
-        for (j = sizeof(buf); j > 0; j--) {
-            carry += (uint32_t)buf[j - 1] << 8;
-            buf[j - 1] = carry % 58;
-            carry /= 58;
+        for (j = 0, carry = 0; j < n; j++) carry = (carry << 8) | data[i + j];
+        
+        for (j = 0; j < count; j++) {
+            carry += (uint64_t)limbs[j] << (n*8);
+            limbs[j] = carry % BASE58_LIMB;
+            carry /= BASE58_LIMB;
         }
         
-        var_clean(&carry);
+        while (carry > 0) limbs[count++] = carry % BASE58_LIMB, carry /= BASE58_LIMB;
+    }
+    
+    for (i = sizeof(buf), j = 0; j < count; j++) { // base58 digits, most significant last
+        for (n = 0; n < BASE58_LIMB_CHARS; n++) buf[--i] = chars[limbs[j] % 58], limbs[j] /= 58;
     }
     
-    i = 0;
-    while (i < sizeof(buf) && buf[i] == 0) i++; // skip leading zeroes
+    while (i < sizeof(buf) && buf[i] == chars[0]) i++; // skip leading zeroes
     len = (zcount + sizeof(buf) - i) + 1;
 
     if (str && len <= strLen) {
         while (zcount-- > 0) *(str++) = chars[0];
-        while (i < sizeof(buf)) *(str++) = chars[buf[i++]];
-        *str = '\0';
+        memcpy(str, &buf[i], sizeof(buf) - i);
+        str[sizeof(buf) - i] = '\0';
     }
     
+    var_clean(&carry);
+    mem_clean(limbs, sizeof(limbs));
     mem_clean(buf, sizeof(buf));
     return (! str || len <= strLen) ? len : 0;
 }
@@ -53,70 +65,79 @@ size_t LWBase58Encode(char *str, size_t strLen, const uint8_t *data, size_t data
 // returns the number of bytes written to data, or total dataLen needed if data is NULL
 size_t LWBase58Decode(uint8_t *data, size_t dataLen, const char *str)
 {
-    size_t i = 0, j, len, zcount = 0;
+    static const uint32_t pow58[] = { 1, 58, 58*58, 58*58*58, 58*58*58*58, BASE58_LIMB };
+    size_t i, j, len, count = 0, zcount = 0;
+    uint32_t digit, n = 0;
+    uint64_t carry = 0;
     
     assert(str != NULL);
     while (str && *str == '1') str++, zcount++; // count leading zeroes
     
-    uint8_t buf[(str) ? strlen(str)*733/1000 + 1 : 0]; // log(58)/log(256), rounded up
-    
-    memset(buf, 0, sizeof(buf));
+    // the number is built up in little endian 32bit limbs, 5 base58 digits at a time
+    uint32_t limbs[(str) ? strlen(str)*733/1000/4 + 2 : 1]; // log(58)/log(256), rounded up
     
-    while (str && *str) {
-        uint32_t carry = *(const uint8_t *)(str++);
+    while (str) {
+        digit = *(const uint8_t *)(str++);
         
-        switch (carry) {
+        switch (digit) {
             case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-                carry -= '1';
+                digit -= '1';
                 break;
                 
             case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H':
-                carry += 9 - 'A';
+                digit += 9 - 'A';
                 break;
                 
             case 'J': case 'K': case 'L': case 'M': case 'N':
-                carry += 17 - 'J';
+                digit += 17 - 'J';
                 break;
                 
             case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U': case 'V': case 'W': case 'X': case 'Y':
             case 'Z':
-                carry += 22 - 'P';
+                digit += 22 - 'P';
                 break;
                 
             case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
             case 'k':
-                carry += 33 - 'a';
+                digit += 33 - 'a';
                 break;
                 
             case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't': case 'u': case 'v':
             case 'w': case 'x': case 'y': case 'z':
-                carry += 44 - 'm';
+                digit += 44 - 'm';
                 break;
                 
             default:
-                carry = UINT32_MAX;
+                digit = UINT32_MAX;
         }
         
-        if (carry >= 58) break; // invalid base58 digit
+        if (digit < 58) carry = carry*58 + digit, n++;
+        if (digit < 58 && n < BASE58_LIMB_CHARS) continue;
         
-        for (j = sizeof(buf); j > 0; j--) {
-            carry += (uint32_t)buf[j - 1]*58;
-            buf[j - 1] = carry & 0xff;
-            carry >>= 8;
+        // multiply in the digits read so far, a decoding error ends the number at the last valid digit
+        for (j = 0; n > 0 && j < count; j++) {
+            carry += (uint64_t)limbs[j]*pow58[n];
+            limbs[j] = (uint32_t)carry;
+            carry >>= 32;
         }
         
-        var_clean(&carry);
+        while (carry > 0) limbs[count++] = (uint32_t)carry, carry >>= 32;
+        n = 0;
+        if (digit >= 58) break; // invalid base58 digit or end of string
     }
     
-    while (i < sizeof(buf) && buf[i] == 0) i++; // skip leading zeroes
-    len = zcount + sizeof(buf) - i;
+    i = count*4;
+    while (i > 0 && (limbs[(i - 1)/4] >> ((i - 1) % 4)*8 & 0xff) == 0) i--; // skip leading zeroes
+    len = zcount + i;
 
     if (data && len <= dataLen) {
         if (zcount > 0) memset(data, 0, zcount);
-        memcpy(&data[zcount], &buf[i], sizeof(buf) - i);
+        for (j = 0; j < i; j++) data[zcount + j] = limbs[(i - 1 - j)/4] >> ((i - 1 - j) % 4)*8 & 0xff;
     }
 
-    mem_clean(buf, sizeof(buf));
+    var_clean(&carry);
+    var_clean(&digit);
+    mem_clean(limbs, count*sizeof(*limbs));
     return (! data || len <= dataLen) ? len : 0;
 }
 
@@ -140,6 +161,30 @@ size_t LWBase58CheckEncode(char *str, size_t strLen, const uint8_t *data, size_t
     return len;
 }
 
+// base58check encodes count items of dataLen bytes each, stored back to back in data, writing item i to
+// &str[i*strLen] with a NULL terminator, returns number of items written, stopping at the first that doesn't fit
+size_t LWBase58CheckEncodeArray(char *str, size_t strLen, const uint8_t *data, size_t dataLen, size_t count)
+{
+    uint8_t _buf[0x1000], *buf = (dataLen + 4 <= sizeof(_buf)) ? _buf : malloc(dataLen + 4), md[256/8];
+    size_t i;
+    
+    assert(buf != NULL);
+    assert(str != NULL || count == 0);
+    assert(data != NULL || dataLen == 0 || count == 0);
+    
+    for (i = 0; i < count; i++) {
+        memcpy(buf, &data[i*dataLen], dataLen);
+        LWSHA256_2(md, buf, dataLen);
+        memcpy(&buf[dataLen], md, 4);
+        if (LWBase58Encode(&str[i*strLen], strLen, buf, dataLen + 4) == 0) break;
+    }
+    
+    mem_clean(buf, dataLen + 4);
+    mem_clean(md, sizeof(md));
+    if (buf != _buf) free(buf);
+    return i;
+}
+
 // returns the number of bytes written to data, or total dataLen needed if data is NULL
 size_t LWBase58CheckDecode(uint8_t *data, size_t dataLen, const char *str)
 {
@@ -24,6 +24,10 @@ size_t LWBase58Decode(uint8_t *data, size_t dataLen, const char *str);
 // returns the number of characters written to str including NULL terminator, or total strLen needed if str is NULL
 size_t LWBase58CheckEncode(char *str, size_t strLen, const uint8_t *data, size_t dataLen);
 
+// base58check encodes count items of dataLen bytes each, stored back to back in data, writing item i to
+// &str[i*strLen] with a NULL terminator, returns number of items written, stopping at the first that doesn't fit
+size_t LWBase58CheckEncodeArray(char *str, size_t strLen, const uint8_t *data, size_t dataLen, size_t count);
+
 // returns the number of bytes written to data, or total dataLen needed if data is NULL
 size_t LWBase58CheckDecode(uint8_t *data, size_t dataLen, const char *str);
 
@@ -0,0 +1,148 @@
+//
+//  LWBlockFilter.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWBlockFilter.h"
+#include "LWCrypto.h"
+#include "LWAddress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// high 64bits of the 128bit product of a and b
+inline static uint64_t _LWMulHi64(uint64_t a, uint64_t b)
+{
+    uint64_t aLo = (uint32_t)a, aHi = a >> 32, bLo = (uint32_t)b, bHi = b >> 32,
+             lo = aLo*bLo, mid1 = aHi*bLo, mid2 = aLo*bHi, carry = ((lo >> 32) + (uint32_t)mid1 + (uint32_t)mid2) >> 32;
+
+    return aHi*bHi + (mid1 >> 32) + (mid2 >> 32) + carry;
+}
+
+static int _LWUInt64Compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+// hashes scripts into the range [0, n*BLOCK_FILTER_M) using the block's key, and sorts the resulting values
+static void _LWBlockFilterValues(uint64_t values[], UInt256 blockHash, const uint8_t *scripts[],
+                                 const size_t scriptLens[], size_t scriptsCount, uint64_t n)
+{
+    for (size_t i = 0; i < scriptsCount; i++) {
+        values[i] = _LWMulHi64(LWSipHash24(blockHash.u8, scripts[i], scriptLens[i]), n*BLOCK_FILTER_M);
+    }
+
+    qsort(values, scriptsCount, sizeof(*values), _LWUInt64Compare);
+}
+
+// reads the next golomb-rice coded delta from buf starting at bit *bitIdx, returns false if buf is too short
+static int _LWBlockFilterReadDelta(const uint8_t *buf, size_t bufLen, size_t *bitIdx, uint64_t *delta)
+{
+    uint64_t q = 0, r = 0;
+    size_t i = *bitIdx;
+
+    while (i/8 < bufLen && (buf[i/8] & (0x80 >> (i % 8)))) q++, i++; // quotient is unary coded
+    if (i/8 >= bufLen || (i + 1 + BLOCK_FILTER_P + 7)/8 > bufLen) return 0;
+    i++;
+
+    for (size_t j = 0; j < BLOCK_FILTER_P; j++, i++) r = (r << 1) | ((buf[i/8] >> (7 - i % 8)) & 1);
+    *bitIdx = i;
+    *delta = (q << BLOCK_FILTER_P) | r;
+    return 1;
+}
+
+// true if any of the given scripts are in the basic filter for the block with blockHash
+int LWBlockFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount)
+{
+    size_t i, j, bitIdx = 0, intLen = 0;
+    uint64_t n = LWVarInt(filter, filterLen, &intLen), value = 0, delta;
+    int r = 0;
+
+    assert(filter != NULL || filterLen == 0);
+    assert(scripts != NULL || scriptsCount == 0);
+    assert(scriptLens != NULL || scriptsCount == 0);
+
+    // each element takes at least BLOCK_FILTER_P + 1 bits, which also keeps n*BLOCK_FILTER_M from overflowing
+    if (intLen == 0 || n == 0 || scriptsCount == 0 || n > (filterLen - intLen)*8/(BLOCK_FILTER_P + 1)) return 0;
+
+    uint64_t _values[512], *values = (scriptsCount <= 512) ? _values : malloc(scriptsCount*sizeof(*values));
+
+    assert(values != NULL);
+    _LWBlockFilterValues(values, blockHash, scripts, scriptLens, scriptsCount, n);
+    filter += intLen;
+    filterLen -= intLen;
+
+    for (i = 0, j = 0; ! r && i < n && j < scriptsCount; i++) { // walk both sorted sets, looking for a common value
+        if (! _LWBlockFilterReadDelta(filter, filterLen, &bitIdx, &delta)) break;
+        value += delta;
+        while (j < scriptsCount && values[j] < value) j++;
+        if (j < scriptsCount && values[j] == value) r = 1;
+    }
+
+    if (values != _values) free(values);
+    return r;
+}
+
+// writes the basic filter for the block with blockHash containing the given scripts to buf, duplicate scripts must be
+// removed by the caller, returns number of bytes written, or buf length needed if buf is NULL
+size_t LWBlockFilterBuild(uint8_t *buf, size_t bufLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount)
+{
+    uint64_t *values = (scriptsCount > 0) ? malloc(scriptsCount*sizeof(*values)) : NULL, value = 0, delta, q;
+    size_t i, j, off, bitLen = 0;
+
+    assert(scripts != NULL || scriptsCount == 0);
+    assert(scriptLens != NULL || scriptsCount == 0);
+    assert(values != NULL || scriptsCount == 0);
+    _LWBlockFilterValues(values, blockHash, scripts, scriptLens, scriptsCount, scriptsCount);
+
+    for (i = 0; i < scriptsCount; i++) {
+        bitLen += (size_t)((values[i] - value) >> BLOCK_FILTER_P) + 1 + BLOCK_FILTER_P;
+        value = values[i];
+    }
+
+    off = LWVarIntSize(scriptsCount) + (bitLen + 7)/8;
+
+    if (buf && off <= bufLen) {
+        off = LWVarIntSet(buf, bufLen, scriptsCount);
+        memset(&buf[off], 0, (bitLen + 7)/8);
+
+        for (i = 0, value = 0, bitLen = off*8; i < scriptsCount; i++) {
+            delta = values[i] - value;
+            value = values[i];
+            for (q = delta >> BLOCK_FILTER_P; q > 0; q--, bitLen++) buf[bitLen/8] |= 0x80 >> (bitLen % 8);
+            bitLen++; // unary terminating zero bit
+
+            for (j = BLOCK_FILTER_P; j > 0; j--, bitLen++) {
+                if ((delta >> (j - 1)) & 1) buf[bitLen/8] |= 0x80 >> (bitLen % 8);
+            }
+        }
+
+        off = (bitLen + 7)/8;
+    }
+    else if (buf) off = 0;
+
+    if (values) free(values);
+    return off;
+}
+
+// the filter hash committed to by a filter header
+UInt256 LWBlockFilterHash(const uint8_t *filter, size_t filterLen)
+{
+    UInt256 hash;
+
+    assert(filter != NULL || filterLen == 0);
+    LWSHA256_2(&hash, filter, filterLen);
+    return hash;
+}
+
+// the filter header for a block with the given filter hash, chained to the filter header of the previous block
+UInt256 LWBlockFilterHeader(UInt256 filterHash, UInt256 prevHeader)
+{
+    UInt256 header, buf[2] = { filterHash, prevHeader };
+
+    LWSHA256_2(&header, buf, sizeof(buf));
+    return header;
+}
@@ -0,0 +1,42 @@
+//
+//  LWBlockFilter.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWBlockFilter_h
+#define LWBlockFilter_h
+
+#include "LWInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// compact block filters are explained in BIP158: https://github.com/bitcoin/bips/blob/master/bip-0158.mediawiki
+// a basic filter is a golomb-rice coded set of the output scripts and spent previous output scripts in a block
+
+#define BLOCK_FILTER_BASIC 0x00   // basic filter type
+#define BLOCK_FILTER_P     19     // golomb-rice coding parameter
+#define BLOCK_FILTER_M     784931 // inverse false positive rate
+
+// true if any of the given scripts are in the basic filter for the block with blockHash
+int LWBlockFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount);
+
+// writes the basic filter for the block with blockHash containing the given scripts to buf, duplicate scripts must be
+// removed by the caller, returns number of bytes written, or buf length needed if buf is NULL
+size_t LWBlockFilterBuild(uint8_t *buf, size_t bufLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount);
+
+// the filter hash committed to by a filter header
+UInt256 LWBlockFilterHash(const uint8_t *filter, size_t filterLen);
+
+// the filter header for a block with the given filter hash, chained to the filter header of the previous block
+UInt256 LWBlockFilterHeader(UInt256 filterHash, UInt256 prevHeader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWBlockFilter_h
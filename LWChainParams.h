@@ -21,7 +21,8 @@ typedef struct {
     uint16_t standardPort;
     uint32_t magicNumber;
     uint64_t services;
-    int (*verifyDifficulty)(const LWMerkleBlock *block, const LWSet *blockSet); // blockSet must have last 2016 blocks
+    // transitionTime is the timestamp of the first block in the retarget window, see LWMerkleBlockVerifyDifficulty()
+    int (*verifyDifficulty)(const LWMerkleBlock *block, const LWMerkleBlock *previous, uint32_t transitionTime);
     const LWCheckPoint *checkpoints;
     size_t checkpointsCount;
 } LWChainParams;
@@ -72,29 +73,18 @@ static const LWCheckPoint LWTestNetCheckpoints[] = {
 	{ 2282112, uint256("b64455a7630d72d982d7e00966e04e3c148a482d2f2b52e20bd7acc3aadbcd69"), 1649496420, 0x1e03ffff }
 };
 
-static int LWMainNetVerifyDifficulty(const LWMerkleBlock *block, const LWSet *blockSet)
+static int LWMainNetVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous,
+                                     uint32_t transitionTime)
 {
-    // const LWMerkleBlock *previous, *b = NULL;
-    // uint32_t i;
-
-    // assert(block != NULL);
-    // assert(blockSet != NULL);
-
-    // // check if we hit a difficulty transition, and find previous transition block
-    // if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-    //     for (i = 0, b = block; b && i < BLOCK_DIFFICULTY_INTERVAL; i++) {
-    //         b = LWSetGet(blockSet, &b->prevBlock);
-    //     }
-    // }
-
-    // previous = LWSetGet(blockSet, &block->prevBlock);
-    // return LWMerkleBlockVerifyDifficulty(block, previous, (b) ? b->timestamp : 0);
-    return 1;
+    assert(block != NULL);
+    assert(previous != NULL);
+    return LWMerkleBlockVerifyDifficulty(block, previous, transitionTime);
 }
 
-static int LWTestNetVerifyDifficulty(const LWMerkleBlock *block, const LWSet *blockSet)
+static int LWTestNetVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous,
+                                     uint32_t transitionTime)
 {
-    return 1; // XXX skip testnet difficulty check for now
+    return 1; // XXX testnet allows minimum difficulty blocks after 5 minutes without one, skip the check for now
 }
 
 static const LWChainParams LWMainNetParams = {
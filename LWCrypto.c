@@ -28,6 +28,9 @@
 // bitwise left rotation
 #define rol32(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
 
+// number of messages hashed together by the multi-buffer kernels, four 32bit words fill a 128bit vector register
+#define HASH_LANES 4
+
 // basic sha1 functions
 #define f1(x, y, z) (((x) & (y)) | (~(x) & (z)))
 #define f2(x, y, z) ((x) ^ (y) ^ (z))
@@ -90,19 +93,19 @@ void LWSHA1(void *md20, const void *data, size_t len)
 #define s2(x) (ror32((x), 7) ^ ror32((x), 18) ^ ((x) >> 3))
 #define s3(x) (ror32((x), 17) ^ ror32((x), 19) ^ ((x) >> 10))
 
+static const uint32_t _sha256K[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
 static void _LWSHA256Compress(uint32_t *r, const uint32_t *x)
 {
-    static const uint32_t k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    
     int i;
     uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
     
@@ -110,7 +113,7 @@ static void _LWSHA256Compress(uint32_t *r, const uint32_t *x)
     for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
     
     for (i = 0; i < 64; i++) {
-        t1 = h + s1(e) + ch(e, f, g) + k[i] + w[i];
+        t1 = h + s1(e) + ch(e, f, g) + _sha256K[i] + w[i];
         t2 = s0(a) + maj(a, b, c);
         h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
     }
@@ -120,6 +123,41 @@ static void _LWSHA256Compress(uint32_t *r, const uint32_t *x)
     mem_clean(w, sizeof(w));
 }
 
+// compresses one block for each of HASH_LANES independent messages, w[0...15] holds the block words in host byte order
+// and the rest of w is used for the message schedule, each step is a short loop across lanes the compiler can vectorize
+static void _LWSHA256CompressLanes(uint32_t r[8][HASH_LANES], uint32_t w[64][HASH_LANES])
+{
+    int i, l;
+    uint32_t a[HASH_LANES], b[HASH_LANES], c[HASH_LANES], d[HASH_LANES], e[HASH_LANES], f[HASH_LANES],
+             g[HASH_LANES], h[HASH_LANES], t1, t2;
+
+    for (i = 16; i < 64; i++) {
+        for (l = 0; l < HASH_LANES; l++) w[i][l] = s3(w[i - 2][l]) + w[i - 7][l] + s2(w[i - 15][l]) + w[i - 16][l];
+    }
+
+    for (l = 0; l < HASH_LANES; l++) {
+        a[l] = r[0][l], b[l] = r[1][l], c[l] = r[2][l], d[l] = r[3][l];
+        e[l] = r[4][l], f[l] = r[5][l], g[l] = r[6][l], h[l] = r[7][l];
+    }
+
+    for (i = 0; i < 64; i++) {
+        for (l = 0; l < HASH_LANES; l++) {
+            t1 = h[l] + s1(e[l]) + ch(e[l], f[l], g[l]) + _sha256K[i] + w[i][l];
+            t2 = s0(a[l]) + maj(a[l], b[l], c[l]);
+            h[l] = g[l], g[l] = f[l], f[l] = e[l], e[l] = d[l] + t1, d[l] = c[l], c[l] = b[l], b[l] = a[l];
+            a[l] = t1 + t2;
+        }
+    }
+
+    for (l = 0; l < HASH_LANES; l++) {
+        r[0][l] += a[l], r[1][l] += b[l], r[2][l] += c[l], r[3][l] += d[l];
+        r[4][l] += e[l], r[5][l] += f[l], r[6][l] += g[l], r[7][l] += h[l];
+    }
+
+    var_clean(&a, &b, &c, &d, &e, &f, &g, &h);
+    var_clean(&t1, &t2);
+}
+
 void LWSHA224(void *md28, const void *data, size_t len) {
     size_t i;
     uint32_t x[16], buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
@@ -145,14 +183,15 @@ void LWSHA224(void *md28, const void *data, size_t len) {
     mem_clean(buf, sizeof(buf));
 }
 
-void LWSHA256(void *md32, const void *data, size_t len)
+static const uint32_t _sha256Init[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                        0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+
+// hashes data into buf, which already has prefixLen bytes (a multiple of 64) hashed into it, and writes the digest to
+// md32
+static void _LWSHA256Final(uint32_t buf[8], const void *data, size_t len, size_t prefixLen, void *md32)
 {
     size_t i;
-    uint32_t x[16], buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
-                              0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
-    
-    assert(md32 != NULL);
-    assert(data != NULL || len == 0);
+    uint32_t x[16];
 
     for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
         memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
@@ -163,11 +202,22 @@ void LWSHA256(void *md32, const void *data, size_t len)
     memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
     ((uint8_t *)x)[len - i] = 0x80; // append padding
     if (len - i >= 56) _LWSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
+    len += prefixLen;
     x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
     _LWSHA256Compress(buf, x); // finalize
     for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md32, buf, 32); // write to md
     mem_clean(x, sizeof(x));
+}
+
+void LWSHA256(void *md32, const void *data, size_t len)
+{
+    uint32_t buf[8];
+    
+    assert(md32 != NULL);
+    assert(data != NULL || len == 0);
+    memcpy(buf, _sha256Init, sizeof(buf));
+    _LWSHA256Final(buf, data, len, 0, md32);
     mem_clean(buf, sizeof(buf));
 }
 
@@ -255,14 +305,16 @@ void LWSHA384(void *md48, const void *data, size_t len)
     mem_clean(buf, sizeof(buf));
 }
 
-void LWSHA512(void *md64, const void *data, size_t len)
+static const uint64_t _sha512Init[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b,
+                                        0xa54ff53a5f1d36f1, 0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+                                        0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 }; // initial buffer values
+
+// hashes data into buf, which already has prefixLen bytes (a multiple of 128) hashed into it, and writes the digest to
+// md64
+static void _LWSHA512Final(uint64_t buf[8], const void *data, size_t len, size_t prefixLen, void *md64)
 {
     size_t i;
-    uint64_t x[16], buf[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
-                              0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
-    
-    assert(md64 != NULL);
-    assert(data != NULL || len == 0);
+    uint64_t x[16];
 
     for (i = 0; i < len; i += 128) { // process data in 128 byte blocks
         memcpy(x, (const uint8_t *)data + i, (i + 128 < len) ? 128 : len - i);
@@ -273,11 +325,21 @@ void LWSHA512(void *md64, const void *data, size_t len)
     memset((uint8_t *)x + (len - i), 0, 128 - (len - i)); // clear remainder of x
     ((uint8_t *)x)[len - i] = 0x80; // append padding
     if (len - i >= 112) _LWSHA512Compress(buf, x), memset(x, 0, 128); // length goes to next block
-    x[14] = 0, x[15] = be64((uint64_t)len*8); // append length in bits
+    x[14] = 0, x[15] = be64((uint64_t)(len + prefixLen)*8); // append length in bits
     _LWSHA512Compress(buf, x); // finalize
     for (i = 0; i < 8; i++) buf[i] = be64(buf[i]); // endian swap
     memcpy(md64, buf, 64); // write to md
     mem_clean(x, sizeof(x));
+}
+
+void LWSHA512(void *md64, const void *data, size_t len)
+{
+    uint64_t buf[8];
+    
+    assert(md64 != NULL);
+    assert(data != NULL || len == 0);
+    memcpy(buf, _sha512Init, sizeof(buf));
+    _LWSHA512Final(buf, data, len, 0, md64);
     mem_clean(buf, sizeof(buf));
 }
 
@@ -292,33 +354,33 @@ void LWSHA512(void *md64, const void *data, size_t len)
 #define rmd(a, b, c, d, e, f, g, h, i, j) ((a) = rol32((f) + (b) + le32(c) + (d), (e)) + (g), (f) = (g), (g) = (h),\
                                            (h) = rol32((i), 10), (i) = (j), (j) = (a))
 
+// left line
+static const int rl1[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, // round 1, id
+                 rl2[] = { 7, 4, 13, 1, 10, 6, 15, 3, 12, 0, 9, 5, 2, 14, 11, 8 }, // round 2, rho
+                 rl3[] = { 3, 10, 14, 4, 9, 15, 8, 1, 2, 7, 0, 6, 13, 11, 5, 12 }, // round 3, rho^2
+                 rl4[] = { 1, 9, 11, 10, 0, 8, 12, 4, 13, 3, 7, 15, 14, 5, 6, 2 }, // round 4, rho^3
+                 rl5[] = { 4, 0, 5, 9, 7, 12, 2, 10, 14, 1, 3, 8, 11, 6, 15, 13 }; // round 5, rho^4
+// right line
+static const int rr1[] = { 5, 14, 7, 0, 9, 2, 11, 4, 13, 6, 15, 8, 1, 10, 3, 12 }, // round 1, pi
+                 rr2[] = { 6, 11, 3, 7, 0, 13, 5, 10, 14, 15, 8, 12, 4, 9, 1, 2 }, // round 2, rho pi
+                 rr3[] = { 15, 5, 1, 3, 7, 14, 6, 9, 11, 8, 12, 2, 10, 0, 4, 13 }, // round 3, rho^2 pi
+                 rr4[] = { 8, 6, 4, 1, 3, 11, 15, 0, 5, 12, 2, 13, 9, 7, 10, 14 }, // round 4, rho^3 pi
+                 rr5[] = { 12, 15, 10, 4, 1, 5, 8, 7, 6, 2, 13, 14, 0, 3, 9, 11 }; // round 5, rho^4 pi
+// left line shifts
+static const int sl1[] = { 11, 14, 15, 12, 5, 8, 7, 9, 11, 13, 14, 15, 6, 7, 9, 8 }, // round 1
+                 sl2[] = { 7, 6, 8, 13, 11, 9, 7, 15, 7, 12, 15, 9, 11, 7, 13, 12 }, // round 2
+                 sl3[] = { 11, 13, 6, 7, 14, 9, 13, 15, 14, 8, 13, 6, 5, 12, 7, 5 }, // round 3
+                 sl4[] = { 11, 12, 14, 15, 14, 15, 9, 8, 9, 14, 5, 6, 8, 6, 5, 12 }, // round 4
+                 sl5[] = { 9, 15, 5, 11, 6, 8, 13, 12, 5, 12, 13, 14, 11, 8, 5, 6 }; // round 5
+// right line shifts
+static const int sr1[] = { 8, 9, 9, 11, 13, 15, 15, 5, 7, 7, 8, 11, 14, 14, 12, 6 }, // round 1
+                 sr2[] = { 9, 13, 15, 7, 12, 8, 9, 11, 7, 7, 12, 7, 6, 15, 13, 11 }, // round 2
+                 sr3[] = { 9, 7, 15, 11, 8, 6, 6, 14, 12, 13, 5, 14, 13, 13, 7, 5 }, // round 3
+                 sr4[] = { 15, 5, 8, 11, 14, 14, 6, 14, 6, 9, 12, 9, 12, 5, 15, 8 }, // round 4
+                 sr5[] = { 8, 5, 12, 9, 12, 5, 14, 6, 8, 13, 6, 5, 15, 13, 11, 11 }; // round 5
+
 static void _LWRMDCompress(uint32_t *r, const uint32_t *x)
 {
-    // left line
-    static const int rl1[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, // round 1, id
-                     rl2[] = { 7, 4, 13, 1, 10, 6, 15, 3, 12, 0, 9, 5, 2, 14, 11, 8 }, // round 2, rho
-                     rl3[] = { 3, 10, 14, 4, 9, 15, 8, 1, 2, 7, 0, 6, 13, 11, 5, 12 }, // round 3, rho^2
-                     rl4[] = { 1, 9, 11, 10, 0, 8, 12, 4, 13, 3, 7, 15, 14, 5, 6, 2 }, // round 4, rho^3
-                     rl5[] = { 4, 0, 5, 9, 7, 12, 2, 10, 14, 1, 3, 8, 11, 6, 15, 13 }; // round 5, rho^4
-    // right line
-    static const int rr1[] = { 5, 14, 7, 0, 9, 2, 11, 4, 13, 6, 15, 8, 1, 10, 3, 12 }, // round 1, pi
-                     rr2[] = { 6, 11, 3, 7, 0, 13, 5, 10, 14, 15, 8, 12, 4, 9, 1, 2 }, // round 2, rho pi
-                     rr3[] = { 15, 5, 1, 3, 7, 14, 6, 9, 11, 8, 12, 2, 10, 0, 4, 13 }, // round 3, rho^2 pi
-                     rr4[] = { 8, 6, 4, 1, 3, 11, 15, 0, 5, 12, 2, 13, 9, 7, 10, 14 }, // round 4, rho^3 pi
-                     rr5[] = { 12, 15, 10, 4, 1, 5, 8, 7, 6, 2, 13, 14, 0, 3, 9, 11 }; // round 5, rho^4 pi
-    // left line shifts
-    static const int sl1[] = { 11, 14, 15, 12, 5, 8, 7, 9, 11, 13, 14, 15, 6, 7, 9, 8 }, // round 1
-                     sl2[] = { 7, 6, 8, 13, 11, 9, 7, 15, 7, 12, 15, 9, 11, 7, 13, 12 }, // round 2
-                     sl3[] = { 11, 13, 6, 7, 14, 9, 13, 15, 14, 8, 13, 6, 5, 12, 7, 5 }, // round 3
-                     sl4[] = { 11, 12, 14, 15, 14, 15, 9, 8, 9, 14, 5, 6, 8, 6, 5, 12 }, // round 4
-                     sl5[] = { 9, 15, 5, 11, 6, 8, 13, 12, 5, 12, 13, 14, 11, 8, 5, 6 }; // round 5
-    // right line shifts
-    static const int sr1[] = { 8, 9, 9, 11, 13, 15, 15, 5, 7, 7, 8, 11, 14, 14, 12, 6 }, // round 1
-                     sr2[] = { 9, 13, 15, 7, 12, 8, 9, 11, 7, 7, 12, 7, 6, 15, 13, 11 }, // round 2
-                     sr3[] = { 9, 7, 15, 11, 8, 6, 6, 14, 12, 13, 5, 14, 13, 13, 7, 5 }, // round 3
-                     sr4[] = { 15, 5, 8, 11, 14, 14, 6, 14, 6, 9, 12, 9, 12, 5, 15, 8 }, // round 4
-                     sr5[] = { 8, 5, 12, 9, 12, 5, 14, 6, 8, 13, 6, 5, 15, 13, 11, 11 }; // round 5
-
     int i;
     uint32_t al = r[0], bl = r[1], cl = r[2], dl = r[3], el = r[4], ar = al, br = bl, cr = cl, dr = dl, er = el, t;
     
@@ -338,6 +400,47 @@ static void _LWRMDCompress(uint32_t *r, const uint32_t *x)
     var_clean(&al, &bl, &cl, &dl, &el, &ar, &br, &cr, &dr, &er, &t);
 }
 
+// compresses one block for each of HASH_LANES independent messages, with x[i][lane] in the same layout as
+// _LWRMDCompress() x[i], each step is a short loop across lanes the compiler can vectorize
+static void _LWRMDCompressLanes(uint32_t r[5][HASH_LANES], const uint32_t x[16][HASH_LANES])
+{
+    int i, l;
+    uint32_t al[HASH_LANES], bl[HASH_LANES], cl[HASH_LANES], dl[HASH_LANES], el[HASH_LANES],
+             ar[HASH_LANES], br[HASH_LANES], cr[HASH_LANES], dr[HASH_LANES], er[HASH_LANES], t[HASH_LANES];
+
+    for (l = 0; l < HASH_LANES; l++) {
+        al[l] = ar[l] = r[0][l], bl[l] = br[l] = r[1][l], cl[l] = cr[l] = r[2][l];
+        dl[l] = dr[l] = r[3][l], el[l] = er[l] = r[4][l];
+    }
+
+#define rmdl(fn, rl, k, sl) for (l = 0; l < HASH_LANES; l++)\
+    rmd(t[l], fn(bl[l], cl[l], dl[l]), x[rl[i]][l], k, sl[i], al[l], el[l], dl[l], cl[l], bl[l])
+#define rmdr(fn, rr, k, sr) for (l = 0; l < HASH_LANES; l++)\
+    rmd(t[l], fn(br[l], cr[l], dr[l]), x[rr[i]][l], k, sr[i], ar[l], er[l], dr[l], cr[l], br[l])
+
+    for (i = 0; i < 16; i++) rmdl(f, rl1, 0x00000000, sl1); // round 1 left
+    for (i = 0; i < 16; i++) rmdr(j, rr1, 0x50a28be6, sr1); // round 1 right
+    for (i = 0; i < 16; i++) rmdl(g, rl2, 0x5a827999, sl2); // round 2 left
+    for (i = 0; i < 16; i++) rmdr(i, rr2, 0x5c4dd124, sr2); // round 2 right
+    for (i = 0; i < 16; i++) rmdl(h, rl3, 0x6ed9eba1, sl3); // round 3 left
+    for (i = 0; i < 16; i++) rmdr(h, rr3, 0x6d703ef3, sr3); // round 3 right
+    for (i = 0; i < 16; i++) rmdl(i, rl4, 0x8f1bbcdc, sl4); // round 4 left
+    for (i = 0; i < 16; i++) rmdr(g, rr4, 0x7a6d76e9, sr4); // round 4 right
+    for (i = 0; i < 16; i++) rmdl(j, rl5, 0xa953fd4e, sl5); // round 5 left
+    for (i = 0; i < 16; i++) rmdr(f, rr5, 0x00000000, sr5); // round 5 right
+
+#undef rmdl
+#undef rmdr
+
+    for (l = 0; l < HASH_LANES; l++) {
+        t[l] = r[1][l] + cl[l] + dr[l]; // final result for r[0]
+        r[1][l] = r[2][l] + dl[l] + er[l], r[2][l] = r[3][l] + el[l] + ar[l], r[3][l] = r[4][l] + al[l] + br[l];
+        r[4][l] = r[0][l] + bl[l] + cr[l], r[0][l] = t[l]; // combine
+    }
+
+    var_clean(&al, &bl, &cl, &dl, &el, &ar, &br, &cr, &dr, &er, &t);
+}
+
 // ripemd-160: http://homes.esat.kuleuven.be/~bosselae/ripemd160.html
 void LWRMD160(void *md20, const void *data, size_t len)
 {
@@ -376,6 +479,57 @@ void LWHash160(void *md20, const void *data, size_t len)
     LWRMD160(md20, t, sizeof(t));
 }
 
+// writes the hash-160 of each of count items of dataLen bytes, stored back to back in data, to md20s
+// items of up to 55 bytes, like 33 byte compressed pubkeys, fit in one block and are hashed HASH_LANES at a time
+void LWHash160Array(void *md20s, const void *data, size_t dataLen, size_t count)
+{
+    const uint8_t *d = data;
+    uint8_t *md = md20s;
+    uint32_t x[64][HASH_LANES], buf[8][HASH_LANES], block[16];
+    size_t i, j, l;
+
+    assert(md20s != NULL || count == 0);
+    assert(data != NULL || dataLen == 0 || count == 0);
+
+    if (dataLen > 55) { // length doesn't fit in the first block
+        for (i = 0; i < count; i++) LWHash160(&md[i*20], &d[i*dataLen], dataLen);
+        return;
+    }
+
+    for (i = 0; i < count; i += HASH_LANES) {
+        for (l = 0; l < HASH_LANES; l++) { // sha-256, unused lanes hash the last item again
+            memset(block, 0, sizeof(block));
+            memcpy(block, &d[((i + l < count) ? i + l : count - 1)*dataLen], dataLen);
+            ((uint8_t *)block)[dataLen] = 0x80; // append padding
+            for (j = 0; j < 15; j++) x[j][l] = be32(block[j]);
+            x[15][l] = (uint32_t)(dataLen << 3); // append length in bits
+            for (j = 0; j < 8; j++) buf[j][l] = _sha256Init[j];
+        }
+
+        _LWSHA256CompressLanes(buf, x);
+
+        for (l = 0; l < HASH_LANES; l++) { // ripemd-160 of the 32 byte sha-256 digests
+            for (j = 0; j < 8; j++) x[j][l] = be32(buf[j][l]);
+            x[8][l] = le32(0x80); // append padding
+            for (j = 9; j < 16; j++) x[j][l] = 0;
+            x[14][l] = le32(32 << 3); // append length in bits
+            buf[0][l] = 0x67452301, buf[1][l] = 0xefcdab89, buf[2][l] = 0x98badcfe, buf[3][l] = 0x10325476;
+            buf[4][l] = 0xc3d2e1f0; // initial buffer values
+        }
+
+        _LWRMDCompressLanes(buf, (const uint32_t (*)[HASH_LANES])x);
+
+        for (l = 0; l < HASH_LANES && i + l < count; l++) {
+            for (j = 0; j < 5; j++) block[j] = le32(buf[j][l]); // endian swap
+            memcpy(&md[(i + l)*20], block, 20); // write to md
+        }
+    }
+
+    mem_clean(x, sizeof(x));
+    mem_clean(buf, sizeof(buf));
+    mem_clean(block, sizeof(block));
+}
+
 // bitwise left rotation
 #define rol64(a, b) ((a) << (b) ^ ((a) >> (64 - (b))))
 
@@ -575,6 +729,117 @@ uint32_t LWMurmur3_32(const void *data, size_t len, uint32_t seed)
     return h;
 }
 
+// one siphash round on the state v
+#define sipround(v) ((v)[0] += (v)[1], (v)[1] = rol64((v)[1], 13), (v)[1] ^= (v)[0], (v)[0] = rol64((v)[0], 32),\
+                     (v)[2] += (v)[3], (v)[3] = rol64((v)[3], 16), (v)[3] ^= (v)[2],\
+                     (v)[0] += (v)[3], (v)[3] = rol64((v)[3], 21), (v)[3] ^= (v)[0],\
+                     (v)[2] += (v)[1], (v)[1] = rol64((v)[1], 17), (v)[1] ^= (v)[2], (v)[2] = rol64((v)[2], 32))
+
+// siphash-2-4: https://131002.net/siphash/siphash.pdf - keyed hash for hashtables and BIP158 filters
+uint64_t LWSipHash24(const void *key16, const void *data, size_t len)
+{
+    const uint8_t *k = key16, *d = data;
+    uint64_t k0 = 0, k1 = 0, m, v[4];
+    size_t i, j;
+
+    assert(key16 != NULL);
+    assert(data != NULL || len == 0);
+    for (i = 0; i < 8; i++) k0 |= (uint64_t)k[i] << (i*8), k1 |= (uint64_t)k[i + 8] << (i*8);
+    v[0] = 0x736f6d6570736575 ^ k0, v[1] = 0x646f72616e646f6d ^ k1;
+    v[2] = 0x6c7967656e657261 ^ k0, v[3] = 0x7465646279746573 ^ k1;
+
+    for (i = 0; i <= len/8; i++) { // the last word is padded with zeros and has the length in its top byte
+        for (j = 0, m = (i == len/8) ? (uint64_t)len << 56 : 0; j < 8 && i*8 + j < len; j++) {
+            m |= (uint64_t)d[i*8 + j] << (j*8);
+        }
+
+        v[3] ^= m;
+        sipround(v);
+        sipround(v);
+        v[0] ^= m;
+    }
+
+    v[2] ^= 0xff;
+    for (i = 0; i < 4; i++) sipround(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// true if the inner and outer hash states can be precomputed for hash, only sha-256 and sha-512 are supported
+inline static int _LWHMACHasMidstate(void (*hash)(void *, const void *, size_t), size_t hashLen)
+{
+    return ((hash == LWSHA256 && hashLen == 256/8) || (hash == LWSHA512 && hashLen == 512/8));
+}
+
+// precomputes the inner and outer hash states for key, so each mac only hashes the data and the inner digest
+// states are only precomputed for LWSHA256 and LWSHA512, other hash functions fall back to LWHMAC()
+// ctx holds key material and should be cleared with mem_clean() when no longer needed
+void LWHMACContextInit(LWHMACContext *ctx, void (*hash)(void *, const void *, size_t), size_t hashLen,
+                       const void *key, size_t keyLen)
+{
+    size_t i, j, blockLen = (hashLen > 32) ? 128 : 64;
+    uint64_t ipad = 0x3636363636363636, opad = 0x5c5c5c5c5c5c5c5c;
+    union { uint32_t u32[32]; uint64_t u64[16]; } pad;
+
+    assert(ctx != NULL);
+    assert(hash != NULL);
+    assert(hashLen > 0 && (hashLen % 4) == 0 && hashLen <= sizeof(ctx->key));
+    assert(key != NULL || keyLen == 0);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->hash = hash;
+    ctx->hashLen = hashLen;
+    if (keyLen > blockLen) hash(ctx->key, key, keyLen), ctx->keyLen = hashLen;
+    else memcpy(ctx->key, key, keyLen), ctx->keyLen = keyLen;
+    if (! _LWHMACHasMidstate(hash, hashLen)) return;
+
+    for (j = 0; j < 2; j++) { // inner state, then outer state
+        memcpy(pad.u64, ctx->key, blockLen);
+        for (i = 0; i < blockLen/sizeof(uint64_t); i++) pad.u64[i] ^= (j == 0) ? ipad : opad;
+
+        if (hash == LWSHA256) {
+            memcpy(&ctx->state.u32[j*8], _sha256Init, sizeof(_sha256Init));
+            _LWSHA256Compress(&ctx->state.u32[j*8], pad.u32);
+        }
+        else {
+            memcpy(&ctx->state.u64[j*8], _sha512Init, sizeof(_sha512Init));
+            _LWSHA512Compress(&ctx->state.u64[j*8], pad.u64);
+        }
+    }
+
+    mem_clean(ctx->key, sizeof(ctx->key)); // the key is no longer needed
+    ctx->keyLen = 0;
+    mem_clean(&pad, sizeof(pad));
+}
+
+// writes HMAC(key, data) to mac, using the states precomputed by LWHMACContextInit()
+void LWHMACContextMac(const LWHMACContext *ctx, void *mac, const void *data, size_t dataLen)
+{
+    union { uint32_t u32[8]; uint64_t u64[8]; } buf;
+    uint8_t md[64];
+
+    assert(ctx != NULL);
+    assert(mac != NULL);
+    assert(data != NULL || dataLen == 0);
+
+    if (! _LWHMACHasMidstate(ctx->hash, ctx->hashLen)) {
+        LWHMAC(mac, ctx->hash, ctx->hashLen, ctx->key, ctx->keyLen, data, dataLen);
+    }
+    else if (ctx->hash == LWSHA256) {
+        memcpy(buf.u32, ctx->state.u32, 32);
+        _LWSHA256Final(buf.u32, data, dataLen, 64, md); // hash((key xor ipad) || data)
+        memcpy(buf.u32, &ctx->state.u32[8], 32);
+        _LWSHA256Final(buf.u32, md, 32, 64, mac); // hash((key xor opad) || inner digest)
+    }
+    else {
+        memcpy(buf.u64, ctx->state.u64, 64);
+        _LWSHA512Final(buf.u64, data, dataLen, 128, md);
+        memcpy(buf.u64, &ctx->state.u64[8], 64);
+        _LWSHA512Final(buf.u64, md, 64, 128, mac);
+    }
+
+    mem_clean(&buf, sizeof(buf));
+    mem_clean(md, sizeof(md));
+}
+
 // HMAC(key, data) = hash((key xor opad) || hash((key xor ipad) || data))
 // opad = 0x5c5c5c...5c5c
 // ipad = 0x363636...3636
@@ -582,14 +847,23 @@ void LWHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLe
             const void *data, size_t dataLen)
 {
     size_t i, blockLen = (hashLen > 32) ? 128 : 64;
-    uint8_t k[hashLen];
-    uint64_t kipad[(blockLen + dataLen)/sizeof(uint64_t) + 1], kopad[(blockLen + hashLen)/sizeof(uint64_t) + 1];
-    
+    LWHMACContext ctx;
+
     assert(mac != NULL);
     assert(hash != NULL);
     assert(hashLen > 0 && (hashLen % 4) == 0);
     assert(key != NULL || keyLen == 0);
     assert(data != NULL || dataLen == 0);
+
+    if (_LWHMACHasMidstate(hash, hashLen)) { // no need to copy data after the key pad
+        LWHMACContextInit(&ctx, hash, hashLen, key, keyLen);
+        LWHMACContextMac(&ctx, mac, data, dataLen);
+        mem_clean(&ctx, sizeof(ctx));
+        return;
+    }
+
+    uint8_t k[hashLen];
+    uint64_t kipad[(blockLen + dataLen)/sizeof(uint64_t) + 1], kopad[(blockLen + hashLen)/sizeof(uint64_t) + 1];
     
     if (keyLen > blockLen) hash(k, key, keyLen), key = k, keyLen = sizeof(k);
     memset(kipad, 0, blockLen);
@@ -853,6 +1127,59 @@ size_t LWChacha20Poly1305AEADDecrypt(void *out, size_t outLen, const void *key32
     return outLen;
 }
 
+// T = U1 ^ U2 ^ ... ^ Urounds, where Ur = hmac_sha256(pw, Ur-1), each hmac is two compressions from the precomputed
+// pad states since Ur-1 and its padding fit in a single block
+static void _LWPBKDF2SHA256Rounds(const LWHMACContext *ctx, void *T, const void *U1, unsigned rounds)
+{
+    uint32_t x[16], buf[8], t[8];
+    
+    memcpy(x, U1, 32);
+    memcpy(t, U1, 32);
+    memset(&x[8], 0, 32);
+    ((uint8_t *)x)[32] = 0x80; // append padding
+    x[15] = be32((64 + 32)*8); // length of the key pad and the previous U in bits
+    
+    for (unsigned r = 1; r < rounds; r++) {
+        memcpy(buf, ctx->state.u32, 32);
+        _LWSHA256Compress(buf, x); // inner hash
+        for (unsigned j = 0; j < 8; j++) x[j] = be32(buf[j]);
+        memcpy(buf, &ctx->state.u32[8], 32);
+        _LWSHA256Compress(buf, x); // outer hash
+        for (unsigned j = 0; j < 8; j++) x[j] = be32(buf[j]), t[j] ^= x[j];
+    }
+    
+    memcpy(T, t, 32);
+    mem_clean(x, sizeof(x));
+    mem_clean(buf, sizeof(buf));
+    mem_clean(t, sizeof(t));
+}
+
+// same as _LWPBKDF2SHA256Rounds() for hmac_sha512
+static void _LWPBKDF2SHA512Rounds(const LWHMACContext *ctx, void *T, const void *U1, unsigned rounds)
+{
+    uint64_t x[16], buf[8], t[8];
+    
+    memcpy(x, U1, 64);
+    memcpy(t, U1, 64);
+    memset(&x[8], 0, 64);
+    ((uint8_t *)x)[64] = 0x80; // append padding
+    x[15] = be64((uint64_t)(128 + 64)*8); // length of the key pad and the previous U in bits
+    
+    for (unsigned r = 1; r < rounds; r++) {
+        memcpy(buf, ctx->state.u64, 64);
+        _LWSHA512Compress(buf, x); // inner hash
+        for (unsigned j = 0; j < 8; j++) x[j] = be64(buf[j]);
+        memcpy(buf, &ctx->state.u64[8], 64);
+        _LWSHA512Compress(buf, x); // outer hash
+        for (unsigned j = 0; j < 8; j++) x[j] = be64(buf[j]), t[j] ^= x[j];
+    }
+    
+    memcpy(T, t, 64);
+    mem_clean(x, sizeof(x));
+    mem_clean(buf, sizeof(buf));
+    mem_clean(t, sizeof(t));
+}
+
 // dk = T1 || T2 || ... || Tdklen/hlen
 // Ti = U1 xor U2 xor ... xor Urounds
 // U1 = hmac_hash(pw, salt || be32(i))
@@ -864,6 +1191,7 @@ void LWPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 {
     uint8_t s[saltLen + sizeof(uint32_t)];
     uint32_t i, j, U[hashLen/sizeof(uint32_t)], T[hashLen/sizeof(uint32_t)];
+    LWHMACContext ctx;
     
     assert(dk != NULL || dkLen == 0);
     assert(hash != NULL);
@@ -873,16 +1201,22 @@ void LWPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
     assert(rounds > 0);
     
     memcpy(s, salt, saltLen);
+    LWHMACContextInit(&ctx, hash, hashLen, pw, pwLen); // the key pads are hashed once for all blocks and rounds
     
     for (i = 0; i < (dkLen + hashLen - 1)/hashLen; i++) {
         j = be32(i + 1);
         memcpy(s + saltLen, &j, sizeof(j));
-        LWHMAC(U, hash, hashLen, pw, pwLen, s, sizeof(s)); // U1 = hmac_hash(pw, salt || be32(i))
-        memcpy(T, U, sizeof(U));
+        LWHMACContextMac(&ctx, U, s, sizeof(s)); // U1 = hmac_hash(pw, salt || be32(i))
         
-        for (unsigned r = 1; r < rounds; r++) {
-            LWHMAC(U, hash, hashLen, pw, pwLen, U, sizeof(U)); // Urounds = hmac_hash(pw, Urounds-1)
-            for (j = 0; j < hashLen/sizeof(uint32_t); j++) T[j] ^= U[j]; // Ti = U1 ^ U2 ^ ... ^ Urounds
+        if (hash == LWSHA256 && hashLen == 256/8) _LWPBKDF2SHA256Rounds(&ctx, T, U, rounds);
+        else if (hash == LWSHA512 && hashLen == 512/8) _LWPBKDF2SHA512Rounds(&ctx, T, U, rounds);
+        else {
+            memcpy(T, U, sizeof(U));
+            
+            for (unsigned r = 1; r < rounds; r++) {
+                LWHMACContextMac(&ctx, U, U, sizeof(U)); // Urounds = hmac_hash(pw, Urounds-1)
+                for (j = 0; j < hashLen/sizeof(uint32_t); j++) T[j] ^= U[j]; // Ti = U1 ^ U2 ^ ... ^ Urounds
+            }
         }
         
         // dk = T1 || T2 || ... || Tdklen/hlen
@@ -892,6 +1226,7 @@ void LWPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
     mem_clean(s, sizeof(s));
     mem_clean(U, sizeof(U));
     mem_clean(T, sizeof(T));
+    mem_clean(&ctx, sizeof(ctx));
 }
 
 // salsa20/8 stream cypher: http://cr.yp.to/snuffle.html
@@ -932,14 +1267,48 @@ static void _blockmix_salsa8(uint64_t *dest, const uint64_t *src, uint64_t *b, u
     }
 }
 
-// scrypt key derivation: http://www.tarsnap.com/scrypt.html
-void LWScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
-              unsigned n, unsigned r, unsigned p)
+// scrypt ROMix on a single 128*r byte block of the p parallel blocks, using a scratch buffer of at least 128*r*n bytes
+void LWScryptROMix(void *b, unsigned n, unsigned r, void *scratch)
 {
-    uint64_t x[16*r], y[16*r], z[8], *v = malloc(128*r*n), m;
-    uint32_t b[32*r*p];
+    uint64_t x[16*r], y[16*r], z[8], *v = scratch, m;
     
+    assert(b != NULL);
     assert(v != NULL);
+    assert(n > 0);
+    assert(r > 0);
+    
+    for (unsigned j = 0; j < 32*r; j++) ((uint32_t *)x)[j] = le32(((uint32_t *)b)[j]);
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        memcpy(&v[j*(16*r)], x, 128*r);
+        _blockmix_salsa8(y, x, z, r);
+        memcpy(&v[(j + 1)*(16*r)], y, 128*r);
+        _blockmix_salsa8(x, y, z, r);
+    }
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        m = le64(x[(2*r - 1)*8]) & (n - 1);
+        for (unsigned k = 0; k < 16*r; k++) x[k] ^= v[m*(16*r) + k];
+        _blockmix_salsa8(y, x, z, r);
+        m = le64(y[(2*r - 1)*8]) & (n - 1);
+        for (unsigned k = 0; k < 16*r; k++) y[k] ^= v[m*(16*r) + k];
+        _blockmix_salsa8(x, y, z, r);
+    }
+    
+    for (unsigned j = 0; j < 32*r; j++) ((uint32_t *)b)[j] = le32(((uint32_t *)x)[j]);
+    mem_clean(x, sizeof(x));
+    mem_clean(y, sizeof(y));
+    mem_clean(z, sizeof(z));
+}
+
+// scrypt key derivation using a caller supplied scratch buffer of at least 128*r*n bytes, useful to avoid allocating a
+// new buffer for each of many calls with the same parameters (scratch is not zeroed afterward)
+void LWScryptBuf(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+                 unsigned n, unsigned r, unsigned p, void *scratch)
+{
+    uint32_t b[32*r*p];
+    
+    assert(scratch != NULL);
     assert(dk != NULL || dkLen == 0);
     assert(pw != NULL || pwLen == 0);
     assert(salt != NULL || saltLen == 0);
@@ -948,34 +1317,19 @@ void LWScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *
     assert(p > 0);
     
     LWPBKDF2(b, sizeof(b), LWSHA256, 256/8, pw, pwLen, salt, saltLen, 1);
-    
-    for (int i = 0; i < p; i++) {
-        for (unsigned j = 0; j < 32*r; j++) ((uint32_t *)x)[j] = le32(b[i*32*r + j]);
-        
-        for (unsigned j = 0; j < n; j += 2) {
-            memcpy(&v[j*(16*r)], x, 128*r);
-            _blockmix_salsa8(y, x, z, r);
-            memcpy(&v[(j + 1)*(16*r)], y, 128*r);
-            _blockmix_salsa8(x, y, z, r);
-        }
-        
-        for (unsigned j = 0; j < n; j += 2) {
-            m = le64(x[(2*r - 1)*8]) & (n - 1);
-            for (unsigned k = 0; k < 16*r; k++) x[k] ^= v[m*(16*r) + k];
-            _blockmix_salsa8(y, x, z, r);
-            m = le64(y[(2*r - 1)*8]) & (n - 1);
-            for (unsigned k = 0; k < 16*r; k++) y[k] ^= v[m*(16*r) + k];
-            _blockmix_salsa8(x, y, z, r);
-        }
-        
-        for (unsigned j = 0; j < 32*r; j++) b[i*32*r + j] = le32(((uint32_t *)x)[j]);
-    }
-    
+    for (unsigned i = 0; i < p; i++) LWScryptROMix(&b[i*32*r], n, r, scratch);
     LWPBKDF2(dk, dkLen, LWSHA256, 256/8, pw, pwLen, b, sizeof(b), 1);
     mem_clean(b, sizeof(b));
-    mem_clean(x, sizeof(x));
-    mem_clean(y, sizeof(y));
-    mem_clean(z, sizeof(z));
+}
+
+// scrypt key derivation: http://www.tarsnap.com/scrypt.html
+void LWScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+              unsigned n, unsigned r, unsigned p)
+{
+    void *v = malloc(128*r*n);
+    
+    assert(v != NULL);
+    LWScryptBuf(dk, dkLen, pw, pwLen, salt, saltLen, n, r, p, v);
     mem_clean(v, 128*r*n);
     free(v);
 }
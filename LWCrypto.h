@@ -34,6 +34,10 @@ void LWRMD160(void *md20, const void *data, size_t len);
 // bitcoin hash-160 = ripemd-160(sha-256(x))
 void LWHash160(void *md20, const void *data, size_t len);
 
+// writes the hash-160 of each of count items of dataLen bytes, stored back to back in data, to md20s
+// items of up to 55 bytes, like 33 byte compressed pubkeys, fit in one block and are hashed several at a time
+void LWHash160Array(void *md20s, const void *data, size_t dataLen, size_t count);
+
 // sha3-256: http://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.202.pdf
 void LWSHA3_256(void *md32, const void *data, size_t len);
 
@@ -46,9 +50,29 @@ void LWMD5(void *md16, const void *data, size_t len);
 // murmurHash3 (x86_32): https://code.google.com/p/smhasher/ - for non cryptographic use only
 uint32_t LWMurmur3_32(const void *data, size_t len, uint32_t seed);
 
+// siphash-2-4: https://131002.net/siphash/siphash.pdf - keyed hash for hashtables and BIP158 filters
+uint64_t LWSipHash24(const void *key16, const void *data, size_t len);
+
 void LWHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLen, const void *key, size_t keyLen,
             const void *data, size_t dataLen);
 
+// hmac with the inner and outer key pad states hashed once, for computing many macs with the same key
+// states are only precomputed for LWSHA256 and LWSHA512, other hash functions fall back to LWHMAC()
+typedef struct {
+    void (*hash)(void *, const void *, size_t);
+    size_t hashLen;
+    union { uint32_t u32[16]; uint64_t u64[16]; } state; // inner state, followed by outer state
+    uint8_t key[128]; // key for hash functions without precomputed states
+    size_t keyLen;
+} LWHMACContext;
+
+// ctx holds key material and should be cleared with mem_clean() when no longer needed
+void LWHMACContextInit(LWHMACContext *ctx, void (*hash)(void *, const void *, size_t), size_t hashLen,
+                       const void *key, size_t keyLen);
+
+// writes HMAC(key, data) to mac, using the states precomputed by LWHMACContextInit()
+void LWHMACContextMac(const LWHMACContext *ctx, void *mac, const void *data, size_t dataLen);
+
 // hmac-drbg with no prediction resistance or additional input
 // K and V must point to buffers of size hashLen, and ps (personalization string) may be NULL
 // to generate additional drbg output, use K and V from the previous call, and set seed, nonce and ps to NULL
@@ -76,6 +100,16 @@ void LWPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 void LWScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
               unsigned n, unsigned r, unsigned p);
 
+// scrypt key derivation using a caller supplied scratch buffer of at least 128*r*n bytes, useful to avoid allocating a
+// new buffer for each of many calls with the same parameters (scratch is not zeroed afterward)
+void LWScryptBuf(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+                 unsigned n, unsigned r, unsigned p, void *scratch);
+
+// scrypt ROMix on a single 128*r byte block of the p parallel blocks, using a scratch buffer of at least 128*r*n bytes
+// scrypt(pw, salt) = pbkdf2_sha256(pw, ROMix(b[0]) || ... || ROMix(b[p - 1]), 1, dkLen), where
+// b = pbkdf2_sha256(pw, salt, 1, 128*r*p), so the p blocks can be mixed in parallel, each with its own scratch buffer
+void LWScryptROMix(void *b, unsigned n, unsigned r, void *scratch);
+
 // zeros out memory in a way that can't be optimized out by the compiler
 inline static void mem_clean(void *ptr, size_t len)
 {
@@ -0,0 +1,278 @@
+//
+//  LWHeaderStore.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWHeaderStore.h"
+#include "LWCrypto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#define HEADER_STORE_MAGIC       0x5348574c // "LWHS"
+#define HEADER_STORE_VERSION     1
+#define HEADER_STORE_HEADER_SIZE 16
+#define HEADER_STORE_MAP_SIZE    (1 << 20) // minimum length of the file mapping
+
+struct LWHeaderStoreStruct {
+    int fd;
+    uint8_t *map; // mapping of the file, may extend past the end of the file
+    size_t mapLen, count;
+    uint32_t startHeight;
+    pthread_mutex_t lock;
+};
+
+inline static size_t _LWHeaderStoreOffset(size_t idx)
+{
+    return HEADER_STORE_HEADER_SIZE + idx*HEADER_STORE_RECORD_SIZE;
+}
+
+// maps at least len bytes of the file, returns false if the file couldn't be mapped
+static int _LWHeaderStoreMap(LWHeaderStore *store, size_t len)
+{
+    size_t mapLen = (store->mapLen > HEADER_STORE_MAP_SIZE) ? store->mapLen : HEADER_STORE_MAP_SIZE;
+    void *map;
+
+    if (store->map && len <= store->mapLen) return 1;
+    while (mapLen < len) mapLen *= 2;
+    if (store->map) munmap(store->map, store->mapLen);
+    map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, store->fd, 0);
+    store->map = (map != MAP_FAILED) ? map : NULL;
+    store->mapLen = (store->map) ? mapLen : 0;
+    return (store->map != NULL);
+}
+
+// truncates the file after the first count records
+static int _LWHeaderStoreTruncate(LWHeaderStore *store, size_t count)
+{
+    if (count < store->count) store->count = count;
+    return (ftruncate(store->fd, (off_t)_LWHeaderStoreOffset(count)) == 0);
+}
+
+// writes a new file header and removes all records
+static int _LWHeaderStoreReset(LWHeaderStore *store)
+{
+    uint8_t header[HEADER_STORE_HEADER_SIZE] = { 0 };
+
+    UInt32SetLE(&header[0], HEADER_STORE_MAGIC);
+    UInt32SetLE(&header[4], HEADER_STORE_VERSION);
+    UInt32SetLE(&header[8], HEADER_STORE_RECORD_SIZE);
+    store->count = 0;
+    return (_LWHeaderStoreTruncate(store, 0) && pwrite(store->fd, header, sizeof(header), 0) == sizeof(header));
+}
+
+// writes the record for block to buf
+static void _LWHeaderStoreSetRecord(uint8_t *buf, const LWMerkleBlock *block)
+{
+    UInt32SetLE(&buf[0], block->version);
+    UInt256Set(&buf[4], block->prevBlock);
+    UInt256Set(&buf[36], block->merkleRoot);
+    UInt32SetLE(&buf[68], block->timestamp);
+    UInt32SetLE(&buf[72], block->target);
+    UInt32SetLE(&buf[76], block->nonce);
+    UInt32SetLE(&buf[80], block->height);
+    UInt32SetLE(&buf[84], LWMurmur3_32(buf, 84, 0));
+}
+
+// returns the record at index idx, or NULL if it's out of range or its checksum doesn't match
+static const uint8_t *_LWHeaderStoreRecord(LWHeaderStore *store, size_t idx)
+{
+    const uint8_t *r = (idx < store->count) ? &store->map[_LWHeaderStoreOffset(idx)] : NULL;
+
+    return (r && UInt32GetLE(&r[84]) == LWMurmur3_32(r, 84, 0)) ? r : NULL;
+}
+
+// opens the header store file at path, creating it if needed, any records after the last valid one among the last
+// HEADER_STORE_VERIFY_COUNT (such as those from an interrupted write) are removed, and if the first record is invalid,
+// all of them are
+// returns NULL if the file can't be opened or mapped, with errno set
+// returned store must be freed by calling LWHeaderStoreFree()
+LWHeaderStore *LWHeaderStoreNew(const char *path)
+{
+    LWHeaderStore *store = calloc(1, sizeof(*store));
+    uint8_t header[HEADER_STORE_HEADER_SIZE];
+    UInt256 hash = UINT256_ZERO;
+    const uint8_t *r;
+    struct stat st;
+    size_t i, start, count = 0;
+    int err = 0;
+
+    assert(store != NULL);
+    assert(path != NULL);
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+
+    if (store->fd < 0 || fstat(store->fd, &st) < 0) err = errno;
+    else if (st.st_size >= HEADER_STORE_HEADER_SIZE &&
+             pread(store->fd, header, sizeof(header), 0) == sizeof(header) &&
+             UInt32GetLE(&header[0]) == HEADER_STORE_MAGIC && UInt32GetLE(&header[4]) == HEADER_STORE_VERSION &&
+             UInt32GetLE(&header[8]) == HEADER_STORE_RECORD_SIZE) {
+        count = ((size_t)st.st_size - HEADER_STORE_HEADER_SIZE)/HEADER_STORE_RECORD_SIZE;
+    }
+    else if (! _LWHeaderStoreReset(store)) err = errno;
+
+    if (! err && ! _LWHeaderStoreMap(store, _LWHeaderStoreOffset(count))) err = errno;
+
+    if (err) {
+        if (store->fd >= 0) close(store->fd);
+        free(store);
+        errno = err;
+        return NULL;
+    }
+
+    store->count = count;
+    r = _LWHeaderStoreRecord(store, 0);
+
+    // record heights are found from the first record's height, so without it none of the records can be used
+    if (r) store->startHeight = UInt32GetLE(&r[80]);
+    else count = 0;
+
+    // only the tail is verified, the rest of the file was verified when it was written
+    start = (count > HEADER_STORE_VERIFY_COUNT) ? count - HEADER_STORE_VERIFY_COUNT : 0;
+
+    for (i = start; i < count; i++) {
+        r = _LWHeaderStoreRecord(store, i);
+        if (! r || UInt32GetLE(&r[80]) != store->startHeight + i) break;
+        if (i > start && ! UInt256Eq(UInt256Get(&r[4]), hash)) break;
+        LWSHA256_2(&hash, r, 80);
+    }
+
+    // drop invalid records, as well as any partial record left at the end of the file
+    if (i < count || (off_t)_LWHeaderStoreOffset(count) != st.st_size) _LWHeaderStoreTruncate(store, i);
+    pthread_mutex_init(&store->lock, NULL);
+    return store;
+}
+
+// number of blocks in the store
+size_t LWHeaderStoreCount(LWHeaderStore *store)
+{
+    size_t count;
+
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    count = store->count;
+    pthread_mutex_unlock(&store->lock);
+    return count;
+}
+
+// height of the first block in the store
+uint32_t LWHeaderStoreStartHeight(LWHeaderStore *store)
+{
+    uint32_t height;
+
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    height = store->startHeight;
+    pthread_mutex_unlock(&store->lock);
+    return height;
+}
+
+// blockHash of the block at height, or UINT256_ZERO if it isn't in the store
+UInt256 LWHeaderStoreBlockHash(LWHeaderStore *store, uint32_t height)
+{
+    UInt256 hash = UINT256_ZERO;
+    const uint8_t *r;
+
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    r = (height >= store->startHeight) ? _LWHeaderStoreRecord(store, height - store->startHeight) : NULL;
+    if (r) LWSHA256_2(&hash, r, 80);
+    pthread_mutex_unlock(&store->lock);
+    return hash;
+}
+
+// returns the block header at height, or NULL if it isn't in the store, proof-of-work is not calculated
+// result must be freed by calling LWMerkleBlockFree()
+LWMerkleBlock *LWHeaderStoreBlock(LWHeaderStore *store, uint32_t height)
+{
+    LWMerkleBlock *block = NULL;
+    const uint8_t *r;
+
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    r = (height >= store->startHeight) ? _LWHeaderStoreRecord(store, height - store->startHeight) : NULL;
+
+    if (r) {
+        block = LWMerkleBlockNew();
+        block->version = UInt32GetLE(&r[0]);
+        block->prevBlock = UInt256Get(&r[4]);
+        block->merkleRoot = UInt256Get(&r[36]);
+        block->timestamp = UInt32GetLE(&r[68]);
+        block->target = UInt32GetLE(&r[72]);
+        block->nonce = UInt32GetLE(&r[76]);
+        block->height = UInt32GetLE(&r[80]);
+        LWSHA256_2(&block->blockHash, r, 80);
+    }
+
+    pthread_mutex_unlock(&store->lock);
+    return block;
+}
+
+// adds blocks, in ascending height order, each linked to the block before it, replacing any stored blocks at the same
+// or greater heights, the store is cleared first if blocks[0] doesn't link to the stored block before it
+// returns true on success
+int LWHeaderStoreAdd(LWHeaderStore *store, LWMerkleBlock *blocks[], size_t blocksCount)
+{
+    uint32_t height = (blocksCount > 0) ? blocks[0]->height : 0;
+    size_t i, count = 0, len = blocksCount*HEADER_STORE_RECORD_SIZE;
+    UInt256 hash = UINT256_ZERO;
+    const uint8_t *r;
+    uint8_t *buf;
+    int ok = 1;
+
+    assert(store != NULL);
+    assert(blocks != NULL || blocksCount == 0);
+
+    for (i = 1; i < blocksCount; i++) {
+        if (blocks[i]->height != height + i || ! UInt256Eq(blocks[i]->prevBlock, blocks[i - 1]->blockHash)) return 0;
+    }
+
+    if (blocksCount == 0 || height == BLOCK_UNKNOWN_HEIGHT) return (blocksCount == 0);
+    buf = malloc(len);
+    assert(buf != NULL);
+    for (i = 0; i < blocksCount; i++) _LWHeaderStoreSetRecord(&buf[i*HEADER_STORE_RECORD_SIZE], blocks[i]);
+    pthread_mutex_lock(&store->lock);
+    r = (height > store->startHeight) ? _LWHeaderStoreRecord(store, height - 1 - store->startHeight) : NULL;
+    if (r) LWSHA256_2(&hash, r, 80);
+
+    if (r && UInt256Eq(hash, blocks[0]->prevBlock)) count = height - store->startHeight;
+    else store->startHeight = height;
+
+    if (! _LWHeaderStoreTruncate(store, count) ||
+        pwrite(store->fd, buf, len, (off_t)_LWHeaderStoreOffset(count)) != (ssize_t)len ||
+        ! _LWHeaderStoreMap(store, _LWHeaderStoreOffset(count + blocksCount))) {
+        _LWHeaderStoreTruncate(store, count); // leave the file as it was before the write
+        ok = 0;
+    }
+    else store->count = count + blocksCount;
+
+    pthread_mutex_unlock(&store->lock);
+    free(buf);
+    return ok;
+}
+
+// removes all blocks from the store
+void LWHeaderStoreClear(LWHeaderStore *store)
+{
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    _LWHeaderStoreTruncate(store, 0);
+    store->startHeight = 0;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// closes the file and frees memory allocated for store
+void LWHeaderStoreFree(LWHeaderStore *store)
+{
+    assert(store != NULL);
+    pthread_mutex_lock(&store->lock);
+    if (store->map) munmap(store->map, store->mapLen);
+    close(store->fd);
+    pthread_mutex_unlock(&store->lock);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
@@ -0,0 +1,60 @@
+//
+//  LWHeaderStore.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWHeaderStore_h
+#define LWHeaderStore_h
+
+#include "LWMerkleBlock.h"
+#include "LWInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// an append-only, memory mapped file of block headers in chain order, so a block's record is found from its height
+// each record is the 80 byte block header, followed by the block height and a checksum of the record
+
+#define HEADER_STORE_RECORD_SIZE  88   // 80 byte header, 4 byte height, 4 byte checksum
+#define HEADER_STORE_VERIFY_COUNT 2016 // number of records at the end of the file that are verified when it's opened
+
+typedef struct LWHeaderStoreStruct LWHeaderStore;
+
+// opens the header store file at path, creating it if needed, any records after the last valid one among the last
+// HEADER_STORE_VERIFY_COUNT (such as those from an interrupted write) are removed, and if the first record is invalid,
+// all of them are
+// returns NULL if the file can't be opened or mapped, with errno set
+// returned store must be freed by calling LWHeaderStoreFree()
+LWHeaderStore *LWHeaderStoreNew(const char *path);
+
+// number of blocks in the store
+size_t LWHeaderStoreCount(LWHeaderStore *store);
+
+// height of the first block in the store
+uint32_t LWHeaderStoreStartHeight(LWHeaderStore *store);
+
+// blockHash of the block at height, or UINT256_ZERO if it isn't in the store
+UInt256 LWHeaderStoreBlockHash(LWHeaderStore *store, uint32_t height);
+
+// returns the block header at height, or NULL if it isn't in the store, proof-of-work is not calculated
+// result must be freed by calling LWMerkleBlockFree()
+LWMerkleBlock *LWHeaderStoreBlock(LWHeaderStore *store, uint32_t height);
+
+// adds blocks, in ascending height order, each linked to the block before it, replacing any stored blocks at the same
+// or greater heights, the store is cleared first if blocks[0] doesn't link to the stored block before it
+// returns true on success
+int LWHeaderStoreAdd(LWHeaderStore *store, LWMerkleBlock *blocks[], size_t blocksCount);
+
+// removes all blocks from the store
+void LWHeaderStoreClear(LWHeaderStore *store);
+
+// closes the file and frees memory allocated for store
+void LWHeaderStoreFree(LWHeaderStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWHeaderStore_h
@@ -0,0 +1,328 @@
+//
+//  LWLog.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWLog.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <assert.h>
+
+#if defined(TARGET_OS_MAC)
+#include <Foundation/Foundation.h>
+#define _log_write(level, line) NSLog(@"%s", (line))
+#elif defined(__ANDROID__)
+#include <android/log.h>
+#define _log_write(level, line) __android_log_print((level) == LW_LOG_ERROR ? ANDROID_LOG_ERROR :\
+                                                    (level) == LW_LOG_WARN ? ANDROID_LOG_WARN :\
+                                                    (level) == LW_LOG_INFO ? ANDROID_LOG_INFO : ANDROID_LOG_DEBUG,\
+                                                    "bread", "%s", (line))
+#else
+#include <stdio.h>
+#define _log_write(level, line) printf("%s\n", (line))
+#endif
+
+#define LOG_MAX_ARGS   16  // arguments stored per record, the rest of the format string is written as is
+#define LOG_LINE_SIZE  1024 // longest formatted line
+
+typedef union {
+    long long i;
+    double d;
+    const void *p;
+    size_t s; // offset of a copied string in the record's strings
+} LWLogArg;
+
+typedef struct {
+    size_t sequence; // ring position the record is ready to be written at, or read from once it's position + 1
+    int level, argCount, port; // port is -1 if the line has no "host:port " prefix, the host is then strings[0]
+    double timestamp;
+    const char *fmt;
+    LWLogArg args[LOG_MAX_ARGS];
+    char strings[LOG_RECORD_SIZE - sizeof(size_t) - 3*sizeof(int) - sizeof(double) - sizeof(const char *) -
+                 LOG_MAX_ARGS*sizeof(LWLogArg)]; // copies of the string arguments
+} LWLogRecord;
+
+int _LWLogLevel = LW_LOG_INFO;
+
+static pthread_once_t _logOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _logLock = PTHREAD_MUTEX_INITIALIZER; // held while reading records, and guards the handler
+static LWLogRecord *_logRing = NULL;
+static size_t _logHead = 0, _logTail = 0, _logDropped = 0; // head is claimed by writers, tail is only read under lock
+static void *_logHandlerInfo = NULL;
+static pthread_mutex_t _logWaitLock = PTHREAD_MUTEX_INITIALIZER; // held by the background thread while it waits
+static pthread_cond_t _logCond = PTHREAD_COND_INITIALIZER; // signalled when a record is added while the thread waits
+static int _logWaiting = 0; // set while the background thread is waiting for the ring buffer to be non-empty
+static void (*_logHandler)(void *info, int level, double timestamp, const char *line) = NULL;
+
+// parses the conversion specification starting at fmt, writing its length modifier to len and its conversion
+// character to conv, returns the length of the specification, or 0 if it isn't supported
+static size_t _LWLogSpec(const char *fmt, char len[3], char *conv)
+{
+    size_t i = 1, l = 0;
+
+    while (fmt[i] && strchr("-+ #0", fmt[i])) i++; // flags
+    while (fmt[i] >= '0' && fmt[i] <= '9') i++; // field width
+    if (fmt[i] == '.') i++;
+    while (fmt[i] >= '0' && fmt[i] <= '9') i++; // precision
+    while (fmt[i] && l < 2 && strchr("hljztL", fmt[i])) len[l++] = fmt[i++]; // length modifier
+    len[l] = '\0';
+    *conv = fmt[i];
+    return (*conv && strchr("diouxXcfFeEgGaAspn%", *conv)) ? i + 1 : 0;
+}
+
+// copies the arguments of fmt from ap to record r, with string arguments copied to r->strings from off on
+static void _LWLogCapture(LWLogRecord *r, size_t off, va_list ap)
+{
+    char len[3], conv;
+    size_t n;
+    const char *s;
+
+    r->argCount = 0;
+
+    for (const char *p = r->fmt; *p && r->argCount < LOG_MAX_ARGS; p++) {
+        if (*p != '%') continue;
+        n = _LWLogSpec(p, len, &conv);
+        if (n == 0) break;
+        p += n - 1;
+        if (conv == '%') continue;
+
+        LWLogArg *a = &r->args[r->argCount++];
+
+        if (strchr("diouxXc", conv)) {
+            if (strcmp(len, "l") == 0) a->i = va_arg(ap, long);
+            else if (strcmp(len, "ll") == 0) a->i = va_arg(ap, long long);
+            else if (strcmp(len, "j") == 0) a->i = (long long)va_arg(ap, intmax_t);
+            else if (strcmp(len, "z") == 0) a->i = (long long)va_arg(ap, size_t);
+            else if (strcmp(len, "t") == 0) a->i = (long long)va_arg(ap, ptrdiff_t);
+            else a->i = va_arg(ap, int);
+        }
+        else if (strchr("fFeEgGaA", conv)) {
+            a->d = (strcmp(len, "L") == 0) ? (double)va_arg(ap, long double) : va_arg(ap, double);
+        }
+        else if (conv == 's') {
+            s = va_arg(ap, const char *);
+            if (! s) s = "(null)";
+            if (off >= sizeof(r->strings)) off = sizeof(r->strings) - 1; // out of room, the rest are empty strings
+            for (n = 0; s[n] && off + n + 1 < sizeof(r->strings); n++) r->strings[off + n] = s[n];
+            r->strings[off + n] = '\0';
+            a->s = off;
+            off += n + 1;
+        }
+        else a->p = va_arg(ap, const void *); // %p, and %n is stored but not written to
+    }
+}
+
+// formats record r into line
+static void _LWLogFormat(char *line, size_t lineLen, const LWLogRecord *r)
+{
+    char spec[32], len[3], conv;
+    const char *p = r->fmt;
+    size_t n, off = 0;
+    int i = 0, w;
+
+    if (r->port >= 0) { // "host:port " prefix
+        w = snprintf(line, lineLen, "%s:%d ", r->strings, r->port);
+        if (w > 0) off = ((size_t)w < lineLen) ? (size_t)w : lineLen - 1;
+    }
+
+    while (*p && off + 1 < lineLen) {
+        if (*p != '%') {
+            line[off++] = *p++;
+            continue;
+        }
+
+        n = _LWLogSpec(p, len, &conv);
+
+        if (n == 0 || n >= sizeof(spec) || (conv != '%' && i >= r->argCount)) { // no stored argument, write the rest
+            n = strlen(p);
+            if (n > lineLen - off - 1) n = lineLen - off - 1;
+            memcpy(&line[off], p, n);
+            off += n;
+            break;
+        }
+
+        memcpy(spec, p, n);
+        spec[n] = '\0';
+        p += n;
+        if (strcmp(len, "L") == 0) spec[n - 2] = conv, spec[n - 1] = '\0'; // long doubles were stored as double
+        const LWLogArg *a = (conv == '%') ? NULL : &r->args[i++];
+
+        if (conv == '%') w = snprintf(&line[off], lineLen - off, "%%");
+        else if (strchr("diouxXc", conv)) {
+            if (strcmp(len, "l") == 0) w = snprintf(&line[off], lineLen - off, spec, (long)a->i);
+            else if (strcmp(len, "ll") == 0) w = snprintf(&line[off], lineLen - off, spec, a->i);
+            else if (strcmp(len, "j") == 0) w = snprintf(&line[off], lineLen - off, spec, (intmax_t)a->i);
+            else if (strcmp(len, "z") == 0) w = snprintf(&line[off], lineLen - off, spec, (size_t)a->i);
+            else if (strcmp(len, "t") == 0) w = snprintf(&line[off], lineLen - off, spec, (ptrdiff_t)a->i);
+            else w = snprintf(&line[off], lineLen - off, spec, (int)a->i);
+        }
+        else if (strchr("fFeEgGaA", conv)) w = snprintf(&line[off], lineLen - off, spec, a->d);
+        else if (conv == 's') w = snprintf(&line[off], lineLen - off, spec, &r->strings[a->s]);
+        else if (conv == 'p') w = snprintf(&line[off], lineLen - off, spec, a->p);
+        else w = 0; // %n
+
+        if (w > 0) off += ((size_t)w < lineLen - off) ? (size_t)w : lineLen - off - 1;
+    }
+
+    line[off] = '\0';
+}
+
+// formats and writes out the records that are ready, returns the number written
+static size_t _LWLogDrain(void)
+{
+    char line[LOG_LINE_SIZE];
+    LWLogRecord *r;
+    size_t count = 0;
+
+    pthread_mutex_lock(&_logLock);
+
+    for (;;) {
+        r = &_logRing[_logTail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE) != _logTail + 1) break; // not written yet
+        _LWLogFormat(line, sizeof(line), r);
+        if (_logHandler) _logHandler(_logHandlerInfo, r->level, r->timestamp, line);
+        else _log_write(r->level, line);
+        __atomic_store_n(&r->sequence, _logTail + LOG_RING_SIZE, __ATOMIC_RELEASE); // free for the next lap
+        _logTail++;
+        count++;
+    }
+
+    pthread_mutex_unlock(&_logLock);
+    return count;
+}
+
+// returns true if the record at the tail of the ring buffer is ready to be written
+static int _LWLogReady(void)
+{
+    int ready;
+
+    pthread_mutex_lock(&_logLock);
+    ready = (__atomic_load_n(&_logRing[_logTail & (LOG_RING_SIZE - 1)].sequence, __ATOMIC_SEQ_CST) == _logTail + 1);
+    pthread_mutex_unlock(&_logLock);
+    return ready;
+}
+
+static void *_logThreadRoutine(void *arg)
+{
+    for (;;) {
+        if (_LWLogDrain() > 0) continue;
+        pthread_mutex_lock(&_logWaitLock);
+        __atomic_store_n(&_logWaiting, 1, __ATOMIC_SEQ_CST); // set before checking, so a new record can't be missed
+        if (! _LWLogReady()) pthread_cond_wait(&_logCond, &_logWaitLock);
+        __atomic_store_n(&_logWaiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&_logWaitLock);
+    }
+
+    return NULL;
+}
+
+static void _LWLogInit(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    _logRing = calloc(LOG_RING_SIZE, sizeof(*_logRing));
+    assert(_logRing != NULL);
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) _logRing[i].sequence = i;
+
+    if (pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_create(&thread, &attr, _logThreadRoutine, NULL);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// claims a record, captures fmt and its arguments from ap, and hands the record to the background thread, host is
+// copied to the record as the line's prefix unless it's NULL
+static void _LWLogRecord(int level, const char *host, uint16_t port, const char *fmt, va_list ap)
+{
+    struct timeval tv;
+    LWLogRecord *r;
+    size_t pos, seq, off = 0;
+
+    pthread_once(&_logOnce, _LWLogInit);
+    pos = __atomic_load_n(&_logHead, __ATOMIC_RELAXED);
+
+    for (;;) { // claim the record at the head of the ring
+        r = &_logRing[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&_logHead, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0) { // ring is full
+            __atomic_fetch_add(&_logDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else pos = __atomic_load_n(&_logHead, __ATOMIC_RELAXED);
+    }
+
+    gettimeofday(&tv, NULL);
+    r->level = level;
+    r->timestamp = tv.tv_sec + (double)tv.tv_usec/1000000;
+    r->fmt = fmt;
+    r->port = (host) ? port : -1;
+
+    if (host) {
+        while (host[off] && off + 1 < sizeof(r->strings)/2) r->strings[off] = host[off], off++;
+        r->strings[off++] = '\0';
+    }
+
+    _LWLogCapture(r, off, ap);
+    __atomic_store_n(&r->sequence, pos + 1, __ATOMIC_SEQ_CST); // hand the record to the background thread
+
+    if (__atomic_load_n(&_logWaiting, __ATOMIC_SEQ_CST)) { // the ring buffer was empty, wake the background thread
+        pthread_mutex_lock(&_logWaitLock);
+        pthread_cond_signal(&_logCond);
+        pthread_mutex_unlock(&_logWaitLock);
+    }
+}
+
+void _LWLog(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    assert(fmt != NULL);
+    va_start(ap, fmt);
+    _LWLogRecord(level, NULL, 0, fmt, ap);
+    va_end(ap);
+}
+
+void _LWLogHost(int level, const char *host, uint16_t port, const char *fmt, ...)
+{
+    va_list ap;
+
+    assert(host != NULL);
+    assert(fmt != NULL);
+    va_start(ap, fmt);
+    _LWLogRecord(level, host, port, fmt, ap);
+    va_end(ap);
+}
+
+// sets the most verbose level that's logged, LW_LOG_INFO by default
+void LWLogSetLevel(int level)
+{
+    _LWLogLevel = level;
+}
+
+// handler is called from the background thread with each formatted line, without a trailing newline, in place of
+// writing to the system log, pass a NULL handler to write to the system log again
+void LWLogSetHandler(void *info, void (*handler)(void *info, int level, double timestamp, const char *line))
+{
+    pthread_mutex_lock(&_logLock);
+    _logHandlerInfo = info;
+    _logHandler = handler;
+    pthread_mutex_unlock(&_logLock);
+}
+
+// formats and writes out all records logged before the call, returns number of records dropped because the ring
+// buffer was full since the last call
+size_t LWLogFlush(void)
+{
+    pthread_once(&_logOnce, _LWLogInit);
+    _LWLogDrain();
+    return __atomic_exchange_n(&_logDropped, 0, __ATOMIC_RELAXED);
+}
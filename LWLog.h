@@ -0,0 +1,68 @@
+//
+//  LWLog.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWLog_h
+#define LWLog_h
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// leveled logging that doesn't format or write anything on the calling thread
+// a log call copies its format string pointer and arguments into a fixed size record in a lock-free ring buffer, and a
+// background thread formats the records and writes them out
+// a log site above the compile time or runtime level is skipped before its arguments are evaluated
+
+#define LW_LOG_ERROR 0
+#define LW_LOG_WARN  1
+#define LW_LOG_INFO  2
+#define LW_LOG_DEBUG 3
+
+#ifndef LW_LOG_LEVEL
+#define LW_LOG_LEVEL LW_LOG_DEBUG // most verbose level compiled in, log sites above it are removed by the compiler
+#endif
+
+#define LOG_RING_SIZE   256 // records in the ring buffer, must be a power of 2, records are dropped when it's full
+#define LOG_RECORD_SIZE 512 // bytes per record, string arguments are truncated to fit
+
+// fmt must be a string literal, since it's formatted after the call returns, and * field widths aren't supported
+// string arguments are copied, other arguments are stored in binary and formatted by the background thread
+#define lw_log(level, ...) ((void)((level) <= LW_LOG_LEVEL && (level) <= _LWLogLevel &&\
+                                   (_LWLog((level), __VA_ARGS__), 1)))
+
+// same as lw_log, with the line prefixed by "host:port ", the host string is copied like a string argument
+#define lw_log_host(level, host, port, ...) ((void)((level) <= LW_LOG_LEVEL && (level) <= _LWLogLevel &&\
+                                                    (_LWLogHost((level), (host), (port), __VA_ARGS__), 1)))
+
+extern int _LWLogLevel;
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 2, 3)))
+#endif
+void _LWLog(int level, const char *fmt, ...);
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((format(printf, 4, 5)))
+#endif
+void _LWLogHost(int level, const char *host, uint16_t port, const char *fmt, ...);
+
+// sets the most verbose level that's logged, LW_LOG_INFO by default
+void LWLogSetLevel(int level);
+
+// handler is called from the background thread with each formatted line, without a trailing newline, in place of
+// writing to the system log, pass a NULL handler to write to the system log again
+void LWLogSetHandler(void *info, void (*handler)(void *info, int level, double timestamp, const char *line));
+
+// formats and writes out all records logged before the call, returns number of records dropped because the ring
+// buffer was full since the last call
+size_t LWLogFlush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWLog_h
@@ -4,6 +4,7 @@
 
 #include "LWMerkleBlock.h"
 #include "LWCrypto.h"
+#include "LWMetrics.h"
 #include "LWAddress.h"
 #include <stdlib.h>
 #include <inttypes.h>
@@ -11,7 +12,12 @@
 #include <string.h>
 #include <assert.h>
 
+#if LITECOIN_REGTEST // test and benchmark builds only, regtest's limit lets them mine a chain locally
+#define MAX_PROOF_OF_WORK 0x207fffff
+#else
 #define MAX_PROOF_OF_WORK 0x1e0fffff    // highest value for difficulty target (higher values are less difficult)
+#endif
+
 #define TARGET_TIMESPAN   302400        // = 3.5*24*60*60; the targeted timespan between difficulty target adjustments
 
 inline static int _ceil_log2(int x)
@@ -82,6 +88,7 @@ LWMerkleBlock *LWMerkleBlockParse(const uint8_t *buf, size_t bufLen)
 {
     LWMerkleBlock *block = (buf && 80 <= bufLen) ? LWMerkleBlockNew() : NULL;
     size_t off = 0, len = 0;
+    uint64_t start;
     
     assert(buf != NULL || bufLen == 0);
     
@@ -116,12 +123,59 @@ LWMerkleBlock *LWMerkleBlockParse(const uint8_t *buf, size_t bufLen)
         }
         
         LWSHA256_2(&block->blockHash, buf, 80);
+        start = LWMetricsTime();
         LWScrypt(&block->powHash, sizeof(block->powHash), buf, 80, buf, 80, 1024, 1, 1);
+        LWMetricsRecordSince(LWMetricTimerScrypt, start);
     }
     
     return block;
 }
 
+// parses count headers from buf, each 80 bytes followed by a tx count of 0, as in a "headers" message
+// each header's prevBlock must match the blockHash of the header before it, this is checked for the whole batch before
+// any proof-of-work is calculated, and a single scrypt scratch buffer is shared by all the proof-of-work hashes
+// returns the number of blocks parsed, or 0 if buf is malformed or the headers aren't linked
+// each parsed block must be freed by calling LWMerkleBlockFree()
+size_t LWMerkleBlockParseHeaders(LWMerkleBlock *blocks[], size_t count, const uint8_t *buf, size_t bufLen)
+{
+    UInt256 blockHash = UINT256_ZERO;
+    uint64_t start;
+    void *v;
+    size_t i;
+    
+    assert(blocks != NULL || count == 0);
+    assert(buf != NULL || bufLen == 0);
+    if (! buf || count == 0 || 81*count > bufLen) return 0;
+    
+    for (i = 0; i < count; i++) { // check that the headers form a chain before doing any expensive work
+        if (i > 0 && ! UInt256Eq(UInt256Get(&buf[81*i + 4]), blockHash)) return 0;
+        LWSHA256_2(&blockHash, &buf[81*i], 80);
+    }
+    
+    v = malloc(128*1024);
+    assert(v != NULL);
+    
+    for (i = 0; i < count; i++) {
+        LWMerkleBlock *block = LWMerkleBlockNew();
+        const uint8_t *b = &buf[81*i];
+        
+        block->version = UInt32GetLE(&b[0]);
+        block->prevBlock = UInt256Get(&b[4]);
+        block->merkleRoot = UInt256Get(&b[36]);
+        block->timestamp = UInt32GetLE(&b[68]);
+        block->target = UInt32GetLE(&b[72]);
+        block->nonce = UInt32GetLE(&b[76]);
+        LWSHA256_2(&block->blockHash, b, 80);
+        start = LWMetricsTime();
+        LWScryptBuf(&block->powHash, sizeof(block->powHash), b, 80, b, 80, 1024, 1, 1, v);
+        LWMetricsRecordSince(LWMetricTimerScrypt, start);
+        blocks[i] = block;
+    }
+    
+    free(v);
+    return count;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t LWMerkleBlockSerialize(const LWMerkleBlock *block, uint8_t *buf, size_t bufLen)
 {
@@ -216,6 +270,70 @@ void LWMerkleBlockSetTxHashes(LWMerkleBlock *block, const UInt256 hashes[], size
     if (block->flags) memcpy(block->flags, flags, flagsLen);
 }
 
+// number of nodes at the given height of a merkle tree with totalTx leaves
+inline static size_t _LWMerkleTreeWidth(size_t totalTx, int height)
+{
+    return (totalTx + ((size_t)1 << height) - 1) >> height;
+}
+
+// recursively calculates the hash of the merkle tree node at the given height and position
+static UInt256 _LWMerkleTreeHashR(const UInt256 txHashes[], size_t txCount, int height, size_t pos)
+{
+    UInt256 hashes[2], md;
+
+    if (height == 0) return txHashes[pos];
+    hashes[0] = _LWMerkleTreeHashR(txHashes, txCount, height - 1, pos*2);
+    hashes[1] = (pos*2 + 1 < _LWMerkleTreeWidth(txCount, height - 1)) ?
+                _LWMerkleTreeHashR(txHashes, txCount, height - 1, pos*2 + 1) : hashes[0];
+    LWSHA256_2(&md, hashes, sizeof(hashes));
+    return md;
+}
+
+// recursively walks the full merkle tree, adding the flags and hashes of the partial merkle tree to block
+static void _LWMerkleBlockSetPartialTreeR(LWMerkleBlock *block, const UInt256 txHashes[], const uint8_t matches[],
+                                          size_t txCount, int height, size_t pos, size_t *flagIdx)
+{
+    size_t i, end = (pos + 1) << height;
+    int match = 0;
+
+    for (i = pos << height; ! match && i < end && i < txCount; i++) match = matches[i];
+    if (match) block->flags[*flagIdx/8] |= (1 << (*flagIdx % 8));
+    (*flagIdx)++;
+
+    if (height == 0 || ! match) {
+        block->hashes[block->hashesCount++] = _LWMerkleTreeHashR(txHashes, txCount, height, pos);
+    }
+    else {
+        _LWMerkleBlockSetPartialTreeR(block, txHashes, matches, txCount, height - 1, pos*2, flagIdx); // left branch
+
+        if (pos*2 + 1 < _LWMerkleTreeWidth(txCount, height - 1)) { // right branch
+            _LWMerkleBlockSetPartialTreeR(block, txHashes, matches, txCount, height - 1, pos*2 + 1, flagIdx);
+        }
+    }
+}
+
+// sets the totalTx, hashes and flags fields to the partial merkle tree for a block with the given tx hashes, in block
+// order, that includes the tx hashes where matches[i] is true
+void LWMerkleBlockSetPartialTree(LWMerkleBlock *block, const UInt256 txHashes[], const uint8_t matches[],
+                                 size_t txCount)
+{
+    size_t flagIdx = 0;
+    int height = _ceil_log2((int)txCount);
+
+    assert(block != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    assert(matches != NULL || txCount == 0);
+
+    if (block->hashes) free(block->hashes);
+    if (block->flags) free(block->flags);
+    block->totalTx = (uint32_t)txCount;
+    block->hashesCount = 0;
+    block->hashes = (txCount > 0) ? malloc(txCount*sizeof(UInt256)) : NULL; // each hash covers a separate subtree
+    block->flags = (txCount > 0) ? calloc((txCount*2 + height)/8 + 1, sizeof(uint8_t)) : NULL; // one flag per node
+    if (txCount > 0) _LWMerkleBlockSetPartialTreeR(block, txHashes, matches, txCount, height, 0, &flagIdx);
+    block->flagsLen = (flagIdx + 7)/8;
+}
+
 // recursively walks the merkle tree to calculate the merkle root
 // NOTE: this merkle tree design has a security vulnerability (CVE-2012-2459), which can be defended against by
 // considering the merkle root invalid if there are duplicate hashes in any rows with an even number of elements
@@ -268,8 +386,11 @@ int LWMerkleBlockIsValid(const LWMerkleBlock *block, uint32_t currentTime)
     // check if proof-of-work target is out of range
     if (target == 0 || target & 0x00800000 || size > maxsize || (size == maxsize && target > maxtarget)) r = 0;
     
-    if (size > 3) UInt32SetLE(&t.u8[size - 3], target);
-    else UInt32SetLE(t.u8, target >> (3 - size)*8);
+    // target bytes in little-endian order from t.u8[size - 3], any below t.u8[0] are shifted out, written a byte at a
+    // time so they stay within t for size 32, and aren't stored through a type that gcc may assume doesn't alias t
+    for (uint32_t i = 0; r && i < 3; i++) {
+        if (size + i >= 3) t.u8[size + i - 3] = (uint8_t)(target >> 8*i);
+    }
     
     for (int i = sizeof(t) - 1; r && i >= 0; i--) { // check proof-of-work
         if (block->powHash.u8[i] < t.u8[i]) break;
@@ -294,53 +415,151 @@ int LWMerkleBlockContainsTxHash(const LWMerkleBlock *block, UInt256 txHash)
     return r;
 }
 
+// sets the 256bit value v, as 32bit words in little-endian order, to the given "compact" format target
+static void _LWTargetSetCompact(uint32_t v[8], uint32_t compact)
+{
+    uint32_t size = compact >> 24, word = compact & 0x007fffff, shift;
+
+    memset(v, 0, 8*sizeof(*v));
+
+    if (size <= 3) v[0] = word >> 8*(3 - size);
+    else if (size <= 32) {
+        shift = 8*(size - 3);
+        v[shift/32] = word << (shift % 32);
+        if (shift % 32 && shift/32 < 7) v[shift/32 + 1] = word >> (32 - shift % 32);
+    }
+}
+
+// returns the "compact" format of the 256bit value v, rounded down to a 23bit mantissa
+static uint32_t _LWTargetGetCompact(const uint32_t v[8])
+{
+    uint32_t size = 32, compact, shift;
+
+    while (size > 0 && ((v[(size - 1)/4] >> 8*((size - 1) % 4)) & 0xff) == 0) size--; // size of v in bytes
+
+    if (size <= 3) compact = v[0] << 8*(3 - size);
+    else {
+        shift = 8*(size - 3);
+        compact = v[shift/32] >> (shift % 32);
+        if (shift % 32 && shift/32 < 7) compact |= v[shift/32 + 1] << (32 - shift % 32);
+        compact &= 0x00ffffff;
+    }
+
+    if (compact & 0x00800000) compact >>= 8, size++; // the mantissa is signed, so it can't use the high bit
+    return compact | size << 24;
+}
+
+// number of significant bits in the 256bit value v
+static int _LWTargetBits(const uint32_t v[8])
+{
+    for (int i = 7; i >= 0; i--) {
+        for (int j = 31; v[i] && j >= 0; j--) {
+            if (v[i] >> j) return 32*i + j + 1;
+        }
+    }
+
+    return 0;
+}
+
+// compares the 256bit values a and b, returns a negative, zero or positive value like memcmp()
+static int _LWTargetCompare(const uint32_t a[8], const uint32_t b[8])
+{
+    for (int i = 7; i >= 0; i--) {
+        if (a[i] != b[i]) return (a[i] < b[i]) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// returns the target for the block after a retarget window that ended with target, and took timespan seconds
+static uint32_t _LWMerkleBlockRetarget(uint32_t target, int64_t timespan)
+{
+    uint32_t v[8], limit[8];
+    uint64_t n = 0;
+    int i, shift;
+
+    // limit difficulty transition to -75% or +400%
+    if (timespan < TARGET_TIMESPAN/4) timespan = TARGET_TIMESPAN/4;
+    if (timespan > TARGET_TIMESPAN*4) timespan = TARGET_TIMESPAN*4;
+
+    _LWTargetSetCompact(v, target);
+    _LWTargetSetCompact(limit, MAX_PROOF_OF_WORK);
+
+    // litecoin shifts targets close to the limit right by one bit first, so multiplying them by timespan can't
+    // overflow, this loses the lowest bit, which has to be matched exactly
+    shift = (_LWTargetBits(v) > _LWTargetBits(limit) - 1);
+    for (i = 0; shift && i < 8; i++) v[i] = (v[i] >> 1) | ((i < 7) ? v[i + 1] << 31 : 0);
+
+    for (i = 0; i < 8; i++) { // v *= timespan
+        n += (uint64_t)v[i]*(uint64_t)timespan;
+        v[i] = (uint32_t)n;
+        n >>= 32;
+    }
+
+    for (i = 7, n = 0; i >= 0; i--) { // v /= TARGET_TIMESPAN
+        n = (n << 32) | v[i];
+        v[i] = (uint32_t)(n/TARGET_TIMESPAN);
+        n %= TARGET_TIMESPAN;
+    }
+
+    for (i = 7; shift && i >= 0; i--) v[i] = (v[i] << 1) | ((i > 0) ? v[i - 1] >> 31 : 0);
+    if (_LWTargetCompare(v, limit) > 0) memcpy(v, limit, sizeof(v)); // limit to MAX_PROOF_OF_WORK
+    return _LWTargetGetCompact(v);
+}
+
 // verifies the block difficulty target is correct for the block's position in the chain
-// transitionTime is the timestamp of the block at the previous difficulty transition
-// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL
+// transitionTime is the timestamp of the first block in the retarget window, which for litecoin is the block before the
+// previous difficulty transition (the genesis block for the first transition)
+// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL, a transition block with a
+// transitionTime of 0 fails, use LWMerkleBlockVerifyDifficultyLimits() when the start of the window isn't known
 //
 // The difficulty target algorithm works as follows:
 // The target must be the same as in the previous block unless the block's height is a multiple of 2016. Every 2016
 // blocks there is a difficulty transition where a new difficulty is calculated. The new target is the previous target
-// multiplied by the time between the last transition block's timestamp and this one (in seconds), divided by the
-// targeted time between transitions (14*24*60*60 seconds). If the new difficulty is more than 4x or less than 1/4 of
-// the previous difficulty, the change is limited to either 4x or 1/4. There is also a minimum difficulty value
+// multiplied by the time between the first block of the retarget window and the previous block (in seconds), divided
+// by the targeted time between transitions (3.5*24*60*60 seconds). If the new difficulty is more than 4x or less than
+// 1/4 of the previous difficulty, the change is limited to either 4x or 1/4. There is also a minimum difficulty value
 // intuitively named MAX_PROOF_OF_WORK... since larger values are less difficult.
 int LWMerkleBlockVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous, uint32_t transitionTime)
 {
     int r = 1;
-    
+
     assert(block != NULL);
     assert(previous != NULL);
-    
+
     if (! previous || !UInt256Eq(block->prevBlock, previous->blockHash) || block->height != previous->height + 1) r = 0;
-    if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0 && transitionTime == 0) r = 0;
-        
-    // if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-    //     // target is in "compact" format, where the most significant byte is the size of resulting value in bytes, next
-    //     // bit is the sign, and the remaining 23bits is the value after having been right shifted by (size - 3)*8 bits
-    //     static const uint32_t maxsize = MAX_PROOF_OF_WORK >> 24, maxtarget = MAX_PROOF_OF_WORK & 0x00ffffff;
-    //     int timespan = (int)((int64_t)previous->timestamp - (int64_t)transitionTime), size = previous->target >> 24;
-    //     uint64_t target = previous->target & 0x00ffffff;
-    
-    //     // limit difficulty transition to -75% or +400%
-    //     if (timespan < TARGET_TIMESPAN/4) timespan = TARGET_TIMESPAN/4;
-    //     if (timespan > TARGET_TIMESPAN*4) timespan = TARGET_TIMESPAN*4;
-    
-    //     // TARGET_TIMESPAN happens to be a multiple of 256, and since timespan is at least TARGET_TIMESPAN/4, we don't
-    //     // lose precision when target is multiplied by timespan and then divided by TARGET_TIMESPAN/256
-    //     target *= timespan;
-    //     target /= TARGET_TIMESPAN >> 8;
-    //     size--; // decrement size since we only divided by TARGET_TIMESPAN/256
-    
-    //     while (size < 1 || target > 0x007fffff) target >>= 8, size++; // normalize target for "compact" format
-    
-    //     // limit to MAX_PROOF_OF_WORK
-    //     if (size > maxsize || (size == maxsize && target > maxtarget)) target = maxtarget, size = maxsize;
-    
-    //     if (block->target != ((uint32_t)target | size << 24)) r = 0;
-    // }
-    // else if (r && block->target != previous->target) r = 0;
-    
+
+    if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
+        if (transitionTime == 0 ||
+            block->target != _LWMerkleBlockRetarget(previous->target, (int64_t)previous->timestamp - transitionTime)) {
+            r = 0;
+        }
+    }
+    else if (r && block->target != previous->target) r = 0;
+
+    return r;
+}
+
+// like LWMerkleBlockVerifyDifficulty(), but at a difficulty transition only checks that the target is within the limits
+// of the difficulty adjustment, since the start of the retarget window isn't known
+int LWMerkleBlockVerifyDifficultyLimits(const LWMerkleBlock *block, const LWMerkleBlock *previous)
+{
+    uint32_t v[8], min[8], max[8];
+    int r = 1;
+
+    assert(block != NULL);
+    assert(previous != NULL);
+
+    if (! previous || !UInt256Eq(block->prevBlock, previous->blockHash) || block->height != previous->height + 1) r = 0;
+
+    if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
+        _LWTargetSetCompact(v, block->target);
+        _LWTargetSetCompact(min, _LWMerkleBlockRetarget(previous->target, 0));
+        _LWTargetSetCompact(max, _LWMerkleBlockRetarget(previous->target, INT32_MAX));
+        if (_LWTargetCompare(v, min) < 0 || _LWTargetCompare(v, max) > 0) r = 0;
+    }
+    else if (r && block->target != previous->target) r = 0;
+
     return r;
 }
 
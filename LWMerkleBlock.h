@@ -48,6 +48,13 @@ LWMerkleBlock *LWMerkleBlockCopy(const LWMerkleBlock *block);
 // returns a merkle block struct that must be freed by calling LWMerkleBlockFree()
 LWMerkleBlock *LWMerkleBlockParse(const uint8_t *buf, size_t bufLen);
 
+// parses count headers from buf, each 80 bytes followed by a tx count of 0, as in a "headers" message
+// each header's prevBlock must match the blockHash of the header before it, this is checked for the whole batch before
+// any proof-of-work is calculated, and a single scrypt scratch buffer is shared by all the proof-of-work hashes
+// returns the number of blocks parsed, or 0 if buf is malformed or the headers aren't linked
+// each parsed block must be freed by calling LWMerkleBlockFree()
+size_t LWMerkleBlockParseHeaders(LWMerkleBlock *blocks[], size_t count, const uint8_t *buf, size_t bufLen);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t LWMerkleBlockSerialize(const LWMerkleBlock *block, uint8_t *buf, size_t bufLen);
 
@@ -59,6 +66,11 @@ size_t LWMerkleBlockTxHashes(const LWMerkleBlock *block, UInt256 *txHashes, size
 void LWMerkleBlockSetTxHashes(LWMerkleBlock *block, const UInt256 hashes[], size_t hashesCount,
                               const uint8_t *flags, size_t flagsLen);
 
+// sets the totalTx, hashes and flags fields to the partial merkle tree for a block with the given tx hashes, in block
+// order, that includes the tx hashes where matches[i] is true
+void LWMerkleBlockSetPartialTree(LWMerkleBlock *block, const UInt256 txHashes[], const uint8_t matches[],
+                                 size_t txCount);
+
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
 // NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
 // target is correct for the block's height in the chain - use LWMerkleBlockVerifyDifficulty() for that
@@ -68,10 +80,16 @@ int LWMerkleBlockIsValid(const LWMerkleBlock *block, uint32_t currentTime);
 int LWMerkleBlockContainsTxHash(const LWMerkleBlock *block, UInt256 txHash);
 
 // verifies the block difficulty target is correct for the block's position in the chain
-// transitionTime is the timestamp of the block at the previous difficulty transition
-// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL
+// transitionTime is the timestamp of the first block in the retarget window, which for litecoin is the block before the
+// previous difficulty transition (the genesis block for the first transition)
+// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL, a transition block with a
+// transitionTime of 0 fails, use LWMerkleBlockVerifyDifficultyLimits() when the start of the window isn't known
 int LWMerkleBlockVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous, uint32_t transitionTime);
 
+// like LWMerkleBlockVerifyDifficulty(), but at a difficulty transition only checks that the target is within the limits
+// of the difficulty adjustment, since the start of the retarget window isn't known
+int LWMerkleBlockVerifyDifficultyLimits(const LWMerkleBlock *block, const LWMerkleBlock *previous);
+
 // returns a hash value for block suitable for use in a hashtable
 inline static size_t LWMerkleBlockHash(const void *block)
 {
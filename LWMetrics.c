@@ -0,0 +1,281 @@
+//
+//  LWMetrics.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWMetrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <assert.h>
+
+// a shard is only written by its own thread, so a relaxed load and store is enough to update it without tearing,
+// while other threads read it for snapshots
+#define metrics_load(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define metrics_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+typedef struct _LWMetricsShard {
+    uint64_t counters[LWMetricCounterCount];
+    LWMetricsHistogram timers[LWMetricTimerCount];
+    struct _LWMetricsShard *next;
+} LWMetricsShard;
+
+static pthread_once_t _metricsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t _metricsKey;
+static pthread_mutex_t _metricsLock = PTHREAD_MUTEX_INITIALIZER; // guards the shard list and callback
+static LWMetricsShard *_metricsShards = NULL; // shards of running threads
+static LWMetricsShard _metricsRetired; // totals of shards from threads that have exited
+static uint64_t _metricsGauges[LWMetricGaugeCount]; // bit patterns of the gauge values
+static int _metricsEnabled = 1;
+static uint64_t _metricsReportTime = UINT64_MAX, _metricsReportInterval = 0;
+static void *_metricsCallbackInfo = NULL;
+static void (*_metricsCallback)(void *info, const LWMetricsSnapshot *snapshot) = NULL;
+
+// adds the counters and timers of shard to counters and timers
+static void _LWMetricsMerge(uint64_t counters[], LWMetricsHistogram timers[], LWMetricsShard *shard)
+{
+    uint64_t min, max;
+    size_t i, j;
+
+    for (i = 0; i < LWMetricCounterCount; i++) counters[i] += metrics_load(&shard->counters[i]);
+
+    for (i = 0; i < LWMetricTimerCount; i++) {
+        timers[i].count += metrics_load(&shard->timers[i].count);
+        timers[i].sum += metrics_load(&shard->timers[i].sum);
+        min = metrics_load(&shard->timers[i].min);
+        max = metrics_load(&shard->timers[i].max);
+        if (min < timers[i].min) timers[i].min = min;
+        if (max > timers[i].max) timers[i].max = max;
+
+        for (j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++) {
+            timers[i].buckets[j] += metrics_load(&shard->timers[i].buckets[j]);
+        }
+    }
+}
+
+static void _LWMetricsShardInit(LWMetricsShard *shard)
+{
+    memset(shard, 0, sizeof(*shard));
+    for (size_t i = 0; i < LWMetricTimerCount; i++) shard->timers[i].min = UINT64_MAX;
+}
+
+// called when a thread exits, moves the totals of its shard to _metricsRetired
+static void _LWMetricsShardFree(void *arg)
+{
+    LWMetricsShard *shard = arg, **s;
+
+    pthread_mutex_lock(&_metricsLock);
+    for (s = &_metricsShards; *s && *s != shard; s = &(*s)->next);
+    if (*s) *s = shard->next;
+    _LWMetricsMerge(_metricsRetired.counters, _metricsRetired.timers, shard);
+    pthread_mutex_unlock(&_metricsLock);
+    free(shard);
+}
+
+static void _LWMetricsInit(void)
+{
+    pthread_key_create(&_metricsKey, _LWMetricsShardFree);
+    _LWMetricsShardInit(&_metricsRetired);
+}
+
+// returns the calling thread's shard, creating it on first use
+static LWMetricsShard *_LWMetricsShard(void)
+{
+    LWMetricsShard *shard;
+
+    pthread_once(&_metricsOnce, _LWMetricsInit);
+    shard = pthread_getspecific(_metricsKey);
+
+    if (! shard) {
+        shard = malloc(sizeof(*shard));
+        assert(shard != NULL);
+        _LWMetricsShardInit(shard);
+        pthread_mutex_lock(&_metricsLock);
+        shard->next = _metricsShards;
+        _metricsShards = shard;
+        pthread_mutex_unlock(&_metricsLock);
+        pthread_setspecific(_metricsKey, shard);
+    }
+
+    return shard;
+}
+
+// index of the histogram bucket for a timing of ns nanoseconds, the first 8 buckets hold 0-7ns, and each power of 2
+// after that is split into 8 buckets
+static size_t _LWMetricsBucket(uint64_t ns)
+{
+    uint64_t v = ns;
+    size_t bits = 0;
+
+    if (ns < 8) return (size_t)ns;
+
+    for (size_t i = 32; i > 0; i /= 2) { // bits = floor(log2(ns))
+        if (v >> i) v >>= i, bits += i;
+    }
+
+    if (bits >= METRICS_HISTOGRAM_BITS) return METRICS_HISTOGRAM_BUCKETS - 1;
+    return (bits - 2)*8 + (size_t)((ns >> (bits - 3)) & 7);
+}
+
+// largest timing that falls in bucket
+static uint64_t _LWMetricsBucketMax(size_t bucket)
+{
+    size_t bits = bucket/8 + 2;
+
+    if (bucket < 8) return bucket;
+    if (bucket >= METRICS_HISTOGRAM_BUCKETS - 1) return UINT64_MAX;
+    return ((8 + (uint64_t)(bucket % 8) + 1) << (bits - 3)) - 1;
+}
+
+// calls the report callback with a new snapshot
+static void _LWMetricsReport(void)
+{
+    void (*callback)(void *, const LWMetricsSnapshot *);
+    LWMetricsSnapshot *snapshot;
+    void *info;
+
+    pthread_mutex_lock(&_metricsLock);
+    callback = _metricsCallback;
+    info = _metricsCallbackInfo;
+    pthread_mutex_unlock(&_metricsLock);
+
+    if (callback) {
+        snapshot = malloc(sizeof(*snapshot));
+        assert(snapshot != NULL);
+        LWMetricsGetSnapshot(snapshot);
+        callback(info, snapshot);
+        free(snapshot);
+    }
+}
+
+// monotonic time in nanoseconds, for measuring timings
+uint64_t LWMetricsTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// recording is enabled by default, while disabled the recording functions return without doing anything
+void LWMetricsSetEnabled(int enabled)
+{
+    metrics_store(&_metricsEnabled, enabled);
+}
+
+// adds n to counter
+void LWMetricsCount(LWMetricCounter counter, uint64_t n)
+{
+    LWMetricsShard *shard;
+
+    assert(counter < LWMetricCounterCount);
+    if (! metrics_load(&_metricsEnabled)) return;
+    shard = _LWMetricsShard();
+    metrics_store(&shard->counters[counter], shard->counters[counter] + n);
+}
+
+// sets gauge to value
+void LWMetricsSetGauge(LWMetricGauge gauge, double value)
+{
+    uint64_t u;
+
+    assert(gauge < LWMetricGaugeCount);
+    if (! metrics_load(&_metricsEnabled)) return;
+    memcpy(&u, &value, sizeof(u));
+    metrics_store(&_metricsGauges[gauge], u);
+}
+
+// records a timing of ns nanoseconds
+void LWMetricsRecord(LWMetricTimer timer, uint64_t ns)
+{
+    LWMetricsHistogram *h;
+    size_t b = _LWMetricsBucket(ns);
+
+    assert(timer < LWMetricTimerCount);
+    if (! metrics_load(&_metricsEnabled)) return;
+    h = &_LWMetricsShard()->timers[timer];
+    metrics_store(&h->count, h->count + 1);
+    metrics_store(&h->sum, h->sum + ns);
+    if (ns < h->min) metrics_store(&h->min, ns);
+    if (ns > h->max) metrics_store(&h->max, ns);
+    metrics_store(&h->buckets[b], h->buckets[b] + 1);
+}
+
+// records the time since start, as returned by LWMetricsTime(), and returns the current time
+uint64_t LWMetricsRecordSince(LWMetricTimer timer, uint64_t start)
+{
+    uint64_t now = LWMetricsTime(), reportTime = metrics_load(&_metricsReportTime);
+
+    LWMetricsRecord(timer, (now > start) ? now - start : 0);
+
+    // only the thread that advances the report time calls the callback
+    if (now >= reportTime &&
+        __atomic_compare_exchange_n(&_metricsReportTime, &reportTime, now + metrics_load(&_metricsReportInterval), 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) _LWMetricsReport();
+
+    return now;
+}
+
+// writes the totals of all counters, gauges and timers recorded since the process started to snapshot
+void LWMetricsGetSnapshot(LWMetricsSnapshot *snapshot)
+{
+    uint64_t u;
+
+    assert(snapshot != NULL);
+    pthread_once(&_metricsOnce, _LWMetricsInit);
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (size_t i = 0; i < LWMetricTimerCount; i++) snapshot->timers[i].min = UINT64_MAX;
+
+    for (size_t i = 0; i < LWMetricGaugeCount; i++) {
+        u = metrics_load(&_metricsGauges[i]);
+        memcpy(&snapshot->gauges[i], &u, sizeof(u));
+    }
+
+    pthread_mutex_lock(&_metricsLock);
+    _LWMetricsMerge(snapshot->counters, snapshot->timers, &_metricsRetired);
+
+    for (LWMetricsShard *shard = _metricsShards; shard; shard = shard->next) {
+        _LWMetricsMerge(snapshot->counters, snapshot->timers, shard);
+    }
+
+    pthread_mutex_unlock(&_metricsLock);
+}
+
+// returns the upper bound of the histogram bucket containing the given percentile (0-100) of timings
+uint64_t LWMetricsPercentile(const LWMetricsHistogram *histogram, double percentile)
+{
+    double t;
+    uint64_t target, n = 0, max;
+    size_t i;
+
+    assert(histogram != NULL);
+    if (histogram->count == 0) return 0;
+    t = (double)histogram->count*percentile/100.0;
+    target = (uint64_t)t;
+    if (target < t || target == 0) target++; // round up to at least one timing
+    if (target > histogram->count) target = histogram->count;
+
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        n += histogram->buckets[i];
+        if (n >= target) break;
+    }
+
+    max = _LWMetricsBucketMax(i);
+    return (max < histogram->max) ? max : histogram->max;
+}
+
+// callback is called with a snapshot about every interval seconds, from whichever thread records a timing after the
+// interval is up, so it must return quickly and must not call back into the peer manager or wallet
+// pass a NULL callback to stop reporting
+void LWMetricsSetCallback(void *info, void (*callback)(void *info, const LWMetricsSnapshot *snapshot),
+                          double interval)
+{
+    uint64_t ns = (interval > 0) ? (uint64_t)(interval*1000000000) : 0;
+
+    pthread_mutex_lock(&_metricsLock);
+    _metricsCallbackInfo = info;
+    _metricsCallback = callback;
+    metrics_store(&_metricsReportInterval, ns);
+    metrics_store(&_metricsReportTime, (callback) ? LWMetricsTime() + ns : UINT64_MAX);
+    pthread_mutex_unlock(&_metricsLock);
+}
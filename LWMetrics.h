@@ -0,0 +1,96 @@
+//
+//  LWMetrics.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWMetrics_h
+#define LWMetrics_h
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// process wide counters, gauges and timing histograms for the sync hot paths
+// each thread records into its own shard with relaxed atomic stores, so recording never takes a lock, and a snapshot
+// sums the shards of all threads
+
+#define METRICS_HISTOGRAM_BITS    40 // timings of 2^40ns (about 18 minutes) or more go in the last bucket
+#define METRICS_HISTOGRAM_BUCKETS ((METRICS_HISTOGRAM_BITS - 2)*8) // 8 buckets per power of 2, within 12.5%
+
+typedef enum {
+    LWMetricCounterBytesIn = 0, // bytes read from peers, including message headers
+    LWMetricCounterBytesOut, // bytes sent to peers, including message headers
+    LWMetricCounterMessagesIn, // messages read from peers
+    LWMetricCounterMessagesOut, // messages sent to peers
+    LWMetricCounterBloomRebuilds, // bloom filters built for a peer
+    LWMetricCounterCount
+} LWMetricCounter;
+
+typedef enum {
+    LWMetricGaugeFpRate = 0, // estimated false positive rate of the loaded bloom filter
+    LWMetricGaugeCount
+} LWMetricGauge;
+
+typedef enum {
+    LWMetricTimerMessageParse = 0, // parsing and handling a peer message
+    LWMetricTimerScrypt, // scrypt proof-of-work hash of a block header
+    LWMetricTimerBloomRebuild, // building and sending a bloom filter
+    LWMetricTimerUpdateBalance, // recalculating the wallet balance
+    LWMetricTimerManagerLockWait, // waiting to lock the peer manager
+    LWMetricTimerManagerLockHold, // holding the peer manager lock
+    LWMetricTimerWalletLockWait, // waiting to lock the wallet
+    LWMetricTimerWalletLockHold, // holding the wallet lock
+    LWMetricTimerCount
+} LWMetricTimer;
+
+typedef struct {
+    uint64_t count; // number of timings recorded
+    uint64_t sum; // total of all timings in nanoseconds
+    uint64_t min; // shortest timing in nanoseconds, UINT64_MAX if none were recorded
+    uint64_t max; // longest timing in nanoseconds
+    uint64_t buckets[METRICS_HISTOGRAM_BUCKETS]; // number of timings in each bucket
+} LWMetricsHistogram;
+
+typedef struct {
+    uint64_t counters[LWMetricCounterCount];
+    double gauges[LWMetricGaugeCount];
+    LWMetricsHistogram timers[LWMetricTimerCount];
+} LWMetricsSnapshot;
+
+// monotonic time in nanoseconds, for measuring timings
+uint64_t LWMetricsTime(void);
+
+// recording is enabled by default, while disabled the recording functions return without doing anything
+void LWMetricsSetEnabled(int enabled);
+
+// adds n to counter
+void LWMetricsCount(LWMetricCounter counter, uint64_t n);
+
+// sets gauge to value
+void LWMetricsSetGauge(LWMetricGauge gauge, double value);
+
+// records a timing of ns nanoseconds
+void LWMetricsRecord(LWMetricTimer timer, uint64_t ns);
+
+// records the time since start, as returned by LWMetricsTime(), and returns the current time
+uint64_t LWMetricsRecordSince(LWMetricTimer timer, uint64_t start);
+
+// writes the totals of all counters, gauges and timers recorded since the process started to snapshot
+void LWMetricsGetSnapshot(LWMetricsSnapshot *snapshot);
+
+// returns the upper bound of the histogram bucket containing the given percentile (0-100) of timings
+uint64_t LWMetricsPercentile(const LWMetricsHistogram *histogram, double percentile);
+
+// callback is called with a snapshot about every interval seconds, from whichever thread records a timing after the
+// interval is up, so it must return quickly and must not call back into the peer manager or wallet
+// pass a NULL callback to stop reporting
+void LWMetricsSetCallback(void *info, void (*callback)(void *info, const LWMetricsSnapshot *snapshot),
+                          double interval);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWMetrics_h
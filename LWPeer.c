@@ -7,8 +7,11 @@
 #include "LWAddress.h"
 #include "LWSet.h"
 #include "LWArray.h"
+#include "LWBlockFilter.h"
 #include "LWCrypto.h"
+#include "LWMetrics.h"
 #include "LWInt.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <float.h>
 #include <inttypes.h>
@@ -32,6 +35,7 @@
 #define LOCAL_HOST         ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 })
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
+#define KNOWN_TX_CAPACITY  6144 // default number of known tx hashes remembered in each generation of the inv filter
 
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
@@ -68,6 +72,16 @@ typedef enum {
     inv_filtered_block = 3
 } inv_type;
 
+// a two-generation set of 64bit tx hash fingerprints using fixed memory, once the current generation holds capacity
+// fingerprints, the previous one is discarded and the current one takes its place, so at least the last capacity
+// hashes added are always remembered
+typedef struct {
+    uint64_t *slots; // two generations of slotCount open addressed fingerprints, zero marks an empty slot
+    size_t slotCount, capacity, count; // count is the number of fingerprints in the current generation
+    uint64_t salt;
+    int current;
+} LWInvFilter;
+
 typedef struct {
     LWPeer peer; // superstruct on top of LWPeer
     uint32_t magicNumber;
@@ -80,11 +94,12 @@ typedef struct {
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
     double startTime, pingTime;
     volatile double disconnectTime, mempoolTime;
-    int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
+    int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks, headersFirst;
+    int headerRequests; // single headers requested with LWPeerSendGetheader() that haven't been answered yet
     UInt256 lastBlockHash;
     LWMerkleBlock *currentBlock;
-    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
-    LWSet *knownTxHashSet;
+    UInt256 *currentBlockTxHashes, *knownBlockHashes;
+    LWInvFilter knownTxHashes;
     volatile int socket;
     void *info;
     void (*connected)(void *info);
@@ -94,6 +109,13 @@ typedef struct {
     void (*hasTx)(void *info, UInt256 txHash);
     void (*rejectedTx)(void *info, UInt256 txHash, uint8_t code);
     void (*relayedBlock)(void *info, LWMerkleBlock *block);
+    int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount);
+    void (*headersDone)(void *info);
+    void (*relayedCompactFilter)(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen);
+    void (*relayedFilterHashes)(void *info, UInt256 stopHash, UInt256 prevHeader, const UInt256 filterHashes[],
+                                size_t hashesCount);
+    void (*relayedFilterCheckpoints)(void *info, UInt256 stopHash, const UInt256 filterHeaders[], size_t count);
+    int (*blockTxMatches)(void *info, const LWTransaction *tx);
     void (*notfound)(void *info, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                      size_t blockCount);
     void (*setFeePerKb)(void *info, uint64_t feePerKb);
@@ -116,24 +138,73 @@ inline static int _LWPeerIsIPv4(const LWPeer *peer)
     return (peer->address.u64[0] == 0 && peer->address.u16[4] == 0 && peer->address.u16[5] == 0xffff);
 }
 
+// (re)allocates filter to remember at least capacity hashes, forgetting any already added
+static void _LWInvFilterInit(LWInvFilter *filter, size_t capacity)
+{
+    size_t slotCount = 16;
+
+    while (slotCount < capacity + capacity/3) slotCount <<= 1; // keep the load factor at or below 75%
+    if (filter->slots) free(filter->slots);
+    filter->slots = calloc(slotCount*2, sizeof(*filter->slots));
+    assert(filter->slots != NULL);
+    filter->slotCount = slotCount;
+    filter->capacity = (capacity > 0) ? capacity : 1;
+    filter->count = 0;
+    filter->current = 0;
+    filter->salt = ((uint64_t)LWRand(0) << 32) | (uint64_t)LWRand(0) | 1;
+}
+
+// returns the slot in generation gen holding fingerprint, or the empty slot where it would be inserted
+static uint64_t *_LWInvFilterSlot(const LWInvFilter *filter, int gen, uint64_t fingerprint)
+{
+    uint64_t *slots = &filter->slots[gen*filter->slotCount];
+    size_t i = (size_t)((fingerprint*filter->salt) >> 32) & (filter->slotCount - 1);
+
+    while (slots[i] != 0 && slots[i] != fingerprint) i = (i + 1) & (filter->slotCount - 1);
+    return &slots[i];
+}
+
+// fingerprint of hash used by the inv filter, never zero
+inline static uint64_t _LWInvFilterFingerprint(UInt256 hash)
+{
+    return (hash.u64[0] ^ hash.u64[3]) | (hash.u64[0] == hash.u64[3]);
+}
+
+// true if hash was added to filter (false positive rate is about count/2^64)
+static int _LWInvFilterContains(const LWInvFilter *filter, UInt256 hash)
+{
+    uint64_t fingerprint = _LWInvFilterFingerprint(hash);
+
+    return (*_LWInvFilterSlot(filter, filter->current, fingerprint) == fingerprint ||
+            *_LWInvFilterSlot(filter, ! filter->current, fingerprint) == fingerprint);
+}
+
+// adds hash to filter, returns false if it was already there
+static int _LWInvFilterAdd(LWInvFilter *filter, UInt256 hash)
+{
+    uint64_t fingerprint = _LWInvFilterFingerprint(hash), *slot;
+
+    if (*_LWInvFilterSlot(filter, ! filter->current, fingerprint) == fingerprint) return 0;
+    slot = _LWInvFilterSlot(filter, filter->current, fingerprint);
+    if (*slot == fingerprint) return 0;
+
+    if (filter->count >= filter->capacity) { // start a new generation, dropping the oldest one
+        filter->current = ! filter->current;
+        memset(&filter->slots[filter->current*filter->slotCount], 0, filter->slotCount*sizeof(*filter->slots));
+        filter->count = 0;
+        slot = _LWInvFilterSlot(filter, filter->current, fingerprint);
+    }
+
+    *slot = fingerprint;
+    filter->count++;
+    return 1;
+}
+
 static void _LWPeerAddKnownTxHashes(const LWPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
-    UInt256 *knownTxHashes = ctx->knownTxHashes;
-    size_t i, j;
-    
-    for (i = 0; i < txCount; i++) {
-        if (! LWSetContains(ctx->knownTxHashSet, &txHashes[i])) {
-            array_add(knownTxHashes, txHashes[i]);
-            
-            if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
-                ctx->knownTxHashes = knownTxHashes;
-                LWSetClear(ctx->knownTxHashSet);
-                for (j = array_count(knownTxHashes); j > 0; j--) LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[j - 1]);
-            }
-            else LWSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
-        }
-    }
+
+    for (size_t i = 0; i < txCount; i++) _LWInvFilterAdd(&ctx->knownTxHashes, txHashes[i]);
 }
 
 static void _LWPeerDidConnect(LWPeer *peer)
@@ -252,7 +323,7 @@ static int _LWPeerAcceptAddrMessage(LWPeer *peer, const uint8_t *msg, size_t msg
         size_t peersCount = 0;
         time_t now = time(NULL);
         
-        peer_log(peer, "got addr with %zu address(es)", count);
+        peer_debug(peer, "got addr with %zu address(es)", count);
 
         for (size_t i = 0; i < count; i++) {
             p.timestamp = UInt32GetLE(&msg[off]);
@@ -298,7 +369,7 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
         const uint8_t *transactions[count], *blocks[count];
         size_t i, j, txCount = 0, blockCount = 0;
         
-        peer_log(peer, "got inv with %zu item(s)", count);
+        peer_debug(peer, "got inv with %zu item(s)", count);
 
         for (i = 0; i < count; i++) {
             type = UInt32GetLE(&msg[off]);
@@ -347,14 +418,20 @@ static int _LWPeerAcceptInvMessage(LWPeer *peer, const uint8_t *msg, size_t msgL
             for (i = 0, j = 0; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
                 
-                if (LWSetContains(ctx->knownTxHashSet, &hash)) {
+                if (_LWInvFilterContains(&ctx->knownTxHashes, hash)) {
                     if (ctx->hasTx) ctx->hasTx(ctx->info, hash);
                 }
                 else txHashes[j++] = hash;
             }
             
             _LWPeerAddKnownTxHashes(peer, txHashes, j);
-            if (j > 0 || blockCount > 0) LWPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
+            
+            // blocks may be scheduled for download from several peers at once by the caller
+            size_t getdataCount = blockCount;
+            
+            if (blockCount > 0 && ctx->relayedBlockHashes &&
+                ctx->relayedBlockHashes(ctx->info, blockHashes, blockCount)) getdataCount = 0;
+            if (j > 0 || getdataCount > 0) LWPeerSendGetdata(peer, txHashes, j, blockHashes, getdataCount);
     
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
             if (blockCount >= 500) {
@@ -393,7 +470,7 @@ static int _LWPeerAcceptTxMessage(LWPeer *peer, const uint8_t *msg, size_t msgLe
     }
     else {
         txHash = tx->txHash;
-        peer_log(peer, "got tx: %s", u256hex(txHash));
+        peer_debug(peer, "got tx: %s", u256hex(txHash));
 
         if (ctx->relayedTx) {
             ctx->relayedTx(ctx->info, tx);
@@ -430,47 +507,70 @@ static int _LWPeerAcceptHeadersMessage(LWPeer *peer, const uint8_t *msg, size_t
                  LWVarIntSize(count) + 81*count, count);
         r = 0;
     }
+    else if (count > 2000) {
+        peer_log(peer, "non-standard headers message, %zu is more than 2000 header(s)", count);
+        r = 0;
+    }
     else {
-        peer_log(peer, "got %zu header(s)", count);
+        peer_debug(peer, "got %zu header(s)", count);
     
         // To improve chain download performance, if this message contains 2000 headers then request the next 2000
         // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime
+        // (in headers-first mode, keep requesting headers until the peer's best block is reached)
         uint32_t timestamp = (count > 0) ? UInt32GetLE(&msg[off + 81*(count - 1) + 68]) : 0;
-    
-        if (count >= 2000 || (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
-            size_t last = 0;
+        int requested = (count == 1 && ctx->headerRequests > 0), // reply to LWPeerSendGetheader()
+            keyTimeReached = (! requested && ! ctx->headersFirst && timestamp > 0 &&
+                              timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime);
+
+        if (requested) ctx->headerRequests--;
+
+        if (count == 0 && ctx->headersFirst) { // the peer has no headers after the locators
+            if (ctx->headersDone) ctx->headersDone(ctx->info);
+        }
+        else if (count >= 2000 || keyTimeReached || ctx->headersFirst || requested) {
+            LWMerkleBlock *blocks[count];
+            size_t last = 0, blocksCount = LWMerkleBlockParseHeaders(blocks, count, &msg[off], msgLen - off);
             time_t now = time(NULL);
             UInt256 locators[2];
             
-            LWSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
-            LWSHA256_2(&locators[1], &msg[off], 80);
-
-            if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
-                // request blocks for the remainder of the chain
-                timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
+            if (blocksCount < count) {
+                peer_log(peer, "non-continuous headers message");
+                r = 0;
+            }
+            else if (keyTimeReached) { // request blocks for the remainder of the chain
+                timestamp = (++last < count) ? blocks[last]->timestamp : 0;
 
                 while (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT < ctx->earliestKeyTime) {
-                    timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
+                    timestamp = (++last < count) ? blocks[last]->timestamp : 0;
                 }
                 
-                LWSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
+                locators[0] = blocks[last - 1]->blockHash;
+                locators[1] = blocks[0]->blockHash;
                 LWPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             }
-            else LWPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            else if (count >= 2000) {
+                locators[0] = blocks[count - 1]->blockHash;
+                locators[1] = blocks[0]->blockHash;
+                LWPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            }
 
-            for (size_t i = 0; r && i < count; i++) {
-                LWMerkleBlock *block = LWMerkleBlockParse(&msg[off + 81*i], 81);
-                
-                if (! LWMerkleBlockIsValid(block, (uint32_t)now)) {
-                    peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
-                    LWMerkleBlockFree(block);
+            for (size_t i = 0; i < blocksCount; i++) {
+                if (! r) {
+                    LWMerkleBlockFree(blocks[i]);
+                }
+                else if (! LWMerkleBlockIsValid(blocks[i], (uint32_t)now)) {
+                    peer_log(peer, "invalid block header: %s", u256hex(blocks[i]->blockHash));
+                    LWMerkleBlockFree(blocks[i]);
                     r = 0;
                 }
                 else if (ctx->relayedBlock) {
-                    ctx->relayedBlock(ctx->info, block);
+                    ctx->relayedBlock(ctx->info, blocks[i]);
                 }
-                else LWMerkleBlockFree(block);
+                else LWMerkleBlockFree(blocks[i]);
             }
+
+            // a short reply in headers-first mode means the peer has sent all the headers it has
+            if (r && ctx->headersFirst && ! requested && count < 2000 && ctx->headersDone) ctx->headersDone(ctx->info);
         }
         else {
             peer_log(peer, "non-standard headers message, %zu is fewer header(s) than expected", count);
@@ -483,7 +583,7 @@ static int _LWPeerAcceptHeadersMessage(LWPeer *peer, const uint8_t *msg, size_t
 
 static int _LWPeerAcceptGetaddrMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
 {
-    peer_log(peer, "got getaddr");
+    peer_debug(peer, "got getaddr");
     LWPeerSendAddr(peer);
     return 1;
 }
@@ -506,7 +606,7 @@ static int _LWPeerAcceptGetdataMessage(LWPeer *peer, const uint8_t *msg, size_t
         struct inv_item { uint8_t item[36]; } *notfound = NULL;
         LWTransaction *tx = NULL;
         
-        peer_log(peer, "got getdata with %zu item(s)", count);
+        peer_debug(peer, "got getdata with %zu item(s)", count);
         
         for (size_t i = 0; i < count; i++) {
             inv_type type = UInt32GetLE(&msg[off]);
@@ -575,7 +675,7 @@ static int _LWPeerAcceptNotfoundMessage(LWPeer *peer, const uint8_t *msg, size_t
         inv_type type;
         UInt256 *txHashes, *blockHashes, hash;
         
-        peer_log(peer, "got notfound with %zu item(s)", count);
+        peer_debug(peer, "got notfound with %zu item(s)", count);
         array_new(txHashes, 1);
         array_new(blockHashes, 1);
         
@@ -613,7 +713,7 @@ static int _LWPeerAcceptPingMessage(LWPeer *peer, const uint8_t *msg, size_t msg
         r = 0;
     }
     else {
-        peer_log(peer, "got ping");
+        peer_debug(peer, "got ping");
         LWPeerSendMessage(peer, msg, msgLen, MSG_PONG);
     }
 
@@ -647,9 +747,9 @@ static int _LWPeerAcceptPongMessage(LWPeer *peer, const uint8_t *msg, size_t msg
             // 50% low pass filter on current ping time
             ctx->pingTime = ctx->pingTime*0.5 + pingTime*0.5;
             ctx->startTime = 0;
-            peer_log(peer, "got pong in %fs", pingTime);
+            peer_debug(peer, "got pong in %fs", pingTime);
         }
-        else peer_log(peer, "got pong");
+        else peer_debug(peer, "got pong");
 
         if (array_count(ctx->pongCallback) > 0) {
             void (*pongCallback)(void *, int) = ctx->pongCallback[0];
@@ -698,7 +798,7 @@ static int _LWPeerAcceptMerkleblockMessage(LWPeer *peer, const uint8_t *msg, siz
         count = LWMerkleBlockTxHashes(block, hashes, count);
 
         for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (LWSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
+            if (_LWInvFilterContains(&ctx->knownTxHashes, hashes[i - 1])) continue;
             array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
         }
 
@@ -718,6 +818,150 @@ static int _LWPeerAcceptMerkleblockMessage(LWPeer *peer, const uint8_t *msg, siz
     return r;
 }
 
+// full blocks are only requested when a compact filter matched, matched tx are relayed first, then the block is relayed
+// as a merkleblock containing just those tx
+static int _LWPeerAcceptBlockMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    LWMerkleBlock *block = LWMerkleBlockParse(msg, (msgLen < 80) ? msgLen : 80);
+    size_t i, off = 80, len = 0, txCount = (msgLen > off) ? (size_t)LWVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+
+    off += len;
+
+    if (! block || len == 0 || txCount == 0 || txCount > (msgLen - off)/60) { // a tx is at least 60 bytes
+        peer_log(peer, "malformed block message with length: %zu", msgLen);
+        r = 0;
+    }
+    else if (! ctx->sentGetdata) {
+        peer_log(peer, "got block message before sending getdata");
+        r = 0;
+    }
+    else {
+        LWTransaction **tx = calloc(txCount, sizeof(*tx));
+        UInt256 *txHashes = malloc(txCount*sizeof(*txHashes));
+        uint8_t *matches = calloc(txCount, sizeof(*matches));
+
+        assert(tx != NULL);
+        assert(txHashes != NULL);
+        assert(matches != NULL);
+
+        for (i = 0; r && i < txCount; i++) {
+            tx[i] = LWTransactionParse(&msg[off], msgLen - off);
+
+            if (! tx[i] || UInt256IsZero(tx[i]->txHash)) {
+                peer_log(peer, "malformed tx %zu in block message: %s", i, u256hex(block->blockHash));
+                r = 0;
+            }
+            else {
+                off += LWTransactionSerialize(tx[i], NULL, 0);
+                txHashes[i] = tx[i]->txHash;
+            }
+        }
+
+        if (r) LWMerkleBlockSetPartialTree(block, txHashes, matches, txCount); // verify the tx against the merkle root
+
+        if (r && ! LWMerkleBlockIsValid(block, (uint32_t)time(NULL))) {
+            peer_log(peer, "invalid block: %s", u256hex(block->blockHash));
+            r = 0;
+        }
+
+        for (i = 0; r && i < txCount; i++) { // in order, so tx spending earlier matched tx in the block also match
+            matches[i] = (ctx->blockTxMatches && ctx->blockTxMatches(ctx->info, tx[i]));
+            if (matches[i] && ctx->relayedTx) ctx->relayedTx(ctx->info, tx[i]);
+            else LWTransactionFree(tx[i]);
+            tx[i] = NULL;
+        }
+
+        for (i = 0; i < txCount; i++) if (tx[i]) LWTransactionFree(tx[i]);
+        if (r) LWMerkleBlockSetPartialTree(block, txHashes, matches, txCount);
+        free(matches);
+        free(txHashes);
+        free(tx);
+    }
+
+    if (block && r && ctx->relayedBlock) ctx->relayedBlock(ctx->info, block);
+    else if (block) LWMerkleBlockFree(block);
+    return r;
+}
+
+// BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static int _LWPeerAcceptCfilterMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t off = sizeof(uint8_t) + sizeof(UInt256), len = 0,
+           filterLen = (msgLen > off) ? (size_t)LWVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+
+    if (len == 0 || off + len + filterLen > msgLen) {
+        peer_log(peer, "malformed cfilter message, length is %zu, should be %zu", msgLen, off + len + filterLen);
+        r = 0;
+    }
+    else if (msg[0] != BLOCK_FILTER_BASIC) {
+        peer_log(peer, "ignoring cfilter with type %d", msg[0]);
+    }
+    else if (ctx->relayedCompactFilter) {
+        ctx->relayedCompactFilter(ctx->info, UInt256Get(&msg[sizeof(uint8_t)]), &msg[off + len], filterLen);
+    }
+
+    return r;
+}
+
+// BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static int _LWPeerAcceptCfheadersMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t i, off = sizeof(uint8_t) + sizeof(UInt256)*2, len = 0,
+           count = (msgLen > off) ? (size_t)LWVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+
+    if (len == 0 || count > 2000 || off + len + count*sizeof(UInt256) > msgLen) {
+        peer_log(peer, "malformed cfheaders message, length is %zu, should be %zu for %zu header(s)", msgLen,
+                 off + len + count*sizeof(UInt256), count);
+        r = 0;
+    }
+    else if (msg[0] != BLOCK_FILTER_BASIC) {
+        peer_log(peer, "ignoring cfheaders with type %d", msg[0]);
+    }
+    else if (ctx->relayedFilterHashes) {
+        UInt256 filterHashes[count];
+
+        for (i = 0; i < count; i++) filterHashes[i] = UInt256Get(&msg[off + len + i*sizeof(UInt256)]);
+        ctx->relayedFilterHashes(ctx->info, UInt256Get(&msg[sizeof(uint8_t)]),
+                                 UInt256Get(&msg[sizeof(uint8_t) + sizeof(UInt256)]), filterHashes, count);
+    }
+
+    return r;
+}
+
+// BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static int _LWPeerAcceptCfcheckptMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+    size_t i, off = sizeof(uint8_t) + sizeof(UInt256), len = 0,
+           count = (msgLen > off) ? (size_t)LWVarInt(&msg[off], msgLen - off, &len) : 0;
+    int r = 1;
+
+    if (len == 0 || count > (msgLen - off)/sizeof(UInt256) || off + len + count*sizeof(UInt256) > msgLen) {
+        peer_log(peer, "malformed cfcheckpt message, length is %zu, should be %zu for %zu header(s)", msgLen,
+                 off + len + count*sizeof(UInt256), count);
+        r = 0;
+    }
+    else if (msg[0] != BLOCK_FILTER_BASIC) {
+        peer_log(peer, "ignoring cfcheckpt with type %d", msg[0]);
+    }
+    else if (ctx->relayedFilterCheckpoints) {
+        UInt256 *filterHeaders = malloc((count + 1)*sizeof(*filterHeaders));
+
+        assert(filterHeaders != NULL);
+        for (i = 0; i < count; i++) filterHeaders[i] = UInt256Get(&msg[off + len + i*sizeof(UInt256)]);
+        ctx->relayedFilterCheckpoints(ctx->info, UInt256Get(&msg[sizeof(uint8_t)]), filterHeaders, count);
+        free(filterHeaders);
+    }
+
+    return r;
+}
+
 // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 static int _LWPeerAcceptRejectMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen)
 {
@@ -780,7 +1024,7 @@ static int _LWPeerAcceptFeeFilterMessage(LWPeer *peer, const uint8_t *msg, size_
     }
     else {
         ctx->feePerKb = UInt64GetLE(msg);
-        peer_log(peer, "got feefilter with rate %"PRIu64, ctx->feePerKb);
+        peer_debug(peer, "got feefilter with rate %"PRIu64, ctx->feePerKb);
         if (ctx->setFeePerKb) ctx->setFeePerKb(ctx->info, ctx->feePerKb);
     }
     
@@ -813,6 +1057,10 @@ static int _LWPeerAcceptMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen,
     else if (strncmp(MSG_MERKLEBLOCK, type, 12) == 0) r = _LWPeerAcceptMerkleblockMessage(peer, msg, msgLen);
     else if (strncmp(MSG_REJECT, type, 12) == 0) r = _LWPeerAcceptRejectMessage(peer, msg, msgLen);
     else if (strncmp(MSG_FEEFILTER, type, 12) == 0) r = _LWPeerAcceptFeeFilterMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_BLOCK, type, 12) == 0) r = _LWPeerAcceptBlockMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFILTER, type, 12) == 0) r = _LWPeerAcceptCfilterMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFHEADERS, type, 12) == 0) r = _LWPeerAcceptCfheadersMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFCHECKPT, type, 12) == 0) r = _LWPeerAcceptCfcheckptMessage(peer, msg, msgLen);
     else peer_log(peer, "dropping %s, length %zu, not implemented", type, msgLen);
 
     return r;
@@ -988,7 +1236,14 @@ static void *_peerThreadRoutine(void *arg)
                                      ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
                             error = EPROTO;
                         }
-                        else if (! _LWPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+                        else {
+                            uint64_t start = LWMetricsTime();
+
+                            if (! _LWPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+                            LWMetricsRecordSince(LWMetricTimerMessageParse, start);
+                            LWMetricsCount(LWMetricCounterMessagesIn, 1);
+                            LWMetricsCount(LWMetricCounterBytesIn, HEADER_LENGTH + msgLen);
+                        }
                     }
                 }
             }
@@ -1033,8 +1288,7 @@ LWPeer *LWPeerNew(uint32_t magicNumber)
     array_new(ctx->useragent, 40);
     array_new(ctx->knownBlockHashes, 10);
     array_new(ctx->currentBlockTxHashes, 10);
-    array_new(ctx->knownTxHashes, 10);
-    ctx->knownTxHashSet = LWSetNew(LWTransactionHash, LWTransactionEq, 10);
+    _LWInvFilterInit(&ctx->knownTxHashes, KNOWN_TX_CAPACITY);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
     ctx->pingTime = DBL_MAX;
@@ -1089,12 +1343,66 @@ void LWPeerSetCallbacks(LWPeer *peer, void *info,
     ctx->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// int relayedBlockHashes(void *, const UInt256[], size_t) - called when an "inv" message with block hashes is received,
+// return true if the caller will request the blocks itself, otherwise peer sends getdata for them as usual
+void LWPeerSetBlockHashesCallback(LWPeer *peer,
+                                  int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount))
+{
+    ((LWPeerContext *)peer)->relayedBlockHashes = relayedBlockHashes;
+}
+
+// void headersDone(void *) - called in headers-first mode when a "headers" message has fewer than 2000 headers, after
+// each of them is passed to relayedBlock, meaning the peer has no more headers to send
+void LWPeerSetHeadersDoneCallback(LWPeer *peer, void (*headersDone)(void *info))
+{
+    ((LWPeerContext *)peer)->headersDone = headersDone;
+}
+
+// void relayedCompactFilter(void *, UInt256, const uint8_t *, size_t) - called when a "cfilter" message with a basic
+// filter for the block with the given hash is received
+// void relayedFilterHashes(void *, UInt256, UInt256, const UInt256[], size_t) - called when a "cfheaders" message is
+// received, with the stop hash, the filter header before the first filter, and the hashes of the filters in the range
+// void relayedFilterCheckpoints(void *, UInt256, const UInt256[], size_t) - called when a "cfcheckpt" message is
+// received, with the stop hash and the filter headers at every 1000th block height up to it
+// int blockTxMatches(void *, const LWTransaction *) - called for each tx in a full "block" message, the tx is relayed
+// with relayedTx if this returns true, and the block is relayed with relayedBlock as a merkle block of the matched tx
+void LWPeerSetCompactFilterCallbacks(LWPeer *peer,
+                                     void (*relayedCompactFilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                                  size_t filterLen),
+                                     void (*relayedFilterHashes)(void *info, UInt256 stopHash, UInt256 prevHeader,
+                                                                 const UInt256 filterHashes[], size_t hashesCount),
+                                     void (*relayedFilterCheckpoints)(void *info, UInt256 stopHash,
+                                                                      const UInt256 filterHeaders[], size_t count),
+                                     int (*blockTxMatches)(void *info, const LWTransaction *tx))
+{
+    LWPeerContext *ctx = (LWPeerContext *)peer;
+
+    ctx->relayedCompactFilter = relayedCompactFilter;
+    ctx->relayedFilterHashes = relayedFilterHashes;
+    ctx->relayedFilterCheckpoints = relayedFilterCheckpoints;
+    ctx->blockTxMatches = blockTxMatches;
+}
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void LWPeerSetEarliestKeyTime(LWPeer *peer, uint32_t earliestKeyTime)
 {
     ((LWPeerContext *)peer)->earliestKeyTime = earliestKeyTime;
 }
 
+// set to true to keep requesting headers up to the peer's best block instead of switching to getblocks when headers
+// reach earliestKeyTime, blocks are then requested by the caller with getdata
+void LWPeerSetHeadersFirst(LWPeer *peer, int headersFirst)
+{
+    ((LWPeerContext *)peer)->headersFirst = headersFirst;
+}
+
+// sets the number of recent tx hashes remembered as known to peer (each uses 8 to 16 bytes in each of two generations),
+// known tx aren't announced to peer, call this before connecting
+void LWPeerSetKnownTxCapacity(LWPeer *peer, size_t capacity)
+{
+    _LWInvFilterInit(&((LWPeerContext *)peer)->knownTxHashes, capacity);
+}
+
 // call this when local block height changes (helps detect tarpit nodes)
 void LWPeerSetCurrentBlockHeight(LWPeer *peer, uint32_t currentBlockHeight)
 {
@@ -1248,7 +1556,7 @@ void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const ch
         memcpy(&buf[off], hash, sizeof(uint32_t));
         off += sizeof(uint32_t);
         memcpy(&buf[off], msg, msgLen);
-        peer_log(peer, "sending %s", type);
+        peer_debug(peer, "sending %s", type);
         msgLen = 0;
         socket = ctx->socket;
         if (socket < 0) error = ENOTCONN;
@@ -1266,6 +1574,9 @@ void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const ch
             peer_log(peer, "%s", strerror(error));
             LWPeerDisconnect(peer);
         }
+
+        LWMetricsCount(LWMetricCounterBytesOut, msgLen);
+        if (! error) LWMetricsCount(LWMetricCounterMessagesOut, 1);
     }
 }
 
@@ -1327,6 +1638,21 @@ void LWPeerSendFilterload(LWPeer *peer, const uint8_t *filter, size_t filterLen)
     LWPeerSendMessage(peer, filter, filterLen, MSG_FILTERLOAD);
 }
 
+void LWPeerSendFilteradd(LWPeer *peer, const uint8_t *data, size_t dataLen)
+{
+    uint8_t msg[LWVarIntSize(dataLen) + dataLen];
+    size_t off = LWVarIntSet(msg, sizeof(msg), dataLen);
+
+    assert(data != NULL || dataLen == 0);
+    assert(dataLen <= 520); // BIP37 limits filteradd data to the maximum script element size
+
+    // peers treat filteradd without a loaded filter as misbehavior
+    if (((LWPeerContext *)peer)->sentFilter) {
+        memcpy(&msg[off], data, dataLen);
+        LWPeerSendMessage(peer, msg, off + dataLen, MSG_FILTERADD);
+    }
+}
+
 void LWPeerSendMempool(LWPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success))
 {
@@ -1373,12 +1699,28 @@ void LWPeerSendGetheaders(LWPeer *peer, const UInt256 locators[], size_t locator
     off += sizeof(UInt256);
 
     if (locatorsCount > 0) {
-        peer_log(peer, "calling getheaders with %zu locators: [%s,%s %s]", locatorsCount, u256hex(locators[0]),
+        peer_debug(peer, "calling getheaders with %zu locators: [%s,%s %s]", locatorsCount, u256hex(locators[0]),
                  (locatorsCount > 2 ? " ...," : ""), (locatorsCount > 1 ? u256hex(locators[locatorsCount - 1]) : ""));
         LWPeerSendMessage(peer, msg, off, MSG_GETHEADERS);
     }
 }
 
+// a getheaders message with no locators is answered with just the header of hashStop
+void LWPeerSendGetheader(LWPeer *peer, UInt256 blockHash)
+{
+    uint8_t msg[sizeof(uint32_t) + 1 + sizeof(blockHash)];
+    size_t off = 0;
+
+    UInt32SetLE(&msg[off], PROTOCOL_VERSION);
+    off += sizeof(uint32_t);
+    msg[off++] = 0; // no locators
+    UInt256Set(&msg[off], blockHash);
+    off += sizeof(blockHash);
+    peer_debug(peer, "calling getheaders for header %s", u256hex(blockHash));
+    ((LWPeerContext *)peer)->headerRequests++;
+    LWPeerSendMessage(peer, msg, off, MSG_GETHEADERS);
+}
+
 void LWPeerSendGetblocks(LWPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop)
 {
     size_t i, off = 0;
@@ -1398,7 +1740,7 @@ void LWPeerSendGetblocks(LWPeer *peer, const UInt256 locators[], size_t locators
     off += sizeof(UInt256);
     
     if (locatorsCount > 0) {
-        peer_log(peer, "calling getblocks with %zu locators: [%s,%s %s]", locatorsCount, u256hex(locators[0]),
+        peer_debug(peer, "calling getblocks with %zu locators: [%s,%s %s]", locatorsCount, u256hex(locators[0]),
                  (locatorsCount > 2 ? " ...," : ""), (locatorsCount > 1 ? u256hex(locators[locatorsCount - 1]) : ""));
         LWPeerSendMessage(peer, msg, off, MSG_GETBLOCKS);
     }
@@ -1407,30 +1749,37 @@ void LWPeerSendGetblocks(LWPeer *peer, const UInt256 locators[], size_t locators
 void LWPeerSendInv(LWPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
     LWPeerContext *ctx = (LWPeerContext *)peer;
-    size_t knownCount = array_count(ctx->knownTxHashes);
+    UInt256 _newHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
+            *newHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _newHashes : malloc(txCount*sizeof(*newHashes));
+    size_t i, count = 0;
 
-    _LWPeerAddKnownTxHashes(peer, txHashes, txCount);
-    txCount = array_count(ctx->knownTxHashes) - knownCount;
+    assert(newHashes != NULL || txCount == 0);
 
-    if (txCount > 0) {
-        size_t i, off = 0, msgLen = LWVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
+    for (i = 0; i < txCount; i++) { // only send tx hashes not already known to peer
+        if (_LWInvFilterAdd(&ctx->knownTxHashes, txHashes[i])) newHashes[count++] = txHashes[i];
+    }
+
+    if (count > 0) {
+        size_t off = 0, msgLen = LWVarIntSize(count) + (sizeof(uint32_t) + sizeof(*txHashes))*count;
         uint8_t msg[msgLen];
         
-        off += LWVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), txCount);
+        off += LWVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), count);
         
-        for (i = 0; i < txCount; i++) {
+        for (i = 0; i < count; i++) {
             UInt32SetLE(&msg[off], inv_tx);
             off += sizeof(uint32_t);
-            UInt256Set(&msg[off], ctx->knownTxHashes[knownCount + i]);
+            UInt256Set(&msg[off], newHashes[i]);
             off += sizeof(UInt256);
         }
 
         LWPeerSendMessage(peer, msg, off, MSG_INV);
     }
+
+    if (newHashes != _newHashes) free(newHashes);
 }
 
-void LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
-                       size_t blockCount)
+static void _LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
+                               size_t blockCount, inv_type blockType)
 {
     size_t i, off = 0, count = txCount + blockCount;
     
@@ -1451,7 +1800,7 @@ void LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, c
         }
         
         for (i = 0; i < blockCount; i++) {
-            UInt32SetLE(&msg[off], inv_filtered_block);
+            UInt32SetLE(&msg[off], blockType);
             off += sizeof(uint32_t);
             UInt256Set(&msg[off], blockHashes[i]);
             off += sizeof(UInt256);
@@ -1462,6 +1811,54 @@ void LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, c
     }
 }
 
+void LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
+                       size_t blockCount)
+{
+    _LWPeerSendGetdata(peer, txHashes, txCount, blockHashes, blockCount, inv_filtered_block);
+}
+
+void LWPeerSendGetdataBlocks(LWPeer *peer, const UInt256 blockHashes[], size_t blockCount)
+{
+    _LWPeerSendGetdata(peer, NULL, 0, blockHashes, blockCount, inv_block);
+}
+
+// BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+static void _LWPeerSendFilterRequest(LWPeer *peer, uint32_t startHeight, UInt256 stopHash, const char *type)
+{
+    uint8_t msg[sizeof(uint8_t) + sizeof(uint32_t) + sizeof(UInt256)];
+    size_t off = 0;
+
+    msg[off] = BLOCK_FILTER_BASIC;
+    off += sizeof(uint8_t);
+    UInt32SetLE(&msg[off], startHeight);
+    off += sizeof(uint32_t);
+    UInt256Set(&msg[off], stopHash);
+    off += sizeof(UInt256);
+    peer_debug(peer, "calling %s from height %"PRIu32" to %s", type, startHeight, u256hex(stopHash));
+    LWPeerSendMessage(peer, msg, off, type);
+}
+
+void LWPeerSendGetcfilters(LWPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    _LWPeerSendFilterRequest(peer, startHeight, stopHash, MSG_GETCFILTERS);
+}
+
+void LWPeerSendGetcfheaders(LWPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    _LWPeerSendFilterRequest(peer, startHeight, stopHash, MSG_GETCFHEADERS);
+}
+
+// BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+void LWPeerSendGetcfcheckpt(LWPeer *peer, UInt256 stopHash)
+{
+    uint8_t msg[sizeof(uint8_t) + sizeof(UInt256)];
+
+    msg[0] = BLOCK_FILTER_BASIC;
+    UInt256Set(&msg[sizeof(uint8_t)], stopHash);
+    peer_debug(peer, "calling getcfcheckpt to %s", u256hex(stopHash));
+    LWPeerSendMessage(peer, msg, sizeof(msg), MSG_GETCFCHECKPT);
+}
+
 void LWPeerSendGetaddr(LWPeer *peer)
 {
     ((LWPeerContext *)peer)->sentGetaddr = 1;
@@ -1504,8 +1901,7 @@ void LWPeerFree(LWPeer *peer)
     if (ctx->useragent) array_free(ctx->useragent);
     if (ctx->currentBlockTxHashes) array_free(ctx->currentBlockTxHashes);
     if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
-    if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
-    if (ctx->knownTxHashSet) LWSetFree(ctx->knownTxHashSet);
+    if (ctx->knownTxHashes.slots) free(ctx->knownTxHashes.slots);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
     free(ctx);
@@ -1515,3 +1911,16 @@ void LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t msgLen, co
 {
     _LWPeerAcceptMessage(peer, msg, msgLen, type);
 }
+
+void LWPeerSetSocketTest(LWPeer *peer, int socket)
+{
+    ((LWPeerContext *)peer)->socket = socket;
+}
+
+// adds hash to the tx hashes known to peer if add is true, returns true if hash was already known
+int LWPeerKnownTxTest(LWPeer *peer, UInt256 hash, int add)
+{
+    LWInvFilter *filter = &((LWPeerContext *)peer)->knownTxHashes;
+
+    return (add) ? ! _LWInvFilterAdd(filter, hash) : _LWInvFilterContains(filter, hash);
+}
@@ -8,25 +8,15 @@
 #include "LWTransaction.h"
 #include "LWMerkleBlock.h"
 #include "LWAddress.h"
+#include "LWLog.h"
 #include "LWInt.h"
 #include <stddef.h>
 #include <inttypes.h>
 
-#define peer_log(peer, ...) _peer_log("%s:%"PRIu16" " _va_first(__VA_ARGS__, NULL) "\n", LWPeerHost(peer),\
-                                      (peer)->port, _va_rest(__VA_ARGS__, NULL))
-#define _va_first(first, ...) first
-#define _va_rest(first, ...) __VA_ARGS__
-
-#if defined(TARGET_OS_MAC)
-#include <Foundation/Foundation.h>
-#define _peer_log(...) NSLog(__VA_ARGS__)
-#elif defined(__ANDROID__)
-#include <android/log.h>
-#define _peer_log(...) __android_log_print(ANDROID_LOG_INFO, "bread", __VA_ARGS__)
-#else
-#include <stdio.h>
-#define _peer_log(...) printf(__VA_ARGS__)
-#endif
+// logs a line prefixed with the peer's address, arguments are only evaluated if the level is enabled
+#define peer_log(peer, ...) peer_log_level(LW_LOG_INFO, peer, __VA_ARGS__)
+#define peer_debug(peer, ...) peer_log_level(LW_LOG_DEBUG, peer, __VA_ARGS__)
+#define peer_log_level(level, peer, ...) lw_log_host((level), LWPeerHost(peer), (peer)->port, __VA_ARGS__)
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +25,7 @@ extern "C" {
 #define SERVICES_NODE_NETWORK 0x01 // services value indicating a node carries full blocks, not just headers
 #define SERVICES_NODE_BLOOM   0x04 // BIP111: https://github.com/bitcoin/bips/blob/master/bip-0111.mediawiki
 #define SERVICES_NODE_BCASH   0x20 // https://github.com/Bitcoin-UAHF/spec/blob/master/uahf-technical-spec.md
+#define SERVICES_NODE_COMPACT_FILTERS 0x40 // BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
     
 #define LW_VERSION "0.1"
 #define USER_AGENT "/litewallet:" LW_VERSION "/"
@@ -62,6 +53,12 @@ extern "C" {
 #define MSG_ALERT       "alert"
 #define MSG_REJECT      "reject"   // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 #define MSG_FEEFILTER   "feefilter"// described in BIP133 https://github.com/bitcoin/bips/blob/master/bip-0133.mediawiki
+#define MSG_GETCFILTERS  "getcfilters" // described in BIP157 https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+#define MSG_CFILTER      "cfilter"
+#define MSG_GETCFHEADERS "getcfheaders"
+#define MSG_CFHEADERS    "cfheaders"
+#define MSG_GETCFCHECKPT "getcfcheckpt"
+#define MSG_CFCHECKPT    "cfcheckpt"
 
 #define REJECT_INVALID     0x10 // transaction is invalid for some reason (invalid signature, output value > input, etc)
 #define REJECT_SPENT       0x12 // an input is already spent
@@ -117,9 +114,43 @@ void LWPeerSetCallbacks(LWPeer *peer, void *info,
                         int (*networkIsReachable)(void *info),
                         void (*threadCleanup)(void *info));
 
+// int relayedBlockHashes(void *, const UInt256[], size_t) - called when an "inv" message with block hashes is received,
+// return true if the caller will request the blocks itself, otherwise peer sends getdata for them as usual
+void LWPeerSetBlockHashesCallback(LWPeer *peer,
+                                  int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount));
+
+// void headersDone(void *) - called in headers-first mode when a "headers" message has fewer than 2000 headers, after
+// each of them is passed to relayedBlock, meaning the peer has no more headers to send
+void LWPeerSetHeadersDoneCallback(LWPeer *peer, void (*headersDone)(void *info));
+
+// void relayedCompactFilter(void *, UInt256, const uint8_t *, size_t) - called when a "cfilter" message with a basic
+// filter for the block with the given hash is received
+// void relayedFilterHashes(void *, UInt256, UInt256, const UInt256[], size_t) - called when a "cfheaders" message is
+// received, with the stop hash, the filter header before the first filter, and the hashes of the filters in the range
+// void relayedFilterCheckpoints(void *, UInt256, const UInt256[], size_t) - called when a "cfcheckpt" message is
+// received, with the stop hash and the filter headers at every 1000th block height up to it
+// int blockTxMatches(void *, const LWTransaction *) - called for each tx in a full "block" message, the tx is relayed
+// with relayedTx if this returns true, and the block is relayed with relayedBlock as a merkle block of the matched tx
+void LWPeerSetCompactFilterCallbacks(LWPeer *peer,
+                                     void (*relayedCompactFilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                                  size_t filterLen),
+                                     void (*relayedFilterHashes)(void *info, UInt256 stopHash, UInt256 prevHeader,
+                                                                 const UInt256 filterHashes[], size_t hashesCount),
+                                     void (*relayedFilterCheckpoints)(void *info, UInt256 stopHash,
+                                                                      const UInt256 filterHeaders[], size_t count),
+                                     int (*blockTxMatches)(void *info, const LWTransaction *tx));
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void LWPeerSetEarliestKeyTime(LWPeer *peer, uint32_t earliestKeyTime);
 
+// set to true to keep requesting headers up to the peer's best block instead of switching to getblocks when headers
+// reach earliestKeyTime, blocks are then requested by the caller with getdata
+void LWPeerSetHeadersFirst(LWPeer *peer, int headersFirst);
+
+// sets the number of recent tx hashes remembered as known to peer (each uses 8 to 16 bytes in each of two generations),
+// known tx aren't announced to peer, call this before connecting
+void LWPeerSetKnownTxCapacity(LWPeer *peer, size_t capacity);
+
 // call this when local best block height changes (helps detect tarpit nodes)
 void LWPeerSetCurrentBlockHeight(LWPeer *peer, uint32_t currentBlockHeight);
 
@@ -159,13 +190,20 @@ double LWPeerPingTime(LWPeer *peer);
 // sends a bitcoin protocol message to peer
 void LWPeerSendMessage(LWPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void LWPeerSendFilterload(LWPeer *peer, const uint8_t *filter, size_t filterLen);
+void LWPeerSendFilteradd(LWPeer *peer, const uint8_t *data, size_t dataLen); // not sent unless a filter was loaded
 void LWPeerSendMempool(LWPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success));
 void LWPeerSendGetheaders(LWPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop);
+// requests just the header of blockHash, sent to the relayedBlock callback like other headers
+void LWPeerSendGetheader(LWPeer *peer, UInt256 blockHash);
 void LWPeerSendGetblocks(LWPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop);
 void LWPeerSendInv(LWPeer *peer, const UInt256 txHashes[], size_t txCount);
 void LWPeerSendGetdata(LWPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                        size_t blockCount);
+void LWPeerSendGetdataBlocks(LWPeer *peer, const UInt256 blockHashes[], size_t blockCount); // full blocks
+void LWPeerSendGetcfilters(LWPeer *peer, uint32_t startHeight, UInt256 stopHash);
+void LWPeerSendGetcfheaders(LWPeer *peer, uint32_t startHeight, UInt256 stopHash);
+void LWPeerSendGetcfcheckpt(LWPeer *peer, UInt256 stopHash);
 void LWPeerSendGetaddr(LWPeer *peer);
 void LWPeerSendPing(LWPeer *peer, void *info, void (*pongCallback)(void *info, int success));
 
@@ -4,8 +4,12 @@
 
 #include "LWPeerManager.h"
 #include "LWBloomFilter.h"
+#include "LWAddrManager.h"
+#include "LWTxRelays.h"
 #include "LWSet.h"
 #include "LWArray.h"
+#include "LWBlockFilter.h"
+#include "LWMetrics.h"
 #include "LWInt.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,18 +22,62 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/time.h>
 
 #define PROTOCOL_TIMEOUT      20.0
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define PEER_FLAG_DROPPED     0x04 // disconnected on purpose, not counted as a connect failure
+#define PEER_FLAG_STALEBLOCKS 0x08 // blocks relayed before the next pong were requested with an old filter
+#define PEER_FLAG_CFCHECKPT   0x10 // sent filter header checkpoints for the current header chain
+
+#define DOWNLOAD_CHUNK_MIN     10   // minimum number of blocks to request from a download peer at once
+#define DOWNLOAD_CHUNK_MAX     500  // maximum number of blocks to request from a download peer at once
+#define DOWNLOAD_CHUNK_TIME    2.0  // size requests to take about this many seconds at the peer's download rate
+#define DOWNLOAD_STALL_TIMEOUT 10.0 // reassign requested blocks if a peer hasn't delivered any for this long
+#define DOWNLOAD_MAX_AHEAD     5000 // in headers-first mode, don't request blocks further than this past the last block
+
+#define FILTER_BATCH           1000 // number of compact filters to request at once (the most getcfilters allows)
+#define FILTER_MAX_AHEAD       5000 // don't request compact filters further than this past the next one to match
+#define FILTER_CHECKPOINT_PEERS 2   // peers that must agree on the filter header checkpoints before filters are fetched
+#define FILTER_CHECKPOINT_INTERVAL 1000 // blocks between the filter headers in a cfcheckpt message
+
+#if PEER_MAX_CONNECTIONS_LIMIT > TX_RELAY_MAX_PEERS // so tx relays of connected peers are never forgotten for room
+#error "PEER_MAX_CONNECTIONS_LIMIT can't be more than TX_RELAY_MAX_PEERS"
+#endif
+
+#define ORPHAN_MAX_COUNT       10000          // most orphan blocks kept, more than are requested ahead during sync
+#define ORPHAN_MAX_BYTES       (16*1024*1024) // most memory used by orphan blocks
+#define ORPHAN_MAX_PEER        100            // most unrequested orphan blocks kept from any one peer
+#define ORPHAN_EXPIRY          (60*60)        // evict orphan blocks after this many seconds
+
+#define BLOOM_FILTER_ADD_MAX   500 // elements that can be added to a loaded filter with filteradd before it's rebuilt
+
+#define DNS_CACHE_TTL          (10*60) // reuse DNS seed lookup results for this many seconds
+#define DNS_TIMEOUT            30.0    // give up on DNS seeds that haven't answered after this many seconds
+
+#define BLOCK_TIME_WINDOW 2048 // number of recent chain block timestamps and targets kept for difficulty checks
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
+// a DNS seed lookup, shared by the thread running the resolver and the thread waiting for it, so the resolver can keep
+// running after the lookup times out or is cancelled
 typedef struct {
-    LWPeerManager *manager;
     const char *hostname;
+    void *info;
+    UInt128 *(*resolve)(void *info, const char *hostname);
+    UInt128 *addrList;
+    int isDone, isCancelled, refCount;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled when the resolver answers or the lookup is cancelled
+} LWDNSLookup;
+
+typedef struct {
+    LWPeerManager *manager;
+    LWDNSLookup *lookup;
     uint64_t services;
+    double timeout;
 } LWFindPeersInfo;
 
 typedef struct {
@@ -45,81 +93,40 @@ typedef struct {
 } LWPublishedTx;
 
 typedef struct {
-    UInt256 txHash;
-    LWPeer *peers;
-} LWTxPeerList;
-
-// true if peer is contained in the list of peers associated with txHash
-static int _LWTxPeerListHasPeer(const LWTxPeerList *list, UInt256 txHash, const LWPeer *peer)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
-
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (LWPeerEq(&list[i - 1].peers[j - 1], peer)) return 1;
-        }
-
-        break;
-    }
-
-    return 0;
-}
+    UInt256 blockHash;
+    uint8_t *filter;
+    size_t filterLen;
+} LWPendingFilter;
 
-// number of peers associated with txHash
-static size_t _LWTxPeerListCount(const LWTxPeerList *list, UInt256 txHash)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (UInt256Eq(list[i - 1].txHash, txHash)) return array_count(list[i - 1].peers);
-    }
-
-    return 0;
-}
-
-// adds peer to the list of peers associated with txHash and returns the new total number of peers
-static size_t _LWTxPeerListAddPeer(LWTxPeerList **list, UInt256 txHash, const LWPeer *peer)
-{
-    for (size_t i = array_count(*list); i > 0; i--) {
-        if (! UInt256Eq((*list)[i - 1].txHash, txHash)) continue;
-
-        for (size_t j = array_count((*list)[i - 1].peers); j > 0; j--) {
-            if (LWPeerEq(&(*list)[i - 1].peers[j - 1], peer)) return array_count((*list)[i - 1].peers);
-        }
-
-        array_add((*list)[i - 1].peers, *peer);
-        return array_count((*list)[i - 1].peers);
-    }
-
-    array_add(*list, ((LWTxPeerList) { txHash, NULL }));
-    array_new((*list)[array_count(*list) - 1].peers, PEER_MAX_CONNECTIONS);
-    array_add((*list)[array_count(*list) - 1].peers, *peer);
-    return 1;
-}
-
-// removes peer from the list of peers associated with txHash, returns true if peer was found
-static int _LWTxPeerListRemovePeer(LWTxPeerList *list, UInt256 txHash, const LWPeer *peer)
-{
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
-
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (! LWPeerEq(&list[i - 1].peers[j - 1], peer)) continue;
-            array_rm(list[i - 1].peers, j - 1);
-            return 1;
-        }
+typedef struct {
+    uint8_t script[64];
+    size_t scriptLen;
+} LWFilterScript;
 
-        break;
-    }
+typedef struct {
+    uint32_t height, timestamp, target;
+} LWBlockTime;
+
+typedef struct LWOrphanStruct {
+    UInt256 prevBlock; // orphans are indexed by prevBlock
+    LWMerkleBlock *block; // NULL once the orphan is removed from the pool
+    const LWPeer *peer; // peer that relayed the block without it being requested, for per peer quotas
+    size_t size;
+    time_t received;
+    struct LWOrphanStruct *sibling; // next orphan with the same prevBlock
+} LWOrphan;
 
-    return 0;
-}
+typedef struct {
+    const LWPeer *peer;
+    size_t count;
+} LWOrphanPeer;
 
-// comparator for sorting peers by timestamp, most recent first
-inline static int _peerTimestampCompare(const void *peer, const void *otherPeer)
-{
-    if (((const LWPeer *)peer)->timestamp < ((const LWPeer *)otherPeer)->timestamp) return 1;
-    if (((const LWPeer *)peer)->timestamp > ((const LWPeer *)otherPeer)->timestamp) return -1;
-    return 0;
-}
+typedef struct {
+    LWPeer *peer;
+    UInt256 *hashes; // requested block hashes that haven't been received yet, in chain order
+    double blockTime, stallTime; // time of the last received block (or first request), time of the last stall
+    double blockInterval; // moving average seconds per block
+} LWDownloadSlot;
 
 // returns a hash value for a block's prevBlock value suitable for use in a hashtable
 inline static size_t _LWPrevBlockHash(const void *block)
@@ -133,6 +140,19 @@ inline static int _LWPrevBlockEq(const void *block, const void *otherBlock)
     return UInt256Eq(((const LWMerkleBlock *)block)->prevBlock, ((const LWMerkleBlock *)otherBlock)->prevBlock);
 }
 
+// returns a hash value for an orphan's prevBlock value suitable for use in a hashtable
+inline static size_t _LWOrphanHash(const void *orphan)
+{
+    return (size_t)((const LWOrphan *)orphan)->prevBlock.u32[0];
+}
+
+// true if orphan and otherOrphan have equal prevBlock values
+inline static int _LWOrphanEq(const void *orphan, const void *otherOrphan)
+{
+    return (orphan == otherOrphan ||
+            UInt256Eq(((const LWOrphan *)orphan)->prevBlock, ((const LWOrphan *)otherOrphan)->prevBlock));
+}
+
 // returns a hash value for a block's height value suitable for use in a hashtable
 inline static size_t _LWBlockHeightHash(const void *block)
 {
@@ -150,36 +170,239 @@ struct LWPeerManagerStruct {
     const LWChainParams *params;
     LWWallet *wallet;
     int isConnected, connectFailureCount, misbehavinCount, dnsThreadCount, maxConnectCount;
-    LWPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
+    int connectCount; // number of peers to connect to when there's no fixed peer
+    size_t knownTxCapacity; // tx hashes each peer remembers as known, 0 for the LWPeer default
+    LWPeer *downloadPeer, fixedPeer, **connectedPeers;
+    LWAddrManager *addrs; // known peer addresses with their connection stats and bans
+    LWPeer *dnsPeers; // cached DNS seed lookup results
+    time_t dnsTime; // time of the last DNS seed lookup
+    LWDNSLookup **dnsLookups; // DNS seed lookups still being waited for
+    UInt128 *(*dnsResolve)(void *info, const char *hostname);
+    void *dnsInfo;
+    double dnsTimeout;
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     LWBloomFilter *bloomFilter;
+    size_t bloomFilterCapacity; // number of elements bloomFilter was sized for, not counting those peers add
     double fpRate, averageTxPerBlock;
-    LWSet *blocks, *orphans, *checkpoints;
-    LWMerkleBlock *lastBlock, *lastOrphan;
-    LWTxPeerList *txRelays, *txRequests;
+    LWSet *blocks, *orphans, *checkpoints; // orphans has the first orphan for each prevBlock, the rest are siblings
+    LWMerkleBlock *lastBlock;
+    UInt256 lastOrphan; // blockHash of the last orphan that getblocks was called for
+    LWOrphan **orphanList; // orphans in the order they were added, starting at orphanHead, for eviction
+    size_t orphanHead, orphanCount, orphanBytes;
+    LWOrphanPeer *orphanPeers;
+    LWMerkleBlock **chain; // main chain blocks indexed by height, from chainHeight up to lastBlock
+    uint32_t chainHeight;
+    LWHeaderStore *headerStore;
+    LWBlockTime blockTimes[BLOCK_TIME_WINDOW]; // timestamp and target of recent main chain blocks, indexed by height
+    LWBlockTime headerTimes[BLOCK_TIME_WINDOW]; // the same for the header chain, which runs ahead of the main chain
+    UInt256 windowStartHash; // header requested from the download peer to find the start of the next retarget window
+    LWTxRelays *txRelays; // peers that relayed each unconfirmed tx, and peers each tx was requested from
+    UInt256 *downloadQueue, *headerChain; // headerChain holds header hashes from height headerChainHeight onward
+    LWDownloadSlot *downloadSlots;
+    int headersFirst;
+    uint32_t headerChainHeight, fetchHeight; // fetchHeight is the next header chain height to queue for download
+    int compactFilters, filterSync; // filterSync is true while blocks are fetched by matching compact filters
+    LWMerkleBlock **headerBlocks; // with filterSync, the header chain blocks whose filters haven't been matched yet
+    UInt256 *filterHashes, filterHeader; // hashes of filters from height filterHashHeight on, and the last filter header
+    uint32_t filterHashHeight, filterHeight, matchHeight; // filterHeight is the next height to request filters from,
+    LWPendingFilter *pendingFilters;                      // and pendingFilters starts at matchHeight
+    UInt256 matchedBlock; // full block being downloaded because its filter matched
+    UInt256 *filterCheckpoints; // filter headers at every FILTER_CHECKPOINT_INTERVAL height, as sent by the first peer
+    size_t filterCheckpointPeers; // number of peers whose filter header checkpoints agree
+    LWFilterScript *filterScripts; // wallet scripts to match compact filters against
     LWPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
+    UInt256 *confirmedTxHashes; // tx confirmed by the blocks connected so far in a run, the wallet is updated once
+    uint32_t *confirmedTxHeights, *confirmedTxTimes; // for the whole run
     void *info;
     void (*syncStarted)(void *info);
     void (*syncStopped)(void *info, int error);
     void (*txStatusUpdate)(void *info);
     void (*saveBlocks)(void *info, int replace, LWMerkleBlock *blocks[], size_t blocksCount);
     void (*savePeers)(void *info, int replace, const LWPeer peers[], size_t peersCount);
+    void (*savePeerStats)(void *info, const uint8_t stats[], size_t statsLen);
     int (*networkIsReachable)(void *info);
     void (*threadCleanup)(void *info);
     pthread_mutex_t lock;
+    uint64_t lockTime; // when lock was last acquired, for measuring how long it's held
+    pthread_cond_t cond; // signaled when a DNS lookup finishes or a peer is removed from connectedPeers
 };
 
-static void _LWPeerManagerPeerMisbehavin(LWPeerManager *manager, LWPeer *peer)
+// locks manager, recording how long it took to acquire the lock
+static void _LWPeerManagerLock(LWPeerManager *manager)
+{
+    uint64_t start = LWMetricsTime();
+
+    pthread_mutex_lock(&manager->lock);
+    manager->lockTime = LWMetricsRecordSince(LWMetricTimerManagerLockWait, start);
+}
+
+// unlocks manager, recording how long the lock was held
+static void _LWPeerManagerUnlock(LWPeerManager *manager)
+{
+    LWMetricsRecordSince(LWMetricTimerManagerLockHold, manager->lockTime);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// returns the orphan count entry for peer, or if create is true, a new entry when there isn't one already
+static LWOrphanPeer *_LWPeerManagerOrphanPeer(LWPeerManager *manager, const LWPeer *peer, int create)
+{
+    for (size_t i = 0; peer && i < array_count(manager->orphanPeers); i++) {
+        if (manager->orphanPeers[i].peer == peer) return &manager->orphanPeers[i];
+    }
+
+    if (! peer || ! create) return NULL;
+    array_add(manager->orphanPeers, ((LWOrphanPeer) { peer, 0 }));
+    return &manager->orphanPeers[array_count(manager->orphanPeers) - 1];
+}
+
+// removes orphan from the pool and returns its block, the entry is freed when it reaches the front of orphanList
+static LWMerkleBlock *_LWPeerManagerRemoveOrphan(LWPeerManager *manager, LWOrphan *orphan)
+{
+    LWOrphan *o = LWSetGet(manager->orphans, orphan);
+    LWOrphanPeer *p = _LWPeerManagerOrphanPeer(manager, orphan->peer, 0);
+    LWMerkleBlock *block = orphan->block;
+
+    if (o == orphan) { // orphan is indexed, its next sibling takes its place
+        LWSetRemove(manager->orphans, orphan);
+        if (orphan->sibling) LWSetAdd(manager->orphans, orphan->sibling);
+    }
+    else {
+        while (o && o->sibling != orphan) o = o->sibling;
+        if (o) o->sibling = orphan->sibling;
+    }
+
+    if (p && --p->count == 0) array_rm(manager->orphanPeers, (size_t)(p - manager->orphanPeers));
+    manager->orphanCount--;
+    manager->orphanBytes -= orphan->size;
+    orphan->block = NULL;
+    orphan->sibling = NULL;
+    return block;
+}
+
+// removes expired orphans, then the oldest ones until there's room for another orphan of the given size
+static void _LWPeerManagerEvictOrphans(LWPeerManager *manager, size_t size)
+{
+    time_t now = time(NULL);
+
+    // entries with no block were already removed from the pool
+    while (manager->orphanHead < array_count(manager->orphanList)) {
+        LWOrphan *o = manager->orphanList[manager->orphanHead];
+
+        if (o->block && o->received + ORPHAN_EXPIRY >= now && manager->orphanCount < ORPHAN_MAX_COUNT &&
+            manager->orphanBytes + size <= ORPHAN_MAX_BYTES) break;
+        if (o->block) LWMerkleBlockFree(_LWPeerManagerRemoveOrphan(manager, o));
+        free(o);
+        manager->orphanHead++;
+    }
+
+    if (manager->orphanHead > 0x400 && manager->orphanHead > array_count(manager->orphanList)/2) {
+        array_rm_range(manager->orphanList, 0, manager->orphanHead);
+        manager->orphanHead = 0;
+    }
+}
+
+// adds block to the orphan pool, peer is the peer that relayed it without it being requested, otherwise NULL
+// returns false if the block is already in the pool or peer has too many orphans, in which case the caller frees block
+static int _LWPeerManagerAddOrphan(LWPeerManager *manager, LWMerkleBlock *block, const LWPeer *peer)
 {
-    for (size_t i = array_count(manager->peers); i > 0; i--) {
-        if (LWPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
+    LWOrphan *orphan, *o = LWSetGet(manager->orphans, &(LWOrphan) { .prevBlock = block->prevBlock });
+    LWOrphanPeer *p = _LWPeerManagerOrphanPeer(manager, peer, 0);
+    size_t size = sizeof(*block) + block->hashesCount*sizeof(UInt256) + block->flagsLen;
+
+    while (o && ! UInt256Eq(o->block->blockHash, block->blockHash)) o = o->sibling;
+    if (o || (p && p->count >= ORPHAN_MAX_PEER) || size > ORPHAN_MAX_BYTES) return 0;
+    _LWPeerManagerEvictOrphans(manager, size);
+    orphan = calloc(1, sizeof(*orphan));
+    assert(orphan != NULL);
+    orphan->prevBlock = block->prevBlock;
+    orphan->block = block;
+    orphan->peer = peer;
+    orphan->size = size;
+    orphan->received = time(NULL);
+    o = LWSetGet(manager->orphans, orphan);
+
+    if (o) { // keep competing orphans with the same prevBlock as siblings
+        orphan->sibling = o->sibling;
+        o->sibling = orphan;
+    }
+    else LWSetAdd(manager->orphans, orphan);
+
+    array_add(manager->orphanList, orphan);
+    p = _LWPeerManagerOrphanPeer(manager, peer, 1); // eviction may have moved or removed the entry
+    if (p) p->count++;
+    manager->orphanCount++;
+    manager->orphanBytes += size;
+    return 1;
+}
+
+// removes block from the orphan pool if it's there
+static void _LWPeerManagerRemoveOrphanBlock(LWPeerManager *manager, const LWMerkleBlock *block)
+{
+    LWOrphan *o = LWSetGet(manager->orphans, &(LWOrphan) { .prevBlock = block->prevBlock });
+
+    while (o && o->block != block) o = o->sibling;
+    if (o) _LWPeerManagerRemoveOrphan(manager, o);
+}
+
+// removes the orphans whose previous block is the block with blockHash from the pool and adds them to blocks
+static void _LWPeerManagerTakeOrphans(LWPeerManager *manager, UInt256 blockHash, LWMerkleBlock ***blocks)
+{
+    LWOrphan *o = LWSetGet(manager->orphans, &(LWOrphan) { .prevBlock = blockHash }), *next;
+
+    for (; o; o = next) {
+        next = o->sibling;
+        array_add(*blocks, _LWPeerManagerRemoveOrphan(manager, o));
+    }
+}
+
+// frees all orphans
+static void _LWPeerManagerClearOrphans(LWPeerManager *manager)
+{
+    for (size_t i = manager->orphanHead; i < array_count(manager->orphanList); i++) {
+        if (manager->orphanList[i]->block) LWMerkleBlockFree(manager->orphanList[i]->block);
+        free(manager->orphanList[i]);
     }
 
+    LWSetClear(manager->orphans);
+    array_clear(manager->orphanList);
+    array_clear(manager->orphanPeers);
+    manager->orphanHead = manager->orphanCount = manager->orphanBytes = 0;
+    manager->lastOrphan = UINT256_ZERO;
+}
+
+// stops counting peer's orphans against its quota, they stay in the pool until they're connected or evicted
+static void _LWPeerManagerRemoveOrphanPeer(LWPeerManager *manager, const LWPeer *peer)
+{
+    LWOrphanPeer *p = _LWPeerManagerOrphanPeer(manager, peer, 0);
+
+    for (size_t i = manager->orphanHead; p && i < array_count(manager->orphanList); i++) {
+        if (manager->orphanList[i]->peer == peer) manager->orphanList[i]->peer = NULL;
+    }
+
+    if (p) array_rm(manager->orphanPeers, (size_t)(p - manager->orphanPeers));
+}
+
+// returns the serialized connection stats and bans of known peers, which must be freed by the caller
+static uint8_t *_LWPeerManagerPeerStats(LWPeerManager *manager, size_t *statsLen)
+{
+    time_t now = time(NULL);
+    size_t len = LWAddrManagerSerialize(manager->addrs, NULL, 0, now);
+    uint8_t *stats = malloc(len);
+
+    assert(stats != NULL);
+    *statsLen = LWAddrManagerSerialize(manager->addrs, stats, len, now);
+    return stats;
+}
+
+static void _LWPeerManagerPeerMisbehavin(LWPeerManager *manager, LWPeer *peer)
+{
+    LWAddrManagerMisbehaving(manager->addrs, peer, ADDR_BAN_SCORE, time(NULL));
+
     if (++manager->misbehavinCount >= 10) { // clear out stored peers so we get a fresh list from DNS for next connect
         manager->misbehavinCount = 0;
-        array_clear(manager->peers);
+        LWAddrManagerClear(manager->addrs); // bans are kept
     }
 
     LWPeerDisconnect(peer);
@@ -218,20 +441,195 @@ static void _LWPeerManagerAddTxToPublishList(LWPeerManager *manager, LWTransacti
     }
 }
 
+// records the timestamp and target of the block at height in times for verifying difficulty transitions
+inline static void _LWBlockTimeSet(LWBlockTime times[], uint32_t height, uint32_t timestamp, uint32_t target)
+{
+    times[height % BLOCK_TIME_WINDOW] = (LWBlockTime) { height, timestamp, target };
+}
+
+// returns the timestamp and target of the block at height in times, or NULL if it's not in the window
+inline static const LWBlockTime *_LWBlockTimeGet(const LWBlockTime times[], uint32_t height)
+{
+    const LWBlockTime *t = &times[height % BLOCK_TIME_WINDOW];
+
+    return (t->height == height && t->timestamp != 0) ? t : NULL;
+}
+
+// returns the timestamp and target of the block at height along the header chain, which continues the main chain
+// from headerChainHeight, or NULL if it's not in the window
+inline static const LWBlockTime *_LWPeerManagerHeaderTime(const LWPeerManager *manager, uint32_t height)
+{
+    if (array_count(manager->headerChain) > 0 && height >= manager->headerChainHeight) {
+        return _LWBlockTimeGet(manager->headerTimes, height);
+    }
+
+    return _LWBlockTimeGet(manager->blockTimes, height);
+}
+
+// height of the first block in the retarget window for the difficulty transition at height, litecoin windows start
+// one block before the previous transition so the timespan covers all 2016 block intervals, except for the first one
+inline static uint32_t _LWRetargetWindowStart(uint32_t height)
+{
+    return (height > BLOCK_DIFFICULTY_INTERVAL) ? height - BLOCK_DIFFICULTY_INTERVAL - 1 : 0;
+}
+
+// true if block is in the main chain index
+inline static int _LWPeerManagerChainContains(const LWPeerManager *manager, const LWMerkleBlock *block)
+{
+    size_t i = block->height - manager->chainHeight;
+
+    return (block->height >= manager->chainHeight && i < array_count(manager->chain) && manager->chain[i] == block);
+}
+
+// returns the ancestor of block at the given height, or NULL if it isn't in memory, the lookup is a single array index
+// once the walk back from block reaches the main chain index
+static LWMerkleBlock *_LWPeerManagerAncestor(const LWPeerManager *manager, LWMerkleBlock *block, uint32_t height)
+{
+    while (block && block->height > height) {
+        if (height >= manager->chainHeight && _LWPeerManagerChainContains(manager, block)) {
+            return manager->chain[height - manager->chainHeight];
+        }
+
+        block = LWSetGet(manager->blocks, &block->prevBlock);
+    }
+
+    return (block && block->height == height) ? block : NULL;
+}
+
+// returns the most recent block that's in both block's chain and the main chain, or NULL if none is in memory
+static LWMerkleBlock *_LWPeerManagerChainJoin(const LWPeerManager *manager, LWMerkleBlock *block)
+{
+    LWMerkleBlock *b = block, *b2;
+
+    while (b && b->height >= manager->chainHeight && ! _LWPeerManagerChainContains(manager, b)) {
+        b = LWSetGet(manager->blocks, &b->prevBlock);
+    }
+
+    b2 = (b) ? _LWPeerManagerAncestor(manager, manager->lastBlock, b->height) : NULL;
+
+    while (b && b2 && b != b2 && ! LWMerkleBlockEq(b, b2)) { // below the index, walk back both chains together
+        b = LWSetGet(manager->blocks, &b->prevBlock);
+        b2 = LWSetGet(manager->blocks, &b2->prevBlock);
+    }
+
+    return (b && b2) ? b : NULL;
+}
+
+// sets lastBlock and moves the main chain index to follow it, either extending it, truncating it back to where
+// block's branch joins it, or rebuilding it from the blocks in memory if block doesn't connect to it at all
+static void _LWPeerManagerSetLastBlock(LWPeerManager *manager, LWMerkleBlock *block)
+{
+    LWMerkleBlock *b = block, *last = block;
+    size_t count;
+
+    while (b && ! _LWPeerManagerChainContains(manager, b)) { // walk back to the index, or as far as blocks go
+        last = b;
+        b = LWSetGet(manager->blocks, &b->prevBlock);
+    }
+
+    if (! b) { // block doesn't connect to the index, start a new one from the oldest connected block
+        array_clear(manager->chain);
+        manager->chainHeight = last->height;
+    }
+
+    count = (b) ? b->height + 1 - manager->chainHeight : 0; // entries up to the join point are already in place
+    array_set_count(manager->chain, block->height + 1 - manager->chainHeight);
+
+    for (b = block; b && b->height >= manager->chainHeight + count;) {
+        manager->chain[b->height - manager->chainHeight] = b;
+        b = (b->height > manager->chainHeight) ? LWSetGet(manager->blocks, &b->prevBlock) : NULL;
+    }
+
+    // record the timestamps and targets of the newly indexed blocks in the difficulty window, oldest first
+    if (count + BLOCK_TIME_WINDOW < array_count(manager->chain)) {
+        count = array_count(manager->chain) - BLOCK_TIME_WINDOW;
+    }
+
+    for (; count < array_count(manager->chain); count++) {
+        b = manager->chain[count];
+        _LWBlockTimeSet(manager->blockTimes, b->height, b->timestamp, b->target);
+    }
+
+    manager->lastBlock = block;
+}
+
+// drops main chain index entries below height, the blocks themselves are left as is
+static void _LWPeerManagerTrimChain(LWPeerManager *manager, uint32_t height)
+{
+    size_t count = array_count(manager->chain);
+
+    if (height > manager->chainHeight) {
+        if (height - manager->chainHeight < count) count = height - manager->chainHeight;
+        array_rm_range(manager->chain, 0, count);
+        manager->chainHeight = height;
+    }
+}
+
+// makes sure the block that starts the retarget window of the next difficulty transition is recorded, it's the block
+// before the last transition, which is below the main chain index when the chain starts there, as it does from a
+// checkpoint or from saved blocks, returns the hash of the header that has to be requested from a peer to find it, or
+// UINT256_ZERO if none is needed
+static UInt256 _LWPeerManagerWindowStart(LWPeerManager *manager)
+{
+    uint32_t height = manager->lastBlock->height - manager->lastBlock->height % BLOCK_DIFFICULTY_INTERVAL;
+    LWMerkleBlock *b = (height > 0) ? _LWPeerManagerAncestor(manager, manager->lastBlock, height) : NULL, *start;
+
+    // the first retarget window starts at the genesis block, and transitions that are no longer in memory can't help
+    if (! b || _LWBlockTimeGet(manager->blockTimes, height - 1)) return UINT256_ZERO;
+    if (UInt256IsZero(b->prevBlock)) return b->blockHash; // a checkpoint, its header is needed to know prevBlock
+    start = LWSetGet(manager->blocks, &b->prevBlock);
+    if (! start) return b->prevBlock;
+
+    start->height = height - 1;
+    _LWBlockTimeSet(manager->blockTimes, start->height, start->timestamp, start->target);
+
+    if (manager->chainHeight == height && array_count(manager->chain) > 0 && manager->chain[0] == b) {
+        array_insert(manager->chain, 0, start); // index it so it's saved and stored along with the transition
+        manager->chainHeight = start->height;
+    }
+
+    return UINT256_ZERO;
+}
+
+// appends the main chain blocks that aren't in the header store yet, replacing any stored blocks that are on a fork
+static void _LWPeerManagerStoreChain(LWPeerManager *manager)
+{
+    uint32_t height = manager->lastBlock->height + 1;
+    UInt256 hash = manager->lastBlock->blockHash; // hash of the main chain block at height - 1
+    int stored;
+
+    // walk back to the most recent main chain block that's already stored
+    while (! (stored = (! UInt256IsZero(hash) &&
+                        UInt256Eq(LWHeaderStoreBlockHash(manager->headerStore, height - 1), hash))) &&
+           height > manager->chainHeight) {
+        height--;
+        hash = manager->chain[height - manager->chainHeight]->prevBlock;
+    }
+
+    // a new store has to start at a difficulty transition, or at the block before one that starts the next retarget
+    // window, so the chain loaded from it can verify the next transition
+    if (! stored && (height + 1) % BLOCK_DIFFICULTY_INTERVAL > 1) {
+        height += BLOCK_DIFFICULTY_INTERVAL - 1 - height % BLOCK_DIFFICULTY_INTERVAL;
+    }
+
+    if (height <= manager->lastBlock->height &&
+        ! LWHeaderStoreAdd(manager->headerStore, &manager->chain[height - manager->chainHeight],
+                           manager->lastBlock->height + 1 - height)) {
+        lw_log(LW_LOG_ERROR, "failed to write blocks to header store: %s", strerror(errno));
+    }
+}
+
 static size_t _LWPeerManagerBlockLocators(LWPeerManager *manager, UInt256 locators[], size_t locatorsCount)
 {
     // append 10 most recent block hashes, decending, then continue appending, doubling the step back each time,
     // finishing with the genesis block (top, -1, -2, -3, -4, -5, -6, -7, -8, -9, -11, -15, -23, -39, -71, -135, ..., 0)
     LWMerkleBlock *block = manager->lastBlock;
-    int32_t step = 1, i = 0, j;
+    int32_t step = 1, i = 0;
 
     while (block && block->height > 0) {
         if (locators && i < locatorsCount) locators[i] = block->blockHash;
         if (++i >= 10) step *= 2;
-
-        for (j = 0; block && j < step; j++) {
-            block = LWSetGet(manager->blocks, &block->prevBlock);
-        }
+        block = (block->height > (uint32_t)step) ? _LWPeerManagerAncestor(manager, block, block->height - step) : NULL;
     }
     
     if (locators && i < locatorsCount) locators[i] = genesis_block_hash(manager->params);
@@ -245,17 +643,18 @@ static void _setApplyFreeBlock(void *info, void *block)
 
 static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
 {
+    uint64_t start = LWMetricsTime();
+
     // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
     // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
     // wallet transaction is encountered during the chain sync
     LWWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
     LWWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
 
-    LWSetApply(manager->orphans, NULL, _setApplyFreeBlock);
-    LWSetClear(manager->orphans); // clear out orphans that may have been received on an old filter
-    manager->lastOrphan = NULL;
+    _LWPeerManagerClearOrphans(manager); // clear out orphans that may have been received on an old filter
     manager->filterUpdateHeight = manager->lastBlock->height;
     manager->fpRate = BLOOM_REDUCED_FALSEPOSITIVE_RATE;
+    LWMetricsSetGauge(LWMetricGaugeFpRate, manager->fpRate);
 
     size_t addrsCount = LWWalletAllAddrs(manager->wallet, NULL, 0);
     LWAddress *addrs = malloc(addrsCount*sizeof(*addrs));
@@ -272,15 +671,18 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
     addrsCount = LWWalletAllAddrs(manager->wallet, addrs, addrsCount);
     utxosCount = LWWalletUTXOs(manager->wallet, utxos, utxosCount);
     txCount = LWWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
-    filter = LWBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)LWPeerHash(peer),
+    // leave room for elements added later with filteradd, and 100 more for outputs the peer adds to the filter
+    manager->bloomFilterCapacity = addrsCount + utxosCount + txCount + BLOOM_FILTER_ADD_MAX;
+    filter = LWBloomFilterNew(manager->fpRate, manager->bloomFilterCapacity + 100, (uint32_t)LWPeerHash(peer),
                               BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
 
+    // elements are unique, so they're inserted without checking the filter first, which would double the hashing
     for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
         UInt160 hash = UINT160_ZERO;
 
         LWAddressHash160(&hash, addrs[i].s);
 
-        if (! UInt160IsZero(hash) && ! LWBloomFilterContainsData(filter, hash.u8, sizeof(hash))) {
+        if (! UInt160IsZero(hash)) {
             LWBloomFilterInsertData(filter, hash.u8, sizeof(hash));
         }
     }
@@ -292,7 +694,7 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
 
         UInt256Set(o, utxos[i].hash);
         UInt32SetLE(&o[sizeof(UInt256)], utxos[i].n);
-        if (! LWBloomFilterContainsData(filter, o, sizeof(o))) LWBloomFilterInsertData(filter, o, sizeof(o));
+        LWBloomFilterInsertData(filter, o, sizeof(o));
     }
 
     free(utxos);
@@ -307,20 +709,433 @@ static void _LWPeerManagerLoadBloomFilter(LWPeerManager *manager, LWPeer *peer)
                 LWWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
                 UInt256Set(o, input->txHash);
                 UInt32SetLE(&o[sizeof(UInt256)], input->index);
-                if (! LWBloomFilterContainsData(filter, o, sizeof(o))) LWBloomFilterInsertData(filter, o,sizeof(o));
+                LWBloomFilterInsertData(filter, o, sizeof(o));
             }
         }
     }
 
-    free(transactions);
-    if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
-    manager->bloomFilter = filter;
-    // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+    free(transactions);
+    if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
+    manager->bloomFilter = filter;
+    // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+
+    uint8_t data[LWBloomFilterSerialize(filter, NULL, 0)];
+    size_t len = LWBloomFilterSerialize(filter, data, sizeof(data));
+
+    LWPeerSendFilterload(peer, data, len);
+    LWMetricsRecordSince(LWMetricTimerBloomRebuild, start);
+    LWMetricsCount(LWMetricCounterBloomRebuilds, 1);
+}
+
+// adds unused wallet addresses that are missing from the bloom filter to it, and with filteradd to the filters that
+// connected peers have loaded, so they don't need to be reloaded
+// returns false if the filter would exceed its element budget and has to be rebuilt instead
+static int _LWPeerManagerExtendBloomFilter(LWPeerManager *manager)
+{
+    LWAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 200];
+    UInt160 hashes[sizeof(addrs)/sizeof(*addrs)];
+    size_t i, j, addrsCount, count = 0;
+
+    // generate the same spare addresses that a full filter load does
+    addrsCount = LWWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+    addrsCount += LWWalletUnusedAddrs(manager->wallet, &addrs[addrsCount], SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+
+    for (i = 0; i < addrsCount; i++) {
+        if (LWAddressHash160(&hashes[count], addrs[i].s) &&
+            ! LWBloomFilterContainsData(manager->bloomFilter, hashes[count].u8, sizeof(*hashes))) count++;
+    }
+
+    if (manager->bloomFilter->elemCount + count > manager->bloomFilterCapacity) return 0;
+    lw_log(LW_LOG_INFO, "adding %zu new wallet addresses to bloom filters", count);
+
+    for (i = 0; i < count; i++) {
+        LWBloomFilterInsertData(manager->bloomFilter, hashes[i].u8, sizeof(*hashes));
+
+        for (j = array_count(manager->connectedPeers); j > 0; j--) {
+            if (LWPeerConnectStatus(manager->connectedPeers[j - 1]) != LWPeerStatusConnected) continue;
+            LWPeerSendFilteradd(manager->connectedPeers[j - 1], hashes[i].u8, sizeof(*hashes));
+        }
+    }
+
+    return 1;
+}
+
+static double _LWTimeNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+static LWDownloadSlot *_LWPeerManagerDownloadSlot(LWPeerManager *manager, const LWPeer *peer)
+{
+    for (size_t i = array_count(manager->downloadSlots); i > 0; i--) {
+        if (manager->downloadSlots[i - 1].peer == peer) return &manager->downloadSlots[i - 1];
+    }
+
+    return NULL;
+}
+
+// sends the current bloom filter to peer and adds it to the peers that chain blocks are downloaded from in parallel
+static void _LWPeerManagerAddDownloadPeer(LWPeerManager *manager, LWPeer *peer)
+{
+    LWDownloadSlot slot = { peer, NULL, 0, 0, DOWNLOAD_CHUNK_TIME/DOWNLOAD_CHUNK_MIN };
+
+    if (! _LWPeerManagerDownloadSlot(manager, peer) && manager->bloomFilter) {
+        if (peer != manager->downloadPeer) { // download peer loads its own filter
+            uint8_t data[LWBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+            size_t len = LWBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
+
+            LWPeerSendFilterload(peer, data, len);
+            LWPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
+        }
+
+        array_new(slot.hashes, DOWNLOAD_CHUNK_MAX);
+        array_add(manager->downloadSlots, slot);
+    }
+}
+
+// removes peer from the parallel download peers and returns its outstanding requests to the front of the queue
+static void _LWPeerManagerRemoveDownloadPeer(LWPeerManager *manager, const LWPeer *peer)
+{
+    for (size_t i = array_count(manager->downloadSlots); i > 0; i--) {
+        LWDownloadSlot *slot = &manager->downloadSlots[i - 1];
+
+        if (slot->peer != peer) continue;
+        array_insert_array(manager->downloadQueue, 0, slot->hashes, array_count(slot->hashes));
+        array_free(slot->hashes);
+        array_rm(manager->downloadSlots, i - 1);
+        break;
+    }
+}
+
+// leaves compact filter mode, the header chain blocks are then fetched as merkle blocks from fetchHeight on
+static void _LWPeerManagerStopFilterSync(LWPeerManager *manager)
+{
+    for (size_t i = array_count(manager->headerBlocks); i > 0; i--) {
+        if (manager->headerBlocks[i - 1]) LWMerkleBlockFree(manager->headerBlocks[i - 1]);
+    }
+
+    array_clear(manager->headerBlocks);
+    for (size_t i = array_count(manager->pendingFilters); i > 0; i--) free(manager->pendingFilters[i - 1].filter);
+    array_clear(manager->pendingFilters);
+    array_clear(manager->filterHashes);
+    array_clear(manager->filterCheckpoints);
+    manager->filterSync = 0;
+    manager->filterHashHeight = manager->filterHeight = manager->matchHeight = 0;
+    manager->filterHeader = manager->matchedBlock = UINT256_ZERO;
+    manager->filterCheckpointPeers = 0;
+}
+
+// drops all queued and outstanding parallel block requests, if removePeers is true also drops the download peers
+// and the header chain
+static void _LWPeerManagerResetDownloads(LWPeerManager *manager, int removePeers)
+{
+    array_clear(manager->downloadQueue);
+
+    if (removePeers) {
+        array_clear(manager->headerChain);
+        manager->headerChainHeight = manager->fetchHeight = 0;
+        _LWPeerManagerStopFilterSync(manager);
+    }
+
+    for (size_t i = array_count(manager->downloadSlots); i > 0; i--) {
+        if (removePeers) array_free(manager->downloadSlots[i - 1].hashes);
+        else array_clear(manager->downloadSlots[i - 1].hashes);
+    }
+
+    if (removePeers) array_clear(manager->downloadSlots);
+}
+
+// number of blocks to request from a download peer at once, based on its download rate and round trip time
+static size_t _LWDownloadChunkSize(const LWDownloadSlot *slot)
+{
+    double window = DOWNLOAD_CHUNK_TIME, rtt = LWPeerPingTime(slot->peer), chunk;
+
+    // the next request goes out when half the current one is left, so a window must last at least two round trips
+    if (rtt < DOWNLOAD_STALL_TIMEOUT && 2*rtt > window) window = 2*rtt;
+    chunk = window/slot->blockInterval;
+
+    if (chunk < DOWNLOAD_CHUNK_MIN) chunk = DOWNLOAD_CHUNK_MIN;
+    if (chunk > DOWNLOAD_CHUNK_MAX) chunk = DOWNLOAD_CHUNK_MAX;
+    return (size_t)chunk;
+}
+
+// hands out queued block requests to download peers that are running low on outstanding requests, fastest first
+static void _LWPeerManagerScheduleDownloads(LWPeerManager *manager)
+{
+    double now = _LWTimeNow();
+    size_t i, count = array_count(manager->downloadSlots), chunk, pending = array_count(manager->downloadQueue);
+    LWDownloadSlot *slot, *s;
+
+    for (i = 0; count > 1 && i < count; i++) { // return requests from stalled peers to the queue
+        slot = &manager->downloadSlots[i];
+        if (array_count(slot->hashes) == 0 || slot->blockTime + DOWNLOAD_STALL_TIMEOUT > now) continue;
+        peer_log(slot->peer, "block download stalled, reassigning %zu block(s)", array_count(slot->hashes));
+        array_insert_array(manager->downloadQueue, 0, slot->hashes, array_count(slot->hashes));
+        array_clear(slot->hashes);
+        slot->stallTime = now;
+        slot->blockInterval *= 2;
+    }
+
+    if (manager->fetchHeight > 0) { // headers-first mode, queue blocks from the header chain
+        uint32_t end = manager->headerChainHeight + (uint32_t)array_count(manager->headerChain),
+                 next = manager->lastBlock->height + 1;
+
+        for (i = 0; i < count; i++) pending += array_count(manager->downloadSlots[i].hashes);
+
+        // if nothing is left in flight but the next block is still missing, it was lost (possibly dropped during a
+        // filter update or sent by a misbehaving peer), so request it again
+        if (pending == 0 && next < manager->fetchHeight && next >= manager->headerChainHeight && next < end &&
+            ! LWSetContains(manager->orphans, &(LWOrphan) { .prevBlock = manager->lastBlock->blockHash })) {
+            lw_log(LW_LOG_INFO, "re-requesting missing block #%"PRIu32, next);
+            array_add(manager->downloadQueue, manager->headerChain[next - manager->headerChainHeight]);
+        }
+
+        while (manager->fetchHeight < end && manager->fetchHeight < next + DOWNLOAD_MAX_AHEAD) {
+            array_add(manager->downloadQueue, manager->headerChain[manager->fetchHeight - manager->headerChainHeight]);
+            manager->fetchHeight++;
+        }
+    }
+
+    while (array_count(manager->downloadQueue) > 0) {
+        int stalled = 1;
+
+        for (i = 0, slot = NULL; i < count; i++) { // pick the fastest peer, avoiding peers that recently stalled
+            s = &manager->downloadSlots[i];
+
+            // keep a second request in flight once the first is half done, so peers aren't left idle for a round trip
+            if (array_count(s->hashes) > _LWDownloadChunkSize(s)/2 ||
+                LWPeerConnectStatus(s->peer) != LWPeerStatusConnected) continue;
+
+            if (! slot || (stalled && s->stallTime + DOWNLOAD_STALL_TIMEOUT <= now) ||
+                (stalled == (s->stallTime + DOWNLOAD_STALL_TIMEOUT > now) && s->blockInterval < slot->blockInterval)) {
+                slot = s;
+                stalled = (s->stallTime + DOWNLOAD_STALL_TIMEOUT > now);
+            }
+        }
+
+        if (! slot) break;
+        chunk = _LWDownloadChunkSize(slot);
+        if (chunk > array_count(manager->downloadQueue)) chunk = array_count(manager->downloadQueue);
+        if (array_count(slot->hashes) == 0) slot->blockTime = now;
+        LWPeerSendGetdata(slot->peer, NULL, 0, manager->downloadQueue, chunk);
+        array_add_array(slot->hashes, manager->downloadQueue, chunk);
+        array_rm_range(manager->downloadQueue, 0, chunk);
+    }
+}
+
+// removes a received block from the outstanding parallel requests, returns true if the block was requested that way
+static int _LWPeerManagerDownloadReceived(LWPeerManager *manager, const LWPeer *peer, UInt256 blockHash)
+{
+    double now = _LWTimeNow();
+    size_t i, j;
+    int r = 0;
+
+    for (i = array_count(manager->downloadSlots); ! r && i > 0; i--) {
+        LWDownloadSlot *slot = &manager->downloadSlots[i - 1];
+
+        for (j = 0; ! r && j < array_count(slot->hashes); j++) {
+            if (! UInt256Eq(slot->hashes[j], blockHash)) continue;
+            array_rm(slot->hashes, j);
+            r = 1;
+        }
+
+        if (r && slot->peer == peer) { // update moving average download rate
+            if (now > slot->blockTime) slot->blockInterval = slot->blockInterval*0.9 + (now - slot->blockTime)*0.1;
+            slot->blockTime = now;
+            LWAddrManagerSetThroughput(manager->addrs, peer, 1.0/slot->blockInterval);
+        }
+    }
+
+    for (i = array_count(manager->downloadQueue); ! r && i > 0; i--) { // block was reassigned but arrived anyway
+        if (! UInt256Eq(manager->downloadQueue[i - 1], blockHash)) continue;
+        array_rm(manager->downloadQueue, i - 1);
+        r = 1;
+    }
+
+    return r;
+}
+
+// in headers-first mode, appends a header newer than earliestKeyTime to the header chain
+// returns true if the header extends the header chain and matches any checkpoint at its height
+static int _LWPeerManagerAddHeader(LWPeerManager *manager, LWPeer *peer, const LWMerkleBlock *header)
+{
+    size_t count = array_count(manager->headerChain);
+    UInt256 tip = (count > 0) ? manager->headerChain[count - 1] : manager->lastBlock->blockHash;
+    LWMerkleBlock query, *checkpoint, block = *header, prev;
+    const LWBlockTime *t, *start;
+    int r = 1;
+
+    query.height = (count > 0) ? manager->headerChainHeight + (uint32_t)count : manager->lastBlock->height + 1;
+    checkpoint = LWSetGet(manager->checkpoints, &query);
+
+    // the header chain only has hashes, so the difficulty is verified using the recorded timestamps and targets
+    t = _LWPeerManagerHeaderTime(manager, query.height - 1);
+    start = _LWPeerManagerHeaderTime(manager, _LWRetargetWindowStart(query.height));
+    block.height = query.height;
+    prev = (LWMerkleBlock) { .blockHash = tip, .height = query.height - 1, .timestamp = (t) ? t->timestamp : 0,
+                             .target = (t) ? t->target : 0 };
+
+    if (! UInt256Eq(header->prevBlock, tip)) {
+        peer_log(peer, "header %s doesn't extend header chain at height %"PRIu32, u256hex(header->blockHash),
+                 query.height - 1);
+        r = 0;
+    }
+    else if (checkpoint && ! UInt256Eq(checkpoint->blockHash, header->blockHash)) {
+        peer_log(peer, "relayed a header that differs from the checkpoint at height %"PRIu32", blockHash: %s, "
+                 "expected: %s", query.height, u256hex(header->blockHash), u256hex(checkpoint->blockHash));
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+        r = 0;
+    }
+    else if (! t) {
+        peer_log(peer, "missing previous header at height %"PRIu32", can't verify header difficulty", query.height - 1);
+        r = 0;
+    }
+    else if ((query.height % BLOCK_DIFFICULTY_INTERVAL) == 0 && ! start) {
+        peer_log(peer, "missing start of retarget window at height %"PRIu32", can't verify header difficulty",
+                 _LWRetargetWindowStart(query.height));
+        r = 0;
+    }
+    else if (! manager->params->verifyDifficulty(&block, &prev, (start) ? start->timestamp : 0)) {
+        peer_log(peer, "relayed header with invalid difficulty target %x, blockHash: %s", header->target,
+                 u256hex(header->blockHash));
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+        r = 0;
+    }
+    else {
+        if (count == 0) manager->headerChainHeight = query.height;
+        array_add(manager->headerChain, header->blockHash);
+        _LWBlockTimeSet(manager->headerTimes, query.height, header->timestamp, header->target);
+        if ((query.height % 2000) == 0) peer_log(peer, "added header #%"PRIu32, query.height);
+    }
+
+    return r;
+}
+
+// in compact filter mode, requests filters and filter hashes for the header chain in batches of FILTER_BATCH, keeping
+// at most two batches in flight
+static void _LWPeerManagerRequestFilters(LWPeerManager *manager)
+{
+    uint32_t end = manager->headerChainHeight + (uint32_t)array_count(manager->headerChain), stop,
+             received = manager->matchHeight + (uint32_t)array_count(manager->pendingFilters);
+
+    while (manager->downloadPeer && manager->filterCheckpointPeers >= FILTER_CHECKPOINT_PEERS &&
+           manager->filterHeight < end && manager->filterHeight - received <= FILTER_BATCH &&
+           manager->filterHeight < manager->matchHeight + FILTER_MAX_AHEAD) {
+        stop = (manager->filterHeight + FILTER_BATCH < end) ? manager->filterHeight + FILTER_BATCH - 1 : end - 1;
+        LWPeerSendGetcfheaders(manager->downloadPeer, manager->filterHeight,
+                               manager->headerChain[stop - manager->headerChainHeight]);
+        LWPeerSendGetcfilters(manager->downloadPeer, manager->filterHeight,
+                              manager->headerChain[stop - manager->headerChainHeight]);
+        manager->filterHeight = stop + 1;
+    }
+}
+
+// in compact filter mode, asks the connected peers that serve compact filters for the filter headers at every
+// FILTER_CHECKPOINT_INTERVAL blocks up to the header chain tip, filters are only requested once FILTER_CHECKPOINT_PEERS
+// of them agree, so the download peer's filter header chain isn't trusted on its own
+// returns false if too few peers serve compact filters
+static int _LWPeerManagerRequestFilterCheckpoints(LWPeerManager *manager)
+{
+    UInt256 stopHash = manager->headerChain[array_count(manager->headerChain) - 1];
+    size_t count = 0;
+
+    array_clear(manager->filterCheckpoints);
+    manager->filterCheckpointPeers = 0;
+
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        LWPeer *p = manager->connectedPeers[i - 1];
+
+        p->flags &= ~PEER_FLAG_CFCHECKPT;
+        if (LWPeerConnectStatus(p) != LWPeerStatusConnected ||
+            (p->services & SERVICES_NODE_COMPACT_FILTERS) != SERVICES_NODE_COMPACT_FILTERS) continue;
+        LWPeerSendGetcfcheckpt(p, stopHash);
+        count++;
+    }
+
+    return (count >= FILTER_CHECKPOINT_PEERS);
+}
+
+// true if header matches the agreed filter header checkpoint at height, or there's no checkpoint at that height
+static int _LWPeerManagerFilterCheckpointMatches(LWPeerManager *manager, uint32_t height, UInt256 header)
+{
+    size_t i = height/FILTER_CHECKPOINT_INTERVAL;
+
+    return (height % FILTER_CHECKPOINT_INTERVAL != 0 || i == 0 || i > array_count(manager->filterCheckpoints) ||
+            UInt256Eq(header, manager->filterCheckpoints[i - 1]));
+}
+
+// in compact filter mode, matches received filters in chain order against the wallet scripts, the headers of blocks
+// that don't match are added to blocks to be connected to the chain, and the first block that does match is requested
+// in full, matching then waits for that block so any new wallet addresses it leads to are matched in later filters
+static void _LWPeerManagerMatchFilters(LWPeerManager *manager, LWMerkleBlock ***blocks)
+{
+    size_t i, addrsCount = LWWalletAllAddrs(manager->wallet, NULL, 0);
+    LWPendingFilter *f;
+    LWMerkleBlock *header;
+    uint8_t match = 0;
+
+    if (addrsCount != array_count(manager->filterScripts)) { // wallet addresses changed, update the scripts
+        LWAddress *addrs = malloc(addrsCount*sizeof(*addrs));
+
+        assert(addrs != NULL);
+        addrsCount = LWWalletAllAddrs(manager->wallet, addrs, addrsCount);
+        array_set_count(manager->filterScripts, addrsCount);
+
+        for (i = 0; i < addrsCount; i++) {
+            LWFilterScript *script = &manager->filterScripts[i];
+
+            script->scriptLen = LWAddressScriptPubKey(script->script, sizeof(script->script), addrs[i].s);
+        }
+
+        free(addrs);
+    }
+
+    const uint8_t **scripts = malloc((array_count(manager->filterScripts) + 1)*sizeof(*scripts));
+    size_t *scriptLens = malloc((array_count(manager->filterScripts) + 1)*sizeof(*scriptLens)), scriptsCount = 0;
+
+    assert(scripts != NULL && scriptLens != NULL);
+
+    for (i = 0; i < array_count(manager->filterScripts); i++) {
+        if (manager->filterScripts[i].scriptLen == 0) continue;
+        scripts[scriptsCount] = manager->filterScripts[i].script;
+        scriptLens[scriptsCount++] = manager->filterScripts[i].scriptLen;
+    }
+
+    for (i = 0; i < array_count(manager->pendingFilters) && UInt256IsZero(manager->matchedBlock); i++) {
+        f = &manager->pendingFilters[i];
+        header = manager->headerBlocks[manager->matchHeight - manager->headerChainHeight];
+        manager->headerBlocks[manager->matchHeight - manager->headerChainHeight] = NULL;
+
+        if (LWBlockFilterMatchAny(f->filter, f->filterLen, f->blockHash, scripts, scriptLens, scriptsCount)) {
+            peer_debug(manager->downloadPeer, "compact filter matched block #%"PRIu32", requesting full block",
+                     manager->matchHeight);
+            LWPeerSendGetdataBlocks(manager->downloadPeer, &f->blockHash, 1);
+            manager->matchedBlock = f->blockHash;
+            LWMerkleBlockFree(header);
+        }
+        else if (header) { // a block with no wallet tx, connected with a single unmatched merkle root as its tree
+            LWMerkleBlockSetPartialTree(header, &header->merkleRoot, &match, 1);
+            array_add(*blocks, header);
+        }
+
+        free(f->filter);
+        manager->matchHeight++;
+    }
+
+    free(scripts);
+    free(scriptLens);
+    array_rm_range(manager->pendingFilters, 0, i);
 
-    uint8_t data[LWBloomFilterSerialize(filter, NULL, 0)];
-    size_t len = LWBloomFilterSerialize(filter, data, sizeof(data));
+    if (manager->matchHeight - manager->filterHashHeight >= FILTER_BATCH &&
+        manager->matchHeight - manager->filterHashHeight <= array_count(manager->filterHashes)) {
+        array_rm_range(manager->filterHashes, 0, manager->matchHeight - manager->filterHashHeight);
+        manager->filterHashHeight = manager->matchHeight;
+    }
 
-    LWPeerSendFilterload(peer, data, len);
+    _LWPeerManagerRequestFilters(manager);
 }
 
 static void _updateFilterRerequestDone(void *info, int success)
@@ -331,7 +1146,7 @@ static void _updateFilterRerequestDone(void *info, int success)
     free(info);
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _LWPeerManagerLock(manager);
 
         if ((peer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
             UInt256 locators[_LWPeerManagerBlockLocators(manager, NULL, 0)];
@@ -340,10 +1155,33 @@ static void _updateFilterRerequestDone(void *info, int success)
             LWPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
         }
 
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
     }
 }
 
+static void _staleBlocksPingDone(void *info, int success)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+
+    free(info);
+    _LWPeerManagerLock(manager);
+    peer->flags &= ~PEER_FLAG_STALEBLOCKS;
+    _LWPeerManagerUnlock(manager);
+}
+
+// ignores blocks relayed by peer until it answers a ping, since they were requested before its filter was updated
+static void _LWPeerManagerIgnoreStaleBlocks(LWPeerManager *manager, LWPeer *peer)
+{
+    LWPeerCallbackInfo *info = calloc(1, sizeof(*info));
+
+    assert(info != NULL);
+    info->peer = peer;
+    info->manager = manager;
+    peer->flags |= PEER_FLAG_STALEBLOCKS;
+    LWPeerSendPing(peer, info, _staleBlocksPingDone);
+}
+
 static void _updateFilterLoadDone(void *info, int success)
 {
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
@@ -353,21 +1191,54 @@ static void _updateFilterLoadDone(void *info, int success)
     free(info);
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _LWPeerManagerLock(manager);
         LWPeerSetNeedsFilterUpdate(peer, 0);
         peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
 
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
-            peerInfo = calloc(1, sizeof(*peerInfo));
-            assert(peerInfo != NULL);
-            peerInfo->peer = peer;
-            peerInfo->manager = manager;
-            LWPeerRerequestBlocks(manager->downloadPeer, manager->lastBlock->blockHash);
-            LWPeerSendPing(manager->downloadPeer, peerInfo, _updateFilterRerequestDone);
+        // if syncing, rerequest blocks, unless they're matched with compact filters which don't use the bloom filter
+        if (manager->lastBlock->height < manager->estimatedHeight && ! manager->filterSync) {
+            // blocks requested from other download peers may have been filtered with the old filter, so they get the
+            // new filter and all outstanding requests are dropped
+            for (size_t i = array_count(manager->downloadSlots); i > 0; i--) {
+                LWPeer *p = manager->downloadSlots[i - 1].peer;
+
+                if (p == manager->downloadPeer) continue;
+                _LWPeerManagerRemoveDownloadPeer(manager, p);
+                _LWPeerManagerAddDownloadPeer(manager, p);
+            }
+
+            _LWPeerManagerResetDownloads(manager, 0);
+
+            // blocks still in flight from the dropped requests are ignored until each download peer answers a ping,
+            // so they don't take the place of the blocks requested again (the download peer may have disconnected
+            // while the filterload ping was pending)
+            if (manager->downloadPeer) _LWPeerManagerIgnoreStaleBlocks(manager, manager->downloadPeer);
+
+            for (size_t i = array_count(manager->downloadSlots); i > 0; i--) {
+                if (manager->downloadSlots[i - 1].peer == manager->downloadPeer) continue;
+                _LWPeerManagerIgnoreStaleBlocks(manager, manager->downloadSlots[i - 1].peer);
+            }
+
+            if (manager->fetchHeight > 0) { // headers-first mode, fetch again from the header chain after lastBlock
+                manager->fetchHeight = manager->lastBlock->height + 1;
+                if (manager->fetchHeight < manager->headerChainHeight) manager->fetchHeight = manager->headerChainHeight;
+                _LWPeerManagerScheduleDownloads(manager);
+            }
+            else if (manager->downloadPeer) {
+                // the download peer re-requests all blocks it announced, and new ones are shared out again
+                peerInfo = calloc(1, sizeof(*peerInfo));
+                assert(peerInfo != NULL);
+                peerInfo->peer = peer;
+                peerInfo->manager = manager;
+                LWPeerRerequestBlocks(manager->downloadPeer, manager->lastBlock->blockHash);
+                LWPeerSendPing(manager->downloadPeer, peerInfo, _updateFilterRerequestDone);
+            }
+        }
+        else if (manager->lastBlock->height >= manager->estimatedHeight) { // if not syncing, request mempool
+            LWPeerSendMempool(peer, NULL, 0, NULL, NULL);
         }
-        else LWPeerSendMempool(peer, NULL, 0, NULL, NULL); // if not syncing, request mempool
 
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
     }
 }
 
@@ -378,7 +1249,7 @@ static void _updateFilterPingDone(void *info, int success)
     LWPeerCallbackInfo *peerInfo;
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _LWPeerManagerLock(manager);
         peer_log(peer, "updating filter with newly created wallet addresses");
         if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
         manager->bloomFilter = NULL;
@@ -404,7 +1275,7 @@ static void _updateFilterPingDone(void *info, int success)
             }
         }
 
-         pthread_mutex_unlock(&manager->lock);
+         _LWPeerManagerUnlock(manager);
     }
     else free(info);
 }
@@ -426,6 +1297,19 @@ static void _LWPeerManagerUpdateFilter(LWPeerManager *manager)
     }
 }
 
+// updates the wallet with the tx confirmed since the last call, in a single batch
+static void _LWPeerManagerFlushConfirmedTx(LWPeerManager *manager)
+{
+    if (array_count(manager->confirmedTxHashes) == 0) return;
+    LWWalletUpdateBlockTransactions(manager->wallet, manager->confirmedTxHashes, manager->confirmedTxHeights,
+                                    manager->confirmedTxTimes, array_count(manager->confirmedTxHashes));
+    array_clear(manager->confirmedTxHashes);
+    array_clear(manager->confirmedTxHeights);
+    array_clear(manager->confirmedTxTimes);
+}
+
+// confirmed tx are queued for the wallet until _LWPeerManagerFlushConfirmedTx is called at the end of the run of
+// blocks confirming them, unconfirmed ones are updated right away
 static void _LWPeerManagerUpdateTx(LWPeerManager *manager, const UInt256 txHashes[], size_t txCount,
                                    uint32_t blockHeight, uint32_t timestamp)
 {
@@ -440,15 +1324,16 @@ static void _LWPeerManagerUpdateTx(LWPeerManager *manager, const UInt256 txHashe
                 if (! LWWalletTransactionForHash(manager->wallet, tx->txHash)) LWTransactionFree(tx);
             }
 
-            for (size_t j = array_count(manager->txRelays); j > 0; j--) {
-                if (! UInt256Eq(txHashes[i], manager->txRelays[j - 1].txHash)) continue;
-                array_free(manager->txRelays[j - 1].peers);
-                array_rm(manager->txRelays, j - 1);
-            }
+            LWTxRelaysRemoveTx(manager->txRelays, txHashes[i]);
+            array_add(manager->confirmedTxHashes, txHashes[i]);
+            array_add(manager->confirmedTxHeights, blockHeight);
+            array_add(manager->confirmedTxTimes, timestamp);
         }
     }
-
-    LWWalletUpdateTransactions(manager->wallet, txHashes, txCount, blockHeight, timestamp);
+    else {
+        _LWPeerManagerFlushConfirmedTx(manager);
+        LWWalletUpdateTransactions(manager->wallet, txHashes, txCount, blockHeight, timestamp);
+    }
 }
 
 // unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
@@ -460,7 +1345,7 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
     size_t count = 0;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     if (success) peer->flags |= PEER_FLAG_SYNCED;
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -489,20 +1374,20 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
                     manager->publishedTx[j - 1].callback != NULL) isPublishing = 1;
             }
             
-            if (! isPublishing && _LWTxPeerListCount(manager->txRelays, hash) == 0 &&
-                _LWTxPeerListCount(manager->txRequests, hash) == 0) {
+            if (! isPublishing && LWTxRelaysCount(manager->txRelays, hash) == 0 &&
+                LWTxRelaysRequestCount(manager->txRelays, hash) == 0) {
                 peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
                 assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
                 LWWalletRemoveTransaction(manager->wallet, hash);
             }
-            else if (! isPublishing && _LWTxPeerListCount(manager->txRelays, hash) < manager->maxConnectCount) {
+            else if (! isPublishing && LWTxRelaysCount(manager->txRelays, hash) < manager->maxConnectCount) {
                 // set timestamp 0 to mark as unverified
                 _LWPeerManagerUpdateTx(manager, &hash, 1, TX_UNCONFIRMED, 0);
             }
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
 }
 
 static void _LWPeerManagerRequestUnrelayedTx(LWPeerManager *manager, LWPeer *peer)
@@ -515,10 +1400,9 @@ static void _LWPeerManagerRequestUnrelayedTx(LWPeerManager *manager, LWPeer *pee
     txCount = LWWalletTxUnconfirmedBefore(manager->wallet, tx, txCount, TX_UNCONFIRMED);
 
     for (size_t i = 0; i < txCount; i++) {
-        if (! _LWTxPeerListHasPeer(manager->txRelays, tx[i]->txHash, peer) &&
-            ! _LWTxPeerListHasPeer(manager->txRequests, tx[i]->txHash, peer)) {
+        if (! LWTxRelaysHasPeer(manager->txRelays, tx[i]->txHash, peer)) {
             txHashes[hashCount++] = tx[i]->txHash;
-            _LWTxPeerListAddPeer(&manager->txRequests, tx[i]->txHash, peer);
+            LWTxRelaysAddRequest(manager->txRelays, tx[i]->txHash, peer, time(NULL));
         }
     }
 
@@ -557,7 +1441,7 @@ static void _mempoolDone(void *info, int success)
 
     if (success) {
         peer_log(peer, "mempool request finished");
-        pthread_mutex_lock(&manager->lock);
+        _LWPeerManagerLock(manager);
         if (manager->syncStartHeight > 0) {
             peer_log(peer, "sync succeeded");
             syncFinished = 1;
@@ -566,7 +1450,7 @@ static void _mempoolDone(void *info, int success)
 
         _LWPeerManagerRequestUnrelayedTx(manager, peer);
         LWPeerSendGetaddr(peer); // request a list of other bitcoin peers
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
         if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
         if (syncFinished && manager->syncStopped) manager->syncStopped(manager->info, 0);
     }
@@ -578,12 +1462,12 @@ static void _loadBloomFilterDone(void *info, int success)
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     if (success) {
         LWPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
                           _mempoolDone);
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
     }
     else {
         free(info);
@@ -591,15 +1475,17 @@ static void _loadBloomFilterDone(void *info, int success)
         if (peer == manager->downloadPeer) {
             peer_log(peer, "sync succeeded");
             _LWPeerManagerSyncStopped(manager);
-            pthread_mutex_unlock(&manager->lock);
+            _LWPeerManagerUnlock(manager);
             if (manager->syncStopped) manager->syncStopped(manager->info, 0);
         }
-        else pthread_mutex_unlock(&manager->lock);
+        else _LWPeerManagerUnlock(manager);
     }
 }
 
 static void _LWPeerManagerLoadMempools(LWPeerManager *manager)
 {
+    _LWPeerManagerResetDownloads(manager, 1); // chain download is complete
+
     // after syncing, load filters and get mempools from other peers
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         LWPeer *peer = manager->connectedPeers[i - 1];
@@ -622,13 +1508,15 @@ static void _LWPeerManagerLoadMempools(LWPeerManager *manager)
 }
 
 // returns a UINT128_ZERO terminated array of addresses for hostname that must be freed, or NULL if lookup failed
-static UInt128 *_addressLookup(const char *hostname)
+static UInt128 *_addressLookup(void *info, const char *hostname)
 {
-    struct addrinfo *servinfo, *p;
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *servinfo, *p; // one result per address
     UInt128 *addrList = NULL;
     size_t count = 0, i = 0;
 
-    if (getaddrinfo(hostname, NULL, NULL, &servinfo) == 0) {
+    (void)info;
+
+    if (getaddrinfo(hostname, NULL, &hints, &servinfo) == 0) {
         for (p = servinfo; p != NULL; p = p->ai_next) count++;
         if (count > 0) addrList = calloc(count + 1, sizeof(*addrList));
         assert(addrList != NULL || count == 0);
@@ -650,73 +1538,189 @@ static UInt128 *_addressLookup(const char *hostname)
     return addrList;
 }
 
+static void _LWPeerManagerConnectPeers(LWPeerManager *manager);
+
+// drops a reference to lookup, freeing it once neither the resolver nor the thread waiting for it are using it
+static void _LWDNSLookupRelease(LWDNSLookup *lookup)
+{
+    int refCount;
+
+    pthread_mutex_lock(&lookup->lock);
+    refCount = --lookup->refCount;
+    pthread_mutex_unlock(&lookup->lock);
+
+    if (refCount == 0) {
+        if (lookup->addrList) free(lookup->addrList);
+        pthread_cond_destroy(&lookup->cond);
+        pthread_mutex_destroy(&lookup->lock);
+        free(lookup);
+    }
+}
+
+// runs the resolver, it doesn't touch the manager since it may be freed before a slow lookup finishes
+static void *_dnsLookupThreadRoutine(void *arg)
+{
+    LWDNSLookup *lookup = arg;
+    UInt128 *addrList = lookup->resolve(lookup->info, lookup->hostname);
+
+    pthread_mutex_lock(&lookup->lock);
+    lookup->addrList = addrList;
+    lookup->isDone = 1;
+    pthread_cond_broadcast(&lookup->cond);
+    pthread_mutex_unlock(&lookup->lock);
+    _LWDNSLookupRelease(lookup);
+    return NULL;
+}
+
+// waits for a DNS seed to answer, until timeout or until the lookup is cancelled by LWPeerManagerDisconnect()
 static void *_findPeersThreadRoutine(void *arg)
 {
     LWPeerManager *manager = ((LWFindPeersInfo *)arg)->manager;
+    LWDNSLookup *lookup = ((LWFindPeersInfo *)arg)->lookup;
     uint64_t services = ((LWFindPeersInfo *)arg)->services;
+    double timeout = ((LWFindPeersInfo *)arg)->timeout;
+    int isFirstSeed = (lookup->hostname == manager->params->dnsSeeds[0]), isTimedOut;
     UInt128 *addrList, *addr;
     time_t now = time(NULL), age;
+    struct timeval tv;
+    struct timespec deadline;
+    LWPeer peer;
+    void *volatile info = NULL; // volatile since they're set between pthread_cleanup_push() and pthread_cleanup_pop()
+    void (*volatile syncStopped)(void *info, int error) = NULL;
 
     pthread_cleanup_push(manager->threadCleanup, manager->info);
-    addrList = _addressLookup(((LWFindPeersInfo *)arg)->hostname);
     free(arg);
-    pthread_mutex_lock(&manager->lock);
+    gettimeofday(&tv, NULL);
+    deadline.tv_sec = tv.tv_sec + (time_t)timeout;
+    deadline.tv_nsec = tv.tv_usec*1000 + (long)((timeout - (time_t)timeout)*1000000000);
+    if (deadline.tv_nsec >= 1000000000) deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+    pthread_mutex_lock(&lookup->lock);
+
+    while (! lookup->isDone && ! lookup->isCancelled &&
+           pthread_cond_timedwait(&lookup->cond, &lookup->lock, &deadline) != ETIMEDOUT);
+
+    isTimedOut = (! lookup->isDone && ! lookup->isCancelled);
+    addrList = lookup->addrList;
+    lookup->addrList = NULL;
+    pthread_mutex_unlock(&lookup->lock);
+    _LWPeerManagerLock(manager);
+    if (isTimedOut) peer_log(&LW_PEER_NONE, "DNS seed %s timed out", lookup->hostname);
+
+    for (size_t i = array_count(manager->dnsLookups); i > 0; i--) {
+        if (manager->dnsLookups[i - 1] == lookup) array_rm(manager->dnsLookups, i - 1);
+    }
 
     for (addr = addrList; addr && ! UInt128IsZero(*addr); addr++) {
-        age = 24*60*60 + LWRand(2*24*60*60); // add between 1 and 3 days
-        array_add(manager->peers, ((LWPeer) { *addr, manager->params->standardPort, services, now - age, 0 }));
+        age = (isFirstSeed) ? 0 : 24*60*60 + LWRand(2*24*60*60); // add between 1 and 3 days except for the first seed
+        peer = ((LWPeer) { *addr, manager->params->standardPort, services, now - age, 0 });
+        array_add(manager->dnsPeers, peer);
+        LWAddrManagerAdd(manager->addrs, &peer, 1, NULL, now);
     }
 
+    // start connecting as soon as any seed answers, unless LWPeerManagerDisconnect() was called
+    if (addrList && manager->connectFailureCount < MAX_CONNECT_FAILURES) _LWPeerManagerConnectPeers(manager);
     manager->dnsThreadCount--;
-    pthread_mutex_unlock(&manager->lock);
+    pthread_cond_broadcast(&manager->cond);
+
+    // the last seed to answer or time out reports a failure if there's still no peers to connect to
+    if (manager->dnsThreadCount == 0 && array_count(manager->connectedPeers) == 0 &&
+        manager->connectFailureCount < MAX_CONNECT_FAILURES) {
+        peer_log(&LW_PEER_NONE, "sync failed");
+        _LWPeerManagerSyncStopped(manager);
+        info = manager->info;
+        syncStopped = manager->syncStopped;
+    }
+
+    _LWPeerManagerUnlock(manager);
+    _LWDNSLookupRelease(lookup);
     if (addrList) free(addrList);
+    if (syncStopped) syncStopped(info, ENETUNREACH);
     pthread_cleanup_pop(1);
     return NULL;
 }
 
-// DNS peer discovery
+// DNS peer discovery, seeds are looked up in parallel in the background and peers are connected to as soon as any seed
+// answers, seeds that don't answer within dnsTimeout are given up on, and lookup results are cached for DNS_CACHE_TTL
 static void _LWPeerManagerFindPeers(LWPeerManager *manager)
 {
     uint64_t services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
     time_t now = time(NULL);
-    struct timespec ts;
     pthread_t thread;
     pthread_attr_t attr;
-    UInt128 *addr, *addrList;
     LWFindPeersInfo *info;
+    LWDNSLookup *lookup;
+    LWPeer peer;
 
     if (! UInt128IsZero(manager->fixedPeer.address)) {
-        array_set_count(manager->peers, 1);
-        manager->peers[0] = manager->fixedPeer;
-        manager->peers[0].services = services;
-        manager->peers[0].timestamp = now;
-    }
-    else {
-        for (size_t i = 1; manager->params->dnsSeeds[i]; i++) {
+        peer = manager->fixedPeer;
+        peer.services = services;
+        peer.timestamp = now;
+        LWAddrManagerRemove(manager->addrs, &peer); // the fixed peer is used even if it was banned
+        LWAddrManagerAdd(manager->addrs, &peer, 1, NULL, now);
+    }
+    else if (array_count(manager->dnsPeers) > 0 && manager->dnsTime + DNS_CACHE_TTL > now) {
+        LWAddrManagerAdd(manager->addrs, manager->dnsPeers, array_count(manager->dnsPeers), NULL, now);
+    }
+    else if (manager->dnsThreadCount == 0) {
+        array_clear(manager->dnsPeers);
+        manager->dnsTime = now;
+
+        for (size_t i = 0; manager->params->dnsSeeds[i]; i++) {
+            lookup = calloc(1, sizeof(*lookup));
+            assert(lookup != NULL);
+            lookup->hostname = manager->params->dnsSeeds[i];
+            lookup->info = manager->dnsInfo;
+            lookup->resolve = manager->dnsResolve;
+            lookup->refCount = 2; // one for the resolver thread, and one for the thread waiting for it
+            pthread_mutex_init(&lookup->lock, NULL);
+            pthread_cond_init(&lookup->cond, NULL);
             info = calloc(1, sizeof(LWFindPeersInfo));
             assert(info != NULL);
             info->manager = manager;
-            info->hostname = manager->params->dnsSeeds[i];
+            info->lookup = lookup;
             info->services = services;
+            info->timeout = manager->dnsTimeout;
+
             if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
-                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
+                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) {
+                manager->dnsThreadCount++;
+                array_add(manager->dnsLookups, lookup);
+
+                if (pthread_create(&thread, &attr, _dnsLookupThreadRoutine, lookup) != 0) {
+                    pthread_mutex_lock(&lookup->lock); // report the seed as failed
+                    lookup->isDone = 1;
+                    pthread_cond_broadcast(&lookup->cond);
+                    pthread_mutex_unlock(&lookup->lock);
+                    _LWDNSLookupRelease(lookup);
+                }
+            }
+            else {
+                free(info);
+                pthread_cond_destroy(&lookup->cond);
+                pthread_mutex_destroy(&lookup->lock);
+                free(lookup);
+            }
         }
+    }
+}
 
-        for (addr = addrList = _addressLookup(manager->params->dnsSeeds[0]); addr && ! UInt128IsZero(*addr); addr++) {
-            array_add(manager->peers, ((LWPeer) { *addr, manager->params->standardPort, services, now, 0 }));
-        }
+// once maxConnectCount peers have finished the version handshake, drops the slower peers still connecting
+static void _LWPeerManagerDropRacingPeers(LWPeerManager *manager)
+{
+    size_t i, count = 0;
+
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        LWPeer *p = manager->connectedPeers[i - 1];
 
-        if (addrList) free(addrList);
-        ts.tv_sec = 0;
-        ts.tv_nsec = 1;
+        if (LWPeerConnectStatus(p) == LWPeerStatusConnected && ! (p->flags & PEER_FLAG_DROPPED)) count++;
+    }
 
-        do {
-            pthread_mutex_unlock(&manager->lock);
-            nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-            pthread_mutex_lock(&manager->lock);
-        } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < PEER_MAX_CONNECTIONS);
+    for (i = array_count(manager->connectedPeers); count >= (size_t)manager->maxConnectCount && i > 0; i--) {
+        LWPeer *p = manager->connectedPeers[i - 1];
 
-        qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
+        if (LWPeerConnectStatus(p) != LWPeerStatusConnecting || (p->flags & PEER_FLAG_DROPPED)) continue;
+        p->flags |= PEER_FLAG_DROPPED;
+        LWPeerDisconnect(p);
     }
 }
 
@@ -727,16 +1731,20 @@ static void _peerConnected(void *info)
     LWPeerCallbackInfo *peerInfo;
     time_t now = time(NULL);
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     if (peer->timestamp > now + 2*60*60 || peer->timestamp < now - 2*60*60) peer->timestamp = now; // sanity check
+    LWAddrManagerConnected(manager->addrs, peer, LWPeerPingTime(peer), now);
+    _LWPeerManagerDropRacingPeers(manager);
 
     // TODO: XXX does this work with 0.11 pruned nodes?
     if ((peer->services & manager->params->services) != manager->params->services) {
         peer_log(peer, "unsupported node type");
+        LWAddrManagerRemove(manager->addrs, peer);
         LWPeerDisconnect(peer);
     }
     else if ((peer->services & SERVICES_NODE_NETWORK) != SERVICES_NODE_NETWORK) {
         peer_log(peer, "node doesn't carry full blocks");
+        LWAddrManagerRemove(manager->addrs, peer);
         LWPeerDisconnect(peer);
     }
     else if (LWPeerLastBlock(peer) + 10 < manager->lastBlock->height) {
@@ -745,6 +1753,7 @@ static void _peerConnected(void *info)
     }
     else if (LWPeerVersion(peer) >= 70011 && (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
         peer_log(peer, "node doesn't support SPV mode");
+        LWAddrManagerRemove(manager->addrs, peer);
         LWPeerDisconnect(peer);
     }
     else if (manager->downloadPeer && // check if we should stick with the existing download peer
@@ -760,6 +1769,10 @@ static void _peerConnected(void *info)
             peerInfo->manager = manager;
             LWPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
         }
+        else if (LWPeerLastBlock(peer) + 10 >= manager->estimatedHeight) { // help download the chain
+            _LWPeerManagerAddDownloadPeer(manager, peer);
+            _LWPeerManagerScheduleDownloads(manager);
+        }
     }
     else { // select the peer with the lowest ping time to download the chain from if we're behind
         // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
@@ -783,16 +1796,37 @@ static void _peerConnected(void *info)
         _LWPeerManagerLoadBloomFilter(manager, peer);
         LWPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
         _LWPeerManagerPublishPendingTx(manager, peer);
+        _LWPeerManagerResetDownloads(manager, 1); // sync restarts from the block locators
 
         if (manager->lastBlock->height < LWPeerLastBlock(peer)) { // start blockchain sync
             UInt256 locators[_LWPeerManagerBlockLocators(manager, NULL, 0)];
             size_t count = _LWPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
 
             LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
+            _LWPeerManagerAddDownloadPeer(manager, peer);
 
-            // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that
+            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) { // other synced peers can help
+                LWPeer *p = manager->connectedPeers[i - 1];
+
+                if (p == peer || LWPeerConnectStatus(p) != LWPeerStatusConnected) continue;
+                if (LWPeerLastBlock(p) + 10 >= manager->estimatedHeight) _LWPeerManagerAddDownloadPeer(manager, p);
+            }
+
+            // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that, or in
+            // headers-first mode, all block headers followed by merkleblocks requested from the header chain
             // we do not reset connect failure count yet incase this request times out
-            if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
+            manager->filterSync = (manager->compactFilters &&
+                                   (peer->services & SERVICES_NODE_COMPACT_FILTERS) == SERVICES_NODE_COMPACT_FILTERS);
+            LWPeerSetHeadersFirst(peer, manager->headersFirst || manager->filterSync);
+
+            // the peer answers in order, so the start of the next retarget window arrives before that transition
+            manager->windowStartHash = _LWPeerManagerWindowStart(manager);
+            if (! UInt256IsZero(manager->windowStartHash)) LWPeerSendGetheader(peer, manager->windowStartHash);
+
+            if (manager->headersFirst || manager->filterSync) {
+                LWPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
+            }
+            else if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
                 LWPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
             }
             else LWPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
@@ -803,19 +1837,20 @@ static void _peerConnected(void *info)
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
 }
 
 static void _peerDisconnected(void *info, int error)
 {
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
-    LWTxPeerList *peerList;
     int willSave = 0, willReconnect = 0, txError = 0;
-    size_t txCount = 0;
+    size_t txCount = 0, statsLen = 0;
+    uint8_t *stats = NULL;
 
     //free(info);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
+    if (peer->flags & PEER_FLAG_DROPPED) error = 0; // we disconnected on purpose, the peer didn't fail
 
     void *txInfo[array_count(manager->publishedTx)];
     void (*txCallback[array_count(manager->publishedTx)])(void *, int);
@@ -824,10 +1859,7 @@ static void _peerDisconnected(void *info, int error)
         _LWPeerManagerPeerMisbehavin(manager, peer);
     }
     else if (error) { // timeout or some non-protocol related network error
-        for (size_t i = array_count(manager->peers); i > 0; i--) {
-            if (LWPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
-        }
-
+        LWAddrManagerFailed(manager->addrs, peer);
         manager->connectFailureCount++;
 
         // if it's a timeout and there's pending tx publish callbacks, the tx publish timed out
@@ -836,13 +1868,11 @@ static void _peerDisconnected(void *info, int error)
                                    array_count(manager->connectedPeers) == 1)) txError = ETIMEDOUT;
     }
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        peerList = &manager->txRelays[i - 1];
+    LWTxRelaysRemovePeer(manager->txRelays, peer);
+    _LWPeerManagerRemoveOrphanPeer(manager, peer);
 
-        for (size_t j = array_count(peerList->peers); j > 0; j--) {
-            if (LWPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
-        }
-    }
+    _LWPeerManagerRemoveDownloadPeer(manager, peer);
+    _LWPeerManagerScheduleDownloads(manager);
 
     if (peer == manager->downloadPeer) { // download peer disconnected
         manager->isConnected = 0;
@@ -853,10 +1883,11 @@ static void _peerDisconnected(void *info, int error)
     if (! manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
         _LWPeerManagerSyncStopped(manager);
 
-        // clear out stored peers so we get a fresh list from DNS on next connect attempt
-        array_clear(manager->peers);
+        // clear out stored peers so we get a fresh list from DNS on next connect attempt, bans are kept
+        LWAddrManagerClear(manager->addrs);
         txError = ENOTCONN; // trigger any pending tx publish callbacks
         willSave = 1;
+        if (manager->savePeerStats) stats = _LWPeerManagerPeerStats(manager, &statsLen);
         peer_log(peer, "sync failed");
     }
     else if (manager->connectFailureCount < MAX_CONNECT_FAILURES) willReconnect = 1;
@@ -877,17 +1908,20 @@ static void _peerDisconnected(void *info, int error)
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (manager->connectedPeers[i - 1] != peer) continue;
         array_rm(manager->connectedPeers, i - 1);
+        pthread_cond_broadcast(&manager->cond);
         break;
     }
 
     LWPeerFree(peer);
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
 
     for (size_t i = 0; i < txCount; i++) {
         txCallback[i](txInfo[i], txError);
     }
 
     if (willSave && manager->savePeers) manager->savePeers(manager->info, 1, NULL, 0);
+    if (stats) manager->savePeerStats(manager->info, stats, statsLen);
+    if (stats) free(stats);
     if (willSave && manager->syncStopped) manager->syncStopped(manager->info, error);
     if (willReconnect) LWPeerManagerConnect(manager); // try connecting to another peer
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
@@ -898,29 +1932,24 @@ static void _peerRelayedPeers(void *info, const LWPeer peers[], size_t peersCoun
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
     time_t now = time(NULL);
+    LWPeer save[1000];
+    size_t saveCount = 0, statsLen = 0;
+    uint8_t *stats = NULL;
 
-    pthread_mutex_lock(&manager->lock);
-    peer_log(peer, "relayed %zu peer(s)", peersCount);
-
-    array_add_array(manager->peers, peers, peersCount);
-    qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
-
-    // limit total to 2500 peers
-    if (array_count(manager->peers) > 2500) array_set_count(manager->peers, 2500);
-    peersCount = array_count(manager->peers);
+    _LWPeerManagerLock(manager);
+    peer_debug(peer, "relayed %zu peer(s)", peersCount);
+    LWAddrManagerAdd(manager->addrs, peers, peersCount, peer, now);
 
-    // remove peers more than 3 hours old, or until there are only 1000 left
-    while (peersCount > 1000 && manager->peers[peersCount - 1].timestamp + 3*60*60 < now) peersCount--;
-    array_set_count(manager->peers, peersCount);
-
-    LWPeer save[peersCount];
-
-    for (size_t i = 0; i < peersCount; i++) save[i] = manager->peers[i];
-    pthread_mutex_unlock(&manager->lock);
+    // peer relaying is complete when we receive <1000, save the 1000 most recent peers
+    if (peersCount > 1 && peersCount < 1000) {
+        saveCount = LWAddrManagerPeers(manager->addrs, save, sizeof(save)/sizeof(*save), now);
+        if (manager->savePeerStats) stats = _LWPeerManagerPeerStats(manager, &statsLen);
+    }
 
-    // peer relaying is complete when we receive <1000
-    if (peersCount > 1 && peersCount < 1000 &&
-        manager->savePeers) manager->savePeers(manager->info, 1, save, peersCount);
+    _LWPeerManagerUnlock(manager);
+    if (saveCount > 0 && manager->savePeers) manager->savePeers(manager->info, 1, save, saveCount);
+    if (stats) manager->savePeerStats(manager->info, stats, statsLen);
+    if (stats) free(stats);
 }
 
 static void _peerRelayedTx(void *info, LWTransaction *tx)
@@ -932,8 +1961,8 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
 
-    pthread_mutex_lock(&manager->lock);
-    peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
+    _LWPeerManagerLock(manager);
+    peer_debug(peer, "relayed tx: %s", u256hex(tx->txHash));
     
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
         if (UInt256Eq(manager->publishedTxHashes[i - 1], tx->txHash)) {
@@ -941,7 +1970,7 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
             txCallback = manager->publishedTx[i - 1].callback;
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
-            relayCount = _LWTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+            relayCount = LWTxRelaysAdd(manager->txRelays, tx->txHash, peer, time(NULL));
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
@@ -972,9 +2001,9 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
 
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _LWTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = LWTxRelaysAdd(manager->txRelays, tx->txHash, peer, time(NULL));
 
-        _LWTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
+        LWTxRelaysRemoveRequest(manager->txRelays, tx->txHash, peer);
 
         if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
             LWAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
@@ -988,9 +2017,17 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
             for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
                 if (! LWAddressHash160(&hash, addrs[i].s) ||
                     LWBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
-                if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
-                manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
-                _LWPeerManagerUpdateFilter(manager);
+
+                // add new addresses to the filters peers already have, only rebuild them once they're full, or
+                // during a bloom filtered sync, where blocks already requested were filtered without the new
+                // addresses, and are requested again once the reloaded filter is in place
+                if ((manager->lastBlock->height < manager->estimatedHeight && ! manager->filterSync) ||
+                    ! _LWPeerManagerExtendBloomFilter(manager)) {
+                    LWBloomFilterFree(manager->bloomFilter);
+                    manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
+                    _LWPeerManagerUpdateFilter(manager);
+                }
+
                 break;
             }
         }
@@ -1001,7 +2038,7 @@ static void _peerRelayedTx(void *info, LWTransaction *tx)
         _LWPeerManagerUpdateTx(manager, &tx->txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     if (txCallback) txCallback(txInfo, 0);
 }
 
@@ -1015,9 +2052,9 @@ static void _peerHasTx(void *info, UInt256 txHash)
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     tx = LWWalletTransactionForHash(manager->wallet, txHash);
-    peer_log(peer, "has tx: %s", u256hex(txHash));
+    peer_debug(peer, "has tx: %s", u256hex(txHash));
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
         if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
@@ -1026,7 +2063,7 @@ static void _peerHasTx(void *info, UInt256 txHash)
             txCallback = manager->publishedTx[i - 1].callback;
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
-            relayCount = _LWTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+            relayCount = LWTxRelaysAdd(manager->txRelays, txHash, peer, time(NULL));
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
@@ -1047,17 +2084,17 @@ static void _peerHasTx(void *info, UInt256 txHash)
 
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _LWTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = LWTxRelaysAdd(manager->txRelays, txHash, peer, time(NULL));
 
         // set timestamp when tx is verified
         if (relayCount >= manager->maxConnectCount && tx && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
             _LWPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
         }
 
-        _LWTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+        LWTxRelaysRemoveRequest(manager->txRelays, txHash, peer);
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     if (txCallback) txCallback(txInfo, 0);
 }
 
@@ -1067,13 +2104,13 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
     LWTransaction *tx, *t;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     peer_log(peer, "rejected tx: %s", u256hex(txHash));
     tx = LWWalletTransactionForHash(manager->wallet, txHash);
-    _LWTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+    LWTxRelaysRemoveRequest(manager->txRelays, txHash, peer);
 
     if (tx) {
-        if (_LWTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
+        if (LWTxRelaysRemove(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
             // set timestamp 0 to mark tx as unverified
             _LWPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, 0);
         }
@@ -1091,32 +2128,31 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
 }
 
 static int _LWPeerManagerVerifyBlock(LWPeerManager *manager, LWMerkleBlock *block, LWMerkleBlock *prev, LWPeer *peer)
 {
+    uint32_t transitionTime = 0;
     int r = 1;
 
     if (! prev || ! UInt256Eq(block->prevBlock, prev->blockHash) || block->height != prev->height + 1) r = 0;
 
-    // check if we hit a difficulty transition, and find previous transition time
+    // check if we hit a difficulty transition, and find the start time of the retarget window
     if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-        LWMerkleBlock *b = block;
-        UInt256 prevBlock;
-
-        for (uint32_t i = 0; b && i < BLOCK_DIFFICULTY_INTERVAL; i++) {
-            b = LWSetGet(manager->blocks, &b->prevBlock);
-        }
+        const LWBlockTime *t = _LWBlockTimeGet(manager->blockTimes, _LWRetargetWindowStart(block->height));
+        LWMerkleBlock *b = _LWPeerManagerAncestor(manager, prev, block->height - BLOCK_DIFFICULTY_INTERVAL);
+        UInt256 prevBlock = (b) ? b->prevBlock : UINT256_ZERO;
 
-        if (! b) {
-            peer_log(peer, "missing previous difficulty tansition, can't verify block: %s", u256hex(block->blockHash));
+        if (t) transitionTime = t->timestamp;
+        else {
+            peer_log(peer, "missing start of retarget window at height %"PRIu32", can't verify block: %s",
+                     _LWRetargetWindowStart(block->height), u256hex(block->blockHash));
             r = 0;
         }
-        else prevBlock = b->prevBlock;
 
-        while (b) { // free up some memory
+        while (r && b) { // free up some memory
             b = LWSetGet(manager->blocks, &prevBlock);
             if (b) prevBlock = b->prevBlock;
 
@@ -1125,10 +2161,13 @@ static int _LWPeerManagerVerifyBlock(LWPeerManager *manager, LWMerkleBlock *bloc
                 LWMerkleBlockFree(b);
             }
         }
+
+        // blocks before the previous transition were freed, so drop them from the main chain index too
+        if (r) _LWPeerManagerTrimChain(manager, block->height - BLOCK_DIFFICULTY_INTERVAL);
     }
 
     // verify block difficulty
-    if (r && ! manager->params->verifyDifficulty(block, manager->blocks)) {
+    if (r && ! manager->params->verifyDifficulty(block, prev, transitionTime)) {
         peer_log(peer, "relayed block with invalid difficulty target %x, blockHash: %s", block->target,
                  u256hex(block->blockHash));
         r = 0;
@@ -1148,30 +2187,33 @@ static int _LWPeerManagerVerifyBlock(LWPeerManager *manager, LWMerkleBlock *bloc
     return r;
 }
 
-static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
+// the header chain is complete, starts fetching the blocks or compact filters for it
+static void _LWPeerManagerHeaderChainDone(LWPeerManager *manager, LWPeer *peer)
 {
-    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
-    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
-    size_t txCount = LWMerkleBlockTxHashes(block, NULL, 0);
-    UInt256 _txHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
-            *txHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _txHashes : malloc(txCount*sizeof(*txHashes));
-    size_t i, j, fpCount = 0, saveCount = 0;
-    LWMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
-    uint32_t txTime = 0;
+    peer_log(peer, "header chain complete at height %"PRIu32", fetching %s",
+             manager->headerChainHeight + (uint32_t)array_count(manager->headerChain) - 1,
+             (manager->filterSync) ? "compact filters" : "blocks");
 
-    assert(txHashes != NULL);
-    txCount = LWMerkleBlockTxHashes(block, txHashes, txCount);
-    pthread_mutex_lock(&manager->lock);
-    prev = LWSetGet(manager->blocks, &block->prevBlock);
+    if (manager->filterSync && ! _LWPeerManagerRequestFilterCheckpoints(manager)) {
+        peer_log(peer, "fewer than %d peers serve compact filters, fetching blocks instead", FILTER_CHECKPOINT_PEERS);
+        _LWPeerManagerStopFilterSync(manager);
+    }
 
-    if (prev) {
-        txTime = block->timestamp/2 + prev->timestamp/2;
-        block->height = prev->height + 1;
+    if (manager->filterSync) { // filters are requested once the filter header checkpoints agree
+        manager->filterHeight = manager->matchHeight = manager->headerChainHeight;
+        manager->filterHashHeight = manager->headerChainHeight;
     }
+    else manager->fetchHeight = manager->headerChainHeight;
+}
+
+// tracks the observed bloom filter false positive rate using a low pass filter to smooth out variance
+static void _LWPeerManagerUpdateFpRate(LWPeerManager *manager, LWPeer *peer, const LWMerkleBlock *block,
+                                       const UInt256 txHashes[], size_t txCount)
+{
+    size_t fpCount = 0;
 
-    // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
-    if (peer == manager->downloadPeer && block->totalTx > 0) {
-        for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
+    if (peer == manager->downloadPeer && block->totalTx > 0 && ! manager->filterSync) {
+        for (size_t i = 0; i < txCount; i++) { // wallet tx are not false-positives
             if (! LWWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
         }
 
@@ -1181,6 +2223,7 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
         // 1% low pass filter, also weights each block by total transactions, compared to the avarage
         manager->fpRate = manager->fpRate*(1.0 - 0.01*block->totalTx/manager->averageTxPerBlock) +
                           0.01*fpCount/manager->averageTxPerBlock;
+        LWMetricsSetGauge(LWMetricGaugeFpRate, manager->fpRate);
 
         // false positive rate sanity check
         if (LWPeerConnectStatus(peer) == LWPeerStatusConnected &&
@@ -1194,13 +2237,50 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
             _LWPeerManagerUpdateFilter(manager); // rebuild bloom filter when it starts to degrade
         }
     }
+}
+
+// adds block to the chain, the header chain, or the orphan pool, txHashes are the block's matched transactions,
+// saveCount is set to the number of blocks ending with block that should be saved, if any
+// returns block if it's in the chain with a known height, otherwise NULL (block was freed or is owned by the pool)
+static LWMerkleBlock *_LWPeerManagerConnectBlock(LWPeerManager *manager, LWPeer *peer, LWMerkleBlock *block,
+                                                 int scheduled, const UInt256 txHashes[], size_t txCount,
+                                                 size_t *saveCount)
+{
+    LWMerkleBlock *b, *b2, *prev = LWSetGet(manager->blocks, &block->prevBlock);
+    uint32_t txTime = 0;
+
+    if (prev) {
+        txTime = block->timestamp/2 + prev->timestamp/2;
+        block->height = prev->height + 1;
+    }
 
-    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx)
+    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx),
+    // except in headers-first mode where they're added to the header chain to fetch the blocks for later
     if (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) {
-        LWMerkleBlockFree(block);
+        if ((manager->headersFirst || manager->filterSync) && peer == manager->downloadPeer &&
+            manager->fetchHeight == 0 && manager->filterHeight == 0 && _LWPeerManagerAddHeader(manager, peer, block)) {
+            uint32_t height = manager->headerChainHeight + (uint32_t)array_count(manager->headerChain) - 1;
+
+            LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+            manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
+
+            if (manager->filterSync) { // keep the header to add to the chain if its filter doesn't match
+                array_add(manager->headerBlocks, block);
+                block = NULL;
+            }
+
+            if (height >= LWPeerLastBlock(peer)) { // header chain is complete, start fetching blocks
+                if (height > manager->estimatedHeight) manager->estimatedHeight = height;
+                _LWPeerManagerHeaderChainDone(manager, peer);
+            }
+        }
+
+        if (block) LWMerkleBlockFree(block);
         block = NULL;
     }
-    else if (manager->bloomFilter == NULL) { // ingore potentially incomplete blocks when a filter update is pending
+    else if (manager->bloomFilter == NULL && ! manager->filterSync) {
+        // ingore potentially incomplete blocks when a filter update is pending (blocks matched with compact filters are
+        // complete regardless of the bloom filter)
         LWMerkleBlockFree(block);
         block = NULL;
 
@@ -1214,25 +2294,31 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
                  u256hex(block->blockHash), u256hex(block->prevBlock), u256hex(manager->lastBlock->blockHash),
                  manager->lastBlock->height);
         
-        if (block->timestamp + 7*24*60*60 < time(NULL)) { // ignore orphans older than one week ago
+        // ignore orphans older than one week ago, unless they were requested out of order during chain sync
+        if (block->timestamp + 7*24*60*60 < time(NULL) && ! scheduled) {
             LWMerkleBlockFree(block);
             block = NULL;
         }
         else {
             // call getblocks, unless we already did with the previous block, or we're still syncing
             if (manager->lastBlock->height >= LWPeerLastBlock(peer) &&
-                (! manager->lastOrphan || ! UInt256Eq(manager->lastOrphan->blockHash, block->prevBlock))) {
+                ! UInt256Eq(manager->lastOrphan, block->prevBlock)) {
                 UInt256 locators[_LWPeerManagerBlockLocators(manager, NULL, 0)];
                 size_t locatorsCount = _LWPeerManagerBlockLocators(manager, locators,
                                                                    sizeof(locators)/sizeof(*locators));
 
-                peer_log(peer, "calling getblocks");
+                peer_debug(peer, "calling getblocks");
                 LWPeerSendGetblocks(peer, locators, locatorsCount, UINT256_ZERO);
             }
 
-            LWSetAdd(manager->orphans, block); // BUG: limit total orphans to avoid memory exhaustion attack
-            manager->lastOrphan = block;
+            // orphans that weren't requested count against the relaying peer's quota
+            if (_LWPeerManagerAddOrphan(manager, block, (scheduled) ? NULL : peer)) {
+                manager->lastOrphan = block->blockHash;
+            }
+            else LWMerkleBlockFree(block);
         }
+
+        block = NULL; // the orphan pool owns the block now, and may evict it once the lock is released
     }
     else if (! _LWPeerManagerVerifyBlock(manager, block, prev, peer)) { // block is invalid
         peer_log(peer, "relayed invalid block");
@@ -1246,48 +2332,54 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
         }
 
         LWSetAdd(manager->blocks, block);
-        manager->lastBlock = block;
+        _LWPeerManagerSetLastBlock(manager, block);
         if (txCount > 0) _LWPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer) LWPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
 
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
-            LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (block->height < manager->estimatedHeight && manager->downloadPeer &&
+            (peer == manager->downloadPeer || scheduled)) {
+            LWPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
 
-        if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) saveCount = 1; // save transition block immediately
+        if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) *saveCount = 1; // save transition block immediately
 
         if (block->height == manager->estimatedHeight) { // chain download is complete
-            saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+            *saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+            _LWPeerManagerFlushConfirmedTx(manager); // the bloom filter is rebuilt from the updated wallet
             _LWPeerManagerLoadMempools(manager);
         }
     }
     else if (LWSetContains(manager->blocks, block)) { // we already have the block (or at least the header)
         if ((block->height % 500) == 0 || txCount > 0 || block->height >= LWPeerLastBlock(peer)) {
-            peer_log(peer, "relayed existing block #%"PRIu32, block->height);
+            peer_debug(peer, "relayed existing block #%"PRIu32, block->height);
         }
 
-        b = manager->lastBlock;
-        while (b && b->height > block->height) b = LWSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
+        b = _LWPeerManagerAncestor(manager, manager->lastBlock, block->height); // is block in main chain?
+        b2 = LWSetAdd(manager->blocks, block);
 
-        if (LWMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
+        if (b && LWMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
             if (txCount > 0) _LWPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
+            if (_LWPeerManagerChainContains(manager, b)) manager->chain[b->height - manager->chainHeight] = block;
             if (block->height == manager->lastBlock->height) manager->lastBlock = block;
         }
 
-        b = LWSetAdd(manager->blocks, block);
+        b = b2;
 
         if (b != block) {
-            if (LWSetGet(manager->orphans, b) == b) LWSetRemove(manager->orphans, b);
-            if (manager->lastOrphan == b) manager->lastOrphan = NULL;
+            _LWPeerManagerRemoveOrphanBlock(manager, b);
             LWMerkleBlockFree(b);
         }
     }
     else if (manager->lastBlock->height < LWPeerLastBlock(peer) &&
              block->height > manager->lastBlock->height + 1) { // special case, new block mined durring rescan
         peer_log(peer, "marking new block #%"PRIu32" as orphan until rescan completes", block->height);
-        LWSetAdd(manager->orphans, block); // mark as orphan til we're caught up
-        manager->lastOrphan = block;
+        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+
+        // mark as orphan til we're caught up
+        if (_LWPeerManagerAddOrphan(manager, block, (scheduled) ? NULL : peer)) manager->lastOrphan = block->blockHash;
+        else LWMerkleBlockFree(block);
+        block = NULL;
     }
     else if (block->height <= manager->params->checkpoints[manager->params->checkpointsCount - 1].height) { // old fork
         peer_log(peer, "ignoring block on fork older than most recent checkpoint, block #%"PRIu32", hash: %s",
@@ -1300,77 +2392,369 @@ static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
         LWSetAdd(manager->blocks, block);
 
         if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
+            UInt256 *hashes = NULL;
+            size_t hashesCount = 0;
+
+            b2 = b = _LWPeerManagerChainJoin(manager, block); // where the fork joins the main chain
+
+            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
+
+            _LWPeerManagerFlushConfirmedTx(manager); // earlier blocks in the run may be on the old chain
+            LWWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+
             b = block;
-            b2 = manager->lastBlock;
 
-            while (b && b2 && ! LWMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
+            while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
+                size_t count = LWMerkleBlockTxHashes(b, NULL, 0);
+                uint32_t height = b->height, timestamp = b->timestamp;
+
+                if (count > hashesCount) {
+                    hashes = realloc(hashes, count*sizeof(*hashes));
+                    assert(hashes != NULL);
+                    hashesCount = count;
+                }
+
+                count = LWMerkleBlockTxHashes(b, hashes, count);
                 b = LWSetGet(manager->blocks, &b->prevBlock);
-                if (b && b->height < b2->height) b2 = LWSetGet(manager->blocks, &b2->prevBlock);
+                if (b) timestamp = timestamp/2 + b->timestamp/2;
+                if (count > 0) LWWalletUpdateTransactions(manager->wallet, hashes, count, height, timestamp);
+            }
+
+            if (hashes) free(hashes);
+
+            _LWPeerManagerSetLastBlock(manager, block);
+
+            if (block->height == manager->estimatedHeight) { // chain download is complete
+                *saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+                _LWPeerManagerLoadMempools(manager);
+            }
+        }
+    }
+
+    return (block && block->height != BLOCK_UNKNOWN_HEIGHT) ? block : NULL;
+}
+
+// connects blocks from peer in order, along with each orphan that connects to a block before it, and when the block a
+// compact filter matched arrives, the blocks whose filters don't match after it, all in one pass, scheduled is true if
+// the first block was requested, blocks is freed
+// called with the manager locked, which is unlocked before the saveBlocks and txStatusUpdate callbacks are called
+static void _LWPeerManagerRelayBlocks(LWPeerManager *manager, LWPeer *peer, LWMerkleBlock **blocks, int scheduled)
+{
+    UInt256 *txHashes = NULL;
+    size_t i, j, txCount, txCapacity = 0, saveCount = 0, count;
+    LWMerkleBlock *b, *save = NULL;
+    int matched = 0, statusUpdate = 0;
+
+    for (i = 0; i < array_count(blocks); i++) {
+        if (manager->filterSync && UInt256Eq(blocks[i]->blockHash, manager->matchedBlock)) matched = 1;
+        txCount = LWMerkleBlockTxHashes(blocks[i], NULL, 0);
+
+        if (txCount > txCapacity) {
+            txHashes = realloc(txHashes, txCount*sizeof(*txHashes));
+            assert(txHashes != NULL);
+            txCapacity = txCount;
+        }
+
+        txCount = LWMerkleBlockTxHashes(blocks[i], txHashes, txCount);
+
+        // orphans were already counted when they were received
+        if (i == 0) _LWPeerManagerUpdateFpRate(manager, peer, blocks[i], txHashes, txCount);
+        count = 0;
+        b = _LWPeerManagerConnectBlock(manager, peer, blocks[i], (i == 0) ? scheduled : 0, txHashes, txCount, &count);
+
+        if (b) {
+            if (b->height > manager->estimatedHeight) manager->estimatedHeight = b->height;
+            if (b->height >= LWPeerLastBlock(peer)) statusUpdate = 1;
+
+            if (count > 0) { // save once for the whole run, saving blocks requested by earlier blocks in the run too
+                if (save && save->height + count < b->height + saveCount) count = saveCount + b->height - save->height;
+                save = b;
+                saveCount = count;
             }
 
-            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
+            // check if the next blocks were received as orphans
+            _LWPeerManagerTakeOrphans(manager, b->blockHash, &blocks);
+        }
+
+        if (matched && i + 1 == array_count(blocks) && manager->filterSync) {
+            // the block a compact filter matched arrived, continue matching filters, the blocks whose filters don't
+            // match are connected in this same pass
+            matched = 0;
+            manager->matchedBlock = UINT256_ZERO;
+            _LWPeerManagerMatchFilters(manager, &blocks);
+        }
+    }
+
+    if (txHashes) free(txHashes);
+    array_free(blocks);
+    _LWPeerManagerFlushConfirmedTx(manager); // one wallet update for the whole run
+    if (scheduled || manager->fetchHeight > 0) _LWPeerManagerScheduleDownloads(manager);
+    if (save && manager->headerStore) _LWPeerManagerStoreChain(manager); // written in batches, when blocks are saved
+
+    LWMerkleBlock *saveBlocks[saveCount];
+
+    for (i = 0, b = save; b && i < saveCount; i++) {
+        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
+        saveBlocks[i] = b;
+        b = LWSetGet(manager->blocks, &b->prevBlock);
+    }
+
+    // make sure the set of blocks to be saved starts at a difficulty interval, or at the block before one, which starts
+    // the retarget window of the next transition
+    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
+    if (j > 0 && j + 1 < BLOCK_DIFFICULTY_INTERVAL) {
+        i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
+    }
+
+    assert(i == 0 || (saveBlocks[i - 1]->height + 1) % BLOCK_DIFFICULTY_INTERVAL <= 1);
+    _LWPeerManagerUnlock(manager);
+    if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
+
+    if (statusUpdate && manager->txStatusUpdate) {
+        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    }
+}
+
+// adds a header requested by _LWPeerManagerWindowStart(), either the previous transition's own header, which gives its
+// prevBlock, or the block before it, then requests the next header if the start of the retarget window is still missing
+static void _LWPeerManagerAddWindowStart(LWPeerManager *manager, LWPeer *peer, LWMerkleBlock *header)
+{
+    uint32_t height = manager->lastBlock->height - manager->lastBlock->height % BLOCK_DIFFICULTY_INTERVAL;
+    LWMerkleBlock *b = LWSetGet(manager->blocks, &header->blockHash),
+                  *next = (height > 0) ? _LWPeerManagerAncestor(manager, manager->lastBlock, height) : NULL;
+
+    if (b && UInt256IsZero(b->prevBlock)) b->prevBlock = header->prevBlock; // the header hashes to the checkpoint
+
+    if (! b && next && UInt256Eq(next->prevBlock, header->blockHash)) {
+        header->height = height - 1;
+        LWSetAdd(manager->blocks, header);
+        peer_log(peer, "added retarget window start #%"PRIu32, header->height);
+    }
+    else LWMerkleBlockFree(header);
+
+    manager->windowStartHash = _LWPeerManagerWindowStart(manager);
+    if (! UInt256IsZero(manager->windowStartHash)) LWPeerSendGetheader(peer, manager->windowStartHash);
+}
+
+static void _peerRelayedBlock(void *info, LWMerkleBlock *block)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    LWMerkleBlock **blocks = NULL;
+    int scheduled;
+
+    _LWPeerManagerLock(manager);
+
+    if (block->totalTx == 0 && ! UInt256IsZero(manager->windowStartHash) &&
+        UInt256Eq(block->blockHash, manager->windowStartHash)) { // requested with LWPeerSendGetheader()
+        _LWPeerManagerAddWindowStart(manager, peer, block);
+        _LWPeerManagerUnlock(manager);
+        return;
+    }
+
+    // while a filter update is pending during the sync, and until each download peer answers the ping sent after it,
+    // blocks were requested with the old filter, they're requested again once the update is done
+    if ((peer->flags & PEER_FLAG_STALEBLOCKS) ||
+        (manager->downloadPeer && (manager->downloadPeer->flags & PEER_FLAG_NEEDSUPDATE) && ! manager->filterSync &&
+         manager->lastBlock->height < manager->estimatedHeight)) {
+        peer_debug(peer, "ignoring block %s filtered with an old filter", u256hex(block->blockHash));
+        _LWPeerManagerUnlock(manager);
+        LWMerkleBlockFree(block);
+        return;
+    }
+
+    scheduled = _LWPeerManagerDownloadReceived(manager, peer, block->blockHash);
+    array_new(blocks, 1);
+    array_add(blocks, block);
+    _LWPeerManagerRelayBlocks(manager, peer, blocks, scheduled); // unlocks manager
+}
+
+static void _peerHeadersDone(void *info)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    size_t count;
+
+    _LWPeerManagerLock(manager);
+    count = array_count(manager->headerChain);
+
+    // the download peer ran out of headers before the height it reported, so its header chain ends here instead of
+    // waiting for a sync timeout
+    if ((manager->headersFirst || manager->filterSync) && peer == manager->downloadPeer &&
+        manager->fetchHeight == 0 && manager->filterHeight == 0 &&
+        manager->lastBlock->height < manager->estimatedHeight) {
+        manager->estimatedHeight = (count > 0) ? manager->headerChainHeight + (uint32_t)count - 1 :
+                                   manager->lastBlock->height;
+
+        if (count > 0) {
+            _LWPeerManagerHeaderChainDone(manager, peer);
+            if (manager->fetchHeight > 0) _LWPeerManagerScheduleDownloads(manager);
+        }
+        else { // no headers after the last block, so the chain is already synced
+            peer_log(peer, "no headers after block #%"PRIu32", chain download is complete",
+                     manager->lastBlock->height);
+            _LWPeerManagerLoadMempools(manager);
+        }
+    }
+
+    _LWPeerManagerUnlock(manager);
+}
+
+static int _peerRelayedBlockHashes(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    int r = 0;
+
+    _LWPeerManagerLock(manager);
+
+    // during chain sync, spread block requests from the download peer's inv across all download peers
+    if (peer == manager->downloadPeer && manager->lastBlock->height < manager->estimatedHeight &&
+        array_count(manager->downloadSlots) > 1) {
+        array_add_array(manager->downloadQueue, blockHashes, blockCount);
+        _LWPeerManagerScheduleDownloads(manager);
+        r = 1;
+    }
+
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+static void _peerRelayedCompactFilter(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    LWMerkleBlock **blocks = NULL;
+    uint32_t height;
+    LWPendingFilter f;
 
-            LWWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+    _LWPeerManagerLock(manager);
+    height = manager->matchHeight + (uint32_t)array_count(manager->pendingFilters);
 
-            b = block;
+    if (! manager->filterSync || peer != manager->downloadPeer || height >= manager->filterHeight ||
+        ! UInt256Eq(blockHash, manager->headerChain[height - manager->headerChainHeight])) {
+        peer_log(peer, "ignoring unexpected cfilter for block %s", u256hex(blockHash));
+    }
+    else if (height - manager->filterHashHeight >= array_count(manager->filterHashes) ||
+             ! UInt256Eq(LWBlockFilterHash(filter, filterLen),
+                         manager->filterHashes[height - manager->filterHashHeight])) {
+        peer_log(peer, "cfilter for block #%"PRIu32" doesn't match its filter header", height);
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        LWPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        f.blockHash = blockHash;
+        f.filter = malloc(filterLen + 1);
+        assert(f.filter != NULL);
+        memcpy(f.filter, filter, filterLen);
+        f.filterLen = filterLen;
+        array_add(manager->pendingFilters, f);
+        array_new(blocks, 100);
+        _LWPeerManagerMatchFilters(manager, &blocks);
+    }
 
-            while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
-                size_t count = LWMerkleBlockTxHashes(b, NULL, 0);
-                uint32_t height = b->height, timestamp = b->timestamp;
+    if (blocks && array_count(blocks) > 0) {
+        _LWPeerManagerRelayBlocks(manager, peer, blocks, 0); // unlocks manager
+    }
+    else {
+        _LWPeerManagerUnlock(manager);
+        if (blocks) array_free(blocks);
+    }
+}
 
-                if (count > txCount) {
-                    txHashes = (txHashes != _txHashes) ? realloc(txHashes, count*sizeof(*txHashes)) :
-                               malloc(count*sizeof(*txHashes));
-                    assert(txHashes != NULL);
-                    txCount = count;
-                }
+static void _peerRelayedFilterHashes(void *info, UInt256 stopHash, UInt256 prevHeader, const UInt256 filterHashes[],
+                                     size_t hashesCount)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    UInt256 header = prevHeader;
+    uint32_t height;
+    size_t i = 0;
 
-                count = LWMerkleBlockTxHashes(b, txHashes, count);
-                b = LWSetGet(manager->blocks, &b->prevBlock);
-                if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) LWWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
-            }
+    _LWPeerManagerLock(manager);
+    height = manager->filterHashHeight + (uint32_t)array_count(manager->filterHashes); // first height in this range
 
-            manager->lastBlock = block;
+    if (! manager->filterSync || peer != manager->downloadPeer || hashesCount == 0 ||
+        height + hashesCount > manager->filterHeight ||
+        ! UInt256Eq(stopHash, manager->headerChain[height + hashesCount - 1 - manager->headerChainHeight])) {
+        peer_log(peer, "ignoring unexpected cfheaders with stop hash %s", u256hex(stopHash));
+    }
+    else if (height > manager->headerChainHeight && ! UInt256Eq(prevHeader, manager->filterHeader)) {
+        peer_log(peer, "cfheaders doesn't connect to previous filter header at height %"PRIu32, height - 1);
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else if (! _LWPeerManagerFilterCheckpointMatches(manager, height - 1, header)) {
+        peer_log(peer, "cfheaders doesn't match filter header checkpoint at height %"PRIu32, height - 1);
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        // the filter header chain is checked against the checkpoints other peers agreed on
+        for (i = 0; i < hashesCount; i++) {
+            header = LWBlockFilterHeader(filterHashes[i], header);
+            if (! _LWPeerManagerFilterCheckpointMatches(manager, height + (uint32_t)i, header)) break;
+        }
 
-            if (block->height == manager->estimatedHeight) { // chain download is complete
-                saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
-                _LWPeerManagerLoadMempools(manager);
-            }
+        if (i < hashesCount) {
+            peer_log(peer, "cfheaders doesn't match filter header checkpoint at height %"PRIu32, height + (uint32_t)i);
+            _LWPeerManagerPeerMisbehavin(manager, peer);
+        }
+        else {
+            manager->filterHeader = header;
+            array_add_array(manager->filterHashes, filterHashes, hashesCount);
         }
     }
 
-    if (txHashes != _txHashes) free(txHashes);
+    _LWPeerManagerUnlock(manager);
+}
 
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT) {
-        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+static void _peerRelayedFilterCheckpoints(void *info, UInt256 stopHash, const UInt256 filterHeaders[], size_t count)
+{
+    LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
+    uint32_t height;
 
-        // check if the next block was received as an orphan
-        orphan.prevBlock = block->blockHash;
-        next = LWSetRemove(manager->orphans, &orphan);
-    }
+    _LWPeerManagerLock(manager);
+    height = manager->headerChainHeight + (uint32_t)array_count(manager->headerChain) - 1;
 
-    LWMerkleBlock *saveBlocks[saveCount];
+    if (! manager->filterSync || manager->filterHeight == 0 || (peer->flags & PEER_FLAG_CFCHECKPT) ||
+        manager->filterCheckpointPeers >= FILTER_CHECKPOINT_PEERS ||
+        ! UInt256Eq(stopHash, manager->headerChain[array_count(manager->headerChain) - 1])) {
+        peer_log(peer, "ignoring unexpected cfcheckpt with stop hash %s", u256hex(stopHash));
+    }
+    else if (count != height/FILTER_CHECKPOINT_INTERVAL) {
+        peer_log(peer, "cfcheckpt has %zu filter header(s), should be %"PRIu32, count,
+                 height/FILTER_CHECKPOINT_INTERVAL);
+        _LWPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else if (manager->filterCheckpointPeers > 0 &&
+             memcmp(filterHeaders, manager->filterCheckpoints, count*sizeof(*filterHeaders)) != 0) {
+        // there's no telling which peer is lying, so don't trust compact filters from either
+        peer_log(peer, "cfcheckpt doesn't match other peers, fetching blocks instead of compact filters");
+        manager->fetchHeight = manager->matchHeight;
+        _LWPeerManagerStopFilterSync(manager);
+        _LWPeerManagerScheduleDownloads(manager);
+    }
+    else {
+        if (manager->filterCheckpointPeers == 0) array_add_array(manager->filterCheckpoints, filterHeaders, count);
+        peer->flags |= PEER_FLAG_CFCHECKPT;
+        manager->filterCheckpointPeers++;
+        if (manager->downloadPeer) LWPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // sync timeout
 
-    for (i = 0, b = block; b && i < saveCount; i++) {
-        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
-        saveBlocks[i] = b;
-        b = LWSetGet(manager->blocks, &b->prevBlock);
+        if (manager->filterCheckpointPeers == FILTER_CHECKPOINT_PEERS) {
+            peer_log(peer, "filter header checkpoints from %d peers agree, fetching compact filters",
+                     FILTER_CHECKPOINT_PEERS);
+            _LWPeerManagerRequestFilters(manager);
+        }
     }
 
-    // make sure the set of blocks to be saved starts at a difficulty interval
-    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
-    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
-    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
-    pthread_mutex_unlock(&manager->lock);
-    if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
+    _LWPeerManagerUnlock(manager);
+}
 
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= LWPeerLastBlock(peer) &&
-        manager->txStatusUpdate) {
-        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
-    }
+static int _peerBlockTxMatches(void *info, const LWTransaction *tx)
+{
+    LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
 
-    if (next) _peerRelayedBlock(info, next);
+    return LWWalletContainsTransaction(manager->wallet, tx);
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1379,14 +2763,30 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
     LWPeer *peer = ((LWPeerCallbackInfo *)info)->peer;
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     for (size_t i = 0; i < txCount; i++) {
-        _LWTxPeerListRemovePeer(manager->txRelays, txHashes[i], peer);
-        _LWTxPeerListRemovePeer(manager->txRequests, txHashes[i], peer);
+        LWTxRelaysRemove(manager->txRelays, txHashes[i], peer);
+        LWTxRelaysRemoveRequest(manager->txRelays, txHashes[i], peer);
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    for (size_t i = 0; manager->filterSync && i < blockCount; i++) { // a block with a matching filter isn't available
+        if (! UInt256Eq(blockHashes[i], manager->matchedBlock)) continue;
+        peer_log(peer, "block %s matching compact filter not found, disconnecting", u256hex(blockHashes[i]));
+        LWPeerDisconnect(peer);
+    }
+
+    // a download peer may be a few blocks behind, request those from the download peer that announced them instead
+    for (size_t i = 0; manager->downloadPeer && peer != manager->downloadPeer && i < blockCount; i++) {
+        LWDownloadSlot *slot = _LWPeerManagerDownloadSlot(manager, manager->downloadPeer);
+
+        if (! slot || ! _LWPeerManagerDownloadReceived(manager, peer, blockHashes[i])) continue;
+        LWPeerSendGetdata(manager->downloadPeer, NULL, 0, &blockHashes[i], 1);
+        array_add(slot->hashes, blockHashes[i]);
+    }
+
+    _LWPeerManagerScheduleDownloads(manager);
+    _LWPeerManagerUnlock(manager);
 }
 
 static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
@@ -1395,7 +2795,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
     uint64_t maxFeePerKb = 0, secondFeePerKb = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) { // find second highest fee rate
         p = manager->connectedPeers[i - 1];
@@ -1409,7 +2809,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
         LWWalletSetFeePerKb(manager->wallet, secondFeePerKb*3/2);
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
 }
 
 //static void _peerRequestedTxPingDone(void *info, int success)
@@ -1419,14 +2819,14 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
 //    UInt256 txHash = ((LWPeerCallbackInfo *)info)->hash;
 //
 //    free(info);
-//    pthread_mutex_lock(&manager->lock);
+//    _LWPeerManagerLock(manager);
 //
-//    if (success && ! _LWTxPeerListHasPeer(manager->txRequests, txHash, peer)) {
-//        _LWTxPeerListAddPeer(&manager->txRequests, txHash, peer);
+//    if (success && ! LWTxRelaysHasPeer(manager->txRelays, txHash, peer)) {
+//        LWTxRelaysAddRequest(manager->txRelays, txHash, peer, time(NULL));
 //        LWPeerSendGetdata(peer, &txHash, 1, NULL, 0); // check if peer will relay the transaction back
 //    }
 //
-//    pthread_mutex_unlock(&manager->lock);
+//    _LWPeerManagerUnlock(manager);
 //}
 
 static LWTransaction *_peerRequestedTx(void *info, UInt256 txHash)
@@ -1439,7 +2839,7 @@ static LWTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     void (*txCallback)(void *, int) = NULL;
     int hasPendingCallbacks = 0, error = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
@@ -1469,7 +2869,7 @@ static LWTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     }
 
     if (tx && ! error) {
-        _LWTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        LWTxRelaysAdd(manager->txRelays, txHash, peer, time(NULL));
         LWWalletRegisterTransaction(manager->wallet, tx);
     }
 
@@ -1479,7 +2879,7 @@ static LWTransaction *_peerRequestedTx(void *info, UInt256 txHash)
 //    pingInfo->manager = manager;
 //    pingInfo->hash = txHash;
 //    LWPeerSendPing(peer, pingInfo, _peerRequestedTxPingDone);
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     if (txCallback) txCallback(txInfo, error);
     return tx;
 }
@@ -1508,6 +2908,7 @@ LWPeerManager *LWPeerManagerNew(const LWChainParams *params, LWWallet *wallet, u
                                 LWMerkleBlock *blocks[], size_t blocksCount, const LWPeer peers[], size_t peersCount)
 {
     LWPeerManager *manager = calloc(1, sizeof(*manager));
+    LWSet *orphans = LWSetNew(_LWPrevBlockHash, _LWPrevBlockEq, blocksCount); // saved blocks indexed by prevBlock
     LWMerkleBlock orphan, *block = NULL;
 
     assert(manager != NULL);
@@ -1520,13 +2921,16 @@ LWPeerManager *LWPeerManagerNew(const LWChainParams *params, LWWallet *wallet, u
     manager->wallet = wallet;
     manager->earliestKeyTime = earliestKeyTime;
     manager->averageTxPerBlock = 1400;
-    manager->maxConnectCount = PEER_MAX_CONNECTIONS;
-    array_new(manager->peers, peersCount);
-    if (peers) array_add_array(manager->peers, peers, peersCount);
-    qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
+    manager->maxConnectCount = manager->connectCount = PEER_MAX_CONNECTIONS;
+    manager->addrs = LWAddrManagerNew();
+    array_new(manager->dnsPeers, 100);
+    array_new(manager->dnsLookups, 10);
+    manager->dnsResolve = _addressLookup;
+    manager->dnsTimeout = DNS_TIMEOUT;
+    LWAddrManagerAdd(manager->addrs, peers, peersCount, NULL, time(NULL));
     array_new(manager->connectedPeers, PEER_MAX_CONNECTIONS);
     manager->blocks = LWSetNew(LWMerkleBlockHash, LWMerkleBlockEq, blocksCount);
-    manager->orphans = LWSetNew(_LWPrevBlockHash, _LWPrevBlockEq, blocksCount); // orphans are indexed by prevBlock
+    manager->orphans = LWSetNew(_LWOrphanHash, _LWOrphanEq, 100); // orphans are indexed by prevBlock
     manager->checkpoints = LWSetNew(_LWBlockHeightHash, _LWBlockHeightEq, 100); // checkpoints are indexed by height
 
     for (size_t i = 0; i < manager->params->checkpointsCount; i++) {
@@ -1544,26 +2948,52 @@ LWPeerManager *LWPeerManagerNew(const LWChainParams *params, LWWallet *wallet, u
 
     for (size_t i = 0; blocks && i < blocksCount; i++) {
         assert(blocks[i]->height != BLOCK_UNKNOWN_HEIGHT); // height must be saved/restored along with serialized block
-        LWSetAdd(manager->orphans, blocks[i]);
+        LWSetAdd(orphans, blocks[i]);
 
         if ((blocks[i]->height % BLOCK_DIFFICULTY_INTERVAL) == 0 &&
             (! block || blocks[i]->height > block->height)) block = blocks[i]; // find last transition block
     }
 
+    // start from the block before it if that was saved too, it starts the retarget window of the next transition
+    for (size_t i = 0; block && i < blocksCount; i++) {
+        if (! UInt256Eq(blocks[i]->blockHash, block->prevBlock)) continue;
+        block = blocks[i];
+        break;
+    }
+
     while (block) {
         LWSetAdd(manager->blocks, block);
         manager->lastBlock = block;
         orphan.prevBlock = block->prevBlock;
-        LWSetRemove(manager->orphans, &orphan);
+        LWSetRemove(orphans, &orphan);
         orphan.prevBlock = block->blockHash;
-        block = LWSetGet(manager->orphans, &orphan);
-    }
-
-    array_new(manager->txRelays, 10);
-    array_new(manager->txRequests, 10);
+        block = LWSetGet(orphans, &orphan);
+    }
+
+    LWSetApply(orphans, NULL, _setApplyFreeBlock); // free saved blocks that aren't connected to the chain
+    LWSetFree(orphans);
+
+    array_new(manager->chain, blocksCount + 1);
+    _LWPeerManagerSetLastBlock(manager, manager->lastBlock);
+
+    manager->txRelays = LWTxRelaysNew();
+    array_new(manager->orphanList, 100);
+    array_new(manager->orphanPeers, PEER_MAX_CONNECTIONS);
+    array_new(manager->downloadQueue, 500);
+    array_new(manager->headerChain, 0);
+    array_new(manager->headerBlocks, 0);
+    array_new(manager->filterHashes, 0);
+    array_new(manager->filterCheckpoints, 0);
+    array_new(manager->pendingFilters, 0);
+    array_new(manager->filterScripts, 0);
+    array_new(manager->downloadSlots, PEER_MAX_CONNECTIONS);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
+    array_new(manager->confirmedTxHashes, 0);
+    array_new(manager->confirmedTxHeights, 0);
+    array_new(manager->confirmedTxTimes, 0);
     pthread_mutex_init(&manager->lock, NULL);
+    pthread_cond_init(&manager->cond, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
 }
@@ -1599,25 +3029,173 @@ void LWPeerManagerSetCallbacks(LWPeerManager *manager, void *info,
     manager->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// not thread-safe, set once before calling LWPeerManagerConnect()
+// void savePeerStats(void *, const uint8_t[], size_t) - called along with savePeers with the connection stats and bans
+// of known peers, which should be saved to the persistent store and passed to LWPeerManagerLoadPeerStats() on launch
+void LWPeerManagerSetPeerStatsCallback(LWPeerManager *manager,
+                                       void (*savePeerStats)(void *info, const uint8_t stats[], size_t statsLen))
+{
+    assert(manager != NULL);
+    manager->savePeerStats = savePeerStats;
+}
+
+// loads peer connection stats and bans saved by the savePeerStats callback, call before LWPeerManagerConnect()
+// returns true if stats were valid
+int LWPeerManagerLoadPeerStats(LWPeerManager *manager, const uint8_t stats[], size_t statsLen)
+{
+    int r;
+
+    assert(manager != NULL);
+    assert(stats != NULL || statsLen == 0);
+    _LWPeerManagerLock(manager);
+    r = LWAddrManagerLoad(manager->addrs, stats, statsLen, time(NULL));
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// not thread-safe, set once before calling LWPeerManagerConnect()
+// UInt128 *resolve(void *, const char *) - looks up a DNS seed on a background thread in place of getaddrinfo, and
+// returns a UINT128_ZERO terminated array of addresses allocated with malloc, or NULL if the lookup failed
+// seeds that haven't answered after timeout seconds, or when LWPeerManagerDisconnect() is called, are given up on, but
+// resolve keeps running until it returns, so info must stay valid until then, even after manager is freed
+// pass NULL for resolve to use getaddrinfo, and 0 for timeout to use the default of 30 seconds
+void LWPeerManagerSetDNSResolver(LWPeerManager *manager, void *info,
+                                 UInt128 *(*resolve)(void *info, const char *hostname), double timeout)
+{
+    assert(manager != NULL);
+    assert(timeout >= 0);
+    manager->dnsInfo = info;
+    manager->dnsResolve = (resolve) ? resolve : _addressLookup;
+    manager->dnsTimeout = (timeout > 0) ? timeout : DNS_TIMEOUT;
+}
+
+// sets the number of peers to stay connected to, from 1 to PEER_MAX_CONNECTIONS_LIMIT, the default is
+// PEER_MAX_CONNECTIONS, servers can use 8 or more for faster tx propagation and relay confirmation
+void LWPeerManagerSetMaxConnectCount(LWPeerManager *manager, int count)
+{
+    size_t connected = 0;
+
+    assert(manager != NULL);
+    _LWPeerManagerLock(manager);
+    manager->connectCount = (count < 1) ? 1 : (count > PEER_MAX_CONNECTIONS_LIMIT) ? PEER_MAX_CONNECTIONS_LIMIT : count;
+    if (UInt128IsZero(manager->fixedPeer.address)) manager->maxConnectCount = manager->connectCount;
+
+    // the download peer is always kept, so it takes up one of the connections
+    if (manager->downloadPeer && ! (manager->downloadPeer->flags & PEER_FLAG_DROPPED)) connected++;
+
+    for (size_t i = 0; i < array_count(manager->connectedPeers); i++) { // drop any peers past the new count
+        LWPeer *p = manager->connectedPeers[i];
+
+        if (p == manager->downloadPeer || (p->flags & PEER_FLAG_DROPPED)) continue;
+        if (++connected <= (size_t)manager->maxConnectCount) continue;
+        p->flags |= PEER_FLAG_DROPPED;
+        LWPeerDisconnect(p);
+    }
+
+    // connect to more peers if connecting or connected
+    if (connected > 0 && manager->connectFailureCount < MAX_CONNECT_FAILURES) _LWPeerManagerConnectPeers(manager);
+    _LWPeerManagerUnlock(manager);
+}
+
+// sets the number of recent tx hashes each peer remembers as already known, so they aren't announced to it again,
+// 0 keeps the LWPeer default, applies to peers connected after the call
+void LWPeerManagerSetKnownTxCapacity(LWPeerManager *manager, size_t capacity)
+{
+    assert(manager != NULL);
+    _LWPeerManagerLock(manager);
+    manager->knownTxCapacity = capacity;
+    _LWPeerManagerUnlock(manager);
+}
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void LWPeerManagerSetFixedPeer(LWPeerManager *manager, UInt128 address, uint16_t port)
 {
     assert(manager != NULL);
     LWPeerManagerDisconnect(manager);
-    pthread_mutex_lock(&manager->lock);
-    manager->maxConnectCount = UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1;
+    _LWPeerManagerLock(manager);
+    manager->maxConnectCount = UInt128IsZero(address) ? manager->connectCount : 1;
     manager->fixedPeer = ((LWPeer) { address, port, 0, 0, 0 });
-    array_clear(manager->peers);
-    pthread_mutex_unlock(&manager->lock);
+    LWAddrManagerClear(manager->addrs);
+    _LWPeerManagerUnlock(manager);
+}
+
+// set to true to download all block headers up to the best chain tip before fetching filtered blocks after
+// earliestKeyTime, which are then requested by hash from all download peers in large pipelined batches
+void LWPeerManagerSetHeadersFirst(LWPeerManager *manager, int headersFirst)
+{
+    assert(manager != NULL);
+    _LWPeerManagerLock(manager);
+    manager->headersFirst = headersFirst;
+    _LWPeerManagerUnlock(manager);
+}
+
+// set to true to sync blocks after earliestKeyTime with BIP157/158 compact filters when the download peer serves them,
+// after downloading all block headers, filters are matched against the wallet scripts and only matching blocks are
+// fetched in full, bloom filters are still used for unconfirmed tx
+void LWPeerManagerSetCompactFilters(LWPeerManager *manager, int compactFilters)
+{
+    assert(manager != NULL);
+    _LWPeerManagerLock(manager);
+    manager->compactFilters = compactFilters;
+    _LWPeerManagerUnlock(manager);
+}
+
+// not thread-safe, set once before calling LWPeerManagerConnect(), store must not be freed before manager
+// loads the chain from store if it's longer than the one passed to LWPeerManagerNew(), and appends main chain blocks
+// to store whenever saveBlocks is called, so blocks don't need to be saved by the caller
+// store is cleared if it has a block that doesn't match a checkpoint
+void LWPeerManagerSetHeaderStore(LWPeerManager *manager, LWHeaderStore *store)
+{
+    size_t count = (store) ? LWHeaderStoreCount(store) : 0;
+    uint32_t start = (store) ? LWHeaderStoreStartHeight(store) : 0, end = start + (uint32_t)count, height;
+    LWMerkleBlock *block, *b, *prev = NULL;
+
+    assert(manager != NULL);
+    _LWPeerManagerLock(manager);
+    manager->headerStore = store;
+
+    for (size_t i = 0; count > 0 && i < manager->params->checkpointsCount; i++) {
+        const LWCheckPoint *c = &manager->params->checkpoints[i];
+
+        if (c->height < start || c->height >= end ||
+            UInt256Eq(LWHeaderStoreBlockHash(store, c->height), UInt256Reverse(c->hash))) continue;
+        lw_log(LW_LOG_WARN, "header store block #%"PRIu32" doesn't match checkpoint, clearing store", c->height);
+        LWHeaderStoreClear(store);
+        count = 0;
+    }
+
+    height = (count > 0) ? (end - 1) - (end - 1) % BLOCK_DIFFICULTY_INTERVAL : 0; // last stored difficulty transition
+    if (height > start) height--; // along with the block before it, which starts the next retarget window
+
+    // only the blocks from the start of the next retarget window on are needed to verify new blocks
+    while (count > 0 && height >= start && end - 1 > manager->lastBlock->height && height < end) {
+        block = LWHeaderStoreBlock(store, height++);
+
+        if (! block || (prev && ! UInt256Eq(block->prevBlock, prev->blockHash))) {
+            if (block) LWMerkleBlockFree(block);
+            break;
+        }
+
+        b = LWSetGet(manager->blocks, block); // keep blocks that are already known, such as checkpoints
+        if (b && UInt256IsZero(b->prevBlock)) b->prevBlock = block->prevBlock;
+
+        if (b) LWMerkleBlockFree(block);
+        else LWSetAdd(manager->blocks, (b = block));
+        prev = b;
+    }
+
+    if (prev) _LWPeerManagerSetLastBlock(manager, prev);
+    if (prev) _LWPeerManagerWindowStart(manager); // indexes it if the stored chain joined the one already in memory
+    _LWPeerManagerUnlock(manager);
 }
 
 uint16_t LWPeerManagerStandardPort(LWPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     uint16_t port = manager->params->standardPort;
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return port;
 }
 
@@ -1627,31 +3205,79 @@ LWPeerStatus LWPeerManagerConnectStatus(LWPeerManager *manager)
     LWPeerStatus status = LWPeerStatusDisconnected;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     if (manager->isConnected != 0) status = LWPeerStatusConnected;
+    if (manager->dnsThreadCount > 0 && manager->connectFailureCount < MAX_CONNECT_FAILURES) {
+        status = LWPeerStatusConnecting; // waiting for DNS seeds to answer
+    }
 
     for (size_t i = array_count(manager->connectedPeers); i > 0 && status == LWPeerStatusDisconnected; i--) {
         if (LWPeerConnectStatus(manager->connectedPeers[i - 1]) == LWPeerStatusDisconnected) continue;
         status = LWPeerStatusConnecting;
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return status;
 }
 
+// connects to new peers until there are maxConnectCount connected peers, looking up DNS seeds first if needed
+// about half again as many peers as needed are dialed at once, and the slowest to finish the handshake are dropped
+static void _LWPeerManagerConnectPeers(LWPeerManager *manager)
+{
+    time_t now = time(NULL);
+    size_t count = 0, need = 0;
+
+    if (array_count(manager->connectedPeers) < manager->maxConnectCount) {
+        need = manager->maxConnectCount - array_count(manager->connectedPeers);
+    }
+
+    if (need == 0) return;
+
+    LWPeer peers[need + (need + 1)/2];
+
+    if (LWAddrManagerCount(manager->addrs, now - 3*24*60*60, now) < manager->maxConnectCount) {
+        _LWPeerManagerFindPeers(manager);
+    }
+
+    // pick peers at random, weighted by their expected sync throughput
+    count = LWAddrManagerSelect(manager->addrs, peers, sizeof(peers)/sizeof(*peers), manager->connectedPeers,
+                                array_count(manager->connectedPeers), now);
+
+    for (size_t i = 0; i < count; i++) {
+        LWPeerCallbackInfo *info = calloc(1, sizeof(*info));
+
+        assert(info != NULL);
+        info->manager = manager;
+        info->peer = LWPeerNew(manager->params->magicNumber);
+        *info->peer = peers[i];
+        LWAddrManagerAttempt(manager->addrs, info->peer, now);
+        array_add(manager->connectedPeers, info->peer);
+        LWPeerSetCallbacks(info->peer, info, _peerConnected, _peerDisconnected, _peerRelayedPeers,
+                           _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
+                           _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
+        LWPeerSetBlockHashesCallback(info->peer, _peerRelayedBlockHashes);
+        LWPeerSetHeadersDoneCallback(info->peer, _peerHeadersDone);
+        LWPeerSetCompactFilterCallbacks(info->peer, _peerRelayedCompactFilter, _peerRelayedFilterHashes,
+                                        _peerRelayedFilterCheckpoints, _peerBlockTxMatches);
+        LWPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+        if (manager->knownTxCapacity > 0) LWPeerSetKnownTxCapacity(info->peer, manager->knownTxCapacity);
+        LWPeerConnect(info->peer);
+    }
+}
+
 // connect to bitcoin peer-to-peer network (also call this whenever networkIsReachable() status changes)
 void LWPeerManagerConnect(LWPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     if (manager->connectFailureCount >= MAX_CONNECT_FAILURES) manager->connectFailureCount = 0; //this is a manual retry
 
     if ((! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
         manager->syncStartHeight = manager->lastBlock->height + 1;
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
         if (manager->syncStarted) manager->syncStarted(manager->info);
-        pthread_mutex_lock(&manager->lock);
+        _LWPeerManagerLock(manager);
     }
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -1660,85 +3286,43 @@ void LWPeerManagerConnect(LWPeerManager *manager)
         if (LWPeerConnectStatus(p) == LWPeerStatusConnecting) LWPeerConnect(p);
     }
 
-    if (array_count(manager->connectedPeers) < manager->maxConnectCount) {
-        time_t now = time(NULL);
-        LWPeer *peers;
-
-        if (array_count(manager->peers) < manager->maxConnectCount ||
-            manager->peers[manager->maxConnectCount - 1].timestamp + 3*24*60*60 < now) {
-            _LWPeerManagerFindPeers(manager);
-        }
-
-        array_new(peers, 100);
-        array_add_array(peers, manager->peers,
-                        (array_count(manager->peers) < 100) ? array_count(manager->peers) : 100);
-
-        while (array_count(peers) > 0 && array_count(manager->connectedPeers) < manager->maxConnectCount) {
-            size_t i = LWRand((uint32_t)array_count(peers)); // index of random peer
-            LWPeerCallbackInfo *info;
-
-            i = i*i/array_count(peers); // bias random peer selection toward peers with more recent timestamp
+    _LWPeerManagerConnectPeers(manager);
 
-            for (size_t j = array_count(manager->connectedPeers); i != SIZE_MAX && j > 0; j--) {
-                if (! LWPeerEq(&peers[i], manager->connectedPeers[j - 1])) continue;
-                array_rm(peers, i); // already in connectedPeers
-                i = SIZE_MAX;
-            }
-
-            if (i != SIZE_MAX) {
-                info = calloc(1, sizeof(*info));
-                assert(info != NULL);
-                info->manager = manager;
-                info->peer = LWPeerNew(manager->params->magicNumber);
-                *info->peer = peers[i];
-                array_rm(peers, i);
-                array_add(manager->connectedPeers, info->peer);
-                LWPeerSetCallbacks(info->peer, info, _peerConnected, _peerDisconnected, _peerRelayedPeers,
-                                   _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
-                                   _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
-                LWPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
-                LWPeerConnect(info->peer);
-            }
-        }
-
-        array_free(peers);
-    }
-
-    if (array_count(manager->connectedPeers) == 0) {
+    if (array_count(manager->connectedPeers) == 0 && manager->dnsThreadCount == 0) {
         peer_log(&LW_PEER_NONE, "sync failed");
         _LWPeerManagerSyncStopped(manager);
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
         if (manager->syncStopped) manager->syncStopped(manager->info, ENETUNREACH);
     }
-    else pthread_mutex_unlock(&manager->lock);
+    else _LWPeerManagerUnlock(manager);
 }
 
 void LWPeerManagerDisconnect(LWPeerManager *manager)
 {
-    struct timespec ts;
-    size_t peerCount, dnsThreadCount;
-
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
-    peerCount = array_count(manager->connectedPeers);
-    dnsThreadCount = manager->dnsThreadCount;
+    _LWPeerManagerLock(manager);
+    manager->connectFailureCount = MAX_CONNECT_FAILURES; // prevent futher automatic reconnect attempts
 
-    for (size_t i = peerCount; i > 0; i--) {
-        manager->connectFailureCount = MAX_CONNECT_FAILURES; // prevent futher automatic reconnect attempts
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         LWPeerDisconnect(manager->connectedPeers[i - 1]);
     }
 
-    pthread_mutex_unlock(&manager->lock);
-    ts.tv_sec = 0;
-    ts.tv_nsec = 1;
+    for (size_t i = array_count(manager->dnsLookups); i > 0; i--) { // stop waiting for DNS seeds that haven't answered
+        LWDNSLookup *lookup = manager->dnsLookups[i - 1];
+
+        pthread_mutex_lock(&lookup->lock);
+        lookup->isCancelled = 1;
+        pthread_cond_broadcast(&lookup->cond);
+        pthread_mutex_unlock(&lookup->lock);
+    }
 
-    while (peerCount > 0 || dnsThreadCount > 0) {
-        nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-        pthread_mutex_lock(&manager->lock);
-        peerCount = array_count(manager->connectedPeers);
-        dnsThreadCount = manager->dnsThreadCount;
-        pthread_mutex_unlock(&manager->lock);
+    while (array_count(manager->connectedPeers) > 0 || manager->dnsThreadCount > 0) {
+        LWMetricsRecordSince(LWMetricTimerManagerLockHold, manager->lockTime);
+        pthread_cond_wait(&manager->cond, &manager->lock);
+        manager->lockTime = LWMetricsTime();
     }
+
+    _LWPeerManagerUnlock(manager);
 }
 
 // rescans blocks and transactions after earliestKeyTime (a new random download peer is also selected due to the
@@ -1746,7 +3330,7 @@ void LWPeerManagerDisconnect(LWPeerManager *manager)
 void LWPeerManagerRescan(LWPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     if (manager->isConnected) {
         // start the chain download from the most recent checkpoint that's at least a week older than earliestKeyTime
@@ -1754,24 +3338,21 @@ void LWPeerManagerRescan(LWPeerManager *manager)
             if (i - 1 == 0 || manager->params->checkpoints[i - 1].timestamp + 7*24*60*60 < manager->earliestKeyTime) {
                 UInt256 hash = UInt256Reverse(manager->params->checkpoints[i - 1].hash);
 
-                manager->lastBlock = LWSetGet(manager->blocks, &hash);
+                _LWPeerManagerSetLastBlock(manager, LWSetGet(manager->blocks, &hash));
                 break;
             }
         }
 
         if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
-            for (size_t i = array_count(manager->peers); i > 0; i--) {
-                if (LWPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
-            }
-
+            LWAddrManagerRemove(manager->addrs, manager->downloadPeer);
             LWPeerDisconnect(manager->downloadPeer);
         }
 
         manager->syncStartHeight = 0; // a syncStartHeight of 0 indicates that syncing hasn't started yet
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
         LWPeerManagerConnect(manager);
     }
-    else pthread_mutex_unlock(&manager->lock);
+    else _LWPeerManagerUnlock(manager);
 }
 
 // the (unverified) best block height reported by connected peers
@@ -1780,10 +3361,10 @@ uint32_t LWPeerManagerEstimatedBlockHeight(LWPeerManager *manager)
     uint32_t height;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     height = (manager->lastBlock->height < manager->estimatedHeight) ? manager->estimatedHeight :
              manager->lastBlock->height;
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return height;
 }
 
@@ -1793,9 +3374,9 @@ uint32_t LWPeerManagerLastBlockHeight(LWPeerManager *manager)
     uint32_t height;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     height = manager->lastBlock->height;
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return height;
 }
 
@@ -1805,9 +3386,9 @@ uint32_t LWPeerManagerLastBlockTimestamp(LWPeerManager *manager)
     uint32_t timestamp;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     timestamp = manager->lastBlock->timestamp;
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return timestamp;
 }
 
@@ -1818,7 +3399,7 @@ double LWPeerManagerSyncProgress(LWPeerManager *manager, uint32_t startHeight)
     double progress;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     if (startHeight == 0) startHeight = manager->syncStartHeight;
 
     if (! manager->downloadPeer && manager->syncStartHeight == 0) {
@@ -1832,7 +3413,7 @@ double LWPeerManagerSyncProgress(LWPeerManager *manager, uint32_t startHeight)
     }
     else progress = 1.0;
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return progress;
 }
 
@@ -1842,13 +3423,13 @@ size_t LWPeerManagerPeerCount(LWPeerManager *manager)
     size_t count = 0;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (LWPeerConnectStatus(manager->connectedPeers[i - 1]) != LWPeerStatusDisconnected) count++;
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return count;
 }
 
@@ -1856,14 +3437,14 @@ size_t LWPeerManagerPeerCount(LWPeerManager *manager)
 const char *LWPeerManagerDownloadPeerName(LWPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
     if (manager->downloadPeer) {
         sprintf(manager->downloadPeerName, "%s:%d", LWPeerHost(manager->downloadPeer), manager->downloadPeer->port);
     }
     else manager->downloadPeerName[0] = '\0';
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return manager->downloadPeerName;
 }
 
@@ -1873,9 +3454,9 @@ static void _publishTxInvDone(void *info, int success)
     LWPeerManager *manager = ((LWPeerCallbackInfo *)info)->manager;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
     _LWPeerManagerRequestUnrelayedTx(manager, peer);
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
 }
 
 // publishes tx to bitcoin network (do not call LWTransactionFree() on tx afterward)
@@ -1884,10 +3465,10 @@ void LWPeerManagerPublishTx(LWPeerManager *manager, LWTransaction *tx, void *inf
 {
     assert(manager != NULL);
     assert(tx != NULL && LWTransactionIsSigned(tx));
-    if (tx) pthread_mutex_lock(&manager->lock);
+    if (tx) _LWPeerManagerLock(manager);
 
     if (tx && ! LWTransactionIsSigned(tx)) {
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
         LWTransactionFree(tx);
         tx = NULL;
         if (callback) callback(info, EINVAL); // transaction not signed
@@ -1895,7 +3476,7 @@ void LWPeerManagerPublishTx(LWPeerManager *manager, LWTransaction *tx, void *inf
     else if (tx && ! manager->isConnected) {
         int connectFailureCount = manager->connectFailureCount;
 
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
 
         if (connectFailureCount >= MAX_CONNECT_FAILURES ||
             (manager->networkIsReachable && ! manager->networkIsReachable(manager->info))) {
@@ -1903,7 +3484,7 @@ void LWPeerManagerPublishTx(LWPeerManager *manager, LWTransaction *tx, void *inf
             tx = NULL;
             if (callback) callback(info, ENOTCONN); // not connected to bitcoin network
         }
-        else pthread_mutex_lock(&manager->lock);
+        else _LWPeerManagerLock(manager);
     }
 
     if (tx) {
@@ -1934,7 +3515,7 @@ void LWPeerManagerPublishTx(LWPeerManager *manager, LWTransaction *tx, void *inf
             }
         }
 
-        pthread_mutex_unlock(&manager->lock);
+        _LWPeerManagerUnlock(manager);
     }
 }
 
@@ -1945,15 +3526,11 @@ size_t LWPeerManagerRelayCount(LWPeerManager *manager, UInt256 txHash)
 
     assert(manager != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&manager->lock);
+    _LWPeerManagerLock(manager);
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        if (! UInt256Eq(manager->txRelays[i - 1].txHash, txHash)) continue;
-        count = array_count(manager->txRelays[i - 1].peers);
-        break;
-    }
+    count = LWTxRelaysCount(manager->txRelays, txHash);
 
-    pthread_mutex_unlock(&manager->lock);
+    _LWPeerManagerUnlock(manager);
     return count;
 }
 
@@ -1961,22 +3538,180 @@ size_t LWPeerManagerRelayCount(LWPeerManager *manager, UInt256 txHash)
 void LWPeerManagerFree(LWPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
-    array_free(manager->peers);
+    _LWPeerManagerLock(manager);
+    LWAddrManagerFree(manager->addrs);
+    array_free(manager->dnsPeers);
+    array_free(manager->dnsLookups);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) LWPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
     LWSetApply(manager->blocks, NULL, _setApplyFreeBlock);
     LWSetFree(manager->blocks);
-    LWSetApply(manager->orphans, NULL, _setApplyFreeBlock);
+    _LWPeerManagerClearOrphans(manager);
     LWSetFree(manager->orphans);
+    array_free(manager->orphanList);
+    array_free(manager->orphanPeers);
     LWSetFree(manager->checkpoints);
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) free(manager->txRelays[i - 1].peers);
-    array_free(manager->txRelays);
-    for (size_t i = array_count(manager->txRequests); i > 0; i--) free(manager->txRequests[i - 1].peers);
-    array_free(manager->txRequests);
+    array_free(manager->chain);
+    LWTxRelaysFree(manager->txRelays);
+    _LWPeerManagerResetDownloads(manager, 1);
+    array_free(manager->downloadQueue);
+    array_free(manager->headerChain);
+    array_free(manager->headerBlocks);
+    array_free(manager->filterHashes);
+    array_free(manager->filterCheckpoints);
+    array_free(manager->pendingFilters);
+    array_free(manager->filterScripts);
+    array_free(manager->downloadSlots);
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
-    pthread_mutex_unlock(&manager->lock);
+    array_free(manager->confirmedTxHashes);
+    array_free(manager->confirmedTxHeights);
+    array_free(manager->confirmedTxTimes);
+    if (manager->bloomFilter) LWBloomFilterFree(manager->bloomFilter);
+    _LWPeerManagerUnlock(manager);
+    pthread_cond_destroy(&manager->cond);
     pthread_mutex_destroy(&manager->lock);
     free(manager);
 }
+
+// loads a bloom filter for peer if none is loaded, otherwise adds new wallet addresses to it with filteradd
+// returns the number of elements in the filter, or 0 if it has to be rebuilt instead
+size_t LWPeerManagerBloomFilterTest(LWPeerManager *manager, LWPeer *peer)
+{
+    size_t r = 0;
+
+    _LWPeerManagerLock(manager);
+    if (! manager->bloomFilter) _LWPeerManagerLoadBloomFilter(manager, peer);
+    if (manager->bloomFilter && _LWPeerManagerExtendBloomFilter(manager)) r = manager->bloomFilter->elemCount;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// sets the download peer and the estimated chain height, then starts a filter update if downloadPeer isn't NULL
+void LWPeerManagerSetDownloadPeerTest(LWPeerManager *manager, LWPeer *downloadPeer, uint32_t estimatedHeight)
+{
+    _LWPeerManagerLock(manager);
+    manager->downloadPeer = downloadPeer;
+    manager->estimatedHeight = estimatedHeight;
+    _LWPeerManagerUpdateFilter(manager);
+    _LWPeerManagerUnlock(manager);
+}
+
+// relays block as if peer had sent it, returns the number of blocks in the orphan pool afterwards
+size_t LWPeerManagerRelayBlockTest(LWPeerManager *manager, LWPeer *peer, LWMerkleBlock *block)
+{
+    LWPeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+    size_t r;
+
+    _peerRelayedBlock(&info, block);
+    _LWPeerManagerLock(manager);
+    r = manager->orphanCount;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// adds peer to the connected peers, and makes it the download peer if downloadPeer is true
+void LWPeerManagerAddPeerTest(LWPeerManager *manager, LWPeer *peer, int downloadPeer)
+{
+    _LWPeerManagerLock(manager);
+    array_add(manager->connectedPeers, peer);
+    if (downloadPeer) manager->downloadPeer = peer;
+    _LWPeerManagerUnlock(manager);
+}
+
+// handles peer disconnecting with error, as if its connection had closed, returns the connect failure count afterwards
+// peer is freed
+int LWPeerManagerPeerDisconnectedTest(LWPeerManager *manager, LWPeer *peer, int error)
+{
+    LWPeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+    int r;
+
+    _peerDisconnected(&info, error);
+    _LWPeerManagerLock(manager);
+    r = manager->connectFailureCount;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// number of peers the manager stays connected to
+int LWPeerManagerMaxConnectCountTest(LWPeerManager *manager)
+{
+    int r;
+
+    _LWPeerManagerLock(manager);
+    r = manager->maxConnectCount;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// adds block to the orphan pool as if peer had relayed it without it being requested (NULL if it was requested),
+// returns the number of orphans in the pool afterwards, or 0 if block was rejected, in which case the caller frees it
+size_t LWPeerManagerAddOrphanTest(LWPeerManager *manager, LWMerkleBlock *block, const LWPeer *peer)
+{
+    size_t r;
+
+    _LWPeerManagerLock(manager);
+    r = (_LWPeerManagerAddOrphan(manager, block, peer)) ? manager->orphanCount : 0;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// true if a block with blockHash and prevBlock is in the orphan pool
+int LWPeerManagerHasOrphanTest(LWPeerManager *manager, UInt256 prevBlock, UInt256 blockHash)
+{
+    LWOrphan *o;
+
+    _LWPeerManagerLock(manager);
+    o = LWSetGet(manager->orphans, &(LWOrphan) { .prevBlock = prevBlock });
+    while (o && ! UInt256Eq(o->block->blockHash, blockHash)) o = o->sibling;
+    _LWPeerManagerUnlock(manager);
+    return (o != NULL);
+}
+
+// makes the orphans in the pool seconds older
+void LWPeerManagerAgeOrphansTest(LWPeerManager *manager, time_t seconds)
+{
+    _LWPeerManagerLock(manager);
+
+    for (size_t i = manager->orphanHead; i < array_count(manager->orphanList); i++) {
+        manager->orphanList[i]->received -= seconds;
+    }
+
+    _LWPeerManagerUnlock(manager);
+}
+
+// starts a compact filter sync of the count blocks in headerChain following the last block, with the filter header
+// checkpoints requested but none received yet, returns the height of the header chain tip
+uint32_t LWPeerManagerFilterSyncTest(LWPeerManager *manager, LWPeer *downloadPeer, const UInt256 headerChain[],
+                                     size_t count)
+{
+    uint32_t r;
+
+    _LWPeerManagerLock(manager);
+    _LWPeerManagerStopFilterSync(manager);
+    manager->downloadPeer = downloadPeer;
+    manager->filterSync = 1;
+    manager->fetchHeight = 0;
+    array_clear(manager->headerChain);
+    array_add_array(manager->headerChain, headerChain, count);
+    manager->headerChainHeight = manager->lastBlock->height + 1;
+    manager->filterHeight = manager->matchHeight = manager->filterHashHeight = manager->headerChainHeight;
+    r = manager->headerChainHeight + (uint32_t)count - 1;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
+
+// handles a cfcheckpt message from peer, returns the number of peers whose filter header checkpoints agree
+// afterwards, or -1 if compact filter sync was given up
+int LWPeerManagerRelayFilterCheckpointsTest(LWPeerManager *manager, LWPeer *peer, UInt256 stopHash,
+                                            const UInt256 filterHeaders[], size_t count)
+{
+    LWPeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+    int r;
+
+    _peerRelayedFilterCheckpoints(&info, stopHash, filterHeaders, count);
+    _LWPeerManagerLock(manager);
+    r = (manager->filterSync) ? (int)manager->filterCheckpointPeers : -1;
+    _LWPeerManagerUnlock(manager);
+    return r;
+}
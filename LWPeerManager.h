@@ -10,6 +10,7 @@
 #include "LWTransaction.h"
 #include "LWWallet.h"
 #include "LWChainParams.h"
+#include "LWHeaderStore.h"
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -17,7 +18,8 @@
 extern "C" {
 #endif
 
-#define PEER_MAX_CONNECTIONS 3
+#define PEER_MAX_CONNECTIONS       3  // default number of peers to connect to
+#define PEER_MAX_CONNECTIONS_LIMIT 32 // most peers that can be connected to with LWPeerManagerSetMaxConnectCount()
 
 typedef struct LWPeerManagerStruct LWPeerManager;
 
@@ -45,10 +47,52 @@ void LWPeerManagerSetCallbacks(LWPeerManager *manager, void *info,
                                int (*networkIsReachable)(void *info),
                                void (*threadCleanup)(void *info));
 
+// not thread-safe, set once before calling LWPeerManagerConnect()
+// void savePeerStats(void *, const uint8_t[], size_t) - called along with savePeers with the connection stats and bans
+// of known peers, which should be saved to the persistent store and passed to LWPeerManagerLoadPeerStats() on launch
+void LWPeerManagerSetPeerStatsCallback(LWPeerManager *manager,
+                                       void (*savePeerStats)(void *info, const uint8_t stats[], size_t statsLen));
+
+// loads peer connection stats and bans saved by the savePeerStats callback, call before LWPeerManagerConnect()
+// returns true if stats were valid
+int LWPeerManagerLoadPeerStats(LWPeerManager *manager, const uint8_t stats[], size_t statsLen);
+
+// not thread-safe, set once before calling LWPeerManagerConnect()
+// UInt128 *resolve(void *, const char *) - looks up a DNS seed on a background thread in place of getaddrinfo, and
+// returns a UINT128_ZERO terminated array of addresses allocated with malloc, or NULL if the lookup failed
+// seeds that haven't answered after timeout seconds, or when LWPeerManagerDisconnect() is called, are given up on, but
+// resolve keeps running until it returns, so info must stay valid until then, even after manager is freed
+// pass NULL for resolve to use getaddrinfo, and 0 for timeout to use the default of 30 seconds
+void LWPeerManagerSetDNSResolver(LWPeerManager *manager, void *info,
+                                 UInt128 *(*resolve)(void *info, const char *hostname), double timeout);
+
+// sets the number of peers to stay connected to, from 1 to PEER_MAX_CONNECTIONS_LIMIT, the default is
+// PEER_MAX_CONNECTIONS, servers can use 8 or more for faster tx propagation and relay confirmation
+void LWPeerManagerSetMaxConnectCount(LWPeerManager *manager, int count);
+
+// sets the number of recent tx hashes each peer remembers as already known, so they aren't announced to it again,
+// 0 keeps the LWPeer default, applies to peers connected after the call
+void LWPeerManagerSetKnownTxCapacity(LWPeerManager *manager, size_t capacity);
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void LWPeerManagerSetFixedPeer(LWPeerManager *manager, UInt128 address, uint16_t port);
 
+// set to true to download all block headers up to the best chain tip before fetching filtered blocks after
+// earliestKeyTime, which are then requested by hash from all download peers in large pipelined batches
+void LWPeerManagerSetHeadersFirst(LWPeerManager *manager, int headersFirst);
+
+// set to true to sync blocks after earliestKeyTime with BIP157/158 compact filters when the download peer serves them,
+// after downloading all block headers, filters are matched against the wallet scripts and only matching blocks are
+// fetched in full, bloom filters are still used for unconfirmed tx
+void LWPeerManagerSetCompactFilters(LWPeerManager *manager, int compactFilters);
+
+// not thread-safe, set once before calling LWPeerManagerConnect(), store must not be freed before manager
+// loads the chain from store if it's longer than the one passed to LWPeerManagerNew(), and appends main chain blocks
+// to store whenever saveBlocks is called, so blocks don't need to be saved by the caller
+// store is cleared if it has a block that doesn't match a checkpoint
+void LWPeerManagerSetHeaderStore(LWPeerManager *manager, LWHeaderStore *store);
+
 // current connect status
 LWPeerStatus LWPeerManagerConnectStatus(LWPeerManager *manager);
 
@@ -0,0 +1,270 @@
+//
+//  LWTxRelays.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#include "LWTxRelays.h"
+#include "LWSet.h"
+#include <stdlib.h>
+#include <assert.h>
+
+typedef struct LWTxRelayStruct {
+    UInt256 txHash; // must be first so entries can be looked up by txHash
+    uint64_t relays, requests; // bitsets of peers that relayed the tx, and peers the tx was requested from
+    time_t updated;
+    struct LWTxRelayStruct *prev, *next; // neighbors in least recently used order
+} LWTxRelay;
+
+struct LWTxRelaysStruct {
+    LWSet *entries; // entries indexed by txHash
+    LWTxRelay *first, *last; // least and most recently used entries
+    const LWPeer *peers[TX_RELAY_MAX_PEERS]; // the peer tracked by each bit of the relays and requests bitsets
+    time_t peerTimes[TX_RELAY_MAX_PEERS]; // when each peer last relayed a tx or had one requested from it
+};
+
+// returns a hash value for a tx relay entry suitable for use in a hashtable
+inline static size_t _LWTxRelayHash(const void *relay)
+{
+    return (size_t)((const LWTxRelay *)relay)->txHash.u32[0];
+}
+
+// true if relay and otherRelay have equal txHash values
+inline static int _LWTxRelayEq(const void *relay, const void *otherRelay)
+{
+    return (relay == otherRelay ||
+            UInt256Eq(((const LWTxRelay *)relay)->txHash, ((const LWTxRelay *)otherRelay)->txHash));
+}
+
+// number of bits set in bits
+inline static size_t _LWBitCount(uint64_t bits)
+{
+    size_t count = 0;
+
+    for (; bits; count++) bits &= bits - 1;
+    return count;
+}
+
+static void _LWTxRelaysUnlink(LWTxRelays *relays, LWTxRelay *relay)
+{
+    if (relay->prev) relay->prev->next = relay->next;
+    else relays->first = relay->next;
+    if (relay->next) relay->next->prev = relay->prev;
+    else relays->last = relay->prev;
+    relay->prev = relay->next = NULL;
+}
+
+static void _LWTxRelaysAppend(LWTxRelays *relays, LWTxRelay *relay)
+{
+    relay->prev = relays->last;
+    relay->next = NULL;
+    if (relays->last) relays->last->next = relay;
+    else relays->first = relay;
+    relays->last = relay;
+}
+
+static void _LWTxRelaysDrop(LWTxRelays *relays, LWTxRelay *relay)
+{
+    _LWTxRelaysUnlink(relays, relay);
+    LWSetRemove(relays->entries, relay);
+    free(relay);
+}
+
+// returns the entry for txHash as the most recently used one, creating it if needed, after dropping expired entries,
+// and the least recently used one if there are too many
+static LWTxRelay *_LWTxRelaysTouch(LWTxRelays *relays, UInt256 txHash, time_t now)
+{
+    LWTxRelay *relay = LWSetGet(relays->entries, &txHash);
+
+    if (relay) _LWTxRelaysUnlink(relays, relay);
+
+    while (relays->first && (relays->first->updated + TX_RELAY_EXPIRY < now ||
+                             (! relay && LWSetCount(relays->entries) >= TX_RELAY_MAX_COUNT))) {
+        _LWTxRelaysDrop(relays, relays->first);
+    }
+
+    if (! relay) {
+        relay = calloc(1, sizeof(*relay));
+        assert(relay != NULL);
+        relay->txHash = txHash;
+        LWSetAdd(relays->entries, relay);
+    }
+
+    relay->updated = now;
+    _LWTxRelaysAppend(relays, relay);
+    return relay;
+}
+
+// returns the bit used to track peer, or 0 if it has none, if assign is true a peer without one is given an unused
+// bit, or the bit of the least recently used peer once all TX_RELAY_MAX_PEERS bits are in use
+static uint64_t _LWTxRelaysPeerBit(LWTxRelays *relays, const LWPeer *peer, int assign, time_t now)
+{
+    size_t i, lru = 0;
+
+    for (i = 0; i < TX_RELAY_MAX_PEERS && relays->peers[i] != peer; i++);
+    if (i == TX_RELAY_MAX_PEERS && ! assign) return 0;
+
+    if (i == TX_RELAY_MAX_PEERS) {
+        for (i = 0; i < TX_RELAY_MAX_PEERS && relays->peers[i]; i++) {
+            if (relays->peerTimes[i] < relays->peerTimes[lru]) lru = i;
+        }
+
+        if (i == TX_RELAY_MAX_PEERS) { // all bits are in use, reclaim the least recently used one
+            i = lru;
+            LWTxRelaysRemovePeer(relays, relays->peers[i]);
+        }
+
+        relays->peers[i] = peer;
+    }
+
+    if (assign) relays->peerTimes[i] = now;
+    return (uint64_t)1 << i;
+}
+
+// returns a newly allocated LWTxRelays struct that must be freed by calling LWTxRelaysFree()
+// not thread-safe, callers must serialize access
+LWTxRelays *LWTxRelaysNew(void)
+{
+    LWTxRelays *relays = calloc(1, sizeof(*relays));
+
+    assert(relays != NULL);
+    relays->entries = LWSetNew(_LWTxRelayHash, _LWTxRelayEq, 10);
+    return relays;
+}
+
+// adds peer to the peers that have relayed txHash, returns the new total number of peers
+size_t LWTxRelaysAdd(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer, time_t now)
+{
+    uint64_t bit;
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    bit = _LWTxRelaysPeerBit(relays, peer, 1, now); // may drop entries of the peer whose bit is reclaimed
+    relay = _LWTxRelaysTouch(relays, txHash, now);
+    relay->relays |= bit;
+    return _LWBitCount(relay->relays);
+}
+
+// removes peer from the peers that have relayed txHash, returns true if peer was found
+int LWTxRelaysRemove(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer)
+{
+    LWTxRelay *relay;
+    uint64_t bit;
+    int r;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    bit = _LWTxRelaysPeerBit(relays, peer, 0, 0);
+    r = (relay && (relay->relays & bit) != 0);
+    if (r) relay->relays &= ~bit;
+    return r;
+}
+
+// adds peer to the peers that txHash was requested from
+void LWTxRelaysAddRequest(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer, time_t now)
+{
+    uint64_t bit;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    bit = _LWTxRelaysPeerBit(relays, peer, 1, now);
+    _LWTxRelaysTouch(relays, txHash, now)->requests |= bit;
+}
+
+// removes peer from the peers that txHash was requested from
+void LWTxRelaysRemoveRequest(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer)
+{
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    if (relay) relay->requests &= ~_LWTxRelaysPeerBit(relays, peer, 0, 0);
+}
+
+// number of peers that have relayed txHash
+size_t LWTxRelaysCount(LWTxRelays *relays, UInt256 txHash)
+{
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    return (relay) ? _LWBitCount(relay->relays) : 0;
+}
+
+// number of peers that txHash has been requested from
+size_t LWTxRelaysRequestCount(LWTxRelays *relays, UInt256 txHash)
+{
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    return (relay) ? _LWBitCount(relay->requests) : 0;
+}
+
+// true if peer has relayed txHash, or it was requested from peer
+int LWTxRelaysHasPeer(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer)
+{
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    return (relay && ((relay->relays | relay->requests) & _LWTxRelaysPeerBit(relays, peer, 0, 0)) != 0);
+}
+
+// stops tracking relays and requests for txHash
+void LWTxRelaysRemoveTx(LWTxRelays *relays, UInt256 txHash)
+{
+    LWTxRelay *relay;
+
+    assert(relays != NULL);
+    relay = LWSetGet(relays->entries, &txHash);
+    if (relay) _LWTxRelaysDrop(relays, relay);
+}
+
+// removes peer from all tx relays and requests, dropping tx that no other peer is tracked for, and frees its bit to be
+// used for another peer
+void LWTxRelaysRemovePeer(LWTxRelays *relays, const LWPeer *peer)
+{
+    LWTxRelay *relay, *next;
+    uint64_t bit;
+
+    assert(relays != NULL);
+    assert(peer != NULL);
+    bit = _LWTxRelaysPeerBit(relays, peer, 0, 0);
+
+    for (relay = (bit) ? relays->first : NULL; relay; relay = next) {
+        next = relay->next;
+        relay->relays &= ~bit;
+        relay->requests &= ~bit;
+        if ((relay->relays | relay->requests) == 0) _LWTxRelaysDrop(relays, relay);
+    }
+
+    for (size_t i = 0; bit && i < TX_RELAY_MAX_PEERS; i++) {
+        if (relays->peers[i] == peer) relays->peers[i] = NULL;
+    }
+}
+
+// number of tx being tracked
+size_t LWTxRelaysTxCount(LWTxRelays *relays)
+{
+    assert(relays != NULL);
+    return LWSetCount(relays->entries);
+}
+
+// frees memory allocated for relays
+void LWTxRelaysFree(LWTxRelays *relays)
+{
+    LWTxRelay *relay, *next;
+
+    assert(relays != NULL);
+
+    for (relay = relays->first; relay; relay = next) {
+        next = relay->next;
+        free(relay);
+    }
+
+    LWSetFree(relays->entries);
+    free(relays);
+}
@@ -0,0 +1,72 @@
+//
+//  LWTxRelays.h
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+#ifndef LWTxRelays_h
+#define LWTxRelays_h
+
+#include "LWPeer.h"
+#include "LWInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// tracks which peers have relayed each unconfirmed tx, and which peers each tx was requested from
+// peers are tracked as bits in a uint64_t per tx, so at most TX_RELAY_MAX_PEERS peers at once, when all of them are in
+// use the least recently used peer is forgotten to make room for a new one
+// entries are kept in least recently used order, so ones that haven't been relayed or requested for TX_RELAY_EXPIRY
+// seconds, or the oldest ones past TX_RELAY_MAX_COUNT, are dropped from the front
+
+#define TX_RELAY_MAX_PEERS 64          // peers tracked at once
+#define TX_RELAY_MAX_COUNT 10000       // maximum number of tx to track relays and requests for
+#define TX_RELAY_EXPIRY    (24*60*60)  // forget tx that haven't been relayed or requested for this long
+
+typedef struct LWTxRelaysStruct LWTxRelays;
+
+// returns a newly allocated LWTxRelays struct that must be freed by calling LWTxRelaysFree()
+// not thread-safe, callers must serialize access
+LWTxRelays *LWTxRelaysNew(void);
+
+// adds peer to the peers that have relayed txHash, returns the new total number of peers
+size_t LWTxRelaysAdd(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer, time_t now);
+
+// removes peer from the peers that have relayed txHash, returns true if peer was found
+int LWTxRelaysRemove(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer);
+
+// adds peer to the peers that txHash was requested from
+void LWTxRelaysAddRequest(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer, time_t now);
+
+// removes peer from the peers that txHash was requested from
+void LWTxRelaysRemoveRequest(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer);
+
+// number of peers that have relayed txHash
+size_t LWTxRelaysCount(LWTxRelays *relays, UInt256 txHash);
+
+// number of peers that txHash has been requested from
+size_t LWTxRelaysRequestCount(LWTxRelays *relays, UInt256 txHash);
+
+// true if peer has relayed txHash, or it was requested from peer
+int LWTxRelaysHasPeer(LWTxRelays *relays, UInt256 txHash, const LWPeer *peer);
+
+// stops tracking relays and requests for txHash
+void LWTxRelaysRemoveTx(LWTxRelays *relays, UInt256 txHash);
+
+// removes peer from all tx relays and requests, dropping tx that no other peer is tracked for, and frees its bit to be
+// used for another peer
+void LWTxRelaysRemovePeer(LWTxRelays *relays, const LWPeer *peer);
+
+// number of tx being tracked
+size_t LWTxRelaysTxCount(LWTxRelays *relays);
+
+// frees memory allocated for relays
+void LWTxRelaysFree(LWTxRelays *relays);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LWTxRelays_h
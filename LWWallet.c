@@ -6,6 +6,7 @@
 #include "LWSet.h"
 #include "LWAddress.h"
 #include "LWArray.h"
+#include "LWMetrics.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -13,6 +14,8 @@
 #include <pthread.h>
 #include <assert.h>
 
+#define ADDRESS_BATCH 64 // addresses derived and encoded together by LWWalletUnusedAddrs()
+
 struct LWWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
     uint32_t blockHeight;
@@ -27,8 +30,25 @@ struct LWWalletStruct {
     void (*txUpdated)(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight, uint32_t timestamp);
     void (*txDeleted)(void *info, UInt256 txHash, int notifyUser, int recommendRescan);
     pthread_mutex_t lock;
+    uint64_t lockTime; // when lock was last acquired, for measuring how long it's held
 };
 
+// locks wallet, recording how long it took to acquire the lock
+static void _LWWalletLock(LWWallet *wallet)
+{
+    uint64_t start = LWMetricsTime();
+
+    pthread_mutex_lock(&wallet->lock);
+    wallet->lockTime = LWMetricsRecordSince(LWMetricTimerWalletLockWait, start);
+}
+
+// unlocks wallet, recording how long the lock was held
+static void _LWWalletUnlock(LWWallet *wallet)
+{
+    LWMetricsRecordSince(LWMetricTimerWalletLockHold, wallet->lockTime);
+    pthread_mutex_unlock(&wallet->lock);
+}
+
 inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
 {
     uint64_t standardFee = ((size + 999)/1000)*TX_FEE_PER_KB, // standard fee based on tx size rounded up to nearest kb
@@ -131,7 +151,7 @@ static int _LWWalletContainsTx(LWWallet *wallet, const LWTransaction *tx)
 static void _LWWalletUpdateBalance(LWWallet *wallet)
 {
     int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
+    uint64_t balance = 0, prevBalance = 0, start = LWMetricsTime();
     time_t now = time(NULL);
     size_t i, j;
     LWTransaction *tx, *t;
@@ -222,6 +242,7 @@ static void _LWWalletUpdateBalance(LWWallet *wallet)
 
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
     wallet->balance = balance;
+    LWMetricsRecordSince(LWMetricTimerUpdateBalance, start);
 }
 
 // allocates and populates a LWWallet struct which must be freed by calling LWWalletFree()
@@ -308,24 +329,33 @@ size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimi
 
     assert(wallet != NULL);
     assert(gapLimit > 0);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
     i = count = startCount = array_count(addrChain);
     
     // keep only the trailing contiguous block of addresses with no transactions
     while (i > 0 && ! LWSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
     
-    while (i + gapLimit > count) { // generate new addresses up to gapLimit
+    while (i + gapLimit > count) { // generate new addresses up to gapLimit, hashing and encoding them in batches
+        size_t k, n, batch = (i + gapLimit - count < ADDRESS_BATCH) ? i + gapLimit - count : ADDRESS_BATCH;
+        LWAddress addresses[ADDRESS_BATCH];
+        uint8_t pubKeys[ADDRESS_BATCH*33];
         LWKey key;
-        LWAddress address = LW_ADDRESS_NONE;
-        uint8_t pubKey[LWBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = LWBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
-        
-        if (! LWKeySetPubKey(&key, pubKey, len)) break;
-        if (! LWKeyAddress(&key, address.s, sizeof(address)) || LWAddressEq(&address, &LW_ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (LWSetContains(wallet->usedAddrs, &address)) i = count;
+
+        for (n = 0; n < batch; n++) { // stop at the first pubKey that isn't a valid point
+            if (LWBIP32PubKey(&pubKeys[n*33], 33, wallet->masterPubKey, chain, (uint32_t)(count + n)) != 33 ||
+                ! LWKeySetPubKey(&key, &pubKeys[n*33], 33)) break;
+        }
+
+        LWAddressesFromPubKeys(addresses, NULL, pubKeys, n);
+
+        for (k = 0; k < n && ! LWAddressEq(&addresses[k], &LW_ADDRESS_NONE); k++) {
+            array_add(addrChain, addresses[k]);
+            count++;
+            if (LWSetContains(wallet->usedAddrs, &addresses[k])) i = count;
+        }
+
+        if (k < batch) break;
     }
 
     if (addrs && i + gapLimit <= count) {
@@ -354,7 +384,7 @@ size_t LWWalletUnusedAddrs(LWWallet *wallet, LWAddress addrs[], uint32_t gapLimi
         }
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return j;
 }
 
@@ -364,9 +394,9 @@ uint64_t LWWalletBalance(LWWallet *wallet)
     uint64_t balance;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     balance = wallet->balance;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return balance;
 }
 
@@ -374,14 +404,14 @@ uint64_t LWWalletBalance(LWWallet *wallet)
 size_t LWWalletUTXOs(LWWallet *wallet, LWUTXO *utxos, size_t utxosCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (! utxos || array_count(wallet->utxos) < utxosCount) utxosCount = array_count(wallet->utxos);
 
     for (size_t i = 0; utxos && i < utxosCount; i++) {
         utxos[i] = wallet->utxos[i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return utxosCount;
 }
 
@@ -390,14 +420,14 @@ size_t LWWalletUTXOs(LWWallet *wallet, LWUTXO *utxos, size_t utxosCount)
 size_t LWWalletTransactions(LWWallet *wallet, LWTransaction *transactions[], size_t txCount)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (! transactions || array_count(wallet->transactions) < txCount) txCount = array_count(wallet->transactions);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         transactions[i] = wallet->transactions[i];
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return txCount;
 }
 
@@ -409,7 +439,7 @@ size_t LWWalletTxUnconfirmedBefore(LWWallet *wallet, LWTransaction *transactions
     size_t total, n = 0;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     total = array_count(wallet->transactions);
     while (n < total && wallet->transactions[(total - n) - 1]->blockHeight >= blockHeight) n++;
     if (! transactions || n < txCount) txCount = n;
@@ -418,7 +448,7 @@ size_t LWWalletTxUnconfirmedBefore(LWWallet *wallet, LWTransaction *transactions
         transactions[i] = wallet->transactions[(total - n) + i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return txCount;
 }
 
@@ -428,9 +458,9 @@ uint64_t LWWalletTotalSent(LWWallet *wallet)
     uint64_t totalSent;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     totalSent = wallet->totalSent;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return totalSent;
 }
 
@@ -440,9 +470,9 @@ uint64_t LWWalletTotalReceived(LWWallet *wallet)
     uint64_t totalReceived;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     totalReceived = wallet->totalReceived;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return totalReceived;
 }
 
@@ -452,18 +482,18 @@ uint64_t LWWalletFeePerKb(LWWallet *wallet)
     uint64_t feePerKb;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     feePerKb = wallet->feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return feePerKb;
 }
 
 void LWWalletSetFeePerKb(LWWallet *wallet, uint64_t feePerKb)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     wallet->feePerKb = feePerKb;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
 }
 
 // returns the first unused external address
@@ -482,7 +512,7 @@ size_t LWWalletAllAddrs(LWWallet *wallet, LWAddress addrs[], size_t addrsCount)
     size_t i, internalCount = 0, externalCount = 0;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     internalCount = (! addrs || array_count(wallet->internalChain) < addrsCount) ?
                     array_count(wallet->internalChain) : addrsCount;
 
@@ -497,7 +527,7 @@ size_t LWWalletAllAddrs(LWWallet *wallet, LWAddress addrs[], size_t addrsCount)
         addrs[internalCount + i] = wallet->externalChain[i];
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return internalCount + externalCount;
 }
 
@@ -508,9 +538,9 @@ int LWWalletContainsAddress(LWWallet *wallet, const char *addr)
 
     assert(wallet != NULL);
     assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (addr) r = LWSetContains(wallet->allAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return r;
 }
 
@@ -521,9 +551,9 @@ int LWWalletAddressIsUsed(LWWallet *wallet, const char *addr)
 
     assert(wallet != NULL);
     assert(addr != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (addr) r = LWSetContains(wallet->usedAddrs, addr);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return r;
 }
 
@@ -561,7 +591,7 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
     }
     
     minAmount = LWWalletMinOutputAmount(wallet);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     feeAmount = _txFee(wallet->feePerKb, LWTransactionSize(transaction) + TX_OUTPUT_SIZE);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
@@ -582,7 +612,7 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
             // check for sufficient total funds before building a smaller transaction
             if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
                                                   (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
-            pthread_mutex_unlock(&wallet->lock);
+            _LWWalletUnlock(wallet);
 
             if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
                 LWTxOutput newOutputs[outCount];
@@ -597,7 +627,7 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
             else transaction = LWWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
 
             balance = amount = feeAmount = 0;
-            pthread_mutex_lock(&wallet->lock);
+            _LWWalletLock(wallet);
             break;
         }
         
@@ -617,7 +647,7 @@ LWTransaction *LWWalletCreateTxForOutputs(LWWallet *wallet, const LWTxOutput out
         if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     
     if (transaction && (outCount < 1 || balance < amount + feeAmount)) { // no outputs/insufficient funds
         LWTransactionFree(transaction);
@@ -647,7 +677,7 @@ int LWWalletSignTransaction(LWWallet *wallet, LWTransaction *tx, int forkId, con
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     
     for (i = 0; tx && i < tx->inCount; i++) {
         for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
@@ -659,7 +689,7 @@ int LWWalletSignTransaction(LWWallet *wallet, LWTransaction *tx, int forkId, con
         }
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
 
     LWKey keys[internalCount + externalCount];
 
@@ -683,9 +713,9 @@ int LWWalletContainsTransaction(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (tx) r = _LWWalletContainsTx(wallet, tx);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return r;
 }
 
@@ -698,7 +728,7 @@ int LWWalletRegisterTransaction(LWWallet *wallet, LWTransaction *tx)
     assert(tx != NULL && LWTransactionIsSigned(tx));
     
     if (tx && LWTransactionIsSigned(tx)) {
-        pthread_mutex_lock(&wallet->lock);
+        _LWWalletLock(wallet);
 
         if (! LWSetContains(wallet->allTx, tx)) {
             if (_LWWalletContainsTx(wallet, tx)) {
@@ -718,7 +748,7 @@ int LWWalletRegisterTransaction(LWWallet *wallet, LWTransaction *tx)
             }
         }
     
-        pthread_mutex_unlock(&wallet->lock);
+        _LWWalletUnlock(wallet);
     }
     else r = 0;
 
@@ -742,7 +772,7 @@ void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash)
 
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     tx = LWSetGet(wallet->allTx, &txHash);
 
     if (tx) {
@@ -761,7 +791,7 @@ void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash)
         }
         
         if (array_count(hashes) > 0) {
-            pthread_mutex_unlock(&wallet->lock);
+            _LWWalletUnlock(wallet);
             
             for (size_t i = array_count(hashes); i > 0; i--) {
                 LWWalletRemoveTransaction(wallet, hashes[i - 1]);
@@ -779,7 +809,7 @@ void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash)
             }
             
             _LWWalletUpdateBalance(wallet);
-            pthread_mutex_unlock(&wallet->lock);
+            _LWWalletUnlock(wallet);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
             if (LWWalletAmountSentByTx(wallet, tx) > 0 && LWWalletTransactionIsValid(wallet, tx)) {
@@ -800,7 +830,7 @@ void LWWalletRemoveTransaction(LWWallet *wallet, UInt256 txHash)
         
         array_free(hashes);
     }
-    else pthread_mutex_unlock(&wallet->lock);
+    else _LWWalletUnlock(wallet);
 }
 
 // returns the transaction with the given hash if it's been registered in the wallet
@@ -810,9 +840,9 @@ LWTransaction *LWWalletTransactionForHash(LWWallet *wallet, UInt256 txHash)
     
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     tx = LWSetGet(wallet->allTx, &txHash);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return tx;
 }
 
@@ -829,7 +859,7 @@ int LWWalletTransactionIsValid(LWWallet *wallet, const LWTransaction *tx)
     // TODO: XXX conflicted tx with the same wallet outputs should be presented as the same tx to the user
 
     if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be invalid
-        pthread_mutex_lock(&wallet->lock);
+        _LWWalletLock(wallet);
 
         if (! LWSetContains(wallet->allTx, tx)) {
             for (size_t i = 0; r && i < tx->inCount; i++) {
@@ -838,7 +868,7 @@ int LWWalletTransactionIsValid(LWWallet *wallet, const LWTransaction *tx)
         }
         else if (LWSetContains(wallet->invalidTx, tx)) r = 0;
 
-        pthread_mutex_unlock(&wallet->lock);
+        _LWWalletUnlock(wallet);
 
         for (size_t i = 0; r && i < tx->inCount; i++) {
             t = LWWalletTransactionForHash(wallet, tx->inputs[i].txHash);
@@ -859,9 +889,9 @@ int LWWalletTransactionIsPending(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL && LWTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     blockHeight = wallet->blockHeight;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
 
     if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be postdated
         if (LWTransactionSize(tx) > TX_MAX_SIZE) r = 1; // check transaction size is under TX_MAX_SIZE
@@ -908,6 +938,36 @@ int LWWalletTransactionIsVerified(LWWallet *wallet, const LWTransaction *tx)
     return r;
 }
 
+// sets tx's block height and timestamp, returns true if tx is a wallet tx and either of them changed, confirmed
+// non-wallet tx are removed and freed, needsUpdate is set if the wallet balance has to be updated
+static int _LWWalletSetTxHeight(LWWallet *wallet, LWTransaction *tx, uint32_t blockHeight, uint32_t timestamp,
+                                int *needsUpdate)
+{
+    size_t k;
+
+    if (tx->blockHeight == blockHeight && tx->timestamp == timestamp) return 0;
+    tx->timestamp = timestamp;
+    tx->blockHeight = blockHeight;
+
+    if (_LWWalletContainsTx(wallet, tx)) {
+        for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
+            if (! LWTransactionEq(wallet->transactions[k - 1], tx)) continue;
+            array_rm(wallet->transactions, k - 1);
+            _LWWalletInsertTx(wallet, tx);
+            break;
+        }
+
+        if (LWSetContains(wallet->pendingTx, tx) || LWSetContains(wallet->invalidTx, tx)) *needsUpdate = 1;
+        return 1;
+    }
+    else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
+        LWSetRemove(wallet->allTx, tx);
+        LWTransactionFree(tx);
+    }
+
+    return 0;
+}
+
 // set the block heights and timestamps for the given transactions
 // use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
 void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
@@ -916,51 +976,76 @@ void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size
     LWTransaction *tx;
     UInt256 hashes[txCount];
     int needsUpdate = 0;
-    size_t i, j, k;
+    size_t i, j;
     
     assert(wallet != NULL);
     assert(txHashes != NULL || txCount == 0);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     if (blockHeight > wallet->blockHeight) wallet->blockHeight = blockHeight;
     
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
         tx = LWSetGet(wallet->allTx, &txHashes[i]);
-        if (! tx || (tx->blockHeight == blockHeight && tx->timestamp == timestamp)) continue;
-        tx->timestamp = timestamp;
-        tx->blockHeight = blockHeight;
-        
-        if (_LWWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! LWTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _LWWalletInsertTx(wallet, tx);
-                break;
-            }
-            
-            hashes[j++] = txHashes[i];
-            if (LWSetContains(wallet->pendingTx, tx) || LWSetContains(wallet->invalidTx, tx)) needsUpdate = 1;
-        }
-        else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
-            LWSetRemove(wallet->allTx, tx);
-            LWTransactionFree(tx);
-        }
+        if (tx && _LWWalletSetTxHeight(wallet, tx, blockHeight, timestamp, &needsUpdate)) hashes[j++] = txHashes[i];
     }
     
     if (needsUpdate) _LWWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     if (needsUpdate && wallet->balanceChanged) {
         wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
     }
     if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
 }
 
+// sets the block heights and timestamps for transactions confirmed in a run of blocks, blockHeights[i] and
+// timestamps[i] are for txHashes[i], the balance is updated once for the whole run, and txUpdated is called once for
+// each consecutive group of tx with the same block height and timestamp
+void LWWalletUpdateBlockTransactions(LWWallet *wallet, const UInt256 txHashes[], const uint32_t blockHeights[],
+                                     const uint32_t timestamps[], size_t txCount)
+{
+    LWTransaction *tx;
+    UInt256 *hashes = (txCount > 0) ? malloc(txCount*sizeof(*hashes)) : NULL;
+    size_t *updated = (txCount > 0) ? malloc(txCount*sizeof(*updated)) : NULL, i, j, n = 0;
+    int needsUpdate = 0;
+
+    assert(wallet != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    assert(blockHeights != NULL || txCount == 0);
+    assert(timestamps != NULL || txCount == 0);
+    assert((hashes != NULL && updated != NULL) || txCount == 0);
+    _LWWalletLock(wallet);
+
+    for (i = 0; i < txCount; i++) {
+        if (blockHeights[i] != TX_UNCONFIRMED && blockHeights[i] > wallet->blockHeight) {
+            wallet->blockHeight = blockHeights[i];
+        }
+
+        tx = LWSetGet(wallet->allTx, &txHashes[i]);
+        if (! tx || ! _LWWalletSetTxHeight(wallet, tx, blockHeights[i], timestamps[i], &needsUpdate)) continue;
+        hashes[n] = txHashes[i];
+        updated[n++] = i;
+    }
+
+    if (needsUpdate) _LWWalletUpdateBalance(wallet);
+    _LWWalletUnlock(wallet);
+    if (needsUpdate && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+
+    for (i = 0; wallet->txUpdated && i < n; i = j) {
+        for (j = i + 1; j < n && blockHeights[updated[j]] == blockHeights[updated[i]] &&
+             timestamps[updated[j]] == timestamps[updated[i]]; j++);
+        wallet->txUpdated(wallet->callbackInfo, &hashes[i], j - i, blockHeights[updated[i]], timestamps[updated[i]]);
+    }
+
+    if (hashes) free(hashes);
+    if (updated) free(updated);
+}
+
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void LWWalletSetTxUnconfirmedAfter(LWWallet *wallet, uint32_t blockHeight)
 {
     size_t i, j, count;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     wallet->blockHeight = blockHeight;
     count = i = array_count(wallet->transactions);
     while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
@@ -974,7 +1059,7 @@ void LWWalletSetTxUnconfirmedAfter(LWWallet *wallet, uint32_t blockHeight)
     }
     
     if (count > 0) _LWWalletUpdateBalance(wallet);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     if (count > 0 && wallet->balanceChanged) {
         wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
     }
@@ -988,14 +1073,14 @@ uint64_t LWWalletAmountReceivedFromTx(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
         if (LWSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return amount;
 }
 
@@ -1006,7 +1091,7 @@ uint64_t LWWalletAmountSentByTx(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     
     for (size_t i = 0; tx && i < tx->inCount; i++) {
         LWTransaction *t = LWSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1017,7 +1102,7 @@ uint64_t LWWalletAmountSentByTx(LWWallet *wallet, const LWTransaction *tx)
         }
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return amount;
 }
 
@@ -1028,7 +1113,7 @@ uint64_t LWWalletFeeForTx(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     
     for (size_t i = 0; tx && i < tx->inCount && amount != UINT64_MAX; i++) {
         LWTransaction *t = LWSetGet(wallet->allTx, &tx->inputs[i].txHash);
@@ -1040,7 +1125,7 @@ uint64_t LWWalletFeeForTx(LWWallet *wallet, const LWTransaction *tx)
         else amount = UINT64_MAX;
     }
     
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     
     for (size_t i = 0; tx && i < tx->outCount && amount != UINT64_MAX; i++) {
         amount -= tx->outputs[i].amount;
@@ -1056,7 +1141,7 @@ uint64_t LWWalletBalanceAfterTx(LWWallet *wallet, const LWTransaction *tx)
     
     assert(wallet != NULL);
     assert(tx != NULL && LWTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     balance = wallet->balance;
     
     for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
@@ -1065,7 +1150,7 @@ uint64_t LWWalletBalanceAfterTx(LWWallet *wallet, const LWTransaction *tx)
         break;
     }
 
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return balance;
 }
 
@@ -1075,9 +1160,9 @@ uint64_t LWWalletFeeForTxSize(LWWallet *wallet, size_t size)
     uint64_t fee;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     fee = _txFee(wallet->feePerKb, size);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return fee;
 }
 
@@ -1111,9 +1196,9 @@ uint64_t LWWalletMinOutputAmount(LWWallet *wallet)
     uint64_t amount;
     
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     amount = (TX_MIN_OUTPUT_AMOUNT*wallet->feePerKb + MIN_FEE_PER_KB - 1)/MIN_FEE_PER_KB;
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     return (amount > TX_MIN_OUTPUT_AMOUNT) ? amount : TX_MIN_OUTPUT_AMOUNT;
 }
 
@@ -1126,7 +1211,7 @@ uint64_t LWWalletMaxOutputAmount(LWWallet *wallet)
     size_t i, txSize, cpfpSize = 0, inCount = 0;
 
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
 
     for (i = array_count(wallet->utxos); i > 0; i--) {
         o = &wallet->utxos[i - 1];
@@ -1143,7 +1228,7 @@ uint64_t LWWalletMaxOutputAmount(LWWallet *wallet)
 
     txSize = 8 + LWVarIntSize(inCount) + TX_INPUT_SIZE*inCount + LWVarIntSize(2) + TX_OUTPUT_SIZE*2;
     fee = _txFee(wallet->feePerKb, txSize + cpfpSize);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     
     return (amount > fee) ? amount - fee : 0;
 }
@@ -1152,7 +1237,7 @@ uint64_t LWWalletMaxOutputAmount(LWWallet *wallet)
 void LWWalletFree(LWWallet *wallet)
 {
     assert(wallet != NULL);
-    pthread_mutex_lock(&wallet->lock);
+    _LWWalletLock(wallet);
     LWSetFree(wallet->allAddrs);
     LWSetFree(wallet->usedAddrs);
     LWSetFree(wallet->allTx);
@@ -1169,7 +1254,7 @@ void LWWalletFree(LWWallet *wallet)
 
     array_free(wallet->transactions);
     array_free(wallet->utxos);
-    pthread_mutex_unlock(&wallet->lock);
+    _LWWalletUnlock(wallet);
     pthread_mutex_destroy(&wallet->lock);
     free(wallet);
 }
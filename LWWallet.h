@@ -140,6 +140,12 @@ int LWWalletTransactionIsVerified(LWWallet *wallet, const LWTransaction *tx);
 // use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
 void LWWalletUpdateTransactions(LWWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
                                 uint32_t timestamp);
+
+// sets the block heights and timestamps for transactions confirmed in a run of blocks, blockHeights[i] and
+// timestamps[i] are for txHashes[i], the balance is updated once for the whole run, and txUpdated is called once for
+// each consecutive group of tx with the same block height and timestamp
+void LWWalletUpdateBlockTransactions(LWWallet *wallet, const UInt256 txHashes[], const uint32_t blockHeights[],
+                                     const uint32_t timestamps[], size_t txCount);
     
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void LWWalletSetTxUnconfirmedAfter(LWWallet *wallet, uint32_t blockHeight);
@@ -0,0 +1,553 @@
+//
+//  bench.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+// microbenchmarks for the crypto, serialization and set primitives, built like test.c but with its own main(), e.g.
+// cc -O3 -Isecp256k1 -o bench bench.c LW*.c -lpthread -lm
+//
+// usage: bench [prefix ...] runs all benchmarks, or only those with names starting with one of the given prefixes
+//
+// writes a csv header line and then one line per benchmark to stdout, so results can be compared across versions:
+// name - benchmark name, and the item size or set size where it matters
+// iterations - total timed iterations over all samples
+// bytes - bytes processed per iteration, 0 when throughput in bytes doesn't apply
+// mean_ns, median_ns, min_ns, max_ns - latency per iteration, median/min/max are over the per sample means
+// ops_per_sec, mb_per_sec - throughput from mean_ns
+
+#include "LWCrypto.h"
+#include "LWSet.h"
+#include "LWBloomFilter.h"
+#include "LWTransaction.h"
+#include "LWKey.h"
+#include "LWAddress.h"
+#include "LWBase58.h"
+#include "LWBech32.h"
+#include "LWMetrics.h"
+#include "LWInt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#define BENCH_SAMPLES     15 // timed samples per benchmark
+#define BENCH_SAMPLE_TIME 20000000 // target nanoseconds per sample
+#define BENCH_SET_ITEMS   1000000 // largest set size benchmarked
+
+static int _benchArgc;
+static const char **_benchArgv;
+static uint64_t _benchUntimed; // nanoseconds of the current sample spent on setup that shouldn't be counted
+static volatile uint8_t _benchSink; // results are folded in here so the compiler can't drop the benchmarked calls
+
+// fills buf with deterministic pseudo-random bytes
+static void _BenchFill(void *buf, size_t len, uint32_t seed)
+{
+    uint8_t md[32], *b = buf;
+    uint32_t in[2] = { seed, 0 };
+
+    for (size_t i = 0; i < len; i += sizeof(md)) {
+        LWSHA256(md, in, sizeof(in));
+        memcpy(&b[i], md, (len - i < sizeof(md)) ? len - i : sizeof(md));
+        in[1]++;
+    }
+}
+
+static int _BenchSelected(const char *name)
+{
+    if (_benchArgc < 2) return 1;
+
+    for (int i = 1; i < _benchArgc; i++) {
+        if (strncmp(name, _benchArgv[i], strlen(_benchArgv[i])) == 0) return 1;
+    }
+
+    return 0;
+}
+
+static int _BenchCompare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+// nanoseconds for n iterations of run, less any time run reports as untimed
+static uint64_t _BenchTime(void (*run)(void *info, size_t n), void *info, size_t n)
+{
+    uint64_t start;
+
+    _benchUntimed = 0;
+    start = LWMetricsTime();
+    run(info, n);
+    return LWMetricsTime() - start - _benchUntimed;
+}
+
+// times run over BENCH_SAMPLES samples of about BENCH_SAMPLE_TIME each and writes a result line
+static void _Bench(const char *name, size_t bytes, void (*run)(void *info, size_t n), void *info)
+{
+    double ns[BENCH_SAMPLES], total = 0, mean;
+    uint64_t t;
+    size_t n = 1, i;
+
+    if (! _BenchSelected(name)) return;
+    t = _BenchTime(run, info, n); // warm up caches and lazily initialized state
+
+    while ((t = _BenchTime(run, info, n)) < BENCH_SAMPLE_TIME/10) n *= 2;
+    n = (size_t)((double)n*BENCH_SAMPLE_TIME/(t ? t : 1));
+    if (n == 0) n = 1;
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        ns[i] = (double)_BenchTime(run, info, n)/n;
+        total += ns[i];
+    }
+
+    qsort(ns, BENCH_SAMPLES, sizeof(*ns), _BenchCompare);
+    mean = total/BENCH_SAMPLES;
+    printf("%s,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%.0f,%.2f\n", name, n*BENCH_SAMPLES, bytes, mean, ns[BENCH_SAMPLES/2],
+           ns[0], ns[BENCH_SAMPLES - 1], 1e9/mean, (double)bytes*1e3/mean);
+    fflush(stdout);
+}
+
+typedef struct {
+    void (*hash)(void *, const void *, size_t);
+    const uint8_t *data;
+    size_t len;
+} BenchHash;
+
+static void _BenchHashRun(void *info, size_t n)
+{
+    BenchHash *b = info;
+    uint8_t md[64];
+
+    for (size_t i = 0; i < n; i++) b->hash(md, b->data, b->len), _benchSink ^= md[0];
+}
+
+static void _BenchHash160ArrayRun(void *info, size_t n) // one iteration is one 33 byte item of a batch of 64
+{
+    const uint8_t *data = info;
+    uint8_t md[64*20];
+
+    for (size_t i = 0; i < n; i += 64) LWHash160Array(md, data, 33, (n - i < 64) ? n - i : 64), _benchSink ^= md[0];
+}
+
+static void _BenchScryptRun(void *info, size_t n) // litecoin proof-of-work hash of an 80 byte block header
+{
+    const uint8_t *header = info;
+    uint8_t md[32];
+
+    for (size_t i = 0; i < n; i++) LWScrypt(md, sizeof(md), header, 80, header, 80, 1024, 1, 1), _benchSink ^= md[0];
+}
+
+static void _BenchScryptBufRun(void *info, size_t n)
+{
+    const uint8_t *header = info;
+    uint8_t md[32], *scratch = malloc(128*1024);
+
+    for (size_t i = 0; scratch && i < n; i++) {
+        LWScryptBuf(md, sizeof(md), header, 80, header, 80, 1024, 1, 1, scratch);
+        _benchSink ^= md[0];
+    }
+
+    free(scratch);
+}
+
+static void _BenchHMACRun(void *info, size_t n)
+{
+    const uint8_t *data = info;
+    uint8_t mac[32];
+
+    for (size_t i = 0; i < n; i++) LWHMAC(mac, LWSHA256, 32, data, 32, data, 64), _benchSink ^= mac[0];
+}
+
+typedef struct {
+    LWHMACContext ctx;
+    const uint8_t *data;
+} BenchHMAC;
+
+static void _BenchHMACContextRun(void *info, size_t n) // BIP32 child key derivation, with the chain code as key
+{
+    const BenchHMAC *b = info;
+    uint8_t mac[64];
+
+    for (size_t i = 0; i < n; i++) LWHMACContextMac(&b->ctx, mac, b->data, 37), _benchSink ^= mac[0];
+}
+
+static void _BenchPBKDF2Run(void *info, size_t n) // BIP39 seed derivation
+{
+    const char *phrase = info;
+    uint8_t dk[64];
+
+    for (size_t i = 0; i < n; i++) {
+        LWPBKDF2(dk, sizeof(dk), LWSHA512, 64, phrase, strlen(phrase), "mnemonic", 8, 2048);
+        _benchSink ^= dk[0];
+    }
+}
+
+typedef struct {
+    LWSet *set;
+    UInt256 *items;
+    size_t count, next;
+} BenchSet;
+
+static size_t _BenchSetHash(const void *item)
+{
+    return (size_t)((const UInt256 *)item)->u64[0];
+}
+
+static int _BenchSetEq(const void *item, const void *otherItem)
+{
+    return (item == otherItem || UInt256Eq(*(const UInt256 *)item, *(const UInt256 *)otherItem));
+}
+
+static void _BenchSetAddRun(void *info, size_t n) // grows a new set from empty to count items, over and over
+{
+    BenchSet *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        if (b->next == b->count) LWSetFree(b->set), b->set = LWSetNew(_BenchSetHash, _BenchSetEq, 0), b->next = 0;
+        LWSetAdd(b->set, &b->items[b->next++]);
+    }
+}
+
+static void _BenchSetGetRun(void *info, size_t n) // random lookups of items in a set of count items
+{
+    BenchSet *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        if (b->next == b->count) b->next = 0;
+        _benchSink ^= (LWSetGet(b->set, &b->items[b->next++]) != NULL);
+    }
+}
+
+static void _BenchSetRemoveRun(void *info, size_t n) // removes all items of a set of count items, refilling untimed
+{
+    BenchSet *b = info;
+    uint64_t start;
+
+    for (size_t i = 0; i < n; i++) {
+        if (b->next == b->count) {
+            start = LWMetricsTime();
+            for (size_t j = 0; j < b->count; j++) LWSetAdd(b->set, &b->items[j]);
+            b->next = 0;
+            _benchUntimed += LWMetricsTime() - start;
+        }
+
+        _benchSink ^= (LWSetRemove(b->set, &b->items[b->next++]) != NULL);
+    }
+}
+
+static void _BenchSets(UInt256 *items)
+{
+    static const size_t sizes[] = { 1000, 100000, BENCH_SET_ITEMS };
+    char name[64];
+    BenchSet b;
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        b = (BenchSet) { LWSetNew(_BenchSetHash, _BenchSetEq, 0), items, sizes[i], 0 };
+        snprintf(name, sizeof(name), "set_add_%zu", sizes[i]);
+        _Bench(name, 0, _BenchSetAddRun, &b);
+        LWSetFree(b.set);
+
+        b = (BenchSet) { LWSetNew(_BenchSetHash, _BenchSetEq, sizes[i]), items, sizes[i], 0 };
+        for (size_t j = 0; j < sizes[i]; j++) LWSetAdd(b.set, &items[j]);
+        snprintf(name, sizeof(name), "set_get_%zu", sizes[i]);
+        _Bench(name, 0, _BenchSetGetRun, &b);
+        b.next = sizes[i]; // refill before the first removal
+        LWSetClear(b.set);
+        snprintf(name, sizeof(name), "set_remove_%zu", sizes[i]);
+        _Bench(name, 0, _BenchSetRemoveRun, &b);
+        LWSetFree(b.set);
+    }
+}
+
+typedef struct {
+    LWTransaction *tx;
+    LWKey *key;
+    uint8_t *buf;
+    size_t len;
+} BenchTx;
+
+static void _BenchTxParseRun(void *info, size_t n)
+{
+    BenchTx *b = info;
+    LWTransaction *tx;
+
+    for (size_t i = 0; i < n; i++) {
+        tx = LWTransactionParse(b->buf, b->len);
+        if (tx) _benchSink ^= tx->txHash.u8[0], LWTransactionFree(tx);
+    }
+}
+
+static void _BenchTxSerializeRun(void *info, size_t n)
+{
+    BenchTx *b = info;
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWTransactionSerialize(b->tx, b->buf, b->len);
+}
+
+static void _BenchTxSignRun(void *info, size_t n) // sighash and signature for every input
+{
+    BenchTx *b = info;
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWTransactionSign(b->tx, 0, b->key, 1);
+}
+
+static void _BenchTransactions(LWKey *key)
+{
+    static const size_t inCounts[] = { 1, 10, 100 };
+    UInt256 inHash;
+    LWAddress address = LW_ADDRESS_NONE;
+    char name[64];
+    BenchTx b;
+
+    LWKeyAddress(key, address.s, sizeof(address));
+
+    uint8_t script[LWAddressScriptPubKey(NULL, 0, address.s)];
+    size_t scriptLen = LWAddressScriptPubKey(script, sizeof(script), address.s);
+
+    for (size_t i = 0; i < sizeof(inCounts)/sizeof(*inCounts); i++) {
+        b.tx = LWTransactionNew();
+        b.key = key;
+
+        for (size_t j = 0; j < inCounts[i]; j++) {
+            _BenchFill(&inHash, sizeof(inHash), (uint32_t)j);
+            LWTransactionAddInput(b.tx, inHash, 0, 100000, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+        }
+
+        LWTransactionAddOutput(b.tx, 100000*inCounts[i] - 10000, script, scriptLen);
+        LWTransactionAddOutput(b.tx, 5000, script, scriptLen);
+        snprintf(name, sizeof(name), "tx_sign_%zuin", inCounts[i]);
+        _Bench(name, 0, _BenchTxSignRun, &b);
+
+        b.len = LWTransactionSerialize(b.tx, NULL, 0);
+        b.buf = malloc(b.len);
+
+        if (b.buf) {
+            snprintf(name, sizeof(name), "tx_serialize_%zuin", inCounts[i]);
+            _Bench(name, b.len, _BenchTxSerializeRun, &b);
+            snprintf(name, sizeof(name), "tx_parse_%zuin", inCounts[i]);
+            _Bench(name, b.len, _BenchTxParseRun, &b);
+        }
+
+        free(b.buf);
+        LWTransactionFree(b.tx);
+    }
+}
+
+typedef struct {
+    LWKey key;
+    UInt256 md;
+    uint8_t sig[72], compactSig[65];
+    size_t sigLen;
+} BenchKey;
+
+static void _BenchKeySignRun(void *info, size_t n)
+{
+    BenchKey *b = info;
+    uint8_t sig[72];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWKeySign(&b->key, sig, sizeof(sig), b->md);
+}
+
+static void _BenchKeyVerifyRun(void *info, size_t n)
+{
+    BenchKey *b = info;
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWKeyVerify(&b->key, b->md, b->sig, b->sigLen);
+}
+
+static void _BenchKeyCompactSignRun(void *info, size_t n)
+{
+    BenchKey *b = info;
+    uint8_t sig[65];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWKeyCompactSign(&b->key, sig, sizeof(sig), b->md);
+}
+
+static void _BenchKeyRecoverRun(void *info, size_t n)
+{
+    BenchKey *b = info;
+    LWKey key;
+
+    for (size_t i = 0; i < n; i++) {
+        _benchSink ^= (uint8_t)LWKeyRecoverPubKey(&key, b->md, b->compactSig, sizeof(b->compactSig));
+    }
+}
+
+static void _BenchKeyPubKeyRun(void *info, size_t n) // public key derivation from a secret
+{
+    BenchKey *b = info;
+    uint8_t pubKey[33];
+    LWKey key;
+
+    for (size_t i = 0; i < n; i++) {
+        LWKeySetSecret(&key, &b->key.secret, 1);
+        _benchSink ^= (uint8_t)LWKeyPubKey(&key, pubKey, sizeof(pubKey));
+    }
+
+    LWKeyClean(&key);
+}
+
+static void _BenchBase58EncodeRun(void *info, size_t n)
+{
+    const uint8_t *data = info;
+    char str[64];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWBase58CheckEncode(str, sizeof(str), data, 21);
+}
+
+static void _BenchBase58EncodeArrayRun(void *info, size_t n) // one iteration is one item of a batch of 64
+{
+    const uint8_t *data = info;
+    char str[64*36];
+
+    for (size_t i = 0; i < n; i += 64) {
+        _benchSink ^= (uint8_t)LWBase58CheckEncodeArray(str, 36, data, 21, (n - i < 64) ? n - i : 64);
+    }
+}
+
+static void _BenchBase58DecodeRun(void *info, size_t n)
+{
+    const char *str = info;
+    uint8_t data[32];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWBase58CheckDecode(data, sizeof(data), str);
+}
+
+static void _BenchBech32EncodeRun(void *info, size_t n)
+{
+    const uint8_t *data = info;
+    char addr[91];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWBech32Encode(addr, "ltc", data);
+}
+
+static void _BenchBech32DecodeRun(void *info, size_t n)
+{
+    const char *addr = info;
+    char hrp[84];
+    uint8_t data[42];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWBech32Decode(hrp, data, addr);
+}
+
+typedef struct {
+    LWBloomFilter *filter;
+    const uint8_t *items; // 32 byte items, the first half inserted into the filter
+    size_t count, next;
+} BenchBloom;
+
+static void _BenchBloomInsertRun(void *info, size_t n)
+{
+    BenchBloom *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        if (b->next >= b->count) b->next = 0;
+        LWBloomFilterInsertData(b->filter, &b->items[32*b->next++], 32);
+    }
+}
+
+static void _BenchBloomContainsRun(void *info, size_t n) // alternates items in the filter with items that aren't
+{
+    BenchBloom *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        if (b->next >= b->count*2) b->next = 0;
+        _benchSink ^= (uint8_t)LWBloomFilterContainsData(b->filter, &b->items[32*b->next++], 32);
+    }
+}
+
+static void _BenchBloomSerializeRun(void *info, size_t n)
+{
+    BenchBloom *b = info;
+    uint8_t buf[BLOOM_MAX_FILTER_LENGTH + 16];
+
+    for (size_t i = 0; i < n; i++) _benchSink ^= (uint8_t)LWBloomFilterSerialize(b->filter, buf, sizeof(buf));
+}
+
+static void _BenchBlooms(const uint8_t *items)
+{
+    BenchBloom b = { LWBloomFilterNew(0.0005, 10000, 0, BLOOM_UPDATE_ALL), items, 10000, 0 };
+
+    _Bench("bloom_insert_32", 32, _BenchBloomInsertRun, &b);
+    b.next = 0;
+    _Bench("bloom_contains_32", 32, _BenchBloomContainsRun, &b);
+    _Bench("bloom_serialize", b.filter->length, _BenchBloomSerializeRun, &b);
+    LWBloomFilterFree(b.filter);
+}
+
+int main(int argc, const char *argv[])
+{
+    static const size_t hashLens[] = { 64, 4096 };
+    static const struct { const char *name; void (*hash)(void *, const void *, size_t); } hashes[] = {
+        { "sha256", LWSHA256 }, { "sha512", LWSHA512 }, { "rmd160", LWRMD160 }, { "sha256_2", LWSHA256_2 }
+    };
+    uint8_t *data = malloc(BENCH_SET_ITEMS*sizeof(UInt256)), pubKeys[64*33], witness[22] = { 0x00, 0x14 };
+    UInt256 secret = UINT256_ZERO;
+    BenchHMAC hmac;
+    BenchKey key;
+    BenchHash h;
+    char str[100];
+
+    if (! data) return 1;
+    _benchArgc = argc;
+    _benchArgv = argv;
+    LWMetricsSetEnabled(0); // keep the library's own instrumentation out of the timings
+    _BenchFill(data, BENCH_SET_ITEMS*sizeof(UInt256), 0);
+    printf("name,iterations,bytes,mean_ns,median_ns,min_ns,max_ns,ops_per_sec,mb_per_sec\n");
+
+    for (size_t i = 0; i < sizeof(hashes)/sizeof(*hashes); i++) {
+        for (size_t j = 0; j < sizeof(hashLens)/sizeof(*hashLens); j++) {
+            h = (BenchHash) { hashes[i].hash, data, hashLens[j] };
+            snprintf(str, sizeof(str), "%s_%zu", hashes[i].name, hashLens[j]);
+            _Bench(str, hashLens[j], _BenchHashRun, &h);
+        }
+    }
+
+    for (size_t i = 0; i < 64; i++) {
+        secret.u8[31] = (uint8_t)(i + 1);
+        LWKeySetSecret(&key.key, &secret, 1);
+        LWKeyPubKey(&key.key, &pubKeys[i*33], 33);
+    }
+
+    h = (BenchHash) { LWHash160, pubKeys, 33 };
+    _Bench("hash160_33", 33, _BenchHashRun, &h);
+    _Bench("hash160_array_33", 33, _BenchHash160ArrayRun, pubKeys);
+    _Bench("scrypt_1024_1_1", 80, _BenchScryptRun, data);
+    _Bench("scrypt_buf_1024_1_1", 80, _BenchScryptBufRun, data);
+    _Bench("hmac_sha256_64", 64, _BenchHMACRun, data);
+    LWHMACContextInit(&hmac.ctx, LWSHA512, 64, &data[64], 32);
+    hmac.data = data;
+    _Bench("hmac_sha512_ctx_37", 37, _BenchHMACContextRun, &hmac);
+    mem_clean(&hmac.ctx, sizeof(hmac.ctx));
+    _Bench("pbkdf2_sha512_2048", 0, _BenchPBKDF2Run,
+           "axis husband project any sea patch drip tip spirit tide bring belt");
+
+    _BenchSets((UInt256 *)data);
+
+    _BenchFill(&secret, sizeof(secret), 1);
+    LWKeySetSecret(&key.key, &secret, 1);
+    _BenchFill(&key.md, sizeof(key.md), 2);
+    key.sigLen = LWKeySign(&key.key, key.sig, sizeof(key.sig), key.md);
+    LWKeyCompactSign(&key.key, key.compactSig, sizeof(key.compactSig), key.md);
+    _Bench("key_sign", 0, _BenchKeySignRun, &key);
+    _Bench("key_verify", 0, _BenchKeyVerifyRun, &key);
+    _Bench("key_compact_sign", 0, _BenchKeyCompactSignRun, &key);
+    _Bench("key_recover_pubkey", 0, _BenchKeyRecoverRun, &key);
+    _Bench("key_pubkey", 0, _BenchKeyPubKeyRun, &key);
+
+    _BenchTransactions(&key.key);
+    LWKeyClean(&key.key);
+
+    _Bench("base58check_encode_21", 21, _BenchBase58EncodeRun, data);
+    _Bench("base58check_encode_array_21", 21, _BenchBase58EncodeArrayRun, data);
+    LWBase58CheckEncode(str, sizeof(str), data, 21);
+    _Bench("base58check_decode_21", 21, _BenchBase58DecodeRun, str);
+    memcpy(&witness[2], data, 20);
+    _Bench("bech32_encode_22", 22, _BenchBech32EncodeRun, witness);
+    LWBech32Encode(str, "ltc", witness);
+    _Bench("bech32_decode_22", 22, _BenchBech32DecodeRun, str);
+
+    _BenchBlooms(data);
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,901 @@
+//
+//  bench_sync.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+// end-to-end sync benchmark, a simulated peer serves a synthetic chain over loopback while LWPeerManager syncs a wallet
+// from it, built like bench.c, but with regtest's proof-of-work limit so the synthetic chain can be mined, e.g.
+// cc -O3 -DLITECOIN_REGTEST=1 -Isecp256k1 -o bench_sync bench_sync.c LW*.c -lpthread -lm
+//
+// usage: bench_sync [-b blocks] [-t tx] [-m rate] [-k height] [-p peers] [-s seed] [-H] [-v]
+// -b blocks in the chain after the genesis block, default 10000
+// -t tx per block, including the coinbase, default 10
+// -m fraction of the tx after the wallet's earliest key time that pay the wallet, default 0.005
+// -k height of the first block after the wallet's earliest key time, default 3/4 of the chain, earlier blocks are
+//    downloaded as headers up to a week before it, and filtered blocks after that
+// -p simulated peers to connect to, each on its own loopback port, default 1
+// -s seed for generating the chain, default 1
+// -H headers-first sync, see LWPeerManagerSetHeadersFirst()
+// -v log peer messages
+//
+// the simulator runs in a forked child process, so the cpu time and peak memory reported are the client's alone
+// the simulator answers version, getaddr, filterload/add/clear, getheaders, getblocks, getdata, mempool and ping, and
+// matches tx against the loaded bloom filter the way a full node does
+//
+// writes a csv header line and then one result line to stdout:
+// blocks, tx_per_block, match_rate, peers, headers_first - the options
+// height - chain height the client synced to, wallet_tx - tx registered in the wallet, of paid_tx paying the wallet
+// headers, merkleblocks, tx - served by the simulator, including blocks requested again after a filter update
+// seconds - from LWPeerManagerConnect() until syncStopped
+// blocks_per_sec - chain blocks synced per second over the whole sync
+// headers_per_sec - headers served per second until the first filtered block was requested
+// merkleblocks_per_sec - filtered blocks served per second after that
+// cpu_ms_per_block - client user and system cpu time per chain block
+// scrypt_ms - client time spent on proof-of-work hashes, mb_in - bytes read from peers
+// peak_rss_kb - client peak resident memory
+// exits with status 1 if the client doesn't sync to the chain tip, or misses a tx paying the wallet
+
+#include "LWPeerManager.h"
+#include "LWWallet.h"
+#include "LWBIP32Sequence.h"
+#include "LWMerkleBlock.h"
+#include "LWBloomFilter.h"
+#include "LWAddress.h"
+#include "LWCrypto.h"
+#include "LWMetrics.h"
+#include "LWLog.h"
+#include "LWSet.h"
+#include "LWInt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SIM_MAGIC         0xdab5bffa // litecoin regtest network magic
+#define SIM_TARGET        0x207fffff // regtest difficulty target, about every other nonce meets it
+#define SIM_BLOCK_SPACING 150 // seconds between blocks, litecoin's target spacing
+#define SIM_MAX_PEERS     PEER_MAX_CONNECTIONS_LIMIT
+#define SIM_MAX_ADDRESSES 1000 // wallet receive addresses paid in order, after which they're reused
+#define SIM_MAX_TX_SIZE   226 // serialized size of a synthetic tx, one input and two P2PKH outputs
+#define SIM_MAX_NONCES    1000 // nonces tried before giving up on mining a block
+#define SIM_MSG_HEADER    24
+#define SIM_MAX_MSG       0x02000000
+#define SIM_TIMEOUT       1800 // seconds to wait for the sync to finish
+
+typedef struct {
+    uint32_t blocks, txPerBlock, keyHeight, peers;
+    double matchRate;
+    uint64_t seed;
+    uint32_t startTime; // timestamp of the genesis block
+    int headersFirst, verbose;
+} SimOptions;
+
+typedef struct {
+    UInt256 blockHash; // must be first, see _SimBlockHash()
+    uint8_t header[80];
+    size_t txIdx, txCount; // range of the block's tx in the chain's txs
+} SimBlock;
+
+typedef struct {
+    UInt256 txHash;
+    size_t off, len; // serialized tx in the chain's txBuf
+} SimTx;
+
+typedef struct {
+    SimBlock *blocks; // blocks[i] is at height i, blocks[0] is the genesis block
+    size_t blocksCount;
+    SimTx *txs;
+    size_t txsCount;
+    uint8_t *txBuf;
+    size_t txBufLen;
+    SimTx mempoolTx; // unconfirmed tx announced in reply to mempool
+    LWSet *blockIndex; // blocks by blockHash
+    size_t paidCount; // tx paying the wallet
+} SimChain;
+
+typedef struct {
+    uint64_t headers, merkleblocks, txs;
+    uint64_t blockRequestTime; // LWMetricsTime() of the first filtered block request, 0 if none
+    uint64_t paidCount;
+} SimStats;
+
+typedef struct {
+    int socket;
+    LWBloomFilter *filter;
+} SimConn;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done, error;
+} SimSync;
+
+static const char *_simDNSSeeds[] = { NULL };
+static SimChain *_simChain;
+static SimStats _simStats;
+static pthread_mutex_t _simLock = PTHREAD_MUTEX_INITIALIZER; // guards _simStats
+
+// deterministic pseudo-random numbers, splitmix64
+static uint64_t _SimRand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void _SimRandBytes(uint64_t *state, uint8_t *buf, size_t len)
+{
+    uint64_t r;
+
+    for (size_t i = 0; i < len; i += sizeof(r)) {
+        r = _SimRand(state);
+        memcpy(&buf[i], &r, (len - i < sizeof(r)) ? len - i : sizeof(r));
+    }
+}
+
+inline static size_t _SimBlockHash(const void *block)
+{
+    return UInt32GetLE(block);
+}
+
+inline static int _SimBlockEq(const void *block, const void *otherBlock)
+{
+    return (block == otherBlock || UInt256Eq(*(const UInt256 *)block, *(const UInt256 *)otherBlock));
+}
+
+// appends a tx with one input and a P2PKH output to payTo, or to a random hash160 if payTo is NULL, a coinbase tx for
+// height if coinbase is true, otherwise spending a random outpoint with a random signature and a second change output
+static void _SimAddTx(SimChain *chain, SimTx *tx, uint64_t *rand, uint32_t height, int coinbase, const UInt160 *payTo)
+{
+    uint8_t *buf = &chain->txBuf[chain->txBufLen];
+    size_t off = 0, outCount = (coinbase) ? 1 : 2;
+
+    UInt32SetLE(&buf[off], 1); // version
+    off += sizeof(uint32_t);
+    buf[off++] = 1; // input count
+
+    if (coinbase) {
+        memset(&buf[off], 0, sizeof(UInt256));
+        off += sizeof(UInt256);
+        UInt32SetLE(&buf[off], UINT32_MAX);
+        off += sizeof(uint32_t);
+        buf[off++] = 14; // signature script: height and extra nonce
+        buf[off++] = sizeof(uint32_t);
+        UInt32SetLE(&buf[off], height);
+        off += sizeof(uint32_t);
+        buf[off++] = sizeof(uint64_t);
+        _SimRandBytes(rand, &buf[off], sizeof(uint64_t));
+        off += sizeof(uint64_t);
+    }
+    else {
+        _SimRandBytes(rand, &buf[off], sizeof(UInt256));
+        off += sizeof(UInt256);
+        UInt32SetLE(&buf[off], (uint32_t)(_SimRand(rand) % 4));
+        off += sizeof(uint32_t);
+        buf[off++] = 107; // signature script: a signature and a compressed pubkey
+        buf[off++] = 72;
+        _SimRandBytes(rand, &buf[off], 72);
+        off += 72;
+        buf[off++] = 33;
+        buf[off] = 0x02;
+        _SimRandBytes(rand, &buf[off + 1], 32);
+        off += 33;
+    }
+
+    UInt32SetLE(&buf[off], UINT32_MAX); // sequence
+    off += sizeof(uint32_t);
+    buf[off++] = (uint8_t)outCount;
+
+    for (size_t i = 0; i < outCount; i++) {
+        UInt64SetLE(&buf[off], (coinbase) ? 1250000000 : 100000 + _SimRand(rand) % 100000000);
+        off += sizeof(uint64_t);
+        buf[off++] = 25;
+        buf[off++] = OP_DUP;
+        buf[off++] = OP_HASH160;
+        buf[off++] = 20;
+        if (i == 0 && payTo) memcpy(&buf[off], payTo, sizeof(UInt160));
+        else _SimRandBytes(rand, &buf[off], sizeof(UInt160));
+        off += sizeof(UInt160);
+        buf[off++] = OP_EQUALVERIFY;
+        buf[off++] = OP_CHECKSIG;
+    }
+
+    UInt32SetLE(&buf[off], 0); // lock time
+    off += sizeof(uint32_t);
+    LWSHA256_2(&tx->txHash, buf, off);
+    tx->off = chain->txBufLen;
+    tx->len = off;
+    chain->txBufLen += off;
+}
+
+// mines block at height with the chain's tx from txIdx on, returns false if no nonce met the target, which happens
+// when the library wasn't built with the raised proof-of-work limit
+static int _SimMineBlock(SimChain *chain, uint32_t height, uint32_t timestamp, size_t txIdx)
+{
+    SimBlock *block = &chain->blocks[height];
+    size_t i, count = chain->txsCount - txIdx;
+    UInt256 *hashes = malloc(count*sizeof(*hashes));
+    uint8_t *matches = calloc(count, sizeof(*matches)), *h = block->header;
+    LWMerkleBlock *b = LWMerkleBlockNew(), *parsed;
+    int r = 0;
+
+    assert(hashes != NULL);
+    assert(matches != NULL);
+    for (i = 0; i < count; i++) hashes[i] = chain->txs[txIdx + i].txHash;
+    LWMerkleBlockSetPartialTree(b, hashes, matches, count); // with nothing matched, the only hash is the merkle root
+    UInt32SetLE(&h[0], 0x20000000); // version
+    UInt256Set(&h[4], (height > 0) ? chain->blocks[height - 1].blockHash : UINT256_ZERO);
+    UInt256Set(&h[36], b->hashes[0]);
+    UInt32SetLE(&h[68], timestamp);
+    UInt32SetLE(&h[72], SIM_TARGET);
+
+    for (uint32_t nonce = 0; ! r && nonce < SIM_MAX_NONCES; nonce++) {
+        UInt32SetLE(&h[76], nonce);
+        parsed = LWMerkleBlockParse(h, sizeof(block->header));
+        r = LWMerkleBlockIsValid(parsed, timestamp);
+        block->blockHash = parsed->blockHash;
+        LWMerkleBlockFree(parsed);
+    }
+
+    block->txIdx = txIdx;
+    block->txCount = count;
+    LWMerkleBlockFree(b);
+    free(matches);
+    free(hashes);
+    return r;
+}
+
+static void _SimChainFree(SimChain *chain)
+{
+    if (chain->blockIndex) LWSetFree(chain->blockIndex);
+    free(chain->blocks);
+    free(chain->txs);
+    free(chain->txBuf);
+    free(chain);
+}
+
+// generates the chain for opts, or just the genesis block if opts->blocks is 0, returns NULL if it can't be mined
+// the tx after opts->keyHeight that pay the wallet go to its receive addresses in order, derived from mpk
+static SimChain *_SimChainNew(const SimOptions *opts, LWMasterPubKey mpk)
+{
+    SimChain *chain = calloc(1, sizeof(*chain));
+    size_t txCount = 1 + (size_t)opts->blocks*opts->txPerBlock, addrCount = 0, txIdx;
+    uint64_t rand = opts->seed;
+    UInt160 *addrs = calloc(SIM_MAX_ADDRESSES, sizeof(*addrs)), *payTo;
+    uint8_t pubKey[33];
+    int r = 1;
+
+    assert(chain != NULL);
+    assert(addrs != NULL);
+    chain->blocksCount = 1 + opts->blocks;
+    chain->blocks = calloc(chain->blocksCount, sizeof(*chain->blocks));
+    chain->txs = calloc(txCount, sizeof(*chain->txs));
+    chain->txBuf = malloc((txCount + 1)*SIM_MAX_TX_SIZE);
+    chain->blockIndex = LWSetNew(_SimBlockHash, _SimBlockEq, chain->blocksCount);
+    assert(chain->blocks != NULL && chain->txs != NULL && chain->txBuf != NULL);
+
+    for (uint32_t height = 0; r && height < chain->blocksCount; height++) {
+        txIdx = chain->txsCount;
+        _SimAddTx(chain, &chain->txs[chain->txsCount++], &rand, height, 1, NULL);
+
+        for (uint32_t i = 1; height > 0 && i < opts->txPerBlock; i++) {
+            payTo = NULL;
+
+            if (height >= opts->keyHeight && (double)(_SimRand(&rand) >> 11)/(1ULL << 53) < opts->matchRate) {
+                payTo = &addrs[chain->paidCount % SIM_MAX_ADDRESSES];
+
+                if (chain->paidCount == addrCount) {
+                    LWBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_EXTERNAL_CHAIN, (uint32_t)addrCount);
+                    LWHash160(payTo, pubKey, sizeof(pubKey));
+                    addrCount++;
+                }
+
+                chain->paidCount++;
+            }
+
+            _SimAddTx(chain, &chain->txs[chain->txsCount++], &rand, height, 0, payTo);
+        }
+
+        r = _SimMineBlock(chain, height, opts->startTime + height*SIM_BLOCK_SPACING, txIdx);
+        LWSetAdd(chain->blockIndex, &chain->blocks[height]);
+    }
+
+    _SimAddTx(chain, &chain->mempoolTx, &rand, 0, 0, NULL);
+    free(addrs);
+    if (! r) _SimChainFree(chain);
+    return (r) ? chain : NULL;
+}
+
+static int _SimRecv(int socket, uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    for (size_t off = 0; off < len; off += n) {
+        n = recv(socket, &buf[off], len - off, 0);
+        if (n < 0 && errno == EINTR) n = 0;
+        else if (n <= 0) return 0;
+    }
+
+    return 1;
+}
+
+static void _SimSend(SimConn *conn, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    uint8_t *buf = malloc(SIM_MSG_HEADER + msgLen), md[32];
+    ssize_t n;
+
+    assert(buf != NULL);
+    UInt32SetLE(&buf[0], SIM_MAGIC);
+    memset(&buf[4], 0, 12);
+    memcpy(&buf[4], type, strlen(type));
+    UInt32SetLE(&buf[16], (uint32_t)msgLen);
+    LWSHA256_2(md, msg, msgLen);
+    memcpy(&buf[20], md, sizeof(uint32_t));
+    if (msgLen > 0) memcpy(&buf[SIM_MSG_HEADER], msg, msgLen);
+
+    for (size_t off = 0; off < SIM_MSG_HEADER + msgLen; off += n) {
+        n = send(conn->socket, &buf[off], SIM_MSG_HEADER + msgLen - off, 0);
+        if (n < 0 && errno == EINTR) n = 0;
+        else if (n <= 0) break; // the client disconnected, the next read fails
+    }
+
+    free(buf);
+}
+
+static void _SimSendVersion(SimConn *conn)
+{
+    static const char userAgent[] = "/bench_sync:1.0/";
+    uint8_t msg[85 + sizeof(userAgent)];
+    size_t off = 0;
+
+    UInt32SetLE(&msg[off], 70015); // version
+    off += sizeof(uint32_t);
+    UInt64SetLE(&msg[off], SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM); // services
+    off += sizeof(uint64_t);
+    UInt64SetLE(&msg[off], (uint64_t)time(NULL)); // timestamp
+    off += sizeof(uint64_t);
+    memset(&msg[off], 0, 2*(sizeof(uint64_t) + sizeof(UInt128) + sizeof(uint16_t))); // receiving and sending addresses
+    off += 2*(sizeof(uint64_t) + sizeof(UInt128) + sizeof(uint16_t));
+    UInt64SetLE(&msg[off], (uint64_t)(uintptr_t)conn); // nonce
+    off += sizeof(uint64_t);
+    msg[off++] = sizeof(userAgent) - 1;
+    memcpy(&msg[off], userAgent, sizeof(userAgent) - 1);
+    off += sizeof(userAgent) - 1;
+    UInt32SetLE(&msg[off], (uint32_t)(_simChain->blocksCount - 1)); // start height
+    off += sizeof(uint32_t);
+    msg[off++] = 1; // relay
+    _SimSend(conn, MSG_VERSION, msg, off);
+}
+
+// height of the first block after the first locator in msg that's in the chain, or after the genesis block if none
+// are, writes the stop hash to stop, returns 0 if msg is malformed
+static size_t _SimLocate(const uint8_t *msg, size_t msgLen, UInt256 *stop)
+{
+    size_t off = sizeof(uint32_t), len = 0, count;
+    const SimBlock *block = NULL;
+    UInt256 hash;
+
+    count = (off <= msgLen) ? (size_t)LWVarInt(&msg[off], msgLen - off, &len) : 0;
+    off += len;
+    if (len == 0 || off + (count + 1)*sizeof(UInt256) > msgLen) return 0;
+
+    for (size_t i = 0; ! block && i < count; i++) {
+        hash = UInt256Get(&msg[off + i*sizeof(UInt256)]);
+        block = LWSetGet(_simChain->blockIndex, &hash);
+    }
+
+    *stop = UInt256Get(&msg[off + count*sizeof(UInt256)]);
+    return (block) ? (size_t)(block - _simChain->blocks) + 1 : 1;
+}
+
+static void _SimAcceptGetheaders(SimConn *conn, const uint8_t *msg, size_t msgLen)
+{
+    UInt256 stop = UINT256_ZERO;
+    size_t height = _SimLocate(msg, msgLen, &stop), count = 0, off = 3;
+    uint8_t *buf = malloc(3 + 2000*81);
+
+    assert(buf != NULL);
+
+    for (; height > 0 && height < _simChain->blocksCount && count < 2000; height++) {
+        memcpy(&buf[off], _simChain->blocks[height].header, 80);
+        buf[off + 80] = 0; // tx count
+        off += 81;
+        count++;
+        if (UInt256Eq(_simChain->blocks[height].blockHash, stop)) break;
+    }
+
+    buf[0] = 0xfd; // count as a 3 byte varint, so it can be written after the headers
+    UInt16SetLE(&buf[1], (uint16_t)count);
+    _SimSend(conn, MSG_HEADERS, buf, off);
+    free(buf);
+    pthread_mutex_lock(&_simLock);
+    _simStats.headers += count;
+    pthread_mutex_unlock(&_simLock);
+}
+
+static void _SimAcceptGetblocks(SimConn *conn, const uint8_t *msg, size_t msgLen)
+{
+    UInt256 stop = UINT256_ZERO;
+    size_t height = _SimLocate(msg, msgLen, &stop), count = 0, off = 3;
+    uint8_t buf[3 + 500*36];
+
+    for (; height > 0 && height < _simChain->blocksCount && count < 500; height++) {
+        if (UInt256Eq(_simChain->blocks[height].blockHash, stop)) break;
+        UInt32SetLE(&buf[off], 2); // MSG_BLOCK inventory type
+        UInt256Set(&buf[off + sizeof(uint32_t)], _simChain->blocks[height].blockHash);
+        off += 36;
+        count++;
+    }
+
+    buf[0] = 0xfd;
+    UInt16SetLE(&buf[1], (uint16_t)count);
+    _SimSend(conn, MSG_INV, buf, off);
+}
+
+// BIP37 filter matching as a full node does it: the tx hash, the data elements of each output script, adding the
+// outpoints of matched outputs when the filter has BLOOM_UPDATE_ALL, and then each input's outpoint and data elements
+static int _SimTxMatches(LWBloomFilter *filter, const SimTx *tx)
+{
+    const uint8_t *buf = &_simChain->txBuf[tx->off], *elems[16], *data;
+    uint8_t outpoint[36];
+    size_t off = sizeof(uint32_t), len, inOff, count, scriptLen, dataLen, n;
+    int r = LWBloomFilterContainsData(filter, tx->txHash.u8, sizeof(UInt256)), match;
+
+    count = (size_t)LWVarInt(&buf[off], tx->len - off, &len);
+    off += len;
+    inOff = off;
+
+    for (size_t i = 0; i < count; i++) { // skip over the inputs
+        off += 36;
+        scriptLen = (size_t)LWVarInt(&buf[off], tx->len - off, &len);
+        off += len + scriptLen + sizeof(uint32_t);
+    }
+
+    count = (size_t)LWVarInt(&buf[off], tx->len - off, &len);
+    off += len;
+
+    for (size_t i = 0; i < count; i++) {
+        off += sizeof(uint64_t);
+        scriptLen = (size_t)LWVarInt(&buf[off], tx->len - off, &len);
+        off += len;
+        n = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), &buf[off], scriptLen);
+        match = 0;
+
+        for (size_t j = 0; ! match && j < n; j++) {
+            data = LWScriptData(elems[j], &dataLen);
+            if (data && dataLen > 0 && LWBloomFilterContainsData(filter, data, dataLen)) match = 1;
+        }
+
+        if (match && (filter->flags & 0x03) == BLOOM_UPDATE_ALL) {
+            UInt256Set(outpoint, tx->txHash);
+            UInt32SetLE(&outpoint[sizeof(UInt256)], (uint32_t)i);
+            LWBloomFilterInsertData(filter, outpoint, sizeof(outpoint));
+        }
+
+        if (match) r = 1;
+        off += scriptLen;
+    }
+
+    count = (size_t)LWVarInt(&buf[inOff - 1], 1, &len);
+    off = inOff;
+
+    for (size_t i = 0; ! r && i < count; i++) {
+        if (LWBloomFilterContainsData(filter, &buf[off], 36)) r = 1;
+        off += 36;
+        scriptLen = (size_t)LWVarInt(&buf[off], tx->len - off, &len);
+        off += len;
+        n = LWScriptElements(elems, sizeof(elems)/sizeof(*elems), &buf[off], scriptLen);
+
+        for (size_t j = 0; ! r && j < n; j++) {
+            data = LWScriptData(elems[j], &dataLen);
+            if (data && dataLen > 0 && LWBloomFilterContainsData(filter, data, dataLen)) r = 1;
+        }
+
+        off += scriptLen + sizeof(uint32_t);
+    }
+
+    return r;
+}
+
+// sends block as a merkleblock with the tx matching the connection's filter, followed by those tx
+static void _SimSendMerkleblock(SimConn *conn, const SimBlock *block)
+{
+    const SimTx *txs = &_simChain->txs[block->txIdx];
+    UInt256 *hashes = malloc(block->txCount*sizeof(*hashes));
+    uint8_t *matches = calloc(block->txCount, sizeof(*matches)), *buf;
+    LWMerkleBlock *b = LWMerkleBlockNew();
+    size_t i, len, count = 0;
+
+    assert(hashes != NULL);
+    assert(matches != NULL);
+
+    for (i = 0; i < block->txCount; i++) {
+        hashes[i] = txs[i].txHash;
+        matches[i] = (conn->filter && _SimTxMatches(conn->filter, &txs[i]));
+        if (matches[i]) count++;
+    }
+
+    LWMerkleBlockSetPartialTree(b, hashes, matches, block->txCount);
+    len = LWMerkleBlockSerialize(b, NULL, 0);
+    buf = malloc(len);
+    assert(buf != NULL);
+    LWMerkleBlockSerialize(b, buf, len);
+    memcpy(buf, block->header, sizeof(block->header)); // b only has the partial merkle tree set
+    _SimSend(conn, MSG_MERKLEBLOCK, buf, len);
+
+    for (i = 0; i < block->txCount; i++) {
+        if (matches[i]) _SimSend(conn, MSG_TX, &_simChain->txBuf[txs[i].off], txs[i].len);
+    }
+
+    pthread_mutex_lock(&_simLock);
+    _simStats.merkleblocks++;
+    _simStats.txs += count;
+    if (_simStats.blockRequestTime == 0) _simStats.blockRequestTime = LWMetricsTime();
+    pthread_mutex_unlock(&_simLock);
+    free(buf);
+    LWMerkleBlockFree(b);
+    free(matches);
+    free(hashes);
+}
+
+static void _SimAcceptGetdata(SimConn *conn, const uint8_t *msg, size_t msgLen)
+{
+    size_t off = 0, len = 0, count = (size_t)LWVarInt(msg, msgLen, &len), notfoundCount = 0;
+    uint8_t *notfound;
+    const SimBlock *block;
+    uint32_t type;
+    UInt256 hash;
+
+    off += len;
+    if (len == 0 || off + count*36 > msgLen) return;
+    notfound = malloc(9 + count*36);
+    assert(notfound != NULL);
+
+    for (size_t i = 0; i < count; i++, off += 36) {
+        type = UInt32GetLE(&msg[off]) & ~0x40000000; // ignore the witness flag
+        hash = UInt256Get(&msg[off + sizeof(uint32_t)]);
+        block = (type == 3) ? LWSetGet(_simChain->blockIndex, &hash) : NULL; // MSG_FILTERED_BLOCK
+
+        if (block) _SimSendMerkleblock(conn, block);
+        else if (type == 1 && UInt256Eq(hash, _simChain->mempoolTx.txHash)) {
+            _SimSend(conn, MSG_TX, &_simChain->txBuf[_simChain->mempoolTx.off], _simChain->mempoolTx.len);
+        }
+        else memcpy(&notfound[9 + 36*notfoundCount++], &msg[off], 36);
+    }
+
+    if (notfoundCount > 0) {
+        len = LWVarIntSize(notfoundCount);
+        LWVarIntSet(&notfound[9 - len], len, notfoundCount);
+        _SimSend(conn, MSG_NOTFOUND, &notfound[9 - len], len + 36*notfoundCount);
+    }
+
+    free(notfound);
+}
+
+static void _SimAcceptMessage(SimConn *conn, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    uint8_t buf[37];
+    size_t len = 0, dataLen;
+
+    if (strcmp(type, MSG_VERSION) == 0) {
+        _SimSendVersion(conn);
+        _SimSend(conn, MSG_VERACK, NULL, 0);
+    }
+    else if (strcmp(type, MSG_PING) == 0) _SimSend(conn, MSG_PONG, msg, msgLen);
+    else if (strcmp(type, MSG_GETADDR) == 0) _SimSend(conn, MSG_ADDR, (const uint8_t *)"", 1); // no addresses
+    else if (strcmp(type, MSG_FILTERLOAD) == 0) {
+        if (conn->filter) LWBloomFilterFree(conn->filter);
+        conn->filter = LWBloomFilterParse(msg, msgLen);
+    }
+    else if (strcmp(type, MSG_FILTERADD) == 0) {
+        dataLen = (size_t)LWVarInt(msg, msgLen, &len);
+        if (conn->filter && len > 0 && len + dataLen <= msgLen) {
+            LWBloomFilterInsertData(conn->filter, &msg[len], dataLen);
+        }
+    }
+    else if (strcmp(type, MSG_FILTERCLEAR) == 0) {
+        if (conn->filter) LWBloomFilterFree(conn->filter);
+        conn->filter = NULL;
+    }
+    else if (strcmp(type, MSG_GETHEADERS) == 0) _SimAcceptGetheaders(conn, msg, msgLen);
+    else if (strcmp(type, MSG_GETBLOCKS) == 0) _SimAcceptGetblocks(conn, msg, msgLen);
+    else if (strcmp(type, MSG_GETDATA) == 0) _SimAcceptGetdata(conn, msg, msgLen);
+    else if (strcmp(type, MSG_MEMPOOL) == 0) { // a real mempool isn't empty, so the client doesn't wait for a timeout
+        buf[0] = 1;
+        UInt32SetLE(&buf[1], 1); // MSG_TX inventory type
+        UInt256Set(&buf[5], _simChain->mempoolTx.txHash);
+        _SimSend(conn, MSG_INV, buf, sizeof(buf));
+    }
+}
+
+static void *_SimConnRoutine(void *arg)
+{
+    SimConn *conn = arg;
+    uint8_t header[SIM_MSG_HEADER], md[32], *msg = NULL;
+    char type[13];
+    size_t msgLen;
+
+    while (_SimRecv(conn->socket, header, sizeof(header)) && UInt32GetLE(header) == SIM_MAGIC) {
+        msgLen = UInt32GetLE(&header[16]);
+        if (msgLen > SIM_MAX_MSG) break;
+        msg = realloc(msg, msgLen + 1);
+        assert(msg != NULL);
+        if (msgLen > 0 && ! _SimRecv(conn->socket, msg, msgLen)) break;
+        LWSHA256_2(md, msg, msgLen);
+        if (memcmp(md, &header[20], sizeof(uint32_t)) != 0) break;
+        memcpy(type, &header[4], 12);
+        type[12] = '\0';
+        _SimAcceptMessage(conn, type, msg, msgLen);
+    }
+
+    close(conn->socket);
+    if (conn->filter) LWBloomFilterFree(conn->filter);
+    free(msg);
+    free(conn);
+    return NULL;
+}
+
+static void *_SimListenRoutine(void *arg)
+{
+    const int *sockets = arg;
+    struct pollfd fds[SIM_MAX_PEERS];
+    size_t i, count = 0;
+    pthread_attr_t attr;
+    pthread_t thread;
+    SimConn *conn;
+    int s, on = 1;
+
+    for (count = 0; sockets[count] >= 0; count++) fds[count] = (struct pollfd) { sockets[count], POLLIN, 0 };
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (poll(fds, count, -1) >= 0 || errno == EINTR) {
+        for (i = 0; i < count; i++) {
+            if (! (fds[i].revents & POLLIN) || (s = accept(fds[i].fd, NULL, NULL)) < 0) continue;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            conn = calloc(1, sizeof(*conn));
+            assert(conn != NULL);
+            conn->socket = s;
+            if (pthread_create(&thread, &attr, _SimConnRoutine, conn) != 0) close(s), free(conn);
+        }
+    }
+
+    return NULL;
+}
+
+// runs the simulator in the forked child, writes a byte to resultFd once it's listening, then writes its stats once
+// controlFd is readable, and exits
+static void _SimRun(const SimOptions *opts, LWMasterPubKey mpk, int sockets[], int resultFd, int controlFd)
+{
+    pthread_t thread;
+    SimStats stats;
+    char c = 'r';
+
+    signal(SIGPIPE, SIG_IGN);
+    _simChain = _SimChainNew(opts, mpk);
+    if (! _simChain || pthread_create(&thread, NULL, _SimListenRoutine, sockets) != 0) c = 'e';
+    if (write(resultFd, &c, 1) != 1 || c != 'r') _exit(1);
+    while (read(controlFd, &c, 1) < 0 && errno == EINTR);
+    pthread_mutex_lock(&_simLock);
+    stats = _simStats;
+    stats.paidCount = _simChain->paidCount;
+    pthread_mutex_unlock(&_simLock);
+    _exit((write(resultFd, &stats, sizeof(stats)) == sizeof(stats)) ? 0 : 1);
+}
+
+// regtest doesn't retarget, the target just has to stay the same
+static int _SimVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous, uint32_t transitionTime)
+{
+    (void)transitionTime;
+    return (! previous || block->target == previous->target);
+}
+
+static void _SimSyncStopped(void *info, int error)
+{
+    SimSync *sync = info;
+
+    pthread_mutex_lock(&sync->lock);
+    if (! sync->done) sync->error = error; // later calls are from reconnect attempts after the simulator exits
+    sync->done = 1;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+// loopback listening socket on a free port, returns -1 on failure
+static int _SimListen(uint16_t *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int s = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s, 16) != 0 ||
+        getsockname(s, (struct sockaddr *)&addr, &addrLen) != 0) {
+        if (s >= 0) close(s);
+        return -1;
+    }
+
+    *port = ntohs(addr.sin_port);
+    return s;
+}
+
+static double _SimCpuTime(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+static long _SimPeakRSS(void) // kilobytes
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss/1024; // bytes on darwin
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    SimOptions opts = { 10000, 10, UINT32_MAX, 1, 0.005, 1, 0, 0, 0 };
+    int sockets[SIM_MAX_PEERS + 1], resultPipe[2], controlPipe[2], opt, status;
+    LWPeer peers[SIM_MAX_PEERS];
+    uint16_t ports[SIM_MAX_PEERS];
+    SimSync sync = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    SimOptions genesisOpts;
+    LWMetricsSnapshot *before = calloc(2, sizeof(*before)), *after = &before[1];
+    SimStats stats = { 0 };
+    UInt512 seed;
+    LWMasterPubKey mpk;
+    SimChain *genesis;
+    LWCheckPoint checkpoint;
+    LWChainParams params;
+    LWWallet *wallet;
+    LWPeerManager *manager;
+    struct timespec timeout;
+    uint64_t start, end;
+    uint32_t height;
+    size_t walletTxCount;
+    double cpu, seconds, headerSeconds;
+    pid_t pid;
+    char c = 0;
+
+    assert(before != NULL);
+
+    while ((opt = getopt(argc, argv, "b:t:m:k:p:s:Hv")) != -1) {
+        switch (opt) {
+            case 'b': opts.blocks = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 't': opts.txPerBlock = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'm': opts.matchRate = strtod(optarg, NULL); break;
+            case 'k': opts.keyHeight = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'p': opts.peers = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'H': opts.headersFirst = 1; break;
+            case 'v': opts.verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-b blocks] [-t tx] [-m rate] [-k height] [-p peers] [-s seed] [-H] [-v]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.blocks == 0 || opts.txPerBlock == 0 || opts.txPerBlock > 0xffff || opts.peers == 0 ||
+        opts.peers > SIM_MAX_PEERS) {
+        fprintf(stderr, "%s: blocks, tx and peers must be positive, with at most 65535 tx and %d peers\n", argv[0],
+                SIM_MAX_PEERS);
+        return 1;
+    }
+
+    if (opts.keyHeight > opts.blocks) opts.keyHeight = opts.blocks*3/4;
+    opts.startTime = (uint32_t)time(NULL) - opts.blocks*SIM_BLOCK_SPACING;
+    LWLogSetLevel((opts.verbose) ? LW_LOG_DEBUG : LW_LOG_WARN);
+    LWSHA512(&seed, "bench_sync", strlen("bench_sync"));
+    mpk = LWBIP32MasterPubKey(&seed, sizeof(seed));
+
+    for (uint32_t i = 0; i < opts.peers; i++) {
+        sockets[i] = _SimListen(&ports[i]);
+        if (sockets[i] < 0) return perror("listen"), 1;
+        peers[i] = ((LWPeer) { ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 } }),
+                               ports[i], SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM, (uint64_t)time(NULL), 0 });
+    }
+
+    sockets[opts.peers] = -1;
+    if (pipe(resultPipe) != 0 || pipe(controlPipe) != 0) return perror("pipe"), 1;
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) return perror("fork"), 1;
+
+    if (pid == 0) {
+        close(resultPipe[0]);
+        close(controlPipe[1]);
+        _SimRun(&opts, mpk, sockets, resultPipe[1], controlPipe[0]);
+    }
+
+    close(resultPipe[1]);
+    close(controlPipe[0]);
+    for (uint32_t i = 0; i < opts.peers; i++) close(sockets[i]);
+    genesisOpts = opts;
+    genesisOpts.blocks = 0;
+    genesis = _SimChainNew(&genesisOpts, mpk); // the simulator's chain starts with the same genesis block
+
+    if (! genesis || read(resultPipe[0], &c, 1) != 1 || c != 'r') {
+        fprintf(stderr, "%s: couldn't mine the chain, build with -DLITECOIN_REGTEST=1\n", argv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return 1;
+    }
+
+    checkpoint = ((LWCheckPoint) { 0, UInt256Reverse(genesis->blocks[0].blockHash), opts.startTime, SIM_TARGET });
+    params = ((LWChainParams) { _simDNSSeeds, ports[0], SIM_MAGIC, 0, _SimVerifyDifficulty, &checkpoint, 1 });
+    _SimChainFree(genesis);
+    wallet = LWWalletNew(NULL, 0, mpk);
+    manager = LWPeerManagerNew(&params, wallet, opts.startTime + opts.keyHeight*SIM_BLOCK_SPACING, NULL, 0, peers,
+                               opts.peers);
+    LWPeerManagerSetCallbacks(manager, &sync, NULL, _SimSyncStopped, NULL, NULL, NULL, NULL, NULL);
+    LWPeerManagerSetMaxConnectCount(manager, (int)opts.peers);
+    LWPeerManagerSetHeadersFirst(manager, opts.headersFirst);
+    LWMetricsGetSnapshot(before);
+    cpu = _SimCpuTime();
+    start = LWMetricsTime();
+    LWPeerManagerConnect(manager);
+    pthread_mutex_lock(&sync.lock);
+    timeout = (struct timespec) { time(NULL) + SIM_TIMEOUT, 0 };
+    while (! sync.done && pthread_cond_timedwait(&sync.cond, &sync.lock, &timeout) != ETIMEDOUT);
+    pthread_mutex_unlock(&sync.lock);
+    end = LWMetricsTime();
+    cpu = _SimCpuTime() - cpu;
+    LWMetricsGetSnapshot(after);
+    height = LWPeerManagerLastBlockHeight(manager);
+    walletTxCount = LWWalletTransactions(wallet, NULL, 0);
+
+    if (write(controlPipe[1], &c, 1) != 1 || read(resultPipe[0], &stats, sizeof(stats)) != sizeof(stats)) {
+        fprintf(stderr, "%s: simulator exited early\n", argv[0]);
+    }
+
+    waitpid(pid, &status, 0);
+    seconds = (end - start)/1e9;
+    headerSeconds = (stats.blockRequestTime > start) ? (stats.blockRequestTime - start)/1e9 : 0;
+    printf("blocks,tx_per_block,match_rate,peers,headers_first,height,wallet_tx,paid_tx,headers,merkleblocks,tx,"
+           "seconds,blocks_per_sec,headers_per_sec,merkleblocks_per_sec,cpu_ms_per_block,scrypt_ms,mb_in,"
+           "peak_rss_kb\n");
+    printf("%"PRIu32",%"PRIu32",%g,%"PRIu32",%d,%"PRIu32",%zu,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%.3f,%.1f,%.1f,"
+           "%.1f,%.3f,%.1f,%.2f,%ld\n", opts.blocks, opts.txPerBlock, opts.matchRate, opts.peers, opts.headersFirst,
+           height, walletTxCount, stats.paidCount, stats.headers, stats.merkleblocks, stats.txs, seconds,
+           opts.blocks/seconds, (headerSeconds > 0) ? stats.headers/headerSeconds : 0,
+           (seconds > headerSeconds) ? stats.merkleblocks/(seconds - headerSeconds) : 0, cpu*1e3/opts.blocks,
+           (after->timers[LWMetricTimerScrypt].sum - before->timers[LWMetricTimerScrypt].sum)/1e6,
+           (after->counters[LWMetricCounterBytesIn] - before->counters[LWMetricCounterBytesIn])/1e6, _SimPeakRSS());
+
+    if (! sync.done || sync.error || height != opts.blocks) {
+        fprintf(stderr, "%s: sync %s at height %"PRIu32" of %"PRIu32"\n", argv[0],
+                (sync.done) ? strerror(sync.error ? sync.error : EPROTO) : "timed out", height, opts.blocks);
+    }
+
+    status = (sync.done && ! sync.error && height == opts.blocks && walletTxCount == stats.paidCount);
+    LWPeerManagerDisconnect(manager);
+    LWLogFlush();
+    // peer threads can still be returning from their disconnect callbacks, so the manager and wallet are left for the
+    // process exit to clean up
+    return (status) ? 0 : 1;
+}
@@ -0,0 +1,397 @@
+//
+//  bench_wallet.c
+//  https://github.com/litecoin-foundation/litewallet-core#readme#OpenSourceLink
+
+// large-wallet stress benchmark, times LWWallet operations on synthetic wallets of increasing size, built like bench.c
+// cc -O3 -Isecp256k1 -o bench_wallet bench_wallet.c LW*.c -lpthread -lm
+//
+// usage: bench_wallet [-n sizes] [-a addresses] [-u utxos] [-c chains] [-l length] [-s seed]
+// -n comma separated wallet sizes in tx, default 1000,10000,100000,1000000
+// -a receive addresses paid in order, after which they're reused, default 1000
+// -u unspent outputs the wallet is kept at while its history is generated, default 100
+// -c chains of unconfirmed spends at the end of the history, default 4
+// -l unconfirmed spends in each chain, each spending the change of the one before it, default 10
+// -s seed for generating the wallets, default 1
+//
+// the history is confirmed tx, one per block, alternating between receives paying the wallet's next receive address
+// while it has fewer than utxos unspent outputs, and spends of two random unspent outputs with change to the wallet's
+// next change address, followed by the unconfirmed chains, each starting from a random unspent output
+// tx inputs not signed by the wallet carry random signatures, since LWWallet doesn't verify them
+//
+// each size runs in a forked child process, so the memory reported is that wallet's alone, and timed operations are
+// repeated for at least half a second, or 100 times, whichever is first
+//
+// writes a csv header line and then one line per size to stdout:
+// tx, addresses, utxos, chains, chain_length - the options, wallet_utxos - unspent outputs of the wallet
+// new_ms - LWWalletNew() with the whole history
+// register_us - LWWalletRegisterTransaction() of an unconfirmed receive
+// remove_us - LWWalletRemoveTransaction() of that receive
+// update_us - LWWalletUpdateTransactions() moving all the unconfirmed chains in or out of a block
+// create_us - LWWalletCreateTxForOutputs() of a single output worth about three unspent outputs
+// sign_us - LWWalletSignTransaction() of that tx, sign_inputs - mean inputs per signed tx
+// generate_ms - generating the history, not counted in any of the above
+// wallet_kb - peak resident memory growth from generating the history through LWWalletNew(), bytes_per_tx - per tx
+// peak_rss_kb - peak resident memory of the child process
+
+#include "LWWallet.h"
+#include "LWBIP32Sequence.h"
+#include "LWTransaction.h"
+#include "LWAddress.h"
+#include "LWCrypto.h"
+#include "LWMetrics.h"
+#include "LWInt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define GEN_MAX_SIZES     16
+#define GEN_START_HEIGHT  100000 // height of the first confirmed tx
+#define GEN_START_TIME    1500000000 // timestamp of the first confirmed tx
+#define GEN_BLOCK_SPACING 150 // seconds between blocks, litecoin's target spacing
+#define GEN_SIG_LEN       107 // signature script of a P2PKH input, a 72 byte signature and a 33 byte pubkey
+#define GEN_TX_FEE        10000 // fee paid by each synthetic spend
+#define OP_MIN_TIME       500000000 // nanoseconds to keep repeating a timed operation
+#define OP_MAX_COUNT      100 // most times a timed operation is repeated
+
+typedef struct {
+    size_t sizes[GEN_MAX_SIZES], sizesCount;
+    uint32_t addrs, utxos, chains, chainLen;
+    uint64_t seed;
+} GenOptions;
+
+typedef struct {
+    UInt256 txHash;
+    uint32_t n;
+    uint64_t amount;
+    const LWAddress *address;
+} GenOutput; // wallet output not spent by any generated tx
+
+typedef struct {
+    LWAddress *external, *internal; // opts->addrs receive and change addresses
+    uint32_t addrs, nextExternal, nextInternal;
+    GenOutput *unspent;
+    size_t unspentCount;
+    uint64_t rand;
+} GenWallet;
+
+typedef struct {
+    uint64_t ns;
+    size_t count;
+} OpTime;
+
+static UInt512 _genSeed;
+static LWMasterPubKey _genMPK;
+
+// deterministic pseudo-random numbers, splitmix64
+static uint64_t _GenRand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void _GenRandBytes(uint64_t *state, uint8_t *buf, size_t len)
+{
+    uint64_t r;
+
+    for (size_t i = 0; i < len; i += sizeof(r)) {
+        r = _GenRand(state);
+        memcpy(&buf[i], &r, (len - i < sizeof(r)) ? len - i : sizeof(r));
+    }
+}
+
+// adds an input spending outpoint txHash:n, with the P2PKH script of address if it's the wallet's, and a random
+// signature script so the tx counts as signed
+static void _GenAddInput(GenWallet *gen, LWTransaction *tx, UInt256 txHash, uint32_t n, uint64_t amount,
+                         const LWAddress *address)
+{
+    uint8_t script[25], sig[GEN_SIG_LEN];
+    size_t scriptLen = (address) ? LWAddressScriptPubKey(script, sizeof(script), address->s) : 0;
+
+    _GenRandBytes(&gen->rand, sig, sizeof(sig));
+    LWTransactionAddInput(tx, txHash, n, amount, (scriptLen > 0) ? script : NULL, scriptLen, sig, sizeof(sig),
+                          TXIN_SEQUENCE);
+}
+
+// adds a P2PKH output paying address, or a random hash160 that isn't the wallet's if address is NULL
+static void _GenAddOutput(GenWallet *gen, LWTransaction *tx, uint64_t amount, const LWAddress *address)
+{
+    uint8_t script[25] = { OP_DUP, OP_HASH160, 20 };
+
+    if (address) LWAddressScriptPubKey(script, sizeof(script), address->s);
+    else _GenRandBytes(&gen->rand, &script[3], 20), script[23] = OP_EQUALVERIFY, script[24] = OP_CHECKSIG;
+    LWTransactionAddOutput(tx, amount, script, sizeof(script));
+}
+
+static void _GenFinish(LWTransaction *tx, uint32_t blockHeight, uint32_t timestamp)
+{
+    uint8_t buf[LWTransactionSerialize(tx, NULL, 0)];
+    size_t len = LWTransactionSerialize(tx, buf, sizeof(buf));
+
+    LWSHA256_2(&tx->txHash, buf, len);
+    tx->blockHeight = blockHeight;
+    tx->timestamp = timestamp;
+}
+
+// a tx from someone else paying the wallet's next receive address, its payment is added to the unspent outputs
+static LWTransaction *_GenReceive(GenWallet *gen, uint32_t blockHeight, uint32_t timestamp)
+{
+    LWTransaction *tx = LWTransactionNew();
+    UInt256 prevHash;
+    uint64_t amount = 1000000 + _GenRand(&gen->rand) % 100000000; // 0.01 to 1.01 LTC
+    const LWAddress *address = &gen->external[gen->nextExternal++ % gen->addrs];
+
+    _GenRandBytes(&gen->rand, prevHash.u8, sizeof(prevHash));
+    _GenAddInput(gen, tx, prevHash, 0, 0, NULL);
+    _GenAddOutput(gen, tx, amount, address);
+    _GenAddOutput(gen, tx, 1000000 + _GenRand(&gen->rand) % 100000000, NULL); // sender's change
+    _GenFinish(tx, blockHeight, timestamp);
+    gen->unspent[gen->unspentCount++] = (GenOutput) { tx->txHash, 0, amount, address };
+    return tx;
+}
+
+// a tx from the wallet spending count random unspent outputs, paying an eighth of them to someone else and the rest,
+// less the fee, to the wallet's next change address, which is added to the unspent outputs
+static LWTransaction *_GenSpend(GenWallet *gen, size_t count, uint32_t blockHeight, uint32_t timestamp)
+{
+    LWTransaction *tx = LWTransactionNew();
+    uint64_t amount = 0;
+    const LWAddress *address = &gen->internal[gen->nextInternal++ % gen->addrs];
+
+    for (size_t i = 0, j; i < count; i++) {
+        j = _GenRand(&gen->rand) % gen->unspentCount;
+        _GenAddInput(gen, tx, gen->unspent[j].txHash, gen->unspent[j].n, gen->unspent[j].amount,
+                     gen->unspent[j].address);
+        amount += gen->unspent[j].amount;
+        gen->unspent[j] = gen->unspent[--gen->unspentCount];
+    }
+
+    _GenAddOutput(gen, tx, amount/8, NULL);
+    _GenAddOutput(gen, tx, amount - amount/8 - GEN_TX_FEE, address);
+    _GenFinish(tx, blockHeight, timestamp);
+    gen->unspent[gen->unspentCount++] = (GenOutput) { tx->txHash, 1, amount - amount/8 - GEN_TX_FEE, address };
+    return tx;
+}
+
+// the wallet's history of count tx, oldest first, the last chains*chainLen of them unconfirmed
+static LWTransaction **_GenHistory(GenWallet *gen, const GenOptions *opts, size_t count)
+{
+    LWTransaction **txs = calloc(count, sizeof(*txs));
+    size_t i = 0, confirmed = count - opts->chains*opts->chainLen;
+    uint32_t height = GEN_START_HEIGHT, timestamp = GEN_START_TIME;
+
+    assert(txs != NULL);
+
+    for (; i < confirmed; i++, height++, timestamp += GEN_BLOCK_SPACING) {
+        if (gen->unspentCount < 2 || gen->unspentCount < opts->utxos) txs[i] = _GenReceive(gen, height, timestamp);
+        else txs[i] = _GenSpend(gen, 2, height, timestamp);
+    }
+
+    for (size_t j = 0; j < opts->chains; j++) {
+        txs[i++] = _GenSpend(gen, 1, TX_UNCONFIRMED, timestamp);
+
+        for (size_t k = 1; k < opts->chainLen; k++) { // spend the change output just added, the last unspent output
+            GenOutput out = gen->unspent[--gen->unspentCount];
+            LWTransaction *tx = LWTransactionNew();
+            const LWAddress *address = &gen->internal[gen->nextInternal++ % gen->addrs];
+
+            _GenAddInput(gen, tx, out.txHash, out.n, out.amount, out.address);
+            _GenAddOutput(gen, tx, out.amount/8, NULL);
+            _GenAddOutput(gen, tx, out.amount - out.amount/8 - GEN_TX_FEE, address);
+            _GenFinish(tx, TX_UNCONFIRMED, timestamp);
+            gen->unspent[gen->unspentCount++] =
+                (GenOutput) { tx->txHash, 1, out.amount - out.amount/8 - GEN_TX_FEE, address };
+            txs[i++] = tx;
+        }
+    }
+
+    return txs;
+}
+
+static long _BenchPeakRSS(void) // kilobytes
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss/1024; // bytes on darwin
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// true while a timed operation should be repeated
+static int _OpMore(const OpTime *t)
+{
+    return (t->count < OP_MAX_COUNT && (t->count == 0 || t->ns < OP_MIN_TIME));
+}
+
+static double _OpMicros(const OpTime *t)
+{
+    return (t->count > 0) ? t->ns/1000.0/t->count : 0;
+}
+
+// generates a wallet of count tx and times operations on it, writing its result line to stdout
+static void _BenchWallet(const GenOptions *opts, size_t count)
+{
+    GenWallet gen = { NULL, NULL, opts->addrs, 0, 0, NULL, 0, opts->seed };
+    LWWallet *wallet;
+    LWTransaction **txs, *tx;
+    UInt256 chainHashes[opts->chains*opts->chainLen + 1];
+    LWTxOutput output = LW_TX_OUTPUT_NONE;
+    OpTime reg = { 0, 0 }, rm = { 0, 0 }, update = { 0, 0 }, create = { 0, 0 }, sign = { 0, 0 };
+    uint64_t start, genTime, newTime, amount;
+    size_t i, inputs = 0, utxoCount;
+    long rss = _BenchPeakRSS(), walletKB;
+    uint8_t script[25];
+
+    gen.external = calloc(opts->addrs, sizeof(*gen.external));
+    gen.internal = calloc(opts->addrs, sizeof(*gen.internal));
+    gen.unspent = calloc(opts->utxos + 2, sizeof(*gen.unspent));
+    assert(gen.external != NULL && gen.internal != NULL && gen.unspent != NULL);
+    wallet = LWWalletNew(NULL, 0, _genMPK); // derive the addresses the history pays
+    LWWalletUnusedAddrs(wallet, gen.external, opts->addrs, 0);
+    LWWalletUnusedAddrs(wallet, gen.internal, opts->addrs, 1);
+    LWWalletFree(wallet);
+
+    start = LWMetricsTime();
+    txs = _GenHistory(&gen, opts, count);
+    genTime = LWMetricsTime() - start;
+    for (i = 0; i < opts->chains*opts->chainLen; i++) chainHashes[i] = txs[count - 1 - i]->txHash;
+    start = LWMetricsTime();
+    wallet = LWWalletNew(txs, count, _genMPK);
+    newTime = LWMetricsTime() - start;
+    walletKB = _BenchPeakRSS() - rss;
+    free(txs);
+
+    if (! wallet || LWWalletTransactions(wallet, NULL, 0) != count) {
+        fprintf(stderr, "bench_wallet: LWWalletNew() rejected the generated history of %zu tx\n", count);
+        exit(1);
+    }
+
+    utxoCount = LWWalletUTXOs(wallet, NULL, 0);
+
+    while (_OpMore(&reg)) { // register and remove an unconfirmed receive, the most common change to a wallet
+        tx = _GenReceive(&gen, TX_UNCONFIRMED, GEN_START_TIME);
+        gen.unspentCount--;
+        start = LWMetricsTime();
+        LWWalletRegisterTransaction(wallet, tx);
+        reg.ns += LWMetricsTime() - start, reg.count++;
+        start = LWMetricsTime();
+        LWWalletRemoveTransaction(wallet, tx->txHash);
+        rm.ns += LWMetricsTime() - start, rm.count++;
+    }
+
+    for (i = 0; _OpMore(&update) && opts->chains*opts->chainLen > 0; i++) { // confirm the chains, then unconfirm them
+        start = LWMetricsTime();
+        LWWalletUpdateTransactions(wallet, chainHashes, opts->chains*opts->chainLen,
+                                   (i % 2 == 0) ? GEN_START_HEIGHT + (uint32_t)count : TX_UNCONFIRMED,
+                                   (i % 2 == 0) ? GEN_START_TIME + (uint32_t)count*GEN_BLOCK_SPACING : 0);
+        update.ns += LWMetricsTime() - start, update.count++;
+    }
+
+    if (i % 2 == 1) { // leave the chains unconfirmed
+        LWWalletUpdateTransactions(wallet, chainHashes, opts->chains*opts->chainLen, TX_UNCONFIRMED, 0);
+    }
+
+    amount = (utxoCount > 0) ? LWWalletBalance(wallet)/utxoCount*3 : 0;
+    LWTxOutputSetScript(&output, script, LWAddressScriptPubKey(script, sizeof(script), gen.external[0].s));
+    output.amount = amount;
+
+    while (amount > 0 && _OpMore(&sign)) {
+        start = LWMetricsTime();
+        tx = LWWalletCreateTxForOutputs(wallet, &output, 1);
+        create.ns += LWMetricsTime() - start, create.count++;
+        if (! tx) break;
+        start = LWMetricsTime();
+        LWWalletSignTransaction(wallet, tx, 0, &_genSeed, sizeof(_genSeed));
+        sign.ns += LWMetricsTime() - start, sign.count++;
+        inputs += tx->inCount;
+
+        if (! LWTransactionIsSigned(tx)) {
+            fprintf(stderr, "bench_wallet: LWWalletSignTransaction() failed on a wallet of %zu tx\n", count);
+            exit(1);
+        }
+
+        LWTransactionFree(tx);
+    }
+
+    LWTxOutputSetScript(&output, NULL, 0);
+    printf("%zu,%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32",%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%.0f,%ld\n",
+           count, opts->addrs, opts->utxos, opts->chains, opts->chainLen, utxoCount, newTime/1e6, _OpMicros(&reg),
+           _OpMicros(&rm), _OpMicros(&update), _OpMicros(&create), _OpMicros(&sign),
+           (sign.count > 0) ? (double)inputs/sign.count : 0, genTime/1e6, walletKB, walletKB*1024.0/count,
+           _BenchPeakRSS());
+    fflush(stdout);
+    LWWalletFree(wallet);
+    free(gen.unspent);
+    free(gen.internal);
+    free(gen.external);
+}
+
+int main(int argc, char *argv[])
+{
+    GenOptions opts = { { 1000, 10000, 100000, 1000000 }, 4, 1000, 100, 4, 10, 1 };
+    char *s, *end;
+    int opt, status;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "n:a:u:c:l:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                for (s = optarg, opts.sizesCount = 0; *s != '\0' && opts.sizesCount < GEN_MAX_SIZES; s = end) {
+                    opts.sizes[opts.sizesCount++] = strtoul(s, &end, 10);
+                    if (end == s) break;
+                    if (*end == ',') end++;
+                }
+                break;
+            case 'a': opts.addrs = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'u': opts.utxos = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'c': opts.chains = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'l': opts.chainLen = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-n sizes] [-a addresses] [-u utxos] [-c chains] [-l length] [-s seed]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    if (opts.chains == 0 || opts.chainLen == 0) opts.chains = opts.chainLen = 0;
+
+    for (size_t i = 0; i < opts.sizesCount; i++) {
+        if (opts.addrs > 0 && opts.utxos >= opts.chains && opts.sizes[i] > (size_t)opts.chains*opts.chainLen) continue;
+        fprintf(stderr, "%s: addresses must be positive, utxos at least chains, and sizes more than chains*length\n",
+                argv[0]);
+        return 1;
+    }
+
+    LWSHA512(&_genSeed, "bench_wallet", strlen("bench_wallet"));
+    _genMPK = LWBIP32MasterPubKey(&_genSeed, sizeof(_genSeed));
+    printf("tx,addresses,utxos,chains,chain_length,wallet_utxos,new_ms,register_us,remove_us,update_us,create_us,"
+           "sign_us,sign_inputs,generate_ms,wallet_kb,bytes_per_tx,peak_rss_kb\n");
+    fflush(stdout);
+
+    for (size_t i = 0; i < opts.sizesCount; i++) {
+        pid = fork();
+
+        if (pid == 0) {
+            _BenchWallet(&opts, opts.sizes[i]);
+            exit(0);
+        }
+
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || ! WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: wallet of %zu tx failed\n", argv[0], opts.sizes[i]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -4,7 +4,9 @@
 
 #include "LWCrypto.h"
 #include "LWBloomFilter.h"
+#include "LWBlockFilter.h"
 #include "LWMerkleBlock.h"
+#include "LWHeaderStore.h"
 #include "LWWallet.h"
 #include "LWKey.h"
 #include "LWBIP38Key.h"
@@ -14,6 +16,10 @@
 #include "LWBIP39Mnemonic.h"
 #include "LWBIP39WordsEn.h"
 #include "LWPeer.h"
+#include "LWAddrManager.h"
+#include "LWTxRelays.h"
+#include "LWMetrics.h"
+#include "LWLog.h"
 #include "LWPeerManager.h"
 #include "LWChainParams.h"
 #include "LWPaymentProtocol.h"
@@ -28,7 +34,10 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <pthread.h>
 
 #define SKIP_BIP38 1
 
@@ -190,6 +199,68 @@ int LWSetTests()
     return r;
 }
 
+int LWPeerKnownTxTest(LWPeer *peer, UInt256 hash, int add);
+
+int LWInvFilterTests()
+{
+    int r = 1;
+    LWPeer *p = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    UInt256 hash[201];
+    size_t i, count = 0;
+
+    for (i = 0; i < 201; i++) LWSHA256(&hash[i], &i, sizeof(i));
+    LWPeerSetKnownTxCapacity(p, 100);
+
+    for (i = 0; i < 100; i++) {
+        if (LWPeerKnownTxTest(p, hash[i], 1)) r = 0, fprintf(stderr, "***FAILED*** %s: add test %zu\n", __func__, i);
+    }
+
+    for (i = 0; i < 100; i++) { // adding a hash again doesn't take up room
+        if (! LWPeerKnownTxTest(p, hash[i], 1))
+            r = 0, fprintf(stderr, "***FAILED*** %s: duplicate test %zu\n", __func__, i);
+    }
+
+    for (i = 100; i < 200; i++) LWPeerKnownTxTest(p, hash[i], 1); // fills the second generation
+
+    for (i = 0; i < 200; i++) {
+        if (! LWPeerKnownTxTest(p, hash[i], 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: generation test 1 %zu\n", __func__, i);
+    }
+
+    LWPeerKnownTxTest(p, hash[200], 1); // starts a new generation, dropping the oldest one
+
+    for (i = 0; i < 201; i++) {
+        if (LWPeerKnownTxTest(p, hash[i], 0) != (i >= 100))
+            r = 0, fprintf(stderr, "***FAILED*** %s: generation test 2 %zu\n", __func__, i);
+    }
+
+    for (i = 201; i < 100201; i++) { // hashes that were never added aren't found, false positives are about count/2^64
+        UInt256 h;
+
+        LWSHA256(&h, &i, sizeof(i));
+        if (LWPeerKnownTxTest(p, h, 0)) count++;
+    }
+
+    if (count > 0) r = 0, fprintf(stderr, "***FAILED*** %s: false positive test\n", __func__);
+
+    if (LWPeerKnownTxTest(p, UINT256_ZERO, 0) || LWPeerKnownTxTest(p, UINT256_ZERO, 1) ||
+        ! LWPeerKnownTxTest(p, UINT256_ZERO, 0)) // a hash with a zero fingerprint isn't taken for an empty slot
+        r = 0, fprintf(stderr, "***FAILED*** %s: zero hash test\n", __func__);
+
+    LWPeerSetKnownTxCapacity(p, 150); // forgets the hashes already added
+    for (i = 0, count = 0; i < 201; i++) count += LWPeerKnownTxTest(p, hash[i], 0);
+    if (count > 0) r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerSetKnownTxCapacity() test 1\n", __func__);
+    for (i = 0; i < 201; i++) LWPeerKnownTxTest(p, hash[i], 1);
+
+    for (i = 0; i < 201; i++) { // the last 150 hashes added are always remembered
+        if (i >= 51 && ! LWPeerKnownTxTest(p, hash[i], 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerSetKnownTxCapacity() test 2 %zu\n", __func__, i);
+    }
+
+    LWPeerFree(p);
+    return r;
+}
+
 int LWBase58Tests()
 {
     int r = 1;
@@ -291,6 +362,31 @@ int LWBase58Tests()
     if (l5 != 21 || memcmp(s, b5, l5) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWBase58CheckDecode() test 5\n", __func__);
 
+    uint8_t items[4*21];
+    char strs[4][35];
+    
+    memcpy(&items[0], b3, 21);
+    memcpy(&items[21], b4, 21);
+    memcpy(&items[42], b5, 21);
+    memcpy(&items[63], "\x00\x01\x09\x66\x77\x60\x06\x95\x3D\x55\x67\x43\x9E\x5E\x39\xF8\x6A\x0D\x27\x3B\xEE", 21);
+    
+    if (LWBase58CheckEncodeArray(strs[0], sizeof(strs[0]), items, 21, 4) != 4 || strcmp(strs[0], s3) != 0 ||
+        strcmp(strs[1], s4) != 0 || strcmp(strs[2], s5) != 0 || strcmp(strs[3], "16UwLL9Risc3QfPqBUvKofHmBQ7wMtjvM") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBase58CheckEncodeArray() test 1\n", __func__);
+
+    if (LWBase58CheckEncodeArray(strs[0], 30, items, 21, 4) != 2) // third item needs 35 chars
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBase58CheckEncodeArray() test 2\n", __func__);
+
+    uint8_t big[0x1000]; // too big for the stack buffer
+    
+    for (size_t i = 0; i < sizeof(big); i++) big[i] = (uint8_t)(i*7 + 1);
+    
+    char s6[LWBase58CheckEncode(NULL, 0, big, sizeof(big))], s7[sizeof(s6)];
+    
+    LWBase58CheckEncode(s6, sizeof(s6), big, sizeof(big));
+    if (LWBase58CheckEncodeArray(s7, sizeof(s7), big, sizeof(big), 1) != 1 || strcmp(s6, s7) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBase58CheckEncodeArray() test 3\n", __func__);
+
     return r;
 }
 
@@ -490,6 +586,27 @@ int LWHashTests()
     if (! UInt160Eq(*(UInt160 *)"\x0b\xdc\x9d\x2d\x25\x6b\x3e\xe9\xda\xae\x34\x7b\xe6\xf4\xdc\x83\x5a\x46\x7f\xfe",
                     *(UInt160 *)md)) r = 0, fprintf(stderr, "***FAILED*** %s: LWRMD160() test 6\n", __func__);
 
+    // test hash160 array, with a count that isn't a multiple of the lane count, and items too long for one block
+
+    uint8_t items[7*60], mds[7*20];
+
+    for (size_t i = 0; i < sizeof(items); i++) items[i] = (uint8_t)(i*7 + 3);
+    LWHash160Array(mds, items, 33, 7);
+
+    for (size_t i = 0; i < 7; i++) {
+        LWHash160(md, &items[i*33], 33);
+        if (memcmp(md, &mds[i*20], 20) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: LWHash160Array() test 1\n", __func__);
+    }
+
+    LWHash160Array(mds, items, 60, 7);
+
+    for (size_t i = 0; i < 7; i++) {
+        LWHash160(md, &items[i*60], 60);
+        if (memcmp(md, &mds[i*20], 20) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: LWHash160Array() test 2\n", __func__);
+    }
+
     // test md5
     
     s = "Free online MD5 Calculator, type text here...";
@@ -553,6 +670,19 @@ int LWHashTests()
                     "\x82\x27\x3b\x7b\xfa\xd8\x04\x5d\x85\xa4\x70", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: Keccak-256() test 10\n", __func__);
     
+    // test siphash-2-4
+    
+    uint8_t k[16], d[15];
+    
+    for (size_t i = 0; i < sizeof(k); i++) k[i] = i;
+    for (size_t i = 0; i < sizeof(d); i++) d[i] = i;
+    
+    if (LWSipHash24(k, d, 0) != 0x726fdb47dd0e0e31)
+        r = 0, fprintf(stderr, "***FAILED*** %s: SipHash24() test 11\n", __func__);
+    
+    if (LWSipHash24(k, d, sizeof(d)) != 0xa129ca6149be45e5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: SipHash24() test 12\n", __func__);
+    
     return r;
 }
 
@@ -613,6 +743,65 @@ int LWMacTests()
                "\xb1\xa3\x4d\x4a\x6b\x4b\x63\x6e\x07\x0a\x38\xbc\xe7\x37", mac, 64) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWHMAC() sha512 test 2\n", __func__);
     
+    LWHMACContext ctx;
+    uint8_t mac2[64];
+
+    LWHMACContextInit(&ctx, LWSHA256, 256/8, k2, sizeof(k2) - 1);
+    LWHMACContextMac(&ctx, mac, d1, sizeof(d1) - 1);
+    LWHMACContextMac(&ctx, mac, d2, sizeof(d2) - 1);
+    if (memcmp("\x5b\xdc\xc1\x46\xbf\x60\x75\x4e\x6a\x04\x24\x26\x08\x95\x75\xc7\x5a\x00\x3f\x08\x9d\x27\x39\x83\x9d"
+               "\xec\x58\xb9\x64\xec\x38\x43", mac, 32) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHMACContextMac() sha256 test\n", __func__);
+
+    LWHMACContextInit(&ctx, LWSHA384, 384/8, k2, sizeof(k2) - 1);
+    LWHMACContextMac(&ctx, mac, d2, sizeof(d2) - 1);
+    if (memcmp("\xaf\x45\xd2\xe3\x76\x48\x40\x31\x61\x7f\x78\xd2\xb5\x8a\x6b\x1b\x9c\x7e\xf4\x64\xf5\xa0\x1b\x47\xe4"
+               "\x2e\xc3\x73\x63\x22\x44\x5e\x8e\x22\x40\xca\x5e\x69\xe2\xc7\x8b\x32\x39\xec\xfa\xb2\x16\x49", mac, 48)
+        != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHMACContextMac() sha384 test\n", __func__);
+
+    uint8_t k3[200], d3[300];
+
+    for (size_t i = 0; i < sizeof(k3); i++) k3[i] = (uint8_t)i;
+    for (size_t i = 0; i < sizeof(d3); i++) d3[i] = (uint8_t)(i*7);
+    LWHMACContextInit(&ctx, LWSHA512, 512/8, k3, sizeof(k3)); // key longer than the block, data longer than a block
+
+    for (size_t i = 0; i <= sizeof(d3); i += 25) {
+        LWHMACContextMac(&ctx, mac, d3, i);
+        LWHMAC(mac2, LWSHA384, 384/8, k3, sizeof(k3), d3, i); // clobber any state LWHMAC() might share
+        LWHMAC(mac2, LWSHA512, 512/8, k3, sizeof(k3), d3, i);
+        if (memcmp(mac, mac2, 64) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: LWHMACContextMac() sha512 test %zu\n", __func__, i);
+    }
+
+    mem_clean(&ctx, sizeof(ctx));
+
+    // test pbkdf2
+
+    LWPBKDF2(mac, 64, LWSHA256, 256/8, "passwd", 6, "salt", 4, 1);
+    if (memcmp("\x55\xac\x04\x6e\x56\xe3\x08\x9f\xec\x16\x91\xc2\x25\x44\xb6\x05\xf9\x41\x85\x21\x6d\xde\x04\x65\xe6"
+               "\x8b\x9d\x57\xc2\x0d\xac\xbc\x49\xca\x9c\xcc\xf1\x79\xb6\x45\x99\x16\x64\xb3\x9d\x77\xef\x31\x7c\x71"
+               "\xb8\x45\xb1\xe3\x0b\xd5\x09\x11\x20\x41\xd3\xa1\x97\x83", mac, 64) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPBKDF2() sha256 test 1\n", __func__);
+
+    LWPBKDF2(mac, 64, LWSHA256, 256/8, "Password", 8, "NaCl", 4, 80000);
+    if (memcmp("\x4d\xdc\xd8\xf6\x0b\x98\xbe\x21\x83\x0c\xee\x5e\xf2\x27\x01\xf9\x64\x1a\x44\x18\xd0\x4c\x04\x14\xae"
+               "\xff\x08\x87\x6b\x34\xab\x56\xa1\xd4\x25\xa1\x22\x58\x33\x54\x9a\xdb\x84\x1b\x51\xc9\xb3\x17\x6a\x27"
+               "\x2b\xde\xbb\xa1\xd0\x78\x47\x8f\x62\xb3\x97\xf3\x3c\x8d", mac, 64) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPBKDF2() sha256 test 2\n", __func__);
+
+    LWPBKDF2(mac, 64, LWSHA512, 512/8, "password", 8, "salt", 4, 2);
+    if (memcmp("\xe1\xd9\xc1\x6a\xa6\x81\x70\x8a\x45\xf5\xc7\xc4\xe2\x15\xce\xb6\x6e\x01\x1a\x2e\x9f\x00\x40\x71\x3f"
+               "\x18\xae\xfd\xb8\x66\xd5\x3c\xf7\x6c\xab\x28\x68\xa3\x9b\x9f\x78\x40\xed\xce\x4f\xef\x5a\x82\xbe\x67"
+               "\x33\x5c\x77\xa6\x06\x8e\x04\x11\x27\x54\xf2\x7c\xcf\x4e", mac, 64) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPBKDF2() sha512 test\n", __func__);
+
+    LWPBKDF2(mac, 48, LWSHA384, 384/8, "password", 8, "salt", 4, 2);
+    if (memcmp("\x54\xf7\x75\xc6\xd7\x90\xf2\x19\x30\x45\x91\x62\xfc\x53\x5d\xbf\x04\xa9\x39\x18\x51\x27\x01\x6a\x04"
+               "\x17\x6a\x07\x30\xc6\xf1\xf4\xfb\x48\x83\x2a\xd1\x26\x1b\xaa\xdd\x2c\xed\xd5\x08\x14\xb1\xc8", mac, 48)
+        != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPBKDF2() sha384 test\n", __func__);
+    
     // test poly1305
 
     const char key1[] = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",
@@ -1262,6 +1451,36 @@ int LWKeyTests()
     return r;
 }
 
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+    char privKey[4][55], bip38Key[61];
+} LWBIP38PoolTestInfo;
+
+static void _LWBIP38PoolTestDecrypted(void *info, uint64_t jobId, const LWKey *key)
+{
+    LWBIP38PoolTestInfo *t = info;
+    LWKey k;
+    
+    pthread_mutex_lock(&t->lock);
+    if (key) k = *key, LWKeyPrivKey(&k, t->privKey[jobId - 1], sizeof(t->privKey[jobId - 1]));
+    t->count++;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void _LWBIP38PoolTestEncrypted(void *info, uint64_t jobId, const char *bip38Key)
+{
+    LWBIP38PoolTestInfo *t = info;
+    
+    pthread_mutex_lock(&t->lock);
+    if (bip38Key) strncpy(t->bip38Key, bip38Key, sizeof(t->bip38Key) - 1);
+    t->count++;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
 int LWBIP38KeyTests()
 {
     int r = 1;
@@ -1355,6 +1574,47 @@ int LWBIP38KeyTests()
     if (LWKeySetBIP38Key(&key, "6PRW5o9FLp4gJDDVqJQKJFTpMvdsSGJxMYHtHaQBF3ooa8mwD69bapcDQn", "foobar"))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWKeySetBIP38Key() test 10\n", __func__);
 
+    // test background decryption and encryption on a worker pool against the results above
+    LWBIP38Pool *pool = LWBIP38PoolNew(2);
+    LWBIP38PoolTestInfo info = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, { "", "", "", "" }, "" };
+    char ecPrivKey[55] = "";
+    uint64_t jobId;
+    
+    if (LWKeySetBIP38Key(&key, "6PfQu77ygVyJLZjfvMLyhLMQbYnu5uguoJJ4kMCLqWwPEdfpwANVS76gTX", "TestingOneTwoThree"))
+        LWKeyPrivKey(&key, ecPrivKey, sizeof(ecPrivKey));
+    
+    UInt256 secret = uint256("09c2686880095b1a4c249ee3ac4eea8a014f11e6f986d0b5025ac1f39afbd9ae");
+    
+    LWKeySetSecret(&key, &secret, 0);
+    LWKeyPrivKey(&key, privKey, sizeof(privKey));
+    LWKeyBIP38Key(&key, bip38Key, sizeof(bip38Key), "Satoshi");
+    LWBIP38PoolDecrypt(pool, bip38Key, "Satoshi", &info, _LWBIP38PoolTestDecrypted);
+    LWBIP38PoolDecrypt(pool, "6PfQu77ygVyJLZjfvMLyhLMQbYnu5uguoJJ4kMCLqWwPEdfpwANVS76gTX", "TestingOneTwoThree", &info,
+                       _LWBIP38PoolTestDecrypted);
+    LWBIP38PoolDecrypt(pool, bip38Key, "foobar", &info, _LWBIP38PoolTestDecrypted);
+    LWBIP38PoolEncrypt(pool, &key, "Satoshi", &info, _LWBIP38PoolTestEncrypted);
+    jobId = LWBIP38PoolDecrypt(pool, bip38Key, "Satoshi", &info, _LWBIP38PoolTestDecrypted);
+    
+    if (! LWBIP38PoolCancel(pool, jobId) || LWBIP38PoolCancel(pool, jobId))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP38PoolCancel() test\n", __func__);
+    
+    pthread_mutex_lock(&info.lock);
+    while (info.count < 4) pthread_cond_wait(&info.cond, &info.lock);
+    pthread_mutex_unlock(&info.lock);
+    LWBIP38PoolFree(pool);
+    
+    if (! privKey[0] || strncmp(info.privKey[0], privKey, sizeof(privKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP38PoolDecrypt() test 1\n", __func__);
+    
+    if (strncmp(info.privKey[1], ecPrivKey, sizeof(ecPrivKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP38PoolDecrypt() test 2\n", __func__);
+    
+    if (info.privKey[2][0] != '\0' || info.count != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP38PoolDecrypt() test 3\n", __func__);
+    
+    if (! bip38Key[0] || strncmp(info.bip38Key, bip38Key, sizeof(bip38Key)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP38PoolEncrypt() test\n", __func__);
+    
     printf("                                    ");
     return r;
 }
@@ -1390,6 +1650,32 @@ int LWAddressTests()
     if (script3Len != sizeof(script2) || memcmp(script2, script3, sizeof(script2)))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: LWAddressScriptPubKey() test", __func__);
 
+    uint8_t pubKeys[9*33], script4[22] = { OP_0, 20 };
+    LWAddress legacyAddrs[9], witnessAddrs[9];
+
+    for (uint32_t i = 0; i < 9; i++) {
+        secret = UINT256_ZERO;
+        secret.u8[31] = (uint8_t)(i + 1);
+        LWKeySetSecret(&k, &secret, 1);
+        LWKeyPubKey(&k, &pubKeys[i*33], 33);
+    }
+
+    LWAddressesFromPubKeys(legacyAddrs, witnessAddrs, pubKeys, 9);
+
+    for (uint32_t i = 0; i < 9; i++) {
+        LWKeySetPubKey(&k, &pubKeys[i*33], 33);
+        addr = LW_ADDRESS_NONE;
+        LWKeyAddress(&k, addr.s, sizeof(addr));
+        if (! LWAddressEq(&addr, &legacyAddrs[i]))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWAddressesFromPubKeys() test 1", __func__);
+
+        UInt160Set(&script4[2], LWKeyHash160(&k));
+        addr = LW_ADDRESS_NONE;
+        LWAddressFromScriptPubKey(addr.s, sizeof(addr), script4, sizeof(script4));
+        if (! LWAddressEq(&addr, &witnessAddrs[i]))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWAddressesFromPubKeys() test 2", __func__);
+    }
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
@@ -1404,6 +1690,15 @@ int LWBIP39MnemonicTests()
     if (LWBIP39PhraseIsValid(LWBIP39WordsEn, s))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP39PhraseIsValid() test\n", __func__);
 
+    const char *phrases[] = { s, "zoo zoo zoo zoo zoo zoo zoo zoo zoo zoo zoo wrong",
+        "jelly better achieve collect unaware mountain thought cargo oxygen act hood bridge",
+        "zoo zoo zoo zoo zoo zoo zoo zoo zoo zoo zoo wrongs", "zoo  zoo zoo zoo zoo zoo zoo zoo zoo zoo zoo wrong", "" };
+    int valid[6];
+    
+    if (LWBIP39PhrasesAreValid(LWBIP39WordsEn, phrases, 6, valid) != 2 || valid[0] || ! valid[1] || ! valid[2] ||
+        valid[3] || valid[4] || valid[5])
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBIP39PhrasesAreValid() test\n", __func__);
+
     UInt512 key = UINT512_ZERO;
 
 //    LWBIP39DeriveKey(key.u8, NULL, NULL); // test invalid key
@@ -1845,6 +2140,17 @@ int LWWalletTests()
     if (LWWalletBalance(w) != SATOSHIS*2)
         r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUpdateTransactions() test\n", __func__);
 
+    LWTransaction *txs[2];
+    UInt256 txHashes[3] = { UINT256_ZERO, UINT256_ZERO, inHash }; // the last one isn't in the wallet
+    uint32_t heights[3] = { 1001, 1002, 1002 }, timestamps[3] = { 2, 3, 3 };
+
+    LWWalletTransactions(w, txs, 2);
+    txHashes[0] = txs[0]->txHash, txHashes[1] = txs[1]->txHash;
+    LWWalletUpdateBlockTransactions(w, txHashes, heights, timestamps, 3);
+    if (txs[0]->blockHeight != 1001 || txs[0]->timestamp != 2 || txs[1]->blockHeight != 1002 ||
+        txs[1]->timestamp != 3 || LWWalletBalance(w) != SATOSHIS*2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUpdateBlockTransactions() test\n", __func__);
+
     LWWalletFree(w);
     tx = LWTransactionNew();
     LWTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
@@ -1922,7 +2228,26 @@ int LWWalletTests()
 
     LWTransactionFree(tx);
     LWWalletFree(w);
-    
+
+    w = LWWalletNew(NULL, 0, mpk); // test a gap limit spanning several address batches
+    LWAddress *gapAddrs = calloc(1000, sizeof(*gapAddrs));
+
+    if (LWWalletUnusedAddrs(w, gapAddrs, 1000, 1) != 1000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUnusedAddrs() test 1\n", __func__);
+
+    for (uint32_t i = 0; i < 1000; i += 333) {
+        uint8_t pubKey[33];
+
+        LWBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_INTERNAL_CHAIN, i);
+        LWKeySetPubKey(&k, pubKey, sizeof(pubKey));
+        LWKeyAddress(&k, addr.s, sizeof(addr));
+        if (! LWAddressEq(&addr, &gapAddrs[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: LWWalletUnusedAddrs() test 2\n", __func__);
+    }
+
+    free(gapAddrs);
+    LWWalletFree(w);
+
     amt = LWBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: LWBitcoinAmount() test 1\n", __func__);
 
@@ -2030,6 +2355,52 @@ static int LWMerkleBlockEqual (const LWMerkleBlock *block1, const LWMerkleBlock
            && block1->height == block2->height;
 }
 
+int LWBlockFilterTests()
+{
+    int r = 1;
+    // testnet genesis block, its basic filter only has the coinbase output script
+    UInt256 blockHash = UInt256Reverse(uint256("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"));
+    const uint8_t script[] = "\x41\x04\x67\x8a\xfd\xb0\xfe\x55\x48\x27\x19\x67\xf1\xa6\x71\x30\xb7\x10\x5c\xd6\xa8\x28"
+    "\xe0\x39\x09\xa6\x79\x62\xe0\xea\x1f\x61\xde\xb6\x49\xf6\xbc\x3f\x4c\xef\x38\xc4\xf3\x55\x04\xe5\x1e\xc1\x12\xde"
+    "\x5c\x38\x4d\xf7\xba\x0b\x8d\x57\x8a\x4c\x70\x2b\x6b\xf1\x1d\x5f\xac",
+        other[] = "\x76\xa9\x14\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13"
+    "\x88\xac";
+    const uint8_t *scripts[] = { script, other };
+    size_t scriptLens[] = { sizeof(script) - 1, sizeof(other) - 1 };
+    uint8_t filter[LWBlockFilterBuild(NULL, 0, blockHash, scripts, scriptLens, 1)];
+    size_t filterLen = LWBlockFilterBuild(filter, sizeof(filter), blockHash, scripts, scriptLens, 1);
+
+    if (filterLen != 4 || memcmp(filter, "\x01\x9d\xfc\xa8", 4) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterBuild() test 1\n", __func__);
+
+    if (! UInt256Eq(LWBlockFilterHeader(LWBlockFilterHash(filter, filterLen), UINT256_ZERO),
+                    UInt256Reverse(uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterHeader() test 1\n", __func__);
+
+    if (! LWBlockFilterMatchAny(filter, filterLen, blockHash, scripts, scriptLens, 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterMatchAny() test 1\n", __func__);
+
+    if (LWBlockFilterMatchAny(filter, filterLen, blockHash, &scripts[1], &scriptLens[1], 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterMatchAny() test 2\n", __func__);
+
+    if (LWBlockFilterMatchAny((const uint8_t *)"\x00", 1, blockHash, scripts, scriptLens, 2)) // empty filter
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterMatchAny() test 3\n", __func__);
+
+    if (LWBlockFilterMatchAny(filter, filterLen - 1, blockHash, scripts, scriptLens, 2)) // truncated filter
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterMatchAny() test 4\n", __func__);
+
+    const uint8_t *manyScripts[1000];
+    size_t manyLens[1000];
+
+    for (size_t i = 0; i < 1000; i++) manyScripts[i] = other, manyLens[i] = sizeof(other) - 1;
+    manyScripts[999] = script, manyLens[999] = sizeof(script) - 1;
+
+    if (! LWBlockFilterMatchAny(filter, filterLen, blockHash, manyScripts, manyLens, 1000)) // more than 512 scripts
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWBlockFilterMatchAny() test 5\n", __func__);
+
+    return r;
+}
+
 int LWMerkleBlockTests()
 {
     int r = 1;
@@ -2085,10 +2456,132 @@ int LWMerkleBlockTests()
     if (! UInt256Eq(txHashes[3], uint256("c9ab658448c10b6921b7a4ce3021eb22ed6bb6a7fde1e5bcc4b1db6615c6abc5")))
         r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockTxHashes() test 4\n", __func__);
     
+    uint8_t headers[81*2];
+    LWMerkleBlock *h[2];
+
+    memcpy(headers, block, 80);
+    headers[80] = 0;
+    memcpy(&headers[81], block, 80);
+    UInt256Set(&headers[81 + 4], b->blockHash);
+    UInt32SetLE(&headers[81 + 68], b->timestamp + 150);
+    headers[161] = 0;
+
+    if (LWMerkleBlockParseHeaders(h, 2, headers, sizeof(headers)) != 2 || ! UInt256Eq(h[0]->blockHash, b->blockHash) ||
+        ! UInt256Eq(h[0]->powHash, b->powHash) || ! UInt256Eq(h[1]->prevBlock, b->blockHash) ||
+        h[1]->timestamp != b->timestamp + 150 || h[1]->totalTx != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockParseHeaders() test 1\n", __func__);
+    else LWMerkleBlockFree(h[0]), LWMerkleBlockFree(h[1]);
+
+    headers[81 + 4] ^= 1; // second header no longer links to the first
+
+    if (LWMerkleBlockParseHeaders(h, 2, headers, sizeof(headers)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockParseHeaders() test 2\n", __func__);
+
+    UInt256 leaves[3] = { uint256("0000000000000000000000000000000000000000000000000000000000000001"),
+                            uint256("0000000000000000000000000000000000000000000000000000000000000002"),
+                            uint256("0000000000000000000000000000000000000000000000000000000000000003") },
+            nodes[2][2] = { { leaves[0], leaves[1] }, { leaves[2], leaves[2] } }, root[2], merkleRoot;
+    uint8_t matches[3] = { 0, 0, 0 };
+    LWMerkleBlock *p = LWMerkleBlockNew();
+
+    LWSHA256_2(&root[0], nodes[0], sizeof(nodes[0]));
+    LWSHA256_2(&root[1], nodes[1], sizeof(nodes[1]));
+    LWSHA256_2(&merkleRoot, root, sizeof(root));
+    LWMerkleBlockSetPartialTree(p, leaves, matches, 3);
+
+    if (p->totalTx != 3 || p->hashesCount != 1 || ! UInt256Eq(p->hashes[0], merkleRoot) ||
+        LWMerkleBlockTxHashes(p, NULL, 0) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockSetPartialTree() test 1\n", __func__);
+
+    matches[2] = 1;
+    LWMerkleBlockSetPartialTree(p, leaves, matches, 3);
+    p->merkleRoot = merkleRoot;
+    p->target = 0x1e0fffff;
+
+    if (p->hashesCount != 2 || ! UInt256Eq(p->hashes[0], root[0]) || LWMerkleBlockTxHashes(p, NULL, 0) != 1 ||
+        ! LWMerkleBlockContainsTxHash(p, leaves[2]) || LWMerkleBlockContainsTxHash(p, leaves[1]) ||
+        ! LWMerkleBlockIsValid(p, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockSetPartialTree() test 2\n", __func__);
+
+    LWMerkleBlockFree(p);
+
     // TODO: test a block with an odd number of tree rows both at the tx level and merkle node level
 
-    // TODO: XXX test LWMerkleBlockVerifyDifficulty()
-    
+    LWMerkleBlock prev = { .height = 2014999, .timestamp = 1500000000, .target = 0x1b0187a3 },
+                  next = { .height = 2015000, .timestamp = 1500000150, .target = 0x1b0187a3 };
+
+    prev.blockHash.u8[0] = next.prevBlock.u8[0] = 1;
+
+    if (! LWMerkleBlockVerifyDifficulty(&next, &prev, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 1\n", __func__);
+
+    next.target = 0x1b0187a4;
+
+    if (LWMerkleBlockVerifyDifficulty(&next, &prev, 0)) // target changed between transitions
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 2\n", __func__);
+
+    next.height = 2016000;
+    prev.height = 2015999;
+    next.target = 0x1b00c3d1; // blocks came twice as fast as targeted, so the target halves
+
+    if (! LWMerkleBlockVerifyDifficulty(&next, &prev, prev.timestamp - 302400/2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 3\n", __func__);
+
+    if (LWMerkleBlockVerifyDifficulty(&next, &prev, prev.timestamp - 302400))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 4\n", __func__);
+
+    next.target = 0x1b061e8c; // adjustment is limited to 4x
+
+    if (! LWMerkleBlockVerifyDifficulty(&next, &prev, prev.timestamp - 302400*10))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 5\n", __func__);
+
+    if (LWMerkleBlockVerifyDifficulty(&next, &prev, 0)) // a transition needs the start of the retarget window
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 6\n", __func__);
+
+    if (! LWMerkleBlockVerifyDifficultyLimits(&next, &prev))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficultyLimits() test 1\n", __func__);
+
+    next.target = 0x1b061e8d;
+
+    if (LWMerkleBlockVerifyDifficultyLimits(&next, &prev))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficultyLimits() test 2\n", __func__);
+
+    prev.target = next.target = 0x1e0fffff; // target can't exceed the proof-of-work limit
+
+    if (! LWMerkleBlockVerifyDifficulty(&next, &prev, prev.timestamp - 302400*4))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockVerifyDifficulty() test 8\n", __func__);
+
+    LWMerkleBlock pow = { .target = 0x1e0fffff }; // 0x0fffff << 27*8, compared against powHash from the top byte
+
+    pow.powHash.u8[29] = 0x0f, pow.powHash.u8[28] = 0xff, pow.powHash.u8[27] = 0xfe;
+    if (! LWMerkleBlockIsValid(&pow, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 1\n", __func__);
+
+    pow.powHash.u8[27] = 0xff, pow.powHash.u8[0] = 1; // just above the target
+    if (LWMerkleBlockIsValid(&pow, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 2\n", __func__);
+
+    pow.target = 0x02123400, pow.powHash = UINT256_ZERO; // size 2, the low target byte is shifted out
+    pow.powHash.u8[0] = 0x34;
+    if (! LWMerkleBlockIsValid(&pow, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 3\n", __func__);
+
+    pow.powHash.u8[1] = 0x12, pow.powHash.u8[0] = 0x35;
+    if (LWMerkleBlockIsValid(&pow, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 4\n", __func__);
+
+    pow.target = 0x207fffff, pow.powHash = UINT256_ZERO; // size 32, only within the proof-of-work limit on regtest
+#if LITECOIN_REGTEST
+    if (! LWMerkleBlockIsValid(&pow, 0))
+#else
+    if (LWMerkleBlockIsValid(&pow, 0))
+#endif
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 5\n", __func__);
+
+    pow.target = 0xff7fffff; // size far past the end of a 32 byte target
+    if (LWMerkleBlockIsValid(&pow, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMerkleBlockIsValid() target test 6\n", __func__);
+
     // TODO: test (CVE-2012-2459) vulnerability
 
     LWMerkleBlock *c = LWMerkleBlockCopy(b);
@@ -2107,6 +2600,508 @@ int LWMerkleBlockTests()
     return r;
 }
 
+int LWHeaderStoreTests()
+{
+    int r = 1, fd;
+    char path[] = "/tmp/LWHeaderStoreTestsXXXXXX";
+    LWMerkleBlock *blocks[10], *b;
+    LWHeaderStore *store;
+    uint8_t buf[80];
+    size_t i;
+
+    fd = mkstemp(path);
+    if (fd >= 0) close(fd);
+
+    for (i = 0; i < 10; i++) { // a chain of headers starting at a difficulty transition
+        blocks[i] = LWMerkleBlockNew();
+        blocks[i]->version = 2;
+        blocks[i]->prevBlock = (i > 0) ? blocks[i - 1]->blockHash : UINT256_ZERO;
+        blocks[i]->merkleRoot.u32[0] = (uint32_t)i;
+        blocks[i]->timestamp = 1500000000 + (uint32_t)i*150;
+        blocks[i]->target = 0x1a0fffff;
+        blocks[i]->nonce = (uint32_t)i;
+        blocks[i]->height = 2016 + (uint32_t)i;
+        LWMerkleBlockSerialize(blocks[i], buf, sizeof(buf));
+        LWSHA256_2(&blocks[i]->blockHash, buf, sizeof(buf));
+    }
+
+    store = LWHeaderStoreNew(path);
+    if (! store || LWHeaderStoreCount(store) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreNew() test 1\n", __func__);
+
+    if (store && ! LWHeaderStoreAdd(store, blocks, 10))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 1\n", __func__);
+
+    if (store) LWHeaderStoreFree(store);
+    store = LWHeaderStoreNew(path);
+
+    if (! store || LWHeaderStoreCount(store) != 10 || LWHeaderStoreStartHeight(store) != 2016)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreNew() test 2\n", __func__);
+
+    b = (store) ? LWHeaderStoreBlock(store, 2021) : NULL;
+
+    if (! b || ! UInt256Eq(b->blockHash, blocks[5]->blockHash) || ! UInt256Eq(b->prevBlock, blocks[4]->blockHash) ||
+        b->height != 2021 || b->timestamp != blocks[5]->timestamp || b->nonce != 5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreBlock() test 1\n", __func__);
+
+    if (b) LWMerkleBlockFree(b);
+
+    if (store && (LWHeaderStoreBlock(store, 2015) != NULL || LWHeaderStoreBlock(store, 2026) != NULL))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreBlock() test 2\n", __func__);
+
+    if (store && (! LWHeaderStoreAdd(store, &blocks[4], 2) || LWHeaderStoreCount(store) != 6 ||
+                  ! UInt256Eq(LWHeaderStoreBlockHash(store, 2021), blocks[5]->blockHash))) // replaces blocks after 2021
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 2\n", __func__);
+
+    if (store) LWHeaderStoreFree(store);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd >= 0 && write(fd, buf, 40) != 40) r = 0; // an interrupted write leaves a partial record
+    if (fd >= 0) close(fd);
+    store = LWHeaderStoreNew(path);
+
+    if (! store || LWHeaderStoreCount(store) != 6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreNew() test 3\n", __func__);
+
+    if (store) LWHeaderStoreFree(store);
+    fd = open(path, O_WRONLY);
+    if (fd >= 0 && pwrite(fd, buf, 1, 16 + 5*HEADER_STORE_RECORD_SIZE + 10) != 1) r = 0; // corrupt the last record
+    if (fd >= 0) close(fd);
+    store = LWHeaderStoreNew(path);
+
+    if (! store || LWHeaderStoreCount(store) != 5 || ! UInt256IsZero(LWHeaderStoreBlockHash(store, 2021)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreNew() test 4\n", __func__);
+
+    if (store && (! LWHeaderStoreAdd(store, &blocks[7], 3) || LWHeaderStoreCount(store) != 3 ||
+                  LWHeaderStoreStartHeight(store) != 2023)) // blocks that don't link to the store replace it
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 3\n", __func__);
+
+    if (store && (LWHeaderStoreAdd(store, (LWMerkleBlock *[]) { blocks[0], blocks[2] }, 2) ||
+                  LWHeaderStoreCount(store) != 3)) // blocks that aren't linked to each other are rejected
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 4\n", __func__);
+
+    if (store) LWHeaderStoreFree(store);
+    for (i = 0; i < 10; i++) LWMerkleBlockFree(blocks[i]);
+
+    LWMerkleBlock *chain[HEADER_STORE_VERIFY_COUNT + 100];
+
+    for (i = 0; i < sizeof(chain)/sizeof(*chain); i++) { // longer than the part of the store verified when it's opened
+        chain[i] = LWMerkleBlockNew();
+        chain[i]->prevBlock = (i > 0) ? chain[i - 1]->blockHash : UINT256_ZERO;
+        chain[i]->nonce = (uint32_t)i;
+        chain[i]->height = 2016 + (uint32_t)i;
+        LWMerkleBlockSerialize(chain[i], buf, sizeof(buf));
+        LWSHA256_2(&chain[i]->blockHash, buf, sizeof(buf));
+    }
+
+    store = LWHeaderStoreNew(path);
+    if (store && ! LWHeaderStoreAdd(store, chain, sizeof(chain)/sizeof(*chain)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 5\n", __func__);
+
+    if (store) LWHeaderStoreFree(store);
+    fd = open(path, O_WRONLY);
+    memset(buf, 0xff, sizeof(buf));
+    if (fd >= 0 && pwrite(fd, buf, 1, 16 + 10) != 1) r = 0; // corrupt the first record
+    if (fd >= 0) close(fd);
+    store = LWHeaderStoreNew(path);
+
+    // the heights of the remaining records aren't known without the first one
+    if (! store || LWHeaderStoreCount(store) != 0 || ! UInt256IsZero(LWHeaderStoreBlockHash(store, 2016 + 200)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreNew() test 5\n", __func__);
+
+    for (i = 0; i < sizeof(chain)/sizeof(*chain); i++) LWMerkleBlockFree(chain[i]);
+
+    // a store is loaded by a peer manager only if it matches the checkpoints
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeerManager *manager;
+    UInt256 merkleRoot = UInt256Reverse(uint256("97ddfbbae6be97fd6cdf3e7ca13232a3afff2353e29badfab7f73011edd4ced9"));
+
+    for (i = 0; i < 3; i++) { // mainnet genesis block, followed by two more headers
+        chain[i] = LWMerkleBlockNew();
+        chain[i]->version = 1;
+        chain[i]->prevBlock = (i > 0) ? chain[i - 1]->blockHash : UINT256_ZERO;
+        chain[i]->merkleRoot = merkleRoot;
+        chain[i]->timestamp = 1317972665 + (uint32_t)i*150;
+        chain[i]->target = 0x1e0ffff0;
+        chain[i]->nonce = (i == 0) ? 2084524493 : (uint32_t)i;
+        chain[i]->height = (uint32_t)i;
+        LWMerkleBlockSerialize(chain[i], buf, sizeof(buf));
+        LWSHA256_2(&chain[i]->blockHash, buf, sizeof(buf));
+    }
+
+    if (store && ! LWHeaderStoreAdd(store, chain, 3))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 6\n", __func__);
+
+    manager = LWPeerManagerNew(&LWMainNetParams, w, 0, NULL, 0, NULL, 0);
+    if (store) LWPeerManagerSetHeaderStore(manager, store);
+
+    if (! store || LWPeerManagerLastBlockHeight(manager) != 2 || LWHeaderStoreCount(store) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerManagerSetHeaderStore() test 1\n", __func__);
+
+    LWPeerManagerFree(manager);
+    chain[0]->nonce++; // a genesis block that doesn't match the checkpoint
+
+    for (i = 0; i < 3; i++) {
+        chain[i]->prevBlock = (i > 0) ? chain[i - 1]->blockHash : UINT256_ZERO;
+        LWMerkleBlockSerialize(chain[i], buf, sizeof(buf));
+        LWSHA256_2(&chain[i]->blockHash, buf, sizeof(buf));
+    }
+
+    if (store && ! LWHeaderStoreAdd(store, chain, 3))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWHeaderStoreAdd() test 7\n", __func__);
+
+    manager = LWPeerManagerNew(&LWMainNetParams, w, 0, NULL, 0, NULL, 0);
+    if (store) LWPeerManagerSetHeaderStore(manager, store);
+
+    if (! store || LWPeerManagerLastBlockHeight(manager) != 0 || LWHeaderStoreCount(store) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerManagerSetHeaderStore() test 2\n", __func__);
+
+    LWPeerManagerFree(manager);
+    LWWalletFree(w);
+    for (i = 0; i < 3; i++) LWMerkleBlockFree(chain[i]);
+    if (store) LWHeaderStoreFree(store);
+    unlink(path);
+    return r;
+}
+
+int LWAddrManagerTests()
+{
+    int r = 1;
+    time_t now = time(NULL);
+    LWAddrManager *manager = LWAddrManagerNew(), *manager2;
+    LWPeer peers[3], out[3], source = { UINT128_ZERO, 9333, 0, 0, 0 }, *exclude[1], p;
+    uint8_t stats[1024];
+    size_t i, len, fast = 0;
+
+    for (i = 0; i < 3; i++) {
+        peers[i] = ((LWPeer) { ((UInt128) { .u32 = { 0, 0, htonl(0xffff), htonl(0x0a000001 + ((uint32_t)i << 16)) } }),
+                               9333, SERVICES_NODE_NETWORK, (uint64_t)now, 0 });
+    }
+
+    if (LWAddrManagerAdd(manager, peers, 3, NULL, now) != 3 || LWAddrManagerCount(manager, 0, now) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerAdd() test 1\n", __func__);
+
+    if (LWAddrManagerAdd(manager, peers, 1, NULL, now) != 0 || LWAddrManagerCount(manager, 0, now) != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerAdd() test 2\n", __func__);
+
+    if (LWAddrManagerMisbehaving(manager, &peers[0], ADDR_BAN_SCORE/2, now) ||
+        ! LWAddrManagerMisbehaving(manager, &peers[0], ADDR_BAN_SCORE/2, now) ||
+        ! LWAddrManagerIsBanned(manager, &peers[0], now) || LWAddrManagerCount(manager, 0, now) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerMisbehaving() test 1\n", __func__);
+
+    LWAddrManagerClear(manager);
+    LWAddrManagerAdd(manager, peers, 3, NULL, now);
+
+    if (! LWAddrManagerIsBanned(manager, &peers[0], now) || LWAddrManagerCount(manager, 0, now) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerClear() test 1\n", __func__);
+
+    exclude[0] = &peers[1];
+
+    if (LWAddrManagerSelect(manager, out, 3, exclude, 1, now) != 1 || ! LWPeerEq(&out[0], &peers[2]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerSelect() test 1\n", __func__);
+
+    LWAddrManagerAttempt(manager, &peers[1], now);
+    LWAddrManagerConnected(manager, &peers[1], 0.1, now);
+    LWAddrManagerSetThroughput(manager, &peers[1], 100.0);
+    LWAddrManagerSetThroughput(manager, &peers[2], 0.1);
+
+    for (i = 0; i < 100; i++) { // selection favors the peer with the higher expected throughput
+        if (LWAddrManagerSelect(manager, out, 1, NULL, 0, now) == 1 && LWPeerEq(&out[0], &peers[1])) fast++;
+    }
+
+    if (fast < 90) r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerSelect() test 2\n", __func__);
+
+    if (LWAddrManagerPeers(manager, out, 3, now) != 2 || LWAddrManagerPeers(manager, NULL, 0, now) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerPeers() test 1\n", __func__);
+
+    len = LWAddrManagerSerialize(manager, stats, sizeof(stats), now);
+    manager2 = LWAddrManagerNew();
+    LWAddrManagerAdd(manager2, &peers[1], 1, NULL, now);
+
+    if (len == 0 || len != LWAddrManagerSerialize(manager, NULL, 0, now) ||
+        ! LWAddrManagerLoad(manager2, stats, len, now) || ! LWAddrManagerIsBanned(manager2, &peers[0], now) ||
+        LWAddrManagerSerialize(manager2, NULL, 0, now) != len)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerLoad() test 1\n", __func__);
+
+    if (LWAddrManagerLoad(manager2, stats, len - 1, now))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerLoad() test 2\n", __func__);
+
+    LWAddrManagerFree(manager2);
+
+    for (i = 0; i < ADDR_MAX_FAILURES; i++) LWAddrManagerFailed(manager, &peers[2]);
+
+    if (LWAddrManagerCount(manager, 0, now) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerFailed() test 1\n", __func__);
+
+    source.address = peers[1].address;
+
+    for (i = 0; i < 10000; i++) { // addresses from a single source only fill a few buckets
+        p = peers[2];
+        p.address.u32[3] = htonl(0x0b000000 + (uint32_t)i*0x10001);
+        LWAddrManagerAdd(manager, &p, 1, &source, now);
+    }
+
+    if (LWAddrManagerCount(manager, 0, now) > ADDR_BUCKET_COUNT*ADDR_BUCKET_SIZE/8)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerAdd() test 3\n", __func__);
+
+    for (i = 0; i < 300; i++) { // more bans in one address group than its buckets have room for
+        p = peers[2];
+        p.address.u32[3] = htonl(0x0c000000 + (uint32_t)i);
+        if (! LWAddrManagerMisbehaving(manager, &p, ADDR_BAN_SCORE, now)) break;
+    }
+
+    if (i < 300) r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerMisbehaving() test 2\n", __func__);
+
+    for (i = 0; i < 10000; i++) { // fill the group's buckets so addresses get evicted
+        p = peers[2];
+        p.address.u32[3] = htonl(0x0c000000 + (uint32_t)i);
+        LWAddrManagerAdd(manager, &p, 1, NULL, now);
+    }
+
+    for (i = 0; i < 300; i++) {
+        p = peers[2];
+        p.address.u32[3] = htonl(0x0c000000 + (uint32_t)i);
+        if (! LWAddrManagerIsBanned(manager, &p, now) || LWAddrManagerAdd(manager, &p, 1, NULL, now) != 0) break;
+    }
+
+    if (i < 300) r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerMisbehaving() test 3\n", __func__);
+
+    LWAddrManagerRemove(manager, &p);
+
+    if (LWAddrManagerIsBanned(manager, &p, now) || LWAddrManagerAdd(manager, &p, 1, NULL, now) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWAddrManagerRemove() test 1\n", __func__);
+
+    LWAddrManagerFree(manager);
+    return r;
+}
+
+int LWTxRelaysTests()
+{
+    int r = 1;
+    time_t now = time(NULL);
+    LWTxRelays *relays = LWTxRelaysNew();
+    LWPeer peers[TX_RELAY_MAX_PEERS + 1];
+    UInt256 a = UINT256_ZERO, b = UINT256_ZERO, c = UINT256_ZERO;
+    size_t i;
+
+    memset(peers, 0, sizeof(peers));
+    a.u8[0] = 1, b.u8[0] = 2, c.u8[0] = 3;
+
+    if (LWTxRelaysAdd(relays, a, &peers[0], now) != 1 || LWTxRelaysAdd(relays, a, &peers[1], now) != 2 ||
+        LWTxRelaysAdd(relays, a, &peers[1], now) != 2 || LWTxRelaysCount(relays, a) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysAdd() test 1\n", __func__);
+
+    if (! LWTxRelaysRemove(relays, a, &peers[1]) || LWTxRelaysRemove(relays, a, &peers[1]) ||
+        LWTxRelaysCount(relays, a) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysRemove() test 1\n", __func__);
+
+    LWTxRelaysAddRequest(relays, b, &peers[1], now);
+
+    if (LWTxRelaysRequestCount(relays, b) != 1 || LWTxRelaysCount(relays, b) != 0 ||
+        ! LWTxRelaysHasPeer(relays, b, &peers[1]) || LWTxRelaysHasPeer(relays, b, &peers[0]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysAddRequest() test 1\n", __func__);
+
+    LWTxRelaysRemoveRequest(relays, b, &peers[1]);
+
+    if (LWTxRelaysRequestCount(relays, b) != 0 || LWTxRelaysHasPeer(relays, b, &peers[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysRemoveRequest() test 1\n", __func__);
+
+    LWTxRelaysRemoveTx(relays, b);
+
+    if (LWTxRelaysTxCount(relays) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysRemoveTx() test 1\n", __func__);
+
+    // a refreshed entry must not keep ones behind it from expiring
+    LWTxRelaysAdd(relays, b, &peers[1], now + 1);
+    LWTxRelaysAdd(relays, a, &peers[0], now + TX_RELAY_EXPIRY);
+    LWTxRelaysAdd(relays, c, &peers[0], now + TX_RELAY_EXPIRY + 2);
+
+    if (LWTxRelaysTxCount(relays) != 2 || LWTxRelaysCount(relays, b) != 0 || LWTxRelaysCount(relays, a) != 1 ||
+        LWTxRelaysCount(relays, c) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: expiry test 1\n", __func__);
+
+    now += TX_RELAY_EXPIRY + 2;
+    LWTxRelaysAdd(relays, b, &peers[1], now);
+    LWTxRelaysAdd(relays, c, &peers[1], now);
+    LWTxRelaysAddRequest(relays, a, &peers[1], now);
+    LWTxRelaysRemovePeer(relays, &peers[0]);
+
+    if (LWTxRelaysTxCount(relays) != 3 || LWTxRelaysCount(relays, a) != 0 || LWTxRelaysRequestCount(relays, a) != 1 ||
+        LWTxRelaysCount(relays, c) != 1 || LWTxRelaysHasPeer(relays, c, &peers[0]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysRemovePeer() test 1\n", __func__);
+
+    LWTxRelaysRemovePeer(relays, &peers[1]);
+
+    if (LWTxRelaysTxCount(relays) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWTxRelaysRemovePeer() test 2\n", __func__);
+
+    // past TX_RELAY_MAX_PEERS peers, the least recently used one is forgotten
+    for (i = 0; i < TX_RELAY_MAX_PEERS; i++) LWTxRelaysAdd(relays, a, &peers[i], now + (time_t)i);
+    LWTxRelaysAdd(relays, b, &peers[0], now + TX_RELAY_MAX_PEERS);
+
+    if (LWTxRelaysCount(relays, a) != TX_RELAY_MAX_PEERS ||
+        LWTxRelaysAdd(relays, c, &peers[TX_RELAY_MAX_PEERS], now + TX_RELAY_MAX_PEERS) != 1 ||
+        LWTxRelaysCount(relays, a) != TX_RELAY_MAX_PEERS - 1 || LWTxRelaysHasPeer(relays, a, &peers[1]) ||
+        ! LWTxRelaysHasPeer(relays, a, &peers[0]) || ! LWTxRelaysHasPeer(relays, b, &peers[0]) ||
+        ! LWTxRelaysHasPeer(relays, c, &peers[TX_RELAY_MAX_PEERS]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: max peers test 1\n", __func__);
+
+    LWTxRelaysFree(relays);
+    return r;
+}
+
+static void *_metricsThread(void *arg)
+{
+    LWMetricsCount(LWMetricCounterBytesIn, 500);
+    LWMetricsRecord(LWMetricTimerMessageParse, 2000);
+    return NULL;
+}
+
+static void _metricsCallback(void *info, const LWMetricsSnapshot *snapshot)
+{
+    (*(int *)info)++;
+}
+
+int LWMetricsTests()
+{
+    int r = 1, reports = 0;
+    LWMetricsSnapshot *a = malloc(sizeof(*a)), *b = malloc(sizeof(*b));
+    LWMetricsHistogram *h;
+    pthread_t thread;
+    size_t i;
+
+    if (! a || ! b) return 0;
+    LWMetricsGetSnapshot(a);
+    LWMetricsCount(LWMetricCounterBytesIn, 1000);
+    LWMetricsSetGauge(LWMetricGaugeFpRate, 0.0005);
+    for (i = 0; i < 99; i++) LWMetricsRecord(LWMetricTimerMessageParse, 1000);
+    LWMetricsRecord(LWMetricTimerMessageParse, 1000000);
+
+    // totals of threads that have exited are kept
+    if (pthread_create(&thread, NULL, _metricsThread, NULL) == 0) pthread_join(thread, NULL);
+    LWMetricsGetSnapshot(b);
+
+    if (b->counters[LWMetricCounterBytesIn] - a->counters[LWMetricCounterBytesIn] != 1500)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsCount() test\n", __func__);
+
+    if (b->gauges[LWMetricGaugeFpRate] != 0.0005)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsSetGauge() test\n", __func__);
+
+    h = &b->timers[LWMetricTimerMessageParse];
+
+    if (h->count - a->timers[LWMetricTimerMessageParse].count != 101 || h->max < 1000000 || h->min > 1000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsRecord() test\n", __func__);
+
+    h->count -= a->timers[LWMetricTimerMessageParse].count; // histogram of only the timings recorded above
+    for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) h->buckets[i] -= a->timers[LWMetricTimerMessageParse].buckets[i];
+
+    if (LWMetricsPercentile(h, 50) < 1000 || LWMetricsPercentile(h, 50) > 1125)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsPercentile() test 1\n", __func__);
+
+    if (LWMetricsPercentile(h, 99) < 2000 || LWMetricsPercentile(h, 99) > 2250)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsPercentile() test 2\n", __func__);
+
+    if (LWMetricsPercentile(h, 100) < 1000000 || LWMetricsPercentile(h, 100) > 1125000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsPercentile() test 3\n", __func__);
+
+    LWMetricsSetCallback(&reports, _metricsCallback, 0);
+    LWMetricsRecordSince(LWMetricTimerMessageParse, LWMetricsTime());
+    LWMetricsSetCallback(NULL, NULL, 0);
+    LWMetricsRecordSince(LWMetricTimerMessageParse, LWMetricsTime());
+
+    if (reports != 1) r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsSetCallback() test\n", __func__);
+
+    LWMetricsSetEnabled(0);
+    LWMetricsCount(LWMetricCounterBytesIn, 1000);
+    LWMetricsSetEnabled(1);
+    LWMetricsGetSnapshot(a);
+
+    if (a->counters[LWMetricCounterBytesIn] != b->counters[LWMetricCounterBytesIn])
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWMetricsSetEnabled() test\n", __func__);
+
+    free(a);
+    free(b);
+    return r;
+}
+
+typedef struct {
+    size_t count;
+    int level;
+    char line[LOG_RECORD_SIZE];
+} LWLogTestLines;
+
+static void _logHandler(void *info, int level, double timestamp, const char *line)
+{
+    LWLogTestLines *lines = info;
+
+    lines->level = level;
+    strncpy(lines->line, line, sizeof(lines->line) - 1);
+    __atomic_add_fetch(&lines->count, 1, __ATOMIC_RELEASE); // read by the test thread when the log isn't flushed
+}
+
+int LWLogTests()
+{
+    int r = 1, evaluated = 0;
+    LWLogTestLines lines = { 0, -1, "" };
+    char s[LOG_RECORD_SIZE];
+    size_t i, dropped;
+
+    LWLogSetLevel(LW_LOG_INFO);
+    LWLogFlush();
+    LWLogSetHandler(&lines, _logHandler);
+    lw_log(LW_LOG_WARN, "%s:%"PRIu16" %zu %"PRIu32" %"PRIu64" %.3f %x %-4d|%5s|%c 100%%", "127.0.0.1", (uint16_t)9333,
+           (size_t)42, (uint32_t)UINT32_MAX, (uint64_t)UINT64_MAX, 0.125, 0xbeef, -7, "ab", 'z');
+    LWLogFlush();
+    snprintf(s, sizeof(s), "%s:%"PRIu16" %zu %"PRIu32" %"PRIu64" %.3f %x %-4d|%5s|%c 100%%", "127.0.0.1",
+             (uint16_t)9333, (size_t)42, (uint32_t)UINT32_MAX, (uint64_t)UINT64_MAX, 0.125, 0xbeef, -7, "ab", 'z');
+
+    if (lines.count != 1 || lines.level != LW_LOG_WARN || strcmp(lines.line, s) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: lw_log() test 1\n", __func__);
+
+    strcpy(s, "changed after the call");
+    lw_log(LW_LOG_INFO, "copied %s", s);
+    s[0] = '\0';
+    LWLogFlush();
+
+    if (lines.count != 2 || strcmp(lines.line, "copied changed after the call") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: lw_log() test 2\n", __func__);
+
+    lw_log_host(LW_LOG_INFO, "127.0.0.1", 9333, "%s %d", "prefixed", 5);
+    lw_log_host(LW_LOG_INFO, "127.0.0.1", 9333, "no arguments");
+    LWLogFlush();
+
+    if (lines.count != 4 || strcmp(lines.line, "127.0.0.1:9333 no arguments") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: lw_log_host() test\n", __func__);
+
+    lw_log(LW_LOG_DEBUG, "%d", evaluated++); // above the runtime level, arguments aren't evaluated
+    LWLogFlush();
+
+    if (lines.count != 4 || evaluated != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWLogSetLevel() test\n", __func__);
+
+    // every record is either written or counted as dropped
+    for (i = 0; i < LOG_RING_SIZE*4; i++) lw_log(LW_LOG_ERROR, "%zu", i);
+    dropped = LWLogFlush();
+
+    if (lines.count + dropped != 4 + LOG_RING_SIZE*4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWLogFlush() test\n", __func__);
+
+    // the background thread waits while the ring buffer is empty, and is woken up by the next record
+    for (i = 0; i < 3; i++) {
+        size_t count = lines.count, n;
+
+        usleep(20000);
+        lw_log(LW_LOG_ERROR, "%zu", i);
+        for (n = 0; n < 1000 && __atomic_load_n(&lines.count, __ATOMIC_ACQUIRE) == count; n++) usleep(1000);
+        if (n == 1000) r = 0, fprintf(stderr, "***FAILED*** %s: lw_log() wake up test %zu\n", __func__, i);
+    }
+
+    LWLogFlush();
+
+    LWLogSetHandler(NULL, NULL);
+    return r;
+}
+
 int LWPaymentProtocolTests()
 {
     int r = 1;
@@ -2544,14 +3539,916 @@ int LWPaymentProtocolEncryptionTests()
 }
 
 void LWPeerAcceptMessageTest(LWPeer *peer, const uint8_t *msg, size_t len, const char *type);
+void LWPeerSetSocketTest(LWPeer *peer, int socket);
+size_t LWPeerManagerBloomFilterTest(LWPeerManager *manager, LWPeer *peer);
+void LWPeerManagerSetDownloadPeerTest(LWPeerManager *manager, LWPeer *downloadPeer, uint32_t estimatedHeight);
+size_t LWPeerManagerRelayBlockTest(LWPeerManager *manager, LWPeer *peer, LWMerkleBlock *block);
+void LWPeerManagerAddPeerTest(LWPeerManager *manager, LWPeer *peer, int downloadPeer);
+int LWPeerManagerPeerDisconnectedTest(LWPeerManager *manager, LWPeer *peer, int error);
+int LWPeerManagerMaxConnectCountTest(LWPeerManager *manager);
+size_t LWPeerManagerAddOrphanTest(LWPeerManager *manager, LWMerkleBlock *block, const LWPeer *peer);
+int LWPeerManagerHasOrphanTest(LWPeerManager *manager, UInt256 prevBlock, UInt256 blockHash);
+void LWPeerManagerAgeOrphansTest(LWPeerManager *manager, time_t seconds);
+uint32_t LWPeerManagerFilterSyncTest(LWPeerManager *manager, LWPeer *downloadPeer, const UInt256 headerChain[],
+                                     size_t count);
+int LWPeerManagerRelayFilterCheckpointsTest(LWPeerManager *manager, LWPeer *peer, UInt256 stopHash,
+                                            const UInt256 filterHeaders[], size_t count);
+
+// reads a message the peer sent to socket, returns its payload length, or -1 if no message is waiting
+static ssize_t _peerTestRecv(int socket, char type[12], uint8_t *payload, size_t payloadLen)
+{
+    uint8_t header[24];
+    ssize_t len;
+
+    if (recv(socket, header, sizeof(header), MSG_DONTWAIT) != sizeof(header)) return -1;
+    memcpy(type, &header[4], 12);
+    len = UInt32GetLE(&header[16]);
+    if (len > payloadLen || (len > 0 && recv(socket, payload, len, MSG_WAITALL) != len)) return -1;
+    return len;
+}
+
+// answers the next ping the peer sent to socket, skipping other messages, returns false if no ping is waiting
+static int _peerTestPong(LWPeer *peer, int socket)
+{
+    uint8_t payload[0x10000];
+    char type[12];
+    ssize_t len;
+
+    while ((len = _peerTestRecv(socket, type, payload, sizeof(payload))) >= 0) {
+        if (strncmp(type, "ping", sizeof(type)) != 0) continue;
+        LWPeerAcceptMessageTest(peer, payload, (size_t)len, "pong");
+        return 1;
+    }
+
+    return 0;
+}
+
+// an orphan block with a single tx, relayed by peer, returns the number of blocks in the orphan pool afterwards
+static size_t _peerTestOrphan(LWPeerManager *manager, LWPeer *peer, uint8_t n)
+{
+    LWMerkleBlock *block = LWMerkleBlockNew();
+
+    block->prevBlock.u8[0] = block->blockHash.u8[0] = n;
+    block->blockHash.u8[1] = 1;
+    block->timestamp = (uint32_t)time(NULL);
+    block->totalTx = 1;
+    return LWPeerManagerRelayBlockTest(manager, peer, block);
+}
+
+// adds orphan block n with hashesCount empty hashes to the pool, block n + 1 has the same prevBlock as block n if n is
+// even, returns the orphan count afterwards, or 0 if the block was rejected
+static size_t _peerTestAddOrphan(LWPeerManager *manager, const LWPeer *peer, uint32_t n, size_t hashesCount)
+{
+    LWMerkleBlock *block = LWMerkleBlockNew();
+    size_t count;
+
+    UInt32SetLE(block->prevBlock.u8, n/2);
+    UInt32SetLE(block->blockHash.u8, n);
+    block->blockHash.u8[31] = 1;
+    block->timestamp = (uint32_t)time(NULL);
+    block->totalTx = 1;
+
+    if (hashesCount > 0) {
+        block->hashes = calloc(hashesCount, sizeof(*block->hashes));
+        assert(block->hashes != NULL);
+        block->hashesCount = hashesCount;
+    }
+
+    count = LWPeerManagerAddOrphanTest(manager, block, peer);
+    if (count == 0) LWMerkleBlockFree(block);
+    return count;
+}
+
+// true if orphan block n from _peerTestAddOrphan() is in the pool
+static int _peerTestHasOrphan(LWPeerManager *manager, uint32_t n)
+{
+    UInt256 prevBlock = UINT256_ZERO, blockHash = UINT256_ZERO;
+
+    UInt32SetLE(prevBlock.u8, n/2);
+    UInt32SetLE(blockHash.u8, n);
+    blockHash.u8[31] = 1;
+    return LWPeerManagerHasOrphanTest(manager, prevBlock, blockHash);
+}
+
+static void _peerTestHeadersDone(void *info)
+{
+    (*(int *)info)++;
+}
+
+// info is an int[2], the second of which counts relayed blocks
+static void _peerTestRelayedBlock(void *info, LWMerkleBlock *block)
+{
+    ((int *)info)[1]++;
+    LWMerkleBlockFree(block);
+}
+
+// info is a UInt256[3] that gets the stop hash and the first two filter headers of a cfcheckpt message
+static void _peerTestFilterCheckpoints(void *info, UInt256 stopHash, const UInt256 filterHeaders[], size_t count)
+{
+    UInt256 *hashes = info;
+
+    hashes[0] = stopHash;
+    for (size_t i = 0; i < count && i < 2; i++) hashes[i + 1] = filterHeaders[i];
+}
+
+// a confirmed tx paying addr, with a dummy signature
+static LWTransaction *_peerTestTx(const char *addr, uint32_t blockHeight)
+{
+    LWTransaction *tx = LWTransactionNew();
+    UInt256 inHash = UINT256_ZERO;
+    uint8_t script[25], sig[107] = { 0 };
+    size_t scriptLen = LWAddressScriptPubKey(script, sizeof(script), addr);
+
+    UInt32SetLE(inHash.u8, blockHeight);
+    LWTransactionAddInput(tx, inHash, 0, 0, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+    LWTransactionAddOutput(tx, SATOSHIS, script, scriptLen);
+    uint8_t buf[LWTransactionSerialize(tx, NULL, 0)];
+    LWSHA256_2(&tx->txHash, buf, LWTransactionSerialize(tx, buf, sizeof(buf)));
+    tx->blockHeight = blockHeight;
+    tx->timestamp = 1;
+    return tx;
+}
 
 int LWPeerTests()
 {
-    int r = 1;
+    int r = 1, fds[2];
     LWPeer *p = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
     const char msg[] = "my message";
+    uint8_t data[20], payload[1024];
+    char type[12];
+    size_t len;
     
     LWPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+
+    memset(data, 0x55, sizeof(data));
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        LWBloomFilter *f = LWBloomFilterNew(0.01, 10, 0, BLOOM_UPDATE_ALL);
+
+        LWPeerSetSocketTest(p, fds[0]);
+        LWPeerSendFilteradd(p, data, sizeof(data));
+        if (_peerTestRecv(fds[1], type, payload, sizeof(payload)) >= 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendFilteradd() test 1", __func__);
+
+        len = LWBloomFilterSerialize(f, payload, sizeof(payload));
+        LWPeerSendFilterload(p, payload, len);
+        LWPeerSendFilteradd(p, data, sizeof(data));
+        
+        if (_peerTestRecv(fds[1], type, payload, sizeof(payload)) != (ssize_t)len ||
+            strncmp(type, "filterload", sizeof(type)) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendFilterload() test", __func__);
+        
+        if (_peerTestRecv(fds[1], type, payload, sizeof(payload)) != sizeof(data) + 1 ||
+            strncmp(type, "filteradd", sizeof(type)) != 0 || payload[0] != sizeof(data) ||
+            memcmp(&payload[1], data, sizeof(data)) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendFilteradd() test 2", __func__);
+
+        LWPeerDisconnect(p);
+        close(fds[1]);
+        LWBloomFilterFree(f);
+    }
+
+    // in headers-first mode, a headers message with fewer than 2000 headers means the peer has no more to send
+    LWPeer *p2 = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    UInt256 merkleRoot = UInt256Reverse(uint256("97ddfbbae6be97fd6cdf3e7ca13232a3afff2353e29badfab7f73011edd4ced9"));
+    uint8_t headers[1 + 81] = { 1, 0x01 }; // genesis block header
+    int done = 0;
+
+    memcpy(&headers[37], merkleRoot.u8, sizeof(merkleRoot));
+    UInt32SetLE(&headers[69], 1317972665);
+    UInt32SetLE(&headers[73], 0x1e0ffff0);
+    UInt32SetLE(&headers[77], 2084524493);
+    LWPeerSetCallbacks(p2, &done, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    LWPeerSetHeadersDoneCallback(p2, _peerTestHeadersDone);
+    LWPeerAcceptMessageTest(p2, (const uint8_t *)"", 1, "headers");
+    if (done != 0) r = 0, fprintf(stderr, "\n***FAILED*** %s: headersDone test 1", __func__);
+    LWPeerSetHeadersFirst(p2, 1);
+    LWPeerAcceptMessageTest(p2, (const uint8_t *)"", 1, "headers");
+    if (done != 1) r = 0, fprintf(stderr, "\n***FAILED*** %s: headersDone test 2", __func__);
+    LWPeerAcceptMessageTest(p2, headers, sizeof(headers), "headers");
+    if (done != 2) r = 0, fprintf(stderr, "\n***FAILED*** %s: headersDone test 3", __func__);
+    headers[77] ^= 1; // invalid proof-of-work
+    LWPeerAcceptMessageTest(p2, headers, sizeof(headers), "headers");
+    if (done != 2) r = 0, fprintf(stderr, "\n***FAILED*** %s: headersDone test 4", __func__);
+    LWPeerFree(p2);
+
+    // a header requested on its own is relayed outside headers-first mode too, and doesn't end the header chain
+    UInt256 genesisHash = UInt256Reverse(LW_CHAIN_PARAMS.checkpoints[0].hash);
+    int counts[2] = { 0, 0 };
+
+    headers[77] ^= 1;
+    p2 = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    LWPeerSetCallbacks(p2, counts, NULL, NULL, NULL, NULL, NULL, NULL, _peerTestRelayedBlock, NULL, NULL, NULL, NULL,
+                       NULL);
+    LWPeerSetHeadersDoneCallback(p2, _peerTestHeadersDone);
+    LWPeerSetEarliestKeyTime(p2, (uint32_t)time(NULL)); // the genesis header doesn't reach it
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        LWPeerSetSocketTest(p2, fds[0]);
+        LWPeerSendGetheader(p2, genesisHash);
+
+        if (_peerTestRecv(fds[1], type, payload, sizeof(payload)) != 4 + 1 + 32 ||
+            strncmp(type, "getheaders", sizeof(type)) != 0 || payload[4] != 0 ||
+            memcmp(&payload[5], genesisHash.u8, sizeof(genesisHash)) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendGetheader() test 1", __func__);
+
+        LWPeerAcceptMessageTest(p2, headers, sizeof(headers), "headers");
+        if (counts[1] != 1) r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendGetheader() test 2", __func__);
+        LWPeerAcceptMessageTest(p2, headers, sizeof(headers), "headers"); // not requested
+        if (counts[1] != 1) r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendGetheader() test 3", __func__);
+        LWPeerSetHeadersFirst(p2, 1);
+        LWPeerSendGetheader(p2, genesisHash);
+        LWPeerAcceptMessageTest(p2, headers, sizeof(headers), "headers");
+        if (counts[0] != 0 || counts[1] != 2)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerSendGetheader() test 4", __func__);
+        LWPeerDisconnect(p2);
+        close(fds[1]);
+    }
+
+    LWPeerFree(p2);
+
+    // a cfcheckpt message is passed on with its stop hash and filter headers, unless it's truncated
+    UInt256 checkpts[3] = { UINT256_ZERO, UINT256_ZERO, UINT256_ZERO };
+    uint8_t cfcheckpt[1 + 32 + 1 + 2*32] = { BLOCK_FILTER_BASIC, 0x01, [33] = 2, [34] = 0x02, [66] = 0x03 };
+
+    p2 = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+    LWPeerSetCallbacks(p2, checkpts, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    LWPeerSetCompactFilterCallbacks(p2, NULL, NULL, _peerTestFilterCheckpoints, NULL);
+    LWPeerAcceptMessageTest(p2, cfcheckpt, sizeof(cfcheckpt) - 1, "cfcheckpt");
+    if (! UInt256IsZero(checkpts[0])) r = 0, fprintf(stderr, "\n***FAILED*** %s: cfcheckpt test 1", __func__);
+    LWPeerAcceptMessageTest(p2, cfcheckpt, sizeof(cfcheckpt), "cfcheckpt");
+    if (checkpts[0].u8[0] != 0x01 || checkpts[1].u8[0] != 0x02 || checkpts[2].u8[0] != 0x03)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: cfcheckpt test 2", __func__);
+    LWPeerFree(p2);
+
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeerManager *manager = LWPeerManagerNew(&LW_CHAIN_PARAMS, w, 0, NULL, 0, NULL, 0);
+    LWAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + 100];
+    size_t i, count = 0, prevCount = LWPeerManagerBloomFilterTest(manager, p);
+
+    if (prevCount == 0) r = 0, fprintf(stderr, "\n***FAILED*** %s: bloom filter load test", __func__);
+
+    for (i = 0; i < 10; i++, prevCount = count) { // use up all the spare addresses until the filter is out of room
+        LWWalletUnusedAddrs(w, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+        LWWalletRegisterTransaction(w, _peerTestTx(addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + 99].s, (uint32_t)i + 1));
+        count = LWPeerManagerBloomFilterTest(manager, p);
+        if (count == 0) break; // the filter has to be rebuilt
+
+        if (count < prevCount + SEQUENCE_GAP_LIMIT_EXTERNAL + 100)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: bloom filter filteradd test %zu", __func__, i);
+    }
+
+    // each round adds 110 receive addresses, so the 500 element filteradd budget runs out on the fifth
+    if (i != 4) r = 0, fprintf(stderr, "\n***FAILED*** %s: bloom filter rebuild test", __func__);
+
+    // during the sync, blocks are dropped while a filter update is pending, and then until the download peer answers
+    // the ping sent after the new filter is loaded
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        LWPeerSetSocketTest(p, fds[0]);
+        LWPeerManagerSetDownloadPeerTest(manager, p, 1000000);
+        if (_peerTestOrphan(manager, p, 1) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: stale block test 1", __func__);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: filter update ping", __func__);
+        if (_peerTestOrphan(manager, p, 2) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: stale block test 2", __func__);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: filterload ping", __func__);
+        if (_peerTestOrphan(manager, p, 3) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: stale block test 3", __func__);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: stale blocks ping", __func__);
+        if (_peerTestOrphan(manager, p, 4) != 1)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: stale block test 4", __func__);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: rerequest ping", __func__);
+
+        // the download peer goes away while the filterload ping is pending
+        LWPeerManagerSetDownloadPeerTest(manager, p, 1000000);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: filter update ping 2", __func__);
+        LWPeerManagerSetDownloadPeerTest(manager, NULL, 1000000);
+        if (! _peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: filterload ping 2", __func__);
+        if (_peerTestPong(p, fds[1])) r = 0, fprintf(stderr, "\n***FAILED*** %s: stale block test 5", __func__);
+
+        LWPeerDisconnect(p);
+        close(fds[1]);
+    }
+
+    LWPeerManagerFree(manager);
+
+    // the connection count is clamped, and a fixed peer only overrides it until it's cleared
+    manager = LWPeerManagerNew(&LW_CHAIN_PARAMS, w, 0, NULL, 0, NULL, 0);
+    LWPeerManagerSetMaxConnectCount(manager, 0);
+    if (LWPeerManagerMaxConnectCountTest(manager) != 1)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetMaxConnectCount() test 1", __func__);
+    LWPeerManagerSetMaxConnectCount(manager, PEER_MAX_CONNECTIONS_LIMIT + 1);
+    if (LWPeerManagerMaxConnectCountTest(manager) != PEER_MAX_CONNECTIONS_LIMIT)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetMaxConnectCount() test 2", __func__);
+    LWPeerManagerSetFixedPeer(manager, ((UInt128) { .u8 = { [10] = 0xff, 0xff, 127, 0, 0, 1 } }), 9333);
+    LWPeerManagerSetMaxConnectCount(manager, 5);
+    if (LWPeerManagerMaxConnectCountTest(manager) != 1)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetFixedPeer() test 1", __func__);
+    LWPeerManagerSetFixedPeer(manager, UINT128_ZERO, 0);
+    if (LWPeerManagerMaxConnectCountTest(manager) != 5)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetFixedPeer() test 2", __func__);
+
+    // lowering the count keeps the download peer and drops other peers past it, which aren't connect failures
+    LWPeer *peers[4];
+    int failures;
+
+    LWPeerManagerDisconnect(manager); // no automatic reconnects
+    failures = LWPeerManagerPeerDisconnectedTest(manager, LWPeerNew(LW_CHAIN_PARAMS.magicNumber), 0);
+
+    for (i = 0; i < 4; i++) { // the download peer is last
+        peers[i] = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+        LWPeerManagerAddPeerTest(manager, peers[i], i == 3);
+    }
+
+    LWPeerManagerSetMaxConnectCount(manager, 2);
+    if (LWPeerManagerPeerDisconnectedTest(manager, peers[2], ETIMEDOUT) != failures)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetMaxConnectCount() test 3", __func__);
+    if (LWPeerManagerPeerDisconnectedTest(manager, peers[1], ETIMEDOUT) != failures)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetMaxConnectCount() test 4", __func__);
+    if (LWPeerManagerPeerDisconnectedTest(manager, peers[0], ETIMEDOUT) != failures + 1)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: LWPeerManagerSetMaxConnectCount() test 5", __func__);
+    LWPeerManagerPeerDisconnectedTest(manager, peers[3], 0);
+
+    // the orphan pool evicts the oldest blocks past 10000 blocks or 16MB, and expired ones first
+    uint32_t n;
+
+    for (n = 0; n < 10000 && _peerTestAddOrphan(manager, NULL, n, 0) == n + 1; n++);
+    if (n < 10000) r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool test 1", __func__);
+    if (_peerTestAddOrphan(manager, NULL, n, 0) != 10000 || _peerTestHasOrphan(manager, 0) ||
+        ! _peerTestHasOrphan(manager, 1) || ! _peerTestHasOrphan(manager, n))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool eviction test 1", __func__);
+    if (_peerTestAddOrphan(manager, NULL, ++n, 0) != 10000 || _peerTestHasOrphan(manager, 1) ||
+        ! _peerTestHasOrphan(manager, 2) || ! _peerTestHasOrphan(manager, n - 1))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool eviction test 2", __func__);
+    if (_peerTestAddOrphan(manager, NULL, n, 0) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool duplicate test", __func__);
+
+    LWPeerManagerAgeOrphansTest(manager, 60*60 + 1);
+    if (_peerTestAddOrphan(manager, NULL, 100000, 0x20000) != 1) // 4MB
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool expiry test", __func__);
+    if (_peerTestAddOrphan(manager, NULL, 100002, 0x20000) != 2 ||
+        _peerTestAddOrphan(manager, NULL, 100004, 0x20000) != 3 ||
+        _peerTestAddOrphan(manager, NULL, 100006, 0x20000) != 3 || _peerTestHasOrphan(manager, 100000) ||
+        ! _peerTestHasOrphan(manager, 100002) || ! _peerTestHasOrphan(manager, 100006))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool size test 1", __func__);
+    if (_peerTestAddOrphan(manager, NULL, 100008, 0x80000) != 0 || ! _peerTestHasOrphan(manager, 100002))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool size test 2", __func__);
+
+    for (n = 200000; n < 200100 && _peerTestAddOrphan(manager, p, n, 0) > 0; n++); // 100 unrequested orphans per peer
+    if (n < 200100 || _peerTestAddOrphan(manager, p, n, 0) != 0 || _peerTestAddOrphan(manager, NULL, n, 0) == 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: orphan pool peer test", __func__);
+
+    // compact filters are only requested once the filter header checkpoints from two peers agree, and blocks are
+    // fetched instead if they don't
+    UInt256 chain[1001], *cfheaders;
+    uint32_t tip;
+
+    for (i = 0; i < 1001; i++) chain[i] = UINT256_ZERO, UInt32SetLE(chain[i].u8, (uint32_t)i + 1);
+    for (i = 0; i < 4; i++) peers[i] = LWPeerNew(LW_CHAIN_PARAMS.magicNumber);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        LWPeerSetSocketTest(p, fds[0]);
+        tip = LWPeerManagerFilterSyncTest(manager, p, chain, 1001);
+        cfheaders = calloc(tip/1000 + 1, sizeof(*cfheaders));
+        cfheaders[0].u8[0] = 1;
+
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[0], chain[999], cfheaders, tip/1000) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint stop hash test", __func__);
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[0], chain[1000], cfheaders, tip/1000) != 1 ||
+            _peerTestRecv(fds[1], type, payload, sizeof(payload)) >= 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint test 1", __func__);
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[0], chain[1000], cfheaders, tip/1000) != 1)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint duplicate test", __func__);
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[1], chain[1000], cfheaders, tip/1000 + 1) != 1)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint count test", __func__);
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[2], chain[1000], cfheaders, tip/1000) != 2 ||
+            _peerTestRecv(fds[1], type, payload, sizeof(payload)) < 0 ||
+            strncmp(type, "getcfheaders", sizeof(type)) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint test 2", __func__);
+
+        LWPeerDisconnect(p);
+        close(fds[1]);
+        tip = LWPeerManagerFilterSyncTest(manager, NULL, chain, 1001);
+        LWPeerManagerRelayFilterCheckpointsTest(manager, peers[1], chain[1000], cfheaders, tip/1000);
+        cfheaders[0].u8[0] = 2;
+        if (LWPeerManagerRelayFilterCheckpointsTest(manager, peers[3], chain[1000], cfheaders, tip/1000) != -1)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: filter checkpoint mismatch test", __func__);
+        free(cfheaders);
+    }
+
+    for (i = 0; i < 4; i++) LWPeerFree(peers[i]);
+    LWPeerManagerFree(manager);
+    LWWalletFree(w);
+    LWPeerFree(p);
+    if (! r) fprintf(stderr, "\n                                    ");
+    return r;
+}
+
+static pthread_mutex_t _dnsTestLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _dnsTestCond = PTHREAD_COND_INITIALIZER;
+static int _dnsTestLookups, _dnsTestRunning, _dnsTestRelease, _dnsTestStopped, _dnsTestError;
+
+// a stub DNS resolver that fails after it's released
+static UInt128 *_dnsTestResolve(void *info, const char *hostname)
+{
+    pthread_mutex_lock(&_dnsTestLock);
+    _dnsTestLookups++;
+    _dnsTestRunning++;
+    pthread_cond_broadcast(&_dnsTestCond);
+    while (! _dnsTestRelease) pthread_cond_wait(&_dnsTestCond, &_dnsTestLock);
+    _dnsTestRunning--;
+    pthread_cond_broadcast(&_dnsTestCond);
+    pthread_mutex_unlock(&_dnsTestLock);
+    return NULL;
+}
+
+static void _dnsTestSyncStopped(void *info, int error)
+{
+    pthread_mutex_lock(&_dnsTestLock);
+    _dnsTestStopped++;
+    _dnsTestError = error;
+    pthread_cond_broadcast(&_dnsTestCond);
+    pthread_mutex_unlock(&_dnsTestLock);
+}
+
+// waits up to 5 seconds for *value to reach count, returns true if it did
+static int _dnsTestWait(int *value, int count)
+{
+    struct timespec deadline = { time(NULL) + 5, 0 };
+    int r;
+
+    pthread_mutex_lock(&_dnsTestLock);
+    while (*value != count && pthread_cond_timedwait(&_dnsTestCond, &_dnsTestLock, &deadline) == 0);
+    r = (*value == count);
+    pthread_mutex_unlock(&_dnsTestLock);
+    return r;
+}
+
+// starts a DNS seed lookup with the stub resolver, which is released right away if release is true
+static LWPeerManager *_dnsTestConnect(LWWallet *wallet, int release, double timeout)
+{
+    LWPeerManager *manager = LWPeerManagerNew(&LWMainNetParams, wallet, 0, NULL, 0, NULL, 0);
+
+    pthread_mutex_lock(&_dnsTestLock);
+    _dnsTestLookups = _dnsTestStopped = _dnsTestError = 0;
+    _dnsTestRelease = release;
+    pthread_mutex_unlock(&_dnsTestLock);
+    LWPeerManagerSetCallbacks(manager, NULL, NULL, _dnsTestSyncStopped, NULL, NULL, NULL, NULL, NULL);
+    LWPeerManagerSetDNSResolver(manager, NULL, _dnsTestResolve, timeout);
+    LWPeerManagerConnect(manager);
+    return manager;
+}
+
+// releases the stub resolver and waits for all its lookups to return
+static int _dnsTestFinish(void)
+{
+    pthread_mutex_lock(&_dnsTestLock);
+    _dnsTestRelease = 1;
+    pthread_cond_broadcast(&_dnsTestCond);
+    pthread_mutex_unlock(&_dnsTestLock);
+    return _dnsTestWait(&_dnsTestRunning, 0);
+}
+
+int LWPeerManagerDNSTests()
+{
+    int r = 1, seeds = 0;
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeerManager *manager;
+    uint64_t start;
+
+    while (LWMainNetParams.dnsSeeds[seeds]) seeds++;
+    manager = _dnsTestConnect(w, 1, 0);
+
+    if (! _dnsTestWait(&_dnsTestStopped, 1) || _dnsTestLookups != seeds || _dnsTestError != ENETUNREACH ||
+        LWPeerManagerConnectStatus(manager) != LWPeerStatusDisconnected)
+        r = 0, fprintf(stderr, "***FAILED*** %s: LWPeerManagerSetDNSResolver() test 1\n", __func__);
+
+    LWPeerManagerDisconnect(manager);
+    LWPeerManagerFree(manager);
+
+    // seeds that don't answer are given up on after the timeout, even though the resolver is still running
+    start = LWMetricsTime();
+    manager = _dnsTestConnect(w, 0, 0.2);
+
+    if (LWPeerManagerConnectStatus(manager) != LWPeerStatusConnecting)
+        r = 0, fprintf(stderr, "***FAILED*** %s: DNS timeout test 1\n", __func__);
+
+    if (! _dnsTestWait(&_dnsTestStopped, 1) || _dnsTestError != ENETUNREACH || _dnsTestRunning != seeds ||
+        LWPeerManagerConnectStatus(manager) != LWPeerStatusDisconnected)
+        r = 0, fprintf(stderr, "***FAILED*** %s: DNS timeout test 2\n", __func__);
+
+    if (LWMetricsTime() - start < 200000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: DNS timeout test 3\n", __func__);
+
+    LWPeerManagerDisconnect(manager);
+    LWPeerManagerFree(manager); // the resolver must not touch the freed manager once released
+    if (! _dnsTestFinish()) r = 0, fprintf(stderr, "***FAILED*** %s: DNS timeout test 4\n", __func__);
+
+    // disconnecting stops waiting for seeds right away, without reporting a sync failure
+    manager = _dnsTestConnect(w, 0, 60);
+
+    if (! _dnsTestWait(&_dnsTestRunning, seeds))
+        r = 0, fprintf(stderr, "***FAILED*** %s: DNS cancel test 1\n", __func__);
+
+    LWPeerManagerDisconnect(manager);
+
+    if (_dnsTestStopped != 0 || _dnsTestRunning != seeds ||
+        LWPeerManagerConnectStatus(manager) != LWPeerStatusDisconnected)
+        r = 0, fprintf(stderr, "***FAILED*** %s: DNS cancel test 2\n", __func__);
+
+    LWPeerManagerFree(manager);
+    if (! _dnsTestFinish()) r = 0, fprintf(stderr, "***FAILED*** %s: DNS cancel test 3\n", __func__);
+    LWWalletFree(w);
+    return r;
+}
+
+static uint32_t _chainTestTime; // when the test chain starts, a day ago
+
+// the hash of block n on the given branch, block 0 is the genesis block, which is all 0x11 bytes
+static UInt256 _chainTestHash(uint8_t branch, uint32_t n)
+{
+    UInt256 hash = UINT256_ZERO;
+
+    if (n == 0) memset(hash.u8, 0x11, sizeof(hash));
+    else hash.u8[0] = branch, UInt32SetLE(&hash.u8[1], n);
+    return hash;
+}
+
+// relays block n on the given branch, which follows block prevN on prevBranch, returns the orphan count afterwards
+static size_t _chainTestRelay(LWPeerManager *manager, LWPeer *peer, uint8_t branch, uint32_t n, uint8_t prevBranch,
+                              uint32_t prevN)
+{
+    LWMerkleBlock *block = LWMerkleBlockNew();
+
+    block->blockHash = _chainTestHash(branch, n);
+    block->prevBlock = _chainTestHash(prevBranch, prevN);
+    block->timestamp = _chainTestTime + n*10*60 + branch;
+    block->totalTx = 1;
+    return LWPeerManagerRelayBlockTest(manager, peer, block);
+}
+
+static int _chainTestVerifyDifficulty(const LWMerkleBlock *block, const LWMerkleBlock *previous,
+                                      uint32_t transitionTime)
+{
+    return 1;
+}
+
+// relays an orphan block n, and returns true if peer sent getblocks with the locators in the given order
+static int _chainTestLocators(LWPeerManager *manager, LWPeer *peer, int socket, uint32_t n,
+                              const UInt256 locators[], size_t count)
+{
+    uint8_t payload[0x10000];
+    char type[12];
+    ssize_t len;
+
+    _chainTestRelay(manager, peer, 'o', n, 'x', n);
+
+    while ((len = _peerTestRecv(socket, type, payload, sizeof(payload))) >= 0) {
+        if (strncmp(type, "getblocks", sizeof(type)) != 0) continue;
+        if (len != 4 + 1 + (count + 1)*32 || payload[4] != count) return 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (memcmp(&payload[5 + i*32], locators[i].u8, 32) != 0) return 0;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int LWPeerManagerChainTests()
+{
+    static const char *dnsSeeds[] = { NULL };
+    int r = 1, fds[2];
+    UInt256 genesis = _chainTestHash(0, 0), locators[13];
+    LWCheckPoint checkpoint = { 0, genesis, 1317972665, 0x1e0ffff0 };
+    LWChainParams params = { dnsSeeds, LW_CHAIN_PARAMS.standardPort, LW_CHAIN_PARAMS.magicNumber, 0,
+                             _chainTestVerifyDifficulty, &checkpoint, 1 };
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeerManager *manager = LWPeerManagerNew(&params, w, 0, NULL, 0, NULL, 0);
+    LWPeer *p = LWPeerNew(params.magicNumber);
+    uint32_t n, count = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: socketpair() test\n", __func__);
+        fds[0] = fds[1] = -1;
+    }
+
+    _chainTestTime = (uint32_t)time(NULL) - 24*60*60;
+    LWPeerSetSocketTest(p, fds[0]);
+    LWPeerManagerBloomFilterTest(manager, p); // blocks are dropped until a filter is loaded
+
+    // the main chain follows a, and the locators step back through the index from its tip
+    for (n = 1; n <= 20; n++) count += _chainTestRelay(manager, p, 'a', n, 'a', n - 1);
+
+    if (count != 0 || LWPeerManagerLastBlockHeight(manager) != 20)
+        r = 0, fprintf(stderr, "***FAILED*** %s: main chain test\n", __func__);
+
+    for (n = 0; n < 10; n++) locators[n] = _chainTestHash('a', 20 - n);
+    locators[10] = _chainTestHash('a', 9), locators[11] = _chainTestHash('a', 5), locators[12] = genesis;
+
+    if (! _chainTestLocators(manager, p, fds[1], 1, locators, 13))
+        r = 0, fprintf(stderr, "***FAILED*** %s: locators test 1\n", __func__);
+
+    // a fork from a10 doesn't move the index until it's longer than the main chain, then it replaces a11-a20
+    _chainTestRelay(manager, p, 'b', 11, 'a', 10);
+    for (n = 12; n <= 20; n++) _chainTestRelay(manager, p, 'b', n, 'b', n - 1);
+
+    if (LWPeerManagerLastBlockHeight(manager) != 20 ||
+        LWPeerManagerLastBlockTimestamp(manager) != _chainTestTime + 20*10*60 + 'a')
+        r = 0, fprintf(stderr, "***FAILED*** %s: fork test\n", __func__);
+
+    _chainTestRelay(manager, p, 'b', 21, 'b', 20);
+
+    if (LWPeerManagerLastBlockHeight(manager) != 21 ||
+        LWPeerManagerLastBlockTimestamp(manager) != _chainTestTime + 21*10*60 + 'b')
+        r = 0, fprintf(stderr, "***FAILED*** %s: reorg test 1\n", __func__);
+
+    for (n = 0; n < 10; n++) locators[n] = _chainTestHash('b', 21 - n);
+    locators[10] = _chainTestHash('a', 10), locators[11] = _chainTestHash('a', 6), locators[12] = genesis;
+
+    if (! _chainTestLocators(manager, p, fds[1], 2, locators, 13))
+        r = 0, fprintf(stderr, "***FAILED*** %s: locators test 2\n", __func__);
+
+    // switching back to a puts a11-a20 back in the index in place of the b blocks
+    _chainTestRelay(manager, p, 'a', 21, 'a', 20);
+    _chainTestRelay(manager, p, 'a', 22, 'a', 21);
+
+    if (LWPeerManagerLastBlockHeight(manager) != 22 ||
+        LWPeerManagerLastBlockTimestamp(manager) != _chainTestTime + 22*10*60 + 'a')
+        r = 0, fprintf(stderr, "***FAILED*** %s: reorg test 2\n", __func__);
+
+    for (n = 0; n < 10; n++) locators[n] = _chainTestHash('a', 22 - n);
+    locators[10] = _chainTestHash('a', 11), locators[11] = _chainTestHash('a', 7), locators[12] = genesis;
+
+    if (! _chainTestLocators(manager, p, fds[1], 3, locators, 13))
+        r = 0, fprintf(stderr, "***FAILED*** %s: locators test 3\n", __func__);
+
+    LWPeerDisconnect(p);
+    if (fds[1] >= 0) close(fds[1]);
+    LWPeerManagerFree(manager);
+    LWPeerFree(p);
+    LWWalletFree(w);
+    return r;
+}
+
+#define DOWNLOAD_TEST_PEERS  3
+#define DOWNLOAD_TEST_BLOCKS 25
+
+typedef struct {
+    int listenSocket, socket;
+    pthread_t thread;
+    int filterload, getblocks; // true once the node was sent a filterload, or a getblocks
+    UInt256 getdata[2*DOWNLOAD_TEST_BLOCKS]; // block hashes the node was sent getdata for, in order
+    size_t getdataCount;
+} LWDownloadTestNode;
+
+static pthread_mutex_t _downloadTestLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _downloadTestCond = PTHREAD_COND_INITIALIZER;
+static LWDownloadTestNode _downloadTestNodes[DOWNLOAD_TEST_PEERS];
+static int _downloadTestCleanups;
+
+// waits up to 5 seconds until filterloads nodes were sent a filterload, the node that was sent getblocks was sent
+// requests block requests, and cleanups peer threads have exited, returns true if they did
+static int _downloadTestWait(int filterloads, size_t requests, int cleanups)
+{
+    struct timespec deadline = { time(NULL) + 5, 0 };
+    size_t n;
+    int f, r;
+
+    pthread_mutex_lock(&_downloadTestLock);
+
+    do {
+        for (size_t i = f = n = 0; i < DOWNLOAD_TEST_PEERS; i++) {
+            f += _downloadTestNodes[i].filterload;
+            if (_downloadTestNodes[i].getblocks) n = _downloadTestNodes[i].getdataCount;
+        }
+
+        r = (f >= filterloads && n >= requests && _downloadTestCleanups >= cleanups);
+    } while (! r && pthread_cond_timedwait(&_downloadTestCond, &_downloadTestLock, &deadline) == 0);
+
+    pthread_mutex_unlock(&_downloadTestLock);
+    return r;
+}
+
+static void _downloadTestThreadCleanup(void *info)
+{
+    pthread_mutex_lock(&_downloadTestLock);
+    _downloadTestCleanups++;
+    pthread_cond_broadcast(&_downloadTestCond);
+    pthread_mutex_unlock(&_downloadTestLock);
+}
+
+// the hash of block n of the chain the nodes announce
+static UInt256 _downloadTestHash(uint32_t n)
+{
+    UInt256 hash = UINT256_ZERO;
+
+    hash.u8[0] = 'd';
+    UInt32SetLE(&hash.u8[1], n);
+    return hash;
+}
+
+static void _downloadTestSend(int socket, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    uint8_t buf[24 + msgLen], md[32];
+
+    UInt32SetLE(&buf[0], LW_CHAIN_PARAMS.magicNumber);
+    memset(&buf[4], 0, 12);
+    memcpy(&buf[4], type, strlen(type));
+    UInt32SetLE(&buf[16], (uint32_t)msgLen);
+    LWSHA256_2(md, msg, msgLen);
+    memcpy(&buf[20], md, sizeof(uint32_t));
+    if (msgLen > 0) memcpy(&buf[24], msg, msgLen);
+    send(socket, buf, sizeof(buf), MSG_NOSIGNAL);
+}
+
+static void _downloadTestSendVersion(int socket)
+{
+    uint8_t msg[85] = { 0 };
+
+    UInt32SetLE(&msg[0], 70015); // version
+    UInt64SetLE(&msg[4], SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM); // services
+    UInt64SetLE(&msg[12], (uint64_t)time(NULL)); // timestamp, followed by the receiving and sending addresses
+    UInt64SetLE(&msg[72], (uint64_t)socket + 1); // nonce, followed by an empty user agent
+    UInt32SetLE(&msg[81], DOWNLOAD_TEST_BLOCKS); // start height
+    _downloadTestSend(socket, "version", msg, sizeof(msg));
+}
+
+// a node that announces DOWNLOAD_TEST_BLOCKS blocks in answer to getblocks once every node has a filter loaded, and
+// records the blocks it's sent getdata for, answering with notfound unless it was the one sent getblocks
+static void *_downloadTestNodeRoutine(void *arg)
+{
+    LWDownloadTestNode *node = arg;
+    uint8_t header[24], inv[1 + DOWNLOAD_TEST_BLOCKS*36], *msg = NULL;
+    size_t msgLen, len, count;
+
+    node->socket = accept(node->listenSocket, NULL, NULL);
+
+    while (node->socket >= 0 && recv(node->socket, header, sizeof(header), MSG_WAITALL) == sizeof(header)) {
+        msgLen = UInt32GetLE(&header[16]);
+        if (msgLen > 0x100000 || ! (msg = realloc(msg, msgLen + 1))) break;
+        if (msgLen > 0 && recv(node->socket, msg, msgLen, MSG_WAITALL) != (ssize_t)msgLen) break;
+
+        if (strncmp((char *)&header[4], "version", 12) == 0) {
+            _downloadTestSendVersion(node->socket);
+            _downloadTestSend(node->socket, "verack", NULL, 0);
+        }
+        else if (strncmp((char *)&header[4], "ping", 12) == 0) _downloadTestSend(node->socket, "pong", msg, msgLen);
+        else if (strncmp((char *)&header[4], "filterload", 12) == 0) {
+            pthread_mutex_lock(&_downloadTestLock);
+            node->filterload = 1;
+            pthread_cond_broadcast(&_downloadTestCond);
+            pthread_mutex_unlock(&_downloadTestLock);
+        }
+        else if (strncmp((char *)&header[4], "getblocks", 12) == 0) {
+            pthread_mutex_lock(&_downloadTestLock);
+            node->getblocks = 1;
+            pthread_mutex_unlock(&_downloadTestLock);
+            _downloadTestWait(DOWNLOAD_TEST_PEERS, 0, 0); // wait for the other peers to be added as download peers
+            inv[0] = DOWNLOAD_TEST_BLOCKS;
+
+            for (uint32_t i = 0; i < DOWNLOAD_TEST_BLOCKS; i++) {
+                UInt32SetLE(&inv[1 + i*36], 2); // MSG_BLOCK inventory type
+                UInt256Set(&inv[1 + i*36 + 4], _downloadTestHash(i + 1));
+            }
+
+            _downloadTestSend(node->socket, "inv", inv, sizeof(inv));
+        }
+        else if (strncmp((char *)&header[4], "getdata", 12) == 0) {
+            count = (size_t)LWVarInt(msg, msgLen, &len);
+            if (len == 0 || len + count*36 > msgLen) continue;
+            pthread_mutex_lock(&_downloadTestLock);
+
+            for (size_t i = 0; i < count && node->getdataCount < 2*DOWNLOAD_TEST_BLOCKS; i++) {
+                node->getdata[node->getdataCount++] = UInt256Get(&msg[len + i*36 + 4]);
+            }
+
+            pthread_cond_broadcast(&_downloadTestCond);
+            pthread_mutex_unlock(&_downloadTestLock);
+            if (! node->getblocks) _downloadTestSend(node->socket, "notfound", msg, msgLen);
+        }
+    }
+
+    free(msg);
+    return NULL;
+}
+
+// loopback listening socket on a free port, returns -1 on failure
+static int _downloadTestListen(uint16_t *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (s >= 0 && (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s, 1) != 0 ||
+                   getsockname(s, (struct sockaddr *)&addr, &addrLen) != 0)) {
+        close(s);
+        s = -1;
+    }
+
+    *port = (s >= 0) ? ntohs(addr.sin_port) : 0;
+    return s;
+}
+
+int LWPeerManagerDownloadTests()
+{
+    static const char *dnsSeeds[] = { NULL };
+    int r = 1, peers = 0, helpers = 0;
+    LWCheckPoint checkpoint = { 0, _chainTestHash(0, 0), 1317972665, 0x1e0ffff0 };
+    LWChainParams params = { dnsSeeds, LW_CHAIN_PARAMS.standardPort, LW_CHAIN_PARAMS.magicNumber, 0,
+                             _chainTestVerifyDifficulty, &checkpoint, 1 };
+    LWMasterPubKey mpk = LWBIP32MasterPubKey("", 1);
+    LWWallet *w = LWWalletNew(NULL, 0, mpk);
+    LWPeer addrs[DOWNLOAD_TEST_PEERS];
+    LWPeerManager *manager;
+    LWDownloadTestNode *node, *downloadNode = NULL;
+    uint16_t port;
+    size_t i, j, count, helperCount;
+
+    memset(_downloadTestNodes, 0, sizeof(_downloadTestNodes));
+    _downloadTestCleanups = 0;
+
+    for (i = 0; i < DOWNLOAD_TEST_PEERS; i++) {
+        node = &_downloadTestNodes[i];
+        node->socket = -1;
+        node->listenSocket = _downloadTestListen(&port);
+        addrs[i] = ((LWPeer) { ((UInt128) { .u8 = { [10] = 0xff, 0xff, 127, 0, 0, 1 } }), port,
+                               SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM, (uint64_t)time(NULL), 0 });
+        if (node->listenSocket >= 0 && pthread_create(&node->thread, NULL, _downloadTestNodeRoutine, node) == 0) {
+            peers++;
+        }
+        else if (node->listenSocket >= 0) close(node->listenSocket), node->listenSocket = -1;
+    }
+
+    if (peers < DOWNLOAD_TEST_PEERS) r = 0, fprintf(stderr, "***FAILED*** %s: listen test\n", __func__);
+    manager = LWPeerManagerNew(&params, w, 0, NULL, 0, addrs, DOWNLOAD_TEST_PEERS);
+    LWPeerManagerSetCallbacks(manager, NULL, NULL, NULL, NULL, NULL, NULL, NULL, _downloadTestThreadCleanup);
+    LWPeerManagerSetMaxConnectCount(manager, DOWNLOAD_TEST_PEERS);
+    LWPeerManagerConnect(manager);
+
+    // blocks announced by the download peer are requested from all download peers, and blocks that another peer
+    // doesn't have are requested from the download peer again
+    if (! _downloadTestWait(DOWNLOAD_TEST_PEERS, DOWNLOAD_TEST_BLOCKS, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: sync test\n", __func__);
+
+    pthread_mutex_lock(&_downloadTestLock);
+
+    for (i = 0; i < DOWNLOAD_TEST_PEERS; i++) {
+        node = &_downloadTestNodes[i];
+        if (node->getblocks) downloadNode = node;
+        else if (node->getdataCount > 0) helpers++;
+    }
+
+    if (! downloadNode || helpers != DOWNLOAD_TEST_PEERS - 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: parallel download test 1\n", __func__);
+
+    for (uint32_t n = 1; n <= DOWNLOAD_TEST_BLOCKS; n++) {
+        UInt256 hash = _downloadTestHash(n);
+
+        for (i = 0, count = helperCount = 0; i < DOWNLOAD_TEST_PEERS; i++) {
+            node = &_downloadTestNodes[i];
+
+            for (j = 0; j < node->getdataCount; j++) {
+                if (! UInt256Eq(node->getdata[j], hash)) continue;
+                if (node == downloadNode) count++;
+                else helperCount++;
+            }
+        }
+
+        // each block is requested from one peer, and from the download peer again if that peer doesn't have it
+        if (count != 1 || helperCount > 1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: parallel download test %"PRIu32"\n", __func__, n + 1);
+    }
+
+    if (downloadNode && downloadNode->getdataCount != DOWNLOAD_TEST_BLOCKS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: notfound test\n", __func__);
+
+    pthread_mutex_unlock(&_downloadTestLock);
+    LWPeerManagerDisconnect(manager);
+
+    // the manager can only be freed once the peer threads are done with it
+    if (_downloadTestWait(0, 0, DOWNLOAD_TEST_PEERS)) LWPeerManagerFree(manager);
+    else r = 0, fprintf(stderr, "***FAILED*** %s: thread cleanup test\n", __func__);
+
+    for (i = 0; i < DOWNLOAD_TEST_PEERS; i++) {
+        node = &_downloadTestNodes[i];
+        if (node->listenSocket < 0) continue;
+        shutdown(node->listenSocket, SHUT_RDWR); // wakes up a node that was never connected to
+        pthread_join(node->thread, NULL);
+        close(node->listenSocket);
+        if (node->socket >= 0) close(node->socket);
+    }
+
+    LWWalletFree(w);
     return r;
 }
 
@@ -2565,6 +4462,8 @@ int LWRunTests()
     printf("%s\n", (LWArrayTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWSetTests...                       ");
     printf("%s\n", (LWSetTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWInvFilterTests...                 ");
+    printf("%s\n", (LWInvFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWBase58Tests...                    ");
     printf("%s\n", (LWBase58Tests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWBech32Tests...                    ");
@@ -2599,8 +4498,28 @@ int LWRunTests()
     printf("%s\n", (LWWalletTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWBloomFilterTests...               ");
     printf("%s\n", (LWBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWBlockFilterTests...               ");
+    printf("%s\n", (LWBlockFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWMerkleBlockTests...               ");
     printf("%s\n", (LWMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWHeaderStoreTests...               ");
+    printf("%s\n", (LWHeaderStoreTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWAddrManagerTests...               ");
+    printf("%s\n", (LWAddrManagerTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWTxRelaysTests...                  ");
+    printf("%s\n", (LWTxRelaysTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWMetricsTests...                   ");
+    printf("%s\n", (LWMetricsTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWLogTests...                       ");
+    printf("%s\n", (LWLogTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerTests...                      ");
+    printf("%s\n", (LWPeerTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerManagerDNSTests...            ");
+    printf("%s\n", (LWPeerManagerDNSTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerManagerChainTests...          ");
+    printf("%s\n", (LWPeerManagerChainTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("LWPeerManagerDownloadTests...       ");
+    printf("%s\n", (LWPeerManagerDownloadTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWPaymentProtocolTests...           ");
     printf("%s\n", (LWPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("LWPaymentProtocolEncryptionTests... ");